@@ -14,7 +14,12 @@
 #define ALIGNMENT       (sizeof(double))
 #define ALIGN(size)     (((size) + (ALIGNMENT - 1)) & ~(ALIGNMENT - 1))
 #define SBRK_FAILURE    ((void *)(-1))
-#define TRIM_THRESHOLD  (1<<10)
+#define TRIM_THRESHOLD  (1<<21)                     /* Free bytes at heap top before shrinking it */
+#define ARENA_CHUNK     (1<<20)                     /* Bytes the heap is grown by at a time */
+#define MMAP_THRESHOLD  (1<<18)                     /* Requests at least this large are mapped */
+#define ADVISE_THRESHOLD (1<<16)                    /* Freed blocks at least this large give back pages */
+#define BLOCK_TAG       (sizeof(size_t))            /* Boundary tag (footer) after block data */
+#define BLOCK_OVERHEAD  (sizeof(Block) + BLOCK_TAG) /* Header and footer bytes per block */
 
 /* Block Structure */
 
@@ -32,14 +37,29 @@ struct block {
 #define BLOCK_FROM_POINTER(ptr) \
     (Block *)((intptr_t)(ptr) - sizeof(Block))
 
+/* Footer holding the capacity of the block, so the block after it can find
+ * its physical predecessor (a footer of 0 marks the start of the heap) */
+#define BLOCK_FOOTER(block) \
+    (*(size_t *)((block)->data + (block)->capacity))
+
 /* Block Functions */
 
 Block * block_allocate(size_t size);
 bool    block_release(Block *block);
+Block * block_map(size_t size, size_t alignment);
+void    block_advise(Block *block);
 
 Block * block_detach(Block *block);
 
 bool    block_merge(Block *dst, Block *src);
 Block * block_split(Block *block, size_t size);
+Block * block_align(Block *block, size_t alignment);
+bool    block_extend(Block *block, size_t size);
+Block * block_remap(Block *block, size_t size);
+
+Block * block_next(Block *block);
+Block * block_prev(Block *block);
+bool    block_is_free(Block *block);
+bool    block_is_mapped(Block *block);
 
 #endif
\ No newline at end of file
@@ -3,9 +3,21 @@
 #ifndef COUNTERS_H
 #define COUNTERS_H
 
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+/* Thread local storage (fixed at load time, so access never allocates) */
+#define THREAD_LOCAL \
+    __thread __attribute__((tls_model("initial-exec")))
+
+/* Read cycle counter (or a nanosecond clock where there is none) */
+#if defined __x86_64__ || defined __i386__
+#define CYCLES()    __builtin_ia32_rdtsc()
+#else
+#define CYCLES()    profile_clock()
+#endif
+
 /* Use buffer to format string and write to specified file descriptor */
 #define fdprintf(fd, b, s, ...) \
     sprintf(b, s, ##__VA_ARGS__); write(fd, b, strlen(b));
@@ -16,23 +28,57 @@ enum {
     BLOCKS,	    /* Number of all blocks */
     MALLOCS,	    /* Number of successful calls to malloc */
     FREES,	    /* Number of successful calls to free */
-    REALLOCS,	    /* Number of successful calls to realloc */
+    IN_PLACE,	    /* Number of reallocs that kept their address */
+    MOVED,	    /* Number of reallocs that moved to a new address */
     CALLOCS,	    /* Number of successful calls to callocs */
     REUSES,	    /* Number of times a block was reused */
     GROWS,	    /* Number of times the heap was grown */
     SHRINKS,        /* Number of times the heap was shrunk */
     SPLITS,	    /* Number of times a block was split */
     MERGES,	    /* Number of times a block was merged */
+    MAPS,	    /* Number of blocks mapped directly with mmap */
+    ADVISES,	    /* Number of times free pages were returned with madvise */
+    SLABS,	    /* Number of slabs in use */
     REQUESTED,	    /* Total number of bytes requested by user */
     HEAP_SIZE,	    /* Size of the heap */
     NCOUNTERS,	    /* Number of counters */
 };
 
-extern size_t Counters[NCOUNTERS];  /* Counters array */
+/* Profile Constants */
+
+#define SIZE_BINS       (32)        /* Number of request size buckets (powers of two) */
+#define CYCLE_BINS      (32)        /* Number of latency buckets (powers of two) */
+#define PROFILE_SITES   (256)       /* Number of sampled allocation sites tracked */
+#define PROFILE_SAMPLE  (1<<19)     /* Average bytes allocated between samples */
+#define PROFILE_TICKS   (1<<12)     /* Calls between checks of the dump interval */
+#define PROFILE_TIMING  (1<<6)      /* Calls per call timed (reading cycles is not free) */
+
+/* Histograms (stored after the counters, so they are totaled the same way) */
+
+#define SIZE_HISTOGRAM      (NCOUNTERS)                     /* Mallocs by request size */
+#define MALLOC_HISTOGRAM    (SIZE_HISTOGRAM + SIZE_BINS)    /* Mallocs by cycles taken */
+#define FREE_HISTOGRAM      (MALLOC_HISTOGRAM + CYCLE_BINS) /* Frees by cycles taken */
+#define NSTATISTICS         (FREE_HISTOGRAM + CYCLE_BINS)   /* Number of counters and bins */
+
+extern THREAD_LOCAL size_t Counters[NSTATISTICS];  /* Counters array (of calling thread) */
 
 /* Counter Functions */
 
-void init_counters();
-void dump_counters();
+void   init_counters();
+void   dump_counters();
+void   report_counters();
+void   retire_counters();
+size_t counter_total(int counter);
+void   counter_totals(size_t totals[NSTATISTICS]);
+void   update_heap_size(intptr_t delta);
+
+/* Profile Functions */
+
+void     profile_poll();
+uint64_t profile_start();
+void     profile_malloc(size_t size, uint64_t start, void *site);
+void     profile_free(uint64_t start);
+size_t   profile_bin(uint64_t value, size_t bins);
+uint64_t profile_clock();
 
 #endif
\ No newline at end of file
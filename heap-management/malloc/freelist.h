@@ -5,10 +5,33 @@
 
 #include "malloc/block.h"
 
+#include <pthread.h>
+
+/* Free List Constants */
+
+#ifndef FIT
+#define FIT             (3)     /* Default to segregated fit (0 first, 1 worst, 2 best) */
+#endif
+
+#if	defined FIT && FIT == 3
+#define FREE_LISTS      (64)    /* Number of segregated size classes */
+#else
+#define FREE_LISTS      (1)     /* Single unordered free list */
+#endif
+#define SMALL_CLASSES   (16)    /* Number of exact size classes (one per ALIGNMENT) */
+#define CLASS_SPLITS    (4)     /* Number of size classes per power of two above them */
+
+/* Free List Globals */
+
+extern Block    FreeLists[FREE_LISTS];  /* Free list sentinels (one per size class) */
+extern uint64_t FreeListMap;            /* Bitmap of possibly non-empty size classes */
+extern pthread_mutex_t HeapLock;        /* Protects free lists and heap growth */
+
 /* Free List Functions */
 
 Block *	free_list_search(size_t size);
-void	free_list_insert(Block *block);
+Block *	free_list_insert(Block *block);
 size_t  free_list_length();
+size_t  free_list_class(size_t capacity);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,60 @@
+/* slab.h: Slab Allocator */
+
+#ifndef SLAB_H
+#define SLAB_H
+
+#include "malloc/block.h"
+
+#include <pthread.h>
+
+/* Slab Constants */
+
+#define SLAB_SIZE       (1<<16)                 /* Bytes per slab (aligned to its size) */
+#define SLAB_MAX        (64)                    /* Largest object served from slabs */
+#define SLAB_CLASSES    (SLAB_MAX / ALIGNMENT)  /* Number of object sizes (one per ALIGNMENT) */
+#define SLAB_REGION     (1UL<<30)               /* Bytes of address space reserved for slabs */
+#define SLAB_HEADER     (64)                    /* Bytes before first object (one cache line) */
+
+#if	defined SPREAD && SPREAD == 1
+#define SLAB_LANES      (16)    /* Slabs of each class per group of threads (never shared) */
+#else
+#define SLAB_LANES      (1)     /* Slabs of each class shared by all threads */
+#endif
+
+/* Slab Structures */
+
+typedef struct slab_class SlabClass;
+typedef struct slab Slab;
+struct slab {
+    Slab *   prev;      /* Previous slab in partial list of class */
+    Slab *   next;      /* Next slab in partial list of class (or free slabs) */
+    void *   free;      /* Inline list of freed objects */
+    char *   unused;    /* First object never handed out */
+    size_t   size;      /* Size of each object */
+    size_t   used;      /* Number of objects handed out */
+    SlabClass * class;  /* Size class (and lane) slab belongs to */
+    bool     listed;    /* Whether or not slab is in partial list of class */
+};
+
+struct slab_class {
+    pthread_mutex_t lock;       /* Protects slabs of this class */
+    Slab *          partial;    /* Slabs with room for more objects */
+};
+
+/* Slab Macros */
+
+#define SLAB_FROM_POINTER(ptr) \
+    ((Slab *)((uintptr_t)(ptr) & ~(uintptr_t)(SLAB_SIZE - 1)))
+
+/* Slab Functions */
+
+void *  slab_allocate(size_t size);
+void    slab_free(void *ptr);
+bool    slab_contains(void *ptr);
+size_t  slab_size(void *ptr);
+
+void    slab_fork_prepare();
+void    slab_fork_parent();
+void    slab_fork_child();
+
+#endif
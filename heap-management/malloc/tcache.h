@@ -0,0 +1,36 @@
+/* tcache.h: Per-Thread Block Cache */
+
+#ifndef TCACHE_H
+#define TCACHE_H
+
+#include "malloc/block.h"
+
+/* Thread Cache Constants */
+
+#define TCACHE_MAX      (1<<9)                  /* Largest block capacity cached */
+#define TCACHE_BINS     (TCACHE_MAX / ALIGNMENT)/* Number of bins (one per capacity) */
+#define TCACHE_COUNT    (16)                    /* Maximum number of blocks per bin */
+
+/* Thread Cache Structure */
+
+typedef struct tcache TCache;
+struct tcache {
+    Block *  bins[TCACHE_BINS];     /* Cached blocks (linked through their data) */
+    size_t   counts[TCACHE_BINS];   /* Number of blocks in each bin */
+    bool     initialized;           /* Whether or not thread exit is hooked */
+    bool     exiting;               /* Whether or not thread is exiting */
+};
+
+/* Thread Cache Macros */
+
+#define TCACHE_NEXT(block) \
+    (*(Block **)(block)->data)
+
+/* Thread Cache Functions */
+
+Block * tcache_get(size_t size);
+bool    tcache_put(Block *block);
+void    tcache_flush();
+void    tcache_init();
+
+#endif
@@ -1,4 +1,22 @@
-/* block.c: Block Structure */
+/* block.c: Block Structure
+ *
+ * Every block ends with a boundary tag holding its capacity, and every run of
+ * heap memory obtained from sbrk starts with a zero tag (the prologue) and
+ * ends with an empty, allocated block (the epilogue).  The physical neighbors
+ * of any block can therefore be found in constant time, and since allocated
+ * blocks are never linked into a free list (their next pointer refers to
+ * themselves), so can whether or not they are free.
+ *
+ * The heap is grown by whole ARENA_CHUNKs, which malloc carves up, rather
+ * than by one sbrk per allocation.  Requests of at least MMAP_THRESHOLD bytes
+ * get a mapping of their own instead (marked by a NULL prev pointer), so their
+ * memory goes straight back to the system when they are freed.  A mapped block
+ * need not start its mapping (so its data can be aligned beyond a page), but
+ * its mapping always starts on the page holding its header and ends right
+ * after its footer.
+ **/
+
+#define _GNU_SOURCE     /* For mremap */
 
 #include "malloc/block.h"
 #include "malloc/counters.h"
@@ -6,32 +24,71 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
+/* Global Variables */
+
+char *  HeapEnd = NULL;     /* End of the heap (after the epilogue) */
+
+/* Internal Prototypes */
+
+void    block_format(Block *block, size_t capacity);
+char *  block_mapping(Block *block);
+
+/* Functions */
+
 /**
  * Allocate a new block on the heap using sbrk:
  *
- *  1. Determined aligned amount of memory to allocate.
- *  2. Allocate memory on the heap.
- *  3. Set allocage block properties.
+ *  1. Map large requests directly (see block_map).
+ *  2. Determined aligned amount of memory to allocate (including footer),
+ *  which is at least a whole arena chunk.
+ *  3. Allocate memory on the heap, reusing the epilogue as the new block
+ *  header if the heap is still contiguous (otherwise start a new run with its
+ *  own prologue).
+ *  4. Set allocage block properties and write a new epilogue after it.
+ *
+ * Note, the new block may be much larger than requested, so the caller should
+ * split it and free the remainder.
  *
  * @param   size    Number of bytes to allocate.
  * @return  Pointer to data portion of newly allocate block.
  **/
 Block*	block_allocate(size_t size) {
+    if (ALIGN(size) >= MMAP_THRESHOLD) {
+        return block_map(size, ALIGNMENT);
+    }
     // Allocate block
-    intptr_t allocated = sizeof(Block) + ALIGN(size);
-    Block*  block     = sbrk(allocated);
-    if (block == SBRK_FAILURE) {
-    	return NULL;
+    intptr_t allocated = BLOCK_OVERHEAD + ALIGN(size);
+    if (allocated < ARENA_CHUNK) {
+        allocated = ARENA_CHUNK;
+    }
+    size_t  capacity = allocated - BLOCK_OVERHEAD;
+    Block*  block;
+    if (HeapEnd && sbrk(0) == HeapEnd) {
+        if (sbrk(allocated) == SBRK_FAILURE) {
+            return NULL;
+        }
+        block = (Block *)(HeapEnd - sizeof(Block));
+    }
+    else {
+        // Someone else moved the break (or this is the first block)
+        char *start = sbrk(sizeof(size_t) + allocated + sizeof(Block));
+        if (start == SBRK_FAILURE) {
+            return NULL;
+        }
+        *(size_t *)start = 0;
+        block      = (Block *)(start + sizeof(size_t));
+        allocated += sizeof(size_t) + sizeof(Block);
     }
     // Record block information
-    block->capacity = ALIGN(size);
-    block->size     = size;
-    block->prev     = block;
-    block->next     = block;
+    block_format(block, capacity);
+    block->size = size;
+    HeapEnd     = (char *)block_next(block) + sizeof(Block);
+    block_format(block_next(block), 0);
     // Update counters
-    Counters[HEAP_SIZE] += allocated;
+    update_heap_size(allocated);
     Counters[BLOCKS]++;
     Counters[GROWS]++;
     return block;
@@ -40,30 +97,119 @@ Block*	block_allocate(size_t size) {
 /**
  * Attempt to release memory used by block to heap:
  *
- *  1. If the block is at the end of the heap.
- *  2. The block capacity meets the trim threshold.
+ *  1. If the block is mapped, then simply unmap it.
+ *  2. If the block is the last one before the epilogue at the end of the
+ *  heap (and nobody else has moved the break since).
+ *  3. The block capacity meets the trim threshold.
+ *
+ * The block header then becomes the new epilogue (it is detached from the free
+ * list first, since the caller may pass a free block).
  *
  * @param   block   Pointer to block to release.
  * @return  Whether or not the release completed successfully.
  **/
 bool	block_release(Block *block) {
-    Block* heap_end = sbrk(0);
+    if(block_is_mapped(block)) {
+        char * start     = block_mapping(block);
+        size_t allocated = (char *)block_next(block) - start;
+        if(munmap(start, allocated) < 0) {
+            return false;
+        }
+        Counters[BLOCKS]--;
+        update_heap_size(-(intptr_t)allocated);
+        return true;
+    }
+
+    char* heap_end = sbrk(0);
 
-    if(!heap_end) {
+    if(heap_end == SBRK_FAILURE || heap_end != HeapEnd) {
         return false;
     }
 
-    if((heap_end == (block + 1 + block->capacity/sizeof(Block))) && block->capacity >= TRIM_THRESHOLD) {
+    if(((char *)block_next(block) + sizeof(Block) == heap_end) && block->capacity >= TRIM_THRESHOLD) {
+        size_t allocated = BLOCK_OVERHEAD + block->capacity;
+        if(sbrk(-allocated) == SBRK_FAILURE) {
+            return false;
+        }
+        HeapEnd -= allocated;
+        block_detach(block);
+        block_format(block, 0);
         Counters[BLOCKS]--;
         Counters[SHRINKS]++;
-        size_t allocated = sizeof(Block)+block->capacity;
-        Counters[HEAP_SIZE] -= allocated;
-        sbrk(-allocated);
+        update_heap_size(-(intptr_t)allocated);
         return true;
     }
     return false;
 }
 
+/**
+ * Map a new block large enough for the specified size with mmap, with its data
+ * aligned to the specified alignment by doing the following:
+ *
+ *  1. Map enough whole pages for the block plus the worst case padding needed
+ *  to align its data.
+ *
+ *  2. Place the header so the data is aligned, then unmap the whole pages
+ *  before the header and after the footer.
+ *
+ * Note, the capacity may exceed the request (it runs to the end of the last
+ * page).
+ *
+ * @param   size        Number of bytes to allocate.
+ * @param   alignment   Alignment of the data (a power of two, at least ALIGNMENT).
+ * @return  Pointer to newly mapped block (otherwise NULL).
+ **/
+Block*	block_map(size_t size, size_t alignment) {
+    uintptr_t page    = getpagesize();
+    size_t    padding = alignment > ALIGNMENT ? alignment - ALIGNMENT : 0;
+    size_t    mapped  = (BLOCK_OVERHEAD + padding + ALIGN(size) + page - 1) & ~(page - 1);
+    char*     region  = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED) {
+        return NULL;
+    }
+    // Trim the pages the aligned block does not touch
+    uintptr_t data  = ((uintptr_t)region + sizeof(Block) + alignment - 1) & ~(alignment - 1);
+    Block*    block = (Block *)(data - sizeof(Block));
+    char*     start = (char *)((uintptr_t)block & ~(page - 1));
+    char*     end   = (char *)((data + ALIGN(size) + BLOCK_TAG + page - 1) & ~(page - 1));
+    if (start > region) {
+        munmap(region, start - region);
+    }
+    if (end < region + mapped) {
+        munmap(end, region + mapped - end);
+    }
+    block_format(block, end - BLOCK_TAG - block->data);
+    block->size = size;
+    block->prev = NULL;
+    // Update counters
+    update_heap_size(end - start);
+    Counters[BLOCKS]++;
+    Counters[MAPS]++;
+    return block;
+}
+
+/**
+ * Give the whole pages inside the data of a large block back to the system
+ * with madvise (they read back as zero when next touched).
+ *
+ * Note, the contents of the block are lost, so this should only be called on
+ * blocks that are being freed.
+ *
+ * @param   block   Pointer to block to advise.
+ **/
+void	block_advise(Block *block) {
+    if(block->capacity < ADVISE_THRESHOLD) {
+        return;
+    }
+
+    uintptr_t page  = getpagesize();
+    uintptr_t start = ((uintptr_t)block->data + page - 1) & ~(page - 1);
+    uintptr_t end   = ((uintptr_t)block->data + block->capacity) & ~(page - 1);
+    if(start < end && madvise((void *)start, end - start, MADV_DONTNEED) == 0) {
+        Counters[ADVISES]++;
+    }
+}
+
 /**
  * Detach specified block from its neighbors.
  *
@@ -89,7 +235,7 @@ Block* block_detach(Block *block) {
  *  1. Compute end of destination and start of source.
  *
  *  2. If they both match, then merge source into destination by giving the
- *  destination all of the memory allocated to source.
+ *  destination all of the memory allocated to source (updating its footer).
  *
  *  3. If destination is not already in the list, insert merged destination
  *  block into list by updating appropriate references.
@@ -99,12 +245,10 @@ Block* block_detach(Block *block) {
  * @return  Whether or not the merge completed successfully.
  **/
 bool block_merge(Block *dst, Block *src) {
-    char* dst_end = (char*) dst;
-    dst_end += sizeof(Block) + dst->capacity;
-
-    if(dst_end == (char*) src) {
-        // Give dst all of the memory (including headers) from source
-        dst->capacity += sizeof(Block) + src->capacity;
+    if(block_next(dst) == src) {
+        // Give dst all of the memory (including headers and footers) from source
+        dst->capacity += BLOCK_OVERHEAD + src->capacity;
+        BLOCK_FOOTER(dst) = dst->capacity;
         // Update counters
         Counters[MERGES]++;
         Counters[BLOCKS]--;
@@ -126,8 +270,8 @@ bool block_merge(Block *dst, Block *src) {
 /**
  * Attempt to split block with the specified size:
  *
- *  1. Check if block capacity is sufficient for requested aligned size and
- *  header Block.
+ *  1. Check if block capacity is sufficient for requested aligned size,
+ *  header Block, and footer.
  *
  *  2. Split specified block into two blocks.
  *
@@ -137,24 +281,210 @@ bool block_merge(Block *dst, Block *src) {
  **/
 Block* block_split(Block* block, size_t size) {
     // Check if capacity is large enough to split
-    if(block->capacity > sizeof(Block)+ALIGN(size)) {
+    if(block->capacity > BLOCK_OVERHEAD+ALIGN(size)) {
         // Calculate location of new block
         char* new_block_char = (char*) block;
-        new_block_char += sizeof(Block) + ALIGN(size);
+        new_block_char += BLOCK_OVERHEAD + ALIGN(size);
         Block* new_block = (Block*) new_block_char;
         // Update new block attributes
-        new_block->capacity = block->capacity-(sizeof(Block)+ALIGN(size));
+        new_block->capacity = block->capacity-(BLOCK_OVERHEAD+ALIGN(size));
         new_block->size = new_block->capacity;            
         new_block->prev = block;
         new_block->next = block->next;
+        BLOCK_FOOTER(new_block) = new_block->capacity;
         // Update block attributes
         block->capacity = ALIGN(size);
         block->size = size;             
         block->next->prev = new_block;
         block->next = new_block;
+        BLOCK_FOOTER(block) = block->capacity;
 
         Counters[SPLITS]++;
         Counters[BLOCKS]++;
     }
     return block;
-}
\ No newline at end of file
+}
+
+/**
+ * Attempt to grow specified allocated block in place to hold the specified
+ * size by doing the following:
+ *
+ *  1. If the block physically after it is free, then absorb it (detaching it
+ *  from its free list).
+ *
+ *  2. If the block is then the last one before the epilogue at the end of the
+ *  heap (and nobody else has moved the break since), then extend the heap
+ *  behind it by at least an arena chunk.
+ *
+ * Note, the block may end up larger than requested, so the caller should
+ * split it and free the remainder.
+ *
+ * @param   block   Pointer to allocated block to grow.
+ * @param   size    Number of bytes the block must hold.
+ * @return  Whether or not the block can now hold the specified size.
+ **/
+bool block_extend(Block *block, size_t size) {
+    Block* next = block_next(block);
+    if(block->capacity < ALIGN(size) && block_is_free(next)) {
+        block_detach(next);
+        block->capacity += BLOCK_OVERHEAD + next->capacity;
+        BLOCK_FOOTER(block) = block->capacity;
+        next = block_next(block);
+        // Update counters
+        Counters[MERGES]++;
+        Counters[BLOCKS]--;
+    }
+
+    if(block->capacity < ALIGN(size) && (char *)next + sizeof(Block) == HeapEnd && sbrk(0) == HeapEnd) {
+        intptr_t grown = ALIGN(size) - block->capacity;
+        if(grown < ARENA_CHUNK) {
+            grown = ARENA_CHUNK;
+        }
+        if(sbrk(grown) == SBRK_FAILURE) {
+            return false;
+        }
+        block->capacity += grown;
+        BLOCK_FOOTER(block) = block->capacity;
+        HeapEnd += grown;
+        block_format(block_next(block), 0);
+        // Update counters
+        update_heap_size(grown);
+        Counters[GROWS]++;
+    }
+    return block->capacity >= ALIGN(size);
+}
+
+/**
+ * Align the data of specified detached heap block by doing the following:
+ *
+ *  1. If the data is already aligned, then return the block as is.
+ *
+ *  2. Otherwise split off just enough of the front of the block that the data
+ *  of the rest is aligned (the front must hold at least ALIGNMENT bytes, so it
+ *  is a valid block of its own).
+ *
+ *  3. Detach both pieces from each other and return the rest.
+ *
+ * Note, the block must have room for BLOCK_OVERHEAD + alignment bytes of
+ * padding, and the caller is responsible for freeing the front piece (which
+ * is block_prev of the returned block) so the padding is not wasted.
+ *
+ * @param   block       Pointer to detached block to align.
+ * @param   alignment   Alignment of the data (a power of two).
+ * @return  Pointer to block with aligned data.
+ **/
+Block* block_align(Block *block, size_t alignment) {
+    uintptr_t data = (uintptr_t)block->data;
+    if((data & (alignment - 1)) == 0) {
+        return block;
+    }
+    uintptr_t aligned = (data + BLOCK_OVERHEAD + ALIGNMENT + alignment - 1) & ~(alignment - 1);
+    block = block_split(block, aligned - data - BLOCK_OVERHEAD);
+    return block_detach(block->next);
+}
+
+/**
+ * Resize specified mapped block to hold the specified size with mremap
+ * (which may move it, but never copies the data).
+ *
+ * @param   block   Pointer to mapped block to resize.
+ * @param   size    Number of bytes the block must hold.
+ * @return  Pointer to resized block (otherwise NULL, leaving block intact).
+ **/
+Block* block_remap(Block *block, size_t size) {
+    size_t page      = getpagesize();
+    char*  start     = block_mapping(block);
+    size_t offset    = (char *)block - start;
+    size_t previous  = (char *)block_next(block) - start;
+    size_t allocated = (offset + BLOCK_OVERHEAD + ALIGN(size) + page - 1) & ~(page - 1);
+    char*  mapping   = mremap(start, previous, allocated, MREMAP_MAYMOVE);
+    if(mapping == MAP_FAILED) {
+        return NULL;
+    }
+    // The header keeps its offset within the first page
+    Block* moved    = (Block *)(mapping + offset);
+    moved->capacity = allocated - offset - BLOCK_OVERHEAD;
+    moved->size     = size;
+    moved->next     = moved;
+    BLOCK_FOOTER(moved) = moved->capacity;
+    // Update counters
+    update_heap_size(allocated - previous);
+    return moved;
+}
+
+/**
+ * Return the block physically after the specified block (the epilogue if it
+ * is the last block of the heap).
+ *
+ * @param   block   Pointer to block.
+ * @return  Pointer to next block in memory.
+ **/
+Block* block_next(Block *block) {
+    return (Block *)(block->data + block->capacity + BLOCK_TAG);
+}
+
+/**
+ * Return the block physically before the specified block.
+ *
+ * @param   block   Pointer to block.
+ * @return  Pointer to previous block in memory (NULL if block is the first).
+ **/
+Block* block_prev(Block *block) {
+    size_t capacity = *((size_t *)block - 1);
+    if(!capacity) {
+        return NULL;
+    }
+    return (Block *)((char *)block - BLOCK_TAG - capacity - sizeof(Block));
+}
+
+/**
+ * Return whether or not the specified block is in a free list (allocated
+ * blocks and the epilogue are detached, so their next pointer is themselves).
+ *
+ * @param   block   Pointer to block.
+ * @return  Whether or not the block is free.
+ **/
+bool block_is_free(Block *block) {
+    return block->next != block;
+}
+
+/**
+ * Return whether or not the specified block has a mapping of its own (rather
+ * than being part of the heap).
+ *
+ * @param   block   Pointer to block.
+ * @return  Whether or not the block is mapped.
+ **/
+bool block_is_mapped(Block *block) {
+    return block->prev == NULL;
+}
+
+/* Internal Functions */
+
+/**
+ * Initialize detached block with the specified capacity and its footer.
+ *
+ * @param   block       Pointer to block.
+ * @param   capacity    Number of bytes available in block (aligned).
+ **/
+void block_format(Block *block, size_t capacity) {
+    block->capacity = capacity;
+    block->size     = capacity;
+    block->prev     = block;
+    block->next     = block;
+    if(capacity) {
+        BLOCK_FOOTER(block) = capacity;
+    }
+}
+
+/**
+ * Return the start of the mapping holding specified mapped block (the page its
+ * header is on).
+ *
+ * @param   block   Pointer to mapped block.
+ * @return  Pointer to start of mapping.
+ **/
+char*	block_mapping(Block *block) {
+    uintptr_t page = getpagesize();
+    return (char *)((uintptr_t)block & ~(page - 1));
+}
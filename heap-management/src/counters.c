@@ -1,19 +1,82 @@
-/* counters.c: Counters */
+/* counters.c: Counters
+ *
+ * Counters (and histograms) are kept per thread, so updating them never
+ * takes a lock, and are summed over every thread when they are reported.
+ * They are always reported at exit, and can also be reported while running
+ * by sending MALLOC_STATS_SIGNAL or every MALLOC_STATS_INTERVAL seconds
+ * (MALLOC_STATS_FORMAT=json selects JSON rather than text).  Only one in
+ * PROFILE_TIMING calls is timed, and allocation sites are sampled by bytes.  Reports are
+ * written by the next thread to call malloc or free, since a signal handler
+ * cannot take the heap lock.
+ **/
 
 #include "malloc/block.h"
 #include "malloc/counters.h"
 #include "malloc/freelist.h"
 
 #include <assert.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+/* Counter Set Structure */
+
+typedef struct counter_set CounterSet;
+struct counter_set {
+    size_t *     values;    /* Counters of thread (NULL until registered) */
+    CounterSet * prev;      /* Previous registered thread */
+    CounterSet * next;      /* Next registered thread */
+};
+
+/* Profile Site Structure */
+
+typedef struct profile_site ProfileSite;
+struct profile_site {
+    void *  address;        /* Return address of sampled malloc call */
+    size_t  samples;        /* Number of samples taken at site */
+    size_t  bytes;          /* Number of bytes requested by samples */
+};
+
 /* Global Variables */
 
-extern Block FreeList;
-size_t Counters[NCOUNTERS] = {0};
-int    DumpFD              = -1;
+THREAD_LOCAL size_t     Counters[NSTATISTICS] = {0};
+THREAD_LOCAL CounterSet ThreadCounters      = {0};
+CounterSet *            CounterSets         = NULL;
+size_t                  RetiredCounters[NSTATISTICS] = {0};
+pthread_mutex_t         CountersLock        = PTHREAD_MUTEX_INITIALIZER;
+pthread_once_t          CountersOnce        = PTHREAD_ONCE_INIT;
+int                     DumpFD              = -1;
+
+size_t                  HeapCurrent         = 0;        /* Bytes of heap (across threads) */
+size_t                  HeapPeak            = 0;        /* Largest value of HeapCurrent */
+
+THREAD_LOCAL intptr_t   SampleCountdown     = 0;        /* Bytes until next sample */
+THREAD_LOCAL size_t     TickCountdown       = 0;        /* Calls until next interval check */
+THREAD_LOCAL size_t     TimingCountdown     = 0;        /* Calls until next timed call */
+ProfileSite             ProfileSites[PROFILE_SITES] = {{0}};
+pthread_mutex_t         ProfileLock         = PTHREAD_MUTEX_INITIALIZER;
+
+bool                    ReportJSON          = false;    /* Whether or not to report JSON */
+volatile sig_atomic_t   ReportPending       = 0;        /* Whether or not a report was signaled */
+uint64_t                ReportInterval      = 0;        /* Nanoseconds between reports (0 if none) */
+uint64_t                ReportNext          = 0;        /* Time of next periodic report */
+
+const char *CounterNames[NCOUNTERS] = {
+    "blocks", "mallocs", "frees", "in_place", "moved", "callocs", "reuses",
+    "grows", "shrinks", "splits", "merges", "maps", "advises", "slabs",
+    "requested", "heap_size",
+};
+
+/* Internal Prototypes */
+
+void    setup_counters();
+void    report_text(size_t totals[NSTATISTICS]);
+void    report_json(size_t totals[NSTATISTICS]);
+void    report_histogram(const char *name, size_t *bins, size_t nbins);
+void    profile_signal(int signum);
 
 /* Functions */
 
@@ -22,19 +85,99 @@ int    DumpFD              = -1;
  *
  *  1. Register the dump_counters function to run when the program terminates.
  *  2. Duplicate standard output file descriptor to the DumpFD global variable.
+ *  3. Read the report settings from the environment.
+ *  4. Register the counters of the calling thread, so they are included in
+ *  the totals.
  *
- * Note, these actions should only be performed once regardless of how many
- * times the function is called.
+ * Note, the first three actions should only be performed once regardless of
+ * how many times the function is called, and the last once per thread.
  **/
 void init_counters() {
-    static bool initialized = false;
+    if (ThreadCounters.values) {
+        return;
+    }
+    // Register before setup, since atexit may allocate memory itself
+    pthread_mutex_lock(&CountersLock);
+    ThreadCounters.values = Counters;
+    ThreadCounters.next   = CounterSets;
+    if (CounterSets) {
+        CounterSets->prev = &ThreadCounters;
+    }
+    CounterSets = &ThreadCounters;
+    pthread_mutex_unlock(&CountersLock);
+
+    pthread_once(&CountersOnce, setup_counters);
+}
+
+/**
+ * Add the counters of the calling (exiting) thread to the retired totals and
+ * unregister them.
+ **/
+void retire_counters() {
+    if (!ThreadCounters.values) {
+        return;
+    }
+
+    pthread_mutex_lock(&CountersLock);
+    for (int counter = 0; counter < NSTATISTICS; counter++) {
+        RetiredCounters[counter] += Counters[counter];
+        Counters[counter] = 0;
+    }
+    if (ThreadCounters.prev) {
+        ThreadCounters.prev->next = ThreadCounters.next;
+    }
+    else {
+        CounterSets = ThreadCounters.next;
+    }
+    if (ThreadCounters.next) {
+        ThreadCounters.next->prev = ThreadCounters.prev;
+    }
+    pthread_mutex_unlock(&CountersLock);
+}
+
+/**
+ * Return specified counter summed over every thread (including exited ones).
+ * @param   counter     Counter to total.
+ * @return  Total value of counter.
+ **/
+size_t counter_total(int counter) {
+    pthread_mutex_lock(&CountersLock);
+    size_t total = RetiredCounters[counter];
+    for (CounterSet *set = CounterSets; set; set = set->next) {
+        total += set->values[counter];
+    }
+    pthread_mutex_unlock(&CountersLock);
+    return total;
+}
 
-    if (!initialized) {
-        assert(atexit(dump_counters) == 0);
-        initialized = true;
-        DumpFD      = dup(STDOUT_FILENO);
-        assert(DumpFD >= 0);
+/**
+ * Store every counter and histogram bin summed over every thread (including
+ * exited ones) in the specified array.
+ * @param   totals      Array of NSTATISTICS totals to fill.
+ **/
+void counter_totals(size_t totals[NSTATISTICS]) {
+    pthread_mutex_lock(&CountersLock);
+    memcpy(totals, RetiredCounters, sizeof(RetiredCounters));
+    for (CounterSet *set = CounterSets; set; set = set->next) {
+        for (int counter = 0; counter < NSTATISTICS; counter++) {
+            totals[counter] += set->values[counter];
+        }
     }
+    pthread_mutex_unlock(&CountersLock);
+}
+
+/**
+ * Record that the heap grew (or shrank) by the specified number of bytes,
+ * keeping track of its peak size.
+ * @param   delta       Change in heap size.
+ **/
+void update_heap_size(intptr_t delta) {
+    Counters[HEAP_SIZE] += delta;
+
+    size_t current = __atomic_add_fetch(&HeapCurrent, delta, __ATOMIC_RELAXED);
+    size_t peak    = __atomic_load_n(&HeapPeak, __ATOMIC_RELAXED);
+    while (delta > 0 && current > peak &&
+           !__atomic_compare_exchange_n(&HeapPeak, &peak, current, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
 }
 
 /**
@@ -47,14 +190,17 @@ void init_counters() {
 double internal_fragmentation() {
     // Implement internal fragmentation computation
     double internal_frags = 0;
-    for(Block *curr = FreeList.next; curr != &FreeList; curr=curr->next) {
-        internal_frags += curr->capacity - curr->size;
+    size_t heap_size      = counter_total(HEAP_SIZE);
+    for(size_t class = 0; class < FREE_LISTS; class++) {
+        for(Block *curr = FreeLists[class].next; curr != &FreeLists[class]; curr=curr->next) {
+            internal_frags += curr->capacity - curr->size;
+        }
     }
     // Make sure heap size isn't 0
-    if(!Counters[HEAP_SIZE]) {
+    if(!heap_size) {
         return 0;
     }
-    return ((double)internal_frags/(double)Counters[HEAP_SIZE])*100;
+    return ((double)internal_frags/(double)heap_size)*100;
 }
 
 /**
@@ -71,11 +217,13 @@ double external_fragmentation() {
     size_t largest_free = 0;
     size_t free_mem = 0;
 
-    for(Block *curr = FreeList.next; curr != &FreeList; curr=curr->next) {
-        if(curr->capacity > largest_free) {
-            largest_free = curr->capacity;
+    for(size_t class = 0; class < FREE_LISTS; class++) {
+        for(Block *curr = FreeLists[class].next; curr != &FreeLists[class]; curr=curr->next) {
+            if(curr->capacity > largest_free) {
+                largest_free = curr->capacity;
+            }
+            free_mem += curr->capacity;
         }
-        free_mem += curr->capacity;
     }
     if(!free_mem) {
         return 0;
@@ -91,24 +239,235 @@ double external_fragmentation() {
  * of the function.
  **/
 void dump_counters() {
-    char buffer[BUFSIZ];
     assert(DumpFD >= 0);
+    report_counters();
+    close(DumpFD);
+}
+
+/**
+ * Display all counters, histograms, and sampled allocation sites to the
+ * DumpFD global file descriptor (as text or JSON).
+ **/
+void report_counters() {
+    size_t totals[NSTATISTICS];
+    counter_totals(totals);
+
+    pthread_mutex_lock(&HeapLock);
+    pthread_mutex_lock(&ProfileLock);
+    if (ReportJSON) {
+        report_json(totals);
+    }
+    else {
+        report_text(totals);
+    }
+    pthread_mutex_unlock(&ProfileLock);
+    pthread_mutex_unlock(&HeapLock);
+}
+
+/**
+ * Write a report if one was signaled or the report interval has passed.
+ *
+ * Note, this must be called without holding any allocator locks.
+ **/
+void profile_poll() {
+    if (ReportPending) {
+        ReportPending = 0;
+        report_counters();
+    }
+
+    if (!ReportInterval || TickCountdown--) {
+        return;
+    }
+    TickCountdown = PROFILE_TICKS;
+
+    // Only the thread that moves the deadline forward writes the report
+    uint64_t now  = profile_clock();
+    uint64_t next = __atomic_load_n(&ReportNext, __ATOMIC_RELAXED);
+    if (now >= next && __atomic_compare_exchange_n(&ReportNext, &next, now + ReportInterval, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        report_counters();
+    }
+}
+
+/**
+ * Start timing a malloc or free call (only one in PROFILE_TIMING is timed).
+ * @return  Cycle counter at start of call (0 if call is not timed).
+ **/
+uint64_t profile_start() {
+    if (TimingCountdown--) {
+        return 0;
+    }
+    TimingCountdown = PROFILE_TIMING - 1;
+    return CYCLES();
+}
+
+/**
+ * Record a successful malloc of the specified size (and how long it took if
+ * it was timed), sampling its call site every PROFILE_SAMPLE bytes or so.
+ * @param   size        Number of bytes requested.
+ * @param   start       Cycle counter at start of call (from profile_start).
+ * @param   site        Return address of malloc call.
+ **/
+void profile_malloc(size_t size, uint64_t start, void *site) {
+    Counters[SIZE_HISTOGRAM + profile_bin(size, SIZE_BINS)]++;
+    if (start) {
+        Counters[MALLOC_HISTOGRAM + profile_bin(CYCLES() - start, CYCLE_BINS)]++;
+    }
+
+    if ((SampleCountdown -= size) > 0) {
+        return;
+    }
+    // Jitter the interval, so periodic allocation patterns are not aliased
+    SampleCountdown = PROFILE_SAMPLE / 2 + CYCLES() % PROFILE_SAMPLE;
+
+    pthread_mutex_lock(&ProfileLock);
+    size_t slot = ((uintptr_t)site >> 4) % PROFILE_SITES;
+    for (size_t probe = 0; probe < PROFILE_SITES; probe++, slot = (slot + 1) % PROFILE_SITES) {
+        ProfileSite *entry = &ProfileSites[slot];
+        if (!entry->address || entry->address == site) {
+            entry->address = site;
+            entry->samples++;
+            entry->bytes  += size;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&ProfileLock);
+}
+
+/**
+ * Record how long a free took if it was timed.
+ * @param   start       Cycle counter at start of call (from profile_start).
+ **/
+void profile_free(uint64_t start) {
+    if (start) {
+        Counters[FREE_HISTOGRAM + profile_bin(CYCLES() - start, CYCLE_BINS)]++;
+    }
+}
+
+/**
+ * Return histogram bin of the specified value (bin i holds values below 2^i,
+ * with the last bin holding everything larger).
+ * @param   value       Value to bin.
+ * @param   bins        Number of bins in histogram.
+ * @return  Index of bin.
+ **/
+size_t profile_bin(uint64_t value, size_t bins) {
+    size_t bin = value ? 64 - __builtin_clzll(value) : 0;
+    return bin < bins ? bin : bins - 1;
+}
+
+/**
+ * Return monotonic time in nanoseconds.
+ * @return  Current time.
+ **/
+uint64_t profile_clock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Internal Functions */
+
+void setup_counters() {
+    assert(atexit(dump_counters) == 0);
+    DumpFD = dup(STDOUT_FILENO);
+    assert(DumpFD >= 0);
+
+    char *format = getenv("MALLOC_STATS_FORMAT");
+    ReportJSON   = format && strcmp(format, "json") == 0;
 
-    fdprintf(DumpFD, buffer, "blocks:      %lu\n"   , Counters[BLOCKS]);
+    char *interval = getenv("MALLOC_STATS_INTERVAL");
+    if (interval && atof(interval) > 0) {
+        ReportInterval = atof(interval) * 1e9;
+        ReportNext     = profile_clock() + ReportInterval;
+    }
+
+    char *signum = getenv("MALLOC_STATS_SIGNAL");
+    if (signum && atoi(signum) > 0) {
+        struct sigaction action = {.sa_handler = profile_signal, .sa_flags = SA_RESTART};
+        sigemptyset(&action.sa_mask);
+        sigaction(atoi(signum), &action, NULL);
+    }
+}
+
+void profile_signal(int signum) {
+    ReportPending = 1;
+}
+
+void report_text(size_t totals[NSTATISTICS]) {
+    char buffer[BUFSIZ];
+
+    fdprintf(DumpFD, buffer, "blocks:      %lu\n"   , totals[BLOCKS]);
     fdprintf(DumpFD, buffer, "free blocks: %lu\n"   , free_list_length());
-    fdprintf(DumpFD, buffer, "mallocs:     %lu\n"   , Counters[MALLOCS]);
-    fdprintf(DumpFD, buffer, "frees:       %lu\n"   , Counters[FREES]);
-    fdprintf(DumpFD, buffer, "callocs:     %lu\n"   , Counters[CALLOCS]);
-    fdprintf(DumpFD, buffer, "reallocs:    %lu\n"   , Counters[REALLOCS]);
-    fdprintf(DumpFD, buffer, "reuses:      %lu\n"   , Counters[REUSES]);
-    fdprintf(DumpFD, buffer, "grows:       %lu\n"   , Counters[GROWS]);
-    fdprintf(DumpFD, buffer, "shrinks:     %lu\n"   , Counters[SHRINKS]);
-    fdprintf(DumpFD, buffer, "splits:      %lu\n"   , Counters[SPLITS]);
-    fdprintf(DumpFD, buffer, "merges:      %lu\n"   , Counters[MERGES]);
-    fdprintf(DumpFD, buffer, "requested:   %lu\n"   , Counters[REQUESTED]);
-    fdprintf(DumpFD, buffer, "heap size:   %lu\n"   , Counters[HEAP_SIZE]);
+    fdprintf(DumpFD, buffer, "mallocs:     %lu\n"   , totals[MALLOCS]);
+    fdprintf(DumpFD, buffer, "frees:       %lu\n"   , totals[FREES]);
+    fdprintf(DumpFD, buffer, "callocs:     %lu\n"   , totals[CALLOCS]);
+    fdprintf(DumpFD, buffer, "in place:    %lu\n"   , totals[IN_PLACE]);
+    fdprintf(DumpFD, buffer, "moved:       %lu\n"   , totals[MOVED]);
+    fdprintf(DumpFD, buffer, "reuses:      %lu\n"   , totals[REUSES]);
+    fdprintf(DumpFD, buffer, "grows:       %lu\n"   , totals[GROWS]);
+    fdprintf(DumpFD, buffer, "shrinks:     %lu\n"   , totals[SHRINKS]);
+    fdprintf(DumpFD, buffer, "splits:      %lu\n"   , totals[SPLITS]);
+    fdprintf(DumpFD, buffer, "merges:      %lu\n"   , totals[MERGES]);
+    fdprintf(DumpFD, buffer, "maps:        %lu\n"   , totals[MAPS]);
+    fdprintf(DumpFD, buffer, "advises:     %lu\n"   , totals[ADVISES]);
+    fdprintf(DumpFD, buffer, "slabs:       %lu\n"   , totals[SLABS]);
+    fdprintf(DumpFD, buffer, "requested:   %lu\n"   , totals[REQUESTED]);
+    fdprintf(DumpFD, buffer, "heap size:   %lu\n"   , totals[HEAP_SIZE]);
+    fdprintf(DumpFD, buffer, "heap peak:   %lu\n"   , HeapPeak);
     fdprintf(DumpFD, buffer, "internal:    %4.2lf\n", internal_fragmentation());
     fdprintf(DumpFD, buffer, "external:    %4.2lf\n", external_fragmentation());
 
-    close(DumpFD);
-}
\ No newline at end of file
+    report_histogram("sizes",         totals + SIZE_HISTOGRAM,   SIZE_BINS);
+    report_histogram("malloc cycles", totals + MALLOC_HISTOGRAM, CYCLE_BINS);
+    report_histogram("free cycles",   totals + FREE_HISTOGRAM,   CYCLE_BINS);
+
+    for (size_t slot = 0; slot < PROFILE_SITES; slot++) {
+        ProfileSite *entry = &ProfileSites[slot];
+        if (entry->address) {
+            fdprintf(DumpFD, buffer, "site %p: %lu samples, %lu bytes\n", entry->address, entry->samples, entry->bytes);
+        }
+    }
+}
+
+void report_histogram(const char *name, size_t *bins, size_t nbins) {
+    char buffer[BUFSIZ];
+
+    for (size_t bin = 0; bin < nbins; bin++) {
+        if (bins[bin]) {
+            fdprintf(DumpFD, buffer, "%s < 2^%-2lu %lu\n", name, bin, bins[bin]);
+        }
+    }
+}
+
+void report_json(size_t totals[NSTATISTICS]) {
+    char buffer[BUFSIZ];
+
+    fdprintf(DumpFD, buffer, "{\"free_blocks\": %lu, \"heap_peak\": %lu, \"internal\": %.2lf, \"external\": %.2lf",
+        free_list_length(), HeapPeak, internal_fragmentation(), external_fragmentation());
+    for (int counter = 0; counter < NCOUNTERS; counter++) {
+        fdprintf(DumpFD, buffer, ", \"%s\": %lu", CounterNames[counter], totals[counter]);
+    }
+
+    const char *names[]   = {"sizes", "malloc_cycles", "free_cycles"};
+    int         offsets[] = {SIZE_HISTOGRAM, MALLOC_HISTOGRAM, FREE_HISTOGRAM};
+    size_t      nbins[]   = {SIZE_BINS, CYCLE_BINS, CYCLE_BINS};
+    for (int histogram = 0; histogram < 3; histogram++) {
+        fdprintf(DumpFD, buffer, ", \"%s\": [", names[histogram]);
+        for (size_t bin = 0; bin < nbins[histogram]; bin++) {
+            fdprintf(DumpFD, buffer, "%s%lu", bin ? ", " : "", totals[offsets[histogram] + bin]);
+        }
+        fdprintf(DumpFD, buffer, "]");
+    }
+
+    bool first = true;
+    fdprintf(DumpFD, buffer, ", \"sites\": [");
+    for (size_t slot = 0; slot < PROFILE_SITES; slot++) {
+        ProfileSite *entry = &ProfileSites[slot];
+        if (entry->address) {
+            fdprintf(DumpFD, buffer, "%s{\"address\": \"%p\", \"samples\": %lu, \"bytes\": %lu}",
+                first ? "" : ", ", entry->address, entry->samples, entry->bytes);
+            first = false;
+        }
+    }
+    fdprintf(DumpFD, buffer, "]}\n");
+}
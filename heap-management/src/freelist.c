@@ -1,16 +1,40 @@
 /* freelist.c: Free List Implementation
  *
- * The FreeList is an unordered doubly-linked circular list containing all the
+ * Each FreeList is an unordered doubly-linked circular list containing
  * available memory allocations (memory that has been previous allocated and
- * can be re-used).
+ * can be re-used).  The first, worst, and best fit policies keep every block
+ * in a single list.  The segregated fit policy (FIT == 3) keeps one list per
+ * size class instead: exact classes for the smallest sizes, then CLASS_SPLITS
+ * classes per power of two, with the last class holding everything larger.
+ * FreeListMap records which classes may be non-empty, so finding a block
+ * from a larger class is a single count-trailing-zeros.
  **/
 
 #include "malloc/counters.h"
 #include "malloc/freelist.h"
 
+/* Internal Prototypes */
+
+void    free_list_push(Block *block);
+
+/* Internal Macros */
+
+#define FREE_LIST(i)    {-1, -1, &FreeLists[i], &FreeLists[i]}
+#define FREE_LISTS_4(i) FREE_LIST(i), FREE_LIST(i + 1), FREE_LIST(i + 2), FREE_LIST(i + 3)
+#define FREE_LISTS_16(i) \
+    FREE_LISTS_4(i), FREE_LISTS_4(i + 4), FREE_LISTS_4(i + 8), FREE_LISTS_4(i + 12)
+#define FREE_LISTS_64(i) \
+    FREE_LISTS_16(i), FREE_LISTS_16(i + 16), FREE_LISTS_16(i + 32), FREE_LISTS_16(i + 48)
+
 /* Global Variables */
 
-Block FreeList = {-1, -1, &FreeList, &FreeList};
+#if	FREE_LISTS == 1
+Block    FreeLists[FREE_LISTS] = {FREE_LIST(0)};
+#else
+Block    FreeLists[FREE_LISTS] = {FREE_LISTS_64(0)};
+#endif
+uint64_t FreeListMap           = 0;
+pthread_mutex_t HeapLock       = PTHREAD_MUTEX_INITIALIZER;
 
 /* Functions */
 
@@ -21,7 +45,7 @@ Block FreeList = {-1, -1, &FreeList, &FreeList};
  * @return  Pointer to existing block (otherwise NULL if none are available).
  **/
 Block * free_list_search_ff(size_t size) {
-    for(Block *curr = FreeList.next; curr != &FreeList; curr=curr->next) {
+    for(Block *curr = FreeLists[0].next; curr != &FreeLists[0]; curr=curr->next) {
         if(curr->capacity >= size) {
             return curr;
         }
@@ -37,7 +61,7 @@ Block * free_list_search_ff(size_t size) {
  **/
 Block* free_list_search_bf(size_t size) {
     Block* closest = NULL;
-    for(Block *curr = FreeList.next; curr != &FreeList; curr=curr->next) {
+    for(Block *curr = FreeLists[0].next; curr != &FreeLists[0]; curr=curr->next) {
         if(curr->capacity >= size) {
             if(!closest) {
                 closest = curr;
@@ -58,7 +82,7 @@ Block* free_list_search_bf(size_t size) {
  **/
 Block* free_list_search_wf(size_t size) {
     Block* largest = NULL;
-    for(Block *curr = FreeList.next; curr != &FreeList; curr=curr->next) {
+    for(Block *curr = FreeLists[0].next; curr != &FreeLists[0]; curr=curr->next) {
         if(curr->capacity >= size) {
             if(!largest) {
                 largest = curr;
@@ -71,10 +95,60 @@ Block* free_list_search_wf(size_t size) {
     return largest;
 }
 
+/**
+ * Search for an existing block with at least the specified size using the
+ * segregated fit algorithm by doing the following:
+ *
+ *  1. Check the blocks in the size class of the request (they may still be
+ *  too small, since each class covers a range of sizes).
+ *
+ *  2. Otherwise take the first block of the next non-empty larger class (any
+ *  block there is large enough), clearing classes that turn out to be empty.
+ *
+ *  3. Detach the block and return any remainder of splitting it to the free
+ *  list of its own size class.
+ *
+ * @param   size    Amount of memory required.
+ * @return  Pointer to detached block (otherwise NULL if none are available).
+ **/
+Block* free_list_search_sf(size_t size) {
+    size_t class = free_list_class(ALIGN(size));
+    Block* found = NULL;
+
+    for(Block *curr = FreeLists[class].next; curr != &FreeLists[class]; curr=curr->next) {
+        if(curr->capacity >= size) {
+            found = curr;
+            break;
+        }
+    }
+
+    // Blocks may be detached without updating the map, so it can be stale
+    uint64_t classes = FreeListMap & ~((2ULL << class) - 1);
+    while(!found && classes) {
+        size_t next = __builtin_ctzll(classes);
+        if(FreeLists[next].next != &FreeLists[next]) {
+            found = FreeLists[next].next;
+        }
+        else {
+            FreeListMap &= ~(1ULL << next);
+        }
+        classes &= classes - 1;
+    }
+    if(!found) {
+        return NULL;
+    }
+
+    block_split(block_detach(found), size);
+    if(found->next != found) {
+        free_list_push(block_detach(found->next));
+    }
+    return found;
+}
+
 /**
  * Search for an existing block in free list with at least the specified size.
  *
- * Note, this is a wrapper function that calls one of the three algorithms
+ * Note, this is a wrapper function that calls one of the four algorithms
  * above based on the compile-time setting.
  *
  * @param   size    Amount of memory required.
@@ -88,6 +162,8 @@ Block* free_list_search(size_t size) {
         block = free_list_search_wf(size);
     #elif	defined FIT && FIT == 2
         block = free_list_search_bf(size);
+    #elif	defined FIT && FIT == 3
+        block = free_list_search_sf(size);
     #endif
 
     if (block) {
@@ -99,26 +175,40 @@ Block* free_list_search(size_t size) {
 /**
  * Insert specified block into free list.
  *
- * Scan the free list and attempt to merge specified block into an existing
- * block (or a current block into the specified block, updating the pointers
- * appropriately).
+ * Use the boundary tags to find the physical neighbors of the block and
+ * merge it with whichever of them are free (the next block is merged into
+ * the specified block, which takes its place in the free list, and the
+ * specified block is merged into the previous block).
  *
  * If a merge is not possible, then simply add the block to the end of the free
- * list.
+ * list of its size class.
  * @param   block   Pointer to block to insert into free list.
+ * @return  Pointer to free block now holding the memory of the block.
  **/
-void free_list_insert(Block *block) {
-    for(Block* curr = FreeList.next; curr != &FreeList; curr=curr->next) {
-        // Try to merge before and after every free block
-        if(block_merge(block, curr) || block_merge(curr, block)) {
-            return;
-        }
+Block* free_list_insert(Block *block) {
+    bool merged = false;
+
+    Block* next = block_next(block);
+    if(block_is_free(next)) {
+        merged = block_merge(block, next);
+    }
+    Block* prev = block_prev(block);
+    if(prev && block_is_free(prev)) {
+        merged = block_merge(prev, block_detach(block)) || merged;
+        block  = prev;
+    }
+
+    if(!merged) {
+        // If not merged insert at end of list
+        free_list_push(block);
     }
-    // If not merged insert at end of list
-    block->prev = FreeList.prev;
-    block->next = &FreeList;
-    FreeList.prev->next = block;
-    FreeList.prev = block;
+    #if	defined FIT && FIT == 3
+    else {
+        // The merged block grew, so it may belong to a larger class
+        free_list_push(block_detach(block));
+    }
+    #endif
+    return block;
 }
 
 /**
@@ -127,8 +217,46 @@ void free_list_insert(Block *block) {
  **/
 size_t free_list_length() {
     size_t length = 0;
-    for(Block* curr = FreeList.next; curr != &FreeList; curr=curr->next) {
-        length++; 
+    for(size_t class = 0; class < FREE_LISTS; class++) {
+        for(Block* curr = FreeLists[class].next; curr != &FreeLists[class]; curr=curr->next) {
+            length++; 
+        }
     }
     return length;
+}
+
+/**
+ * Return size class of a block with the specified capacity (always 0 unless
+ * the segregated fit policy is used).
+ * @param   capacity    Capacity of block.
+ * @return  Index of free list holding blocks with this capacity.
+ **/
+size_t free_list_class(size_t capacity) {
+    if(FREE_LISTS == 1) {
+        return 0;
+    }
+    if(capacity < SMALL_CLASSES*ALIGNMENT) {
+        return capacity / ALIGNMENT;
+    }
+
+    // Split each power of two into CLASS_SPLITS classes by its next bits
+    size_t log2  = 63 - __builtin_clzll(capacity);
+    size_t small = 63 - __builtin_clzll(SMALL_CLASSES*ALIGNMENT);
+    size_t split = (capacity >> (log2 - 2)) & (CLASS_SPLITS - 1);
+    size_t class = SMALL_CLASSES + (log2 - small)*CLASS_SPLITS + split;
+    return class < FREE_LISTS ? class : FREE_LISTS - 1;
+}
+
+/**
+ * Add specified detached block to the end of the free list of its size class.
+ * @param   block   Pointer to block to add.
+ **/
+void free_list_push(Block *block) {
+    size_t class = free_list_class(block->capacity);
+
+    block->prev = FreeLists[class].prev;
+    block->next = &FreeLists[class];
+    FreeLists[class].prev->next = block;
+    FreeLists[class].prev = block;
+    FreeListMap |= 1ULL << class;
 }
\ No newline at end of file
@@ -0,0 +1,638 @@
+/* heapbench.c: Heap Management allocator benchmark
+ *
+ * Runs allocation workloads (or replays a recorded trace) once under the
+ * system allocator and once under each allocator library given with -l, and
+ * reports throughput, 99th percentile latency, peak RSS, and (for our
+ * allocator) the fragmentation it reports at exit, side by side.
+ *
+ * Each run is a separate child process (this program again, with LD_PRELOAD
+ * set), so the allocators never share a heap and peak RSS is per run.
+ * Workloads leave their live allocations in place when they finish, so the
+ * fragmentation reported at exit reflects them.  The
+ * benchmark keeps its own bookkeeping in mmap'ed memory, so only the
+ * workload itself goes through the allocator being measured.
+ *
+ * Trace files have one operation per line (ids name live allocations):
+ *
+ *      m ID SIZE       ID = malloc(SIZE)
+ *      c ID N SIZE     ID = calloc(N, SIZE)
+ *      r ID SIZE       ID = realloc(ID, SIZE)
+ *      f ID            free(ID)
+ *
+ * Build from the heap-management directory with:
+ *
+ *      gcc -std=gnu99 -O2 -pthread -o heapbench src/heapbench.c
+ *
+ * Build the allocator libraries given with -l as described in posix.c (one
+ * library per -DFIT policy to compare them).
+ **/
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Macros */
+
+#define streq(a, b)	(strcmp((a), (b)) == 0)
+
+/* Constants */
+
+#define DEFAULT_OPS     (1000000)   /* Operations per workload */
+#define DEFAULT_THREADS (4)         /* Threads in churn workload */
+#define MAX_THREADS     (64)
+#define MAX_LIBRARIES   (8)
+#define LIVE_SLOTS      (4096)      /* Allocations kept live by each thread */
+#define QUEUE_SLOTS     (1024)      /* Messages in flight between producer and consumer */
+#define LATENCY_SPLITS  (16)        /* Latency bins per power of two */
+#define LATENCY_BINS    (64 * LATENCY_SPLITS)
+
+/* Structures */
+
+typedef struct Latency  Latency;
+struct Latency {
+    size_t      bins[LATENCY_BINS];     /* Operations by nanoseconds taken */
+    size_t      count;                  /* Number of operations recorded */
+};
+
+typedef struct Worker   Worker;
+struct Worker {
+    pthread_t   thread;                 /* Thread running workload */
+    unsigned    seed;                   /* Random number seed */
+    size_t      ops;                    /* Number of operations to perform */
+    void **     slots;                  /* Live allocations */
+    Latency     latency;                /* Latency of operations */
+};
+
+typedef struct Queue    Queue;
+struct Queue {
+    void *          messages[QUEUE_SLOTS];  /* Messages in flight */
+    size_t          head;                   /* Number of messages taken */
+    size_t          tail;                   /* Number of messages put */
+    pthread_mutex_t lock;
+    pthread_cond_t  changed;
+};
+
+typedef struct Result   Result;
+struct Result {
+    size_t      ops;                    /* Number of operations performed */
+    double      elapsed;                /* Total time in seconds */
+    uint64_t    p99;                    /* 99th percentile latency in nanoseconds */
+    long        rss;                    /* Peak resident set size in KB */
+    double      internal;               /* Internal fragmentation (negative if unknown) */
+    double      external;               /* External fragmentation (negative if unknown) */
+};
+
+/* Workload Prototypes */
+
+void *  run_random(void *arg);
+void *  run_realloc(void *arg);
+void *  run_churn(void *arg);
+void *  run_produce(void *arg);
+void *  run_consume(void *arg);
+bool    run_trace(const char *path, Worker *worker);
+
+/* Utility Prototypes */
+
+void    usage(const char *program);
+bool    run_workload(const char *workload, const char *trace, size_t ops, size_t threads);
+bool    spawn(const char *library, char *argv[], Result *result);
+void *  bench_map(size_t bytes);
+uint64_t bench_now();
+void    latency_record(Latency *latency, uint64_t nanoseconds);
+void    latency_merge(Latency *dst, const Latency *src);
+uint64_t latency_percentile(const Latency *latency, double percentile);
+
+/* Globals */
+
+Queue   *MessageQueue = NULL;
+
+/* Main Execution */
+
+int main(int argc, char *argv[]) {
+    char * libraries[MAX_LIBRARIES];
+    size_t nlibraries = 0;
+    char * trace      = NULL;
+    size_t ops        = DEFAULT_OPS;
+    size_t threads    = DEFAULT_THREADS;
+    bool   child      = false;
+    int    argind     = 1;
+
+    while (argind < argc && strlen(argv[argind]) > 1 && argv[argind][0] == '-') {
+        char *arg = argv[argind++];
+        if (streq(arg, "-l") && argind < argc && nlibraries < MAX_LIBRARIES) {
+            libraries[nlibraries++] = argv[argind++];
+        }
+        else if (streq(arg, "-t") && argind < argc) {
+            trace = argv[argind++];
+        }
+        else if (streq(arg, "-n") && argind < argc) {
+            ops = strtoul(argv[argind++], NULL, 10);
+        }
+        else if (streq(arg, "-j") && argind < argc) {
+            threads = strtoul(argv[argind++], NULL, 10);
+        }
+        else if (streq(arg, "-C")) {
+            child = true;
+        }
+        else {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (!threads || threads > MAX_THREADS) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    /* Child: run one workload under whatever allocator was preloaded */
+    if (child) {
+        if (argc - argind != 1) {
+            return EXIT_FAILURE;
+        }
+        return run_workload(argv[argind], trace, ops, threads) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    /* Parent: run every workload under every allocator */
+    char *defaults[] = {"produce", "random", "realloc", "churn"};
+    char **workloads = argv + argind;
+    int    nworkloads = argc - argind;
+    if (trace) {
+        static char *replay[] = {"trace"};
+        workloads  = replay;
+        nworkloads = 1;
+    }
+    else if (!nworkloads) {
+        workloads  = defaults;
+        nworkloads = sizeof(defaults) / sizeof(defaults[0]);
+    }
+
+    char ops_arg[BUFSIZ], threads_arg[BUFSIZ];
+    snprintf(ops_arg, sizeof(ops_arg), "%lu", ops);
+    snprintf(threads_arg, sizeof(threads_arg), "%lu", threads);
+
+    printf("%-10s %-24s %12s %10s %10s %9s %9s\n", "workload", "allocator", "ops/s", "p99 ns", "rss KB", "internal", "external");
+    for (int w = 0; w < nworkloads; w++) {
+        for (size_t l = 0; l <= nlibraries; l++) {
+            char *library = l ? libraries[l - 1] : NULL;
+            char *child_argv[16] = {"/proc/self/exe", "-C", "-n", ops_arg, "-j", threads_arg};
+            int   child_argc     = 6;
+            if (trace) {
+                child_argv[child_argc++] = "-t";
+                child_argv[child_argc++] = trace;
+            }
+            child_argv[child_argc++] = workloads[w];
+            child_argv[child_argc]   = NULL;
+
+            Result result;
+            if (!spawn(library, child_argv, &result)) {
+                fprintf(stderr, "%s under %s failed!\n", workloads[w], library ? library : "system");
+                continue;
+            }
+
+            char internal[BUFSIZ] = "-", external[BUFSIZ] = "-";
+            if (result.internal >= 0) {
+                snprintf(internal, sizeof(internal), "%.2lf", result.internal);
+                snprintf(external, sizeof(external), "%.2lf", result.external);
+            }
+            printf("%-10s %-24s %12.0lf %10lu %10ld %9s %9s\n", workloads[w], library ? library : "system",
+                result.ops / (result.elapsed > 0 ? result.elapsed : 1), result.p99, result.rss, internal, external);
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+/* Workload Functions */
+
+/**
+ * Randomly malloc (or calloc) and free blocks of mostly small and sometimes
+ * large sizes, keeping up to LIVE_SLOTS of them live.
+ * @param       arg         Pointer to Worker structure.
+ **/
+void *  run_random(void *arg) {
+    Worker *worker = arg;
+
+    for (size_t op = 0; op < worker->ops; op++) {
+        size_t slot = rand_r(&worker->seed) % LIVE_SLOTS;
+        if (worker->slots[slot]) {
+            uint64_t start = bench_now();
+            free(worker->slots[slot]);
+            latency_record(&worker->latency, bench_now() - start);
+            worker->slots[slot] = NULL;
+        }
+        else {
+            size_t   size  = rand_r(&worker->seed) % 8 ? rand_r(&worker->seed) % 256 + 1 : rand_r(&worker->seed) % 65536 + 1;
+            uint64_t start = bench_now();
+            worker->slots[slot] = op % 4 ? malloc(size) : calloc(1, size);
+            latency_record(&worker->latency, bench_now() - start);
+            memset(worker->slots[slot], 0xAB, size < 64 ? size : 64);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Grow buffers a few bytes at a time with realloc (as string builders and
+ * vectors do), starting over once they reach a megabyte.
+ * @param       arg         Pointer to Worker structure.
+ **/
+void *  run_realloc(void *arg) {
+    Worker *worker = arg;
+    size_t  sizes[16] = {0};
+
+    for (size_t op = 0; op < worker->ops; op++) {
+        size_t slot = op % 16;
+        size_t size = sizes[slot] + rand_r(&worker->seed) % 64 + 1;
+        if (size > (1<<20)) {
+            free(worker->slots[slot]);
+            worker->slots[slot] = NULL;
+            size = 1;
+        }
+        uint64_t start = bench_now();
+        char *buffer = realloc(worker->slots[slot], size);
+        latency_record(&worker->latency, bench_now() - start);
+        buffer[size - 1] = (char)op;
+        worker->slots[slot] = buffer;
+        sizes[slot] = size;
+    }
+    return NULL;
+}
+
+/**
+ * Malloc and free small blocks (as one of several threads doing the same).
+ * @param       arg         Pointer to Worker structure.
+ **/
+void *  run_churn(void *arg) {
+    Worker *worker = arg;
+
+    for (size_t op = 0; op < worker->ops; op++) {
+        size_t   slot  = rand_r(&worker->seed) % (LIVE_SLOTS / 16);
+        uint64_t start = bench_now();
+        if (worker->slots[slot]) {
+            free(worker->slots[slot]);
+            worker->slots[slot] = NULL;
+        }
+        else {
+            worker->slots[slot] = malloc(rand_r(&worker->seed) % 512 + 16);
+        }
+        latency_record(&worker->latency, bench_now() - start);
+    }
+    return NULL;
+}
+
+/**
+ * Malloc messages and pass them to the consumer thread (which frees them).
+ * @param       arg         Pointer to Worker structure.
+ **/
+void *  run_produce(void *arg) {
+    Worker *worker = arg;
+    Queue  *queue  = MessageQueue;
+
+    for (size_t op = 0; op < worker->ops; op++) {
+        size_t   size    = rand_r(&worker->seed) % 1024 + 16;
+        uint64_t start   = bench_now();
+        char *   message = malloc(size);
+        latency_record(&worker->latency, bench_now() - start);
+        message[0] = 1;
+
+        pthread_mutex_lock(&queue->lock);
+        while (queue->tail - queue->head == QUEUE_SLOTS) {
+            pthread_cond_wait(&queue->changed, &queue->lock);
+        }
+        queue->messages[queue->tail++ % QUEUE_SLOTS] = message;
+        pthread_cond_signal(&queue->changed);
+        pthread_mutex_unlock(&queue->lock);
+    }
+    return NULL;
+}
+
+/**
+ * Free messages passed from the producer thread.
+ * @param       arg         Pointer to Worker structure.
+ **/
+void *  run_consume(void *arg) {
+    Worker *worker = arg;
+    Queue  *queue  = MessageQueue;
+
+    for (size_t op = 0; op < worker->ops; op++) {
+        pthread_mutex_lock(&queue->lock);
+        while (queue->tail == queue->head) {
+            pthread_cond_wait(&queue->changed, &queue->lock);
+        }
+        char *message = queue->messages[queue->head++ % QUEUE_SLOTS];
+        pthread_cond_signal(&queue->changed);
+        pthread_mutex_unlock(&queue->lock);
+
+        uint64_t start = bench_now();
+        free(message);
+        latency_record(&worker->latency, bench_now() - start);
+    }
+    return NULL;
+}
+
+/**
+ * Replay the malloc, calloc, realloc, and free calls of a trace file.
+ * @param       path        Path to trace file.
+ * @param       worker      Pointer to Worker structure (ops is set to the
+ *                          number of calls replayed).
+ * @return      Whether or not the trace was replayed successfully.
+ **/
+bool    run_trace(const char *path, Worker *worker) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !st.st_size) {
+        close(fd);
+        return false;
+    }
+    char *text = mmap(NULL, st.st_size + 1, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (text == MAP_FAILED) {
+        return false;
+    }
+    text[st.st_size] = 0;
+
+    // Find the largest id, so the table of live allocations can be mapped
+    size_t nids = 0;
+    for (char *line = text; line && *line; line = strchr(line, '\n'), line = line ? line + 1 : NULL) {
+        size_t id = strtoul(line + 1, NULL, 10);
+        nids = id + 1 > nids ? id + 1 : nids;
+    }
+    void **ids = bench_map(nids * sizeof(void *));
+
+    worker->ops = 0;
+    for (char *line = text; line && *line; line = strchr(line, '\n'), line = line ? line + 1 : NULL) {
+        char *   end;
+        size_t   id    = strtoul(line + 1, &end, 10);
+        size_t   n     = strtoul(end, &end, 10);
+        size_t   size  = strtoul(end, NULL, 10);
+        uint64_t start = bench_now();
+        switch (line[0]) {
+            case 'm': ids[id] = malloc(n); break;
+            case 'c': ids[id] = calloc(n, size); break;
+            case 'r': ids[id] = realloc(ids[id], n); break;
+            case 'f': free(ids[id]); ids[id] = NULL; break;
+            default:  continue;
+        }
+        latency_record(&worker->latency, bench_now() - start);
+        worker->ops++;
+    }
+
+    munmap(ids, nids * sizeof(void *));
+    munmap(text, st.st_size + 1);
+    return true;
+}
+
+/* Utility Functions */
+
+/**
+ * Display usage message.
+ * @param       program     String containing name of program.
+ **/
+void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [options] [workload ...]\n\n", program);
+    fprintf(stderr, "Workloads:\n");
+    fprintf(stderr, "    produce            One thread mallocs messages another frees\n");
+    fprintf(stderr, "    random             Random sizes malloced and freed in random order\n");
+    fprintf(stderr, "    realloc            Buffers grown a few bytes at a time\n");
+    fprintf(stderr, "    churn              Threads mallocing and freeing small blocks\n\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    -l LIBRARY         Also run under LD_PRELOAD=LIBRARY (may repeat)\n");
+    fprintf(stderr, "    -t TRACE           Replay trace file instead of workloads\n");
+    fprintf(stderr, "    -n OPS             Operations per workload (default %d)\n", DEFAULT_OPS);
+    fprintf(stderr, "    -j THREADS         Threads in churn workload (default %d)\n", DEFAULT_THREADS);
+}
+
+/**
+ * Run the specified workload and write its result to standard output (the
+ * allocator being measured reports its counters after it at exit).
+ * @param       workload    Name of workload.
+ * @param       trace       Path to trace file (when workload is trace).
+ * @param       ops         Number of operations per thread.
+ * @param       threads     Number of threads (for churn).
+ * @return      Whether or not the workload ran successfully.
+ **/
+bool run_workload(const char *workload, const char *trace, size_t ops, size_t threads) {
+    void *(*function)(void *) = NULL;
+    size_t nworkers = 1;
+
+    if (streq(workload, "random")) {
+        function = run_random;
+    }
+    else if (streq(workload, "realloc")) {
+        function = run_realloc;
+    }
+    else if (streq(workload, "churn")) {
+        function = run_churn;
+        nworkers = threads;
+    }
+    else if (streq(workload, "produce")) {
+        MessageQueue = bench_map(sizeof(Queue));
+        pthread_mutex_init(&MessageQueue->lock, NULL);
+        pthread_cond_init(&MessageQueue->changed, NULL);
+        nworkers = 2;
+    }
+    else if (!streq(workload, "trace") || !trace) {
+        fprintf(stderr, "Unknown workload: %s\n", workload);
+        return false;
+    }
+
+    Worker *workers = bench_map(nworkers * sizeof(Worker));
+    for (size_t w = 0; w < nworkers; w++) {
+        workers[w].seed  = w + 1;
+        workers[w].ops   = ops;
+        workers[w].slots = bench_map(LIVE_SLOTS * sizeof(void *));
+    }
+
+    bool   success = true;
+    double start   = bench_now();
+    if (trace) {
+        success = run_trace(trace, &workers[0]);
+    }
+    else {
+        for (size_t w = 0; w < nworkers; w++) {
+            void *(*run)(void *) = function ? function : (w ? run_consume : run_produce);
+            pthread_create(&workers[w].thread, NULL, run, &workers[w]);
+        }
+        for (size_t w = 0; w < nworkers; w++) {
+            pthread_join(workers[w].thread, NULL);
+        }
+    }
+    double elapsed = (bench_now() - start) / 1e9;
+
+    if (success) {
+        Latency *total = bench_map(sizeof(Latency));
+        for (size_t w = 0; w < nworkers; w++) {
+            latency_merge(total, &workers[w].latency);
+        }
+        printf("result %lu %.9lf %lu\n", total->count, elapsed, latency_percentile(total, 0.99));
+        fflush(stdout);
+        munmap(total, sizeof(Latency));
+    }
+
+    // Release the bookkeeping (the live allocations themselves stay in place)
+    for (size_t w = 0; w < nworkers; w++) {
+        munmap(workers[w].slots, LIVE_SLOTS * sizeof(void *));
+    }
+    munmap(workers, nworkers * sizeof(Worker));
+    if (MessageQueue) {
+        pthread_cond_destroy(&MessageQueue->changed);
+        pthread_mutex_destroy(&MessageQueue->lock);
+        munmap(MessageQueue, sizeof(Queue));
+        MessageQueue = NULL;
+    }
+    return success;
+}
+
+/**
+ * Run this program as a child with the specified arguments (under the
+ * specified allocator library) and collect its result.
+ * @param       library     Path to allocator library (NULL for the system allocator).
+ * @param       argv        Arguments of child.
+ * @param       result      Pointer to Result structure to fill in.
+ * @return      Whether or not the child ran successfully.
+ **/
+bool spawn(const char *library, char *argv[], Result *result) {
+    int fds[2];
+    if (pipe(fds) < 0) {
+        return false;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+    if (pid == 0) {
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        if (library) {
+            setenv("LD_PRELOAD", library, 1);
+        }
+        else {
+            unsetenv("LD_PRELOAD");
+        }
+        unsetenv("MALLOC_STATS_FORMAT");
+        execv(argv[0], argv);
+        _exit(EXIT_FAILURE);
+    }
+    close(fds[1]);
+
+    memset(result, 0, sizeof(Result));
+    result->internal = result->external = -1;
+
+    FILE *stream = fdopen(fds[0], "r");
+    char  line[BUFSIZ];
+    bool  found  = false;
+    if (!stream) {
+        close(fds[0]);
+        waitpid(pid, NULL, 0);
+        return false;
+    }
+    while (fgets(line, sizeof(line), stream)) {
+        if (sscanf(line, "result %lu %lf %lu", &result->ops, &result->elapsed, &result->p99) == 3) {
+            found = true;
+        }
+        sscanf(line, "internal: %lf", &result->internal);
+        sscanf(line, "external: %lf", &result->external);
+    }
+    fclose(stream);
+
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) < 0 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+        return false;
+    }
+    result->rss = usage.ru_maxrss;
+    return found;
+}
+
+/**
+ * Map zeroed memory for bookkeeping (without going through malloc).
+ * @param       bytes       Number of bytes to map.
+ * @return      Pointer to mapped memory (exits on failure).
+ **/
+void *  bench_map(size_t bytes) {
+    void *memory = mmap(NULL, bytes ? bytes : 1, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+    return memory;
+}
+
+/**
+ * Return current (monotonic) time in nanoseconds.
+ * @return      Current time.
+ **/
+uint64_t bench_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Record an operation that took the specified number of nanoseconds (binned
+ * by power of two, with LATENCY_SPLITS bins per power).
+ * @param       latency     Pointer to Latency structure.
+ * @param       nanoseconds Time operation took.
+ **/
+void    latency_record(Latency *latency, uint64_t nanoseconds) {
+    size_t bin = nanoseconds;
+    if (nanoseconds >= LATENCY_SPLITS) {
+        size_t log2 = 63 - __builtin_clzll(nanoseconds);
+        size_t sub  = (nanoseconds >> (log2 - 4)) & (LATENCY_SPLITS - 1);
+        bin = (log2 - 3) * LATENCY_SPLITS + sub;
+    }
+    latency->bins[bin < LATENCY_BINS ? bin : LATENCY_BINS - 1]++;
+    latency->count++;
+}
+
+/**
+ * Add latencies recorded in source to destination.
+ * @param       dst         Pointer to Latency structure to add to.
+ * @param       src         Pointer to Latency structure to add from.
+ **/
+void    latency_merge(Latency *dst, const Latency *src) {
+    for (size_t bin = 0; bin < LATENCY_BINS; bin++) {
+        dst->bins[bin] += src->bins[bin];
+    }
+    dst->count += src->count;
+}
+
+/**
+ * Return latency below which the specified share of operations fall (the
+ * lower bound of its bin).
+ * @param       latency     Pointer to Latency structure.
+ * @param       percentile  Share of operations (0 to 1).
+ * @return      Latency in nanoseconds.
+ **/
+uint64_t latency_percentile(const Latency *latency, double percentile) {
+    size_t target = latency->count * percentile;
+    size_t seen   = 0;
+    for (size_t bin = 0; bin < LATENCY_BINS; bin++) {
+        seen += latency->bins[bin];
+        if (seen > target) {
+            if (bin < LATENCY_SPLITS) {
+                return bin;
+            }
+            size_t log2 = bin / LATENCY_SPLITS + 3;
+            return (1ULL << log2) + (bin % LATENCY_SPLITS) * (1ULL << (log2 - 4));
+        }
+    }
+    return 0;
+}
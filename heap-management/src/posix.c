@@ -1,50 +1,53 @@
-/* posix.c: POSIX API Implementation */
+/* posix.c: POSIX API Implementation
+ *
+ * Build the library with -fno-builtin and a fit policy (-DFIT=0 first, 1
+ * worst, 2 best, or 3 segregated, which is the default), for instance:
+ *
+ *      gcc -std=gnu99 -O2 -fno-builtin -fPIC -shared -pthread -I. -DFIT=3 \
+ *          -o libmalloc.so src/block.c src/counters.c src/freelist.c \
+ *          src/posix.c src/slab.c src/tcache.c
+ *
+ * Without it the compiler may turn the functions below back into calls to the
+ * ones they implement (malloc followed by memset becomes calloc), which then
+ * recurse forever once the library is loaded with LD_PRELOAD.
+ **/
 
 #include "malloc/counters.h"
 #include "malloc/freelist.h"
+#include "malloc/slab.h"
+#include "malloc/tcache.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <string.h>
 
+/* Internal Macros */
+
+#define IS_POWER_OF_TWO(n)  ((n) && !((n) & ((n) - 1)))
+
+/* Internal Prototypes */
+
+void *  heap_allocate(size_t size);
+void *  heap_allocate_aligned(size_t alignment, size_t size);
+void    heap_free(void *ptr);
+
 /**
  * Allocate specified amount memory.
  * @param   size    Amount of bytes to allocate.
  * @return  Pointer to the requested amount of memory.
  **/
 void *malloc(size_t size) {
-    // Initialize counters
+    // Initialize counters and thread cache
     init_counters();
+    tcache_init();
+    profile_poll();
 
-    // Handle empty size
-    if (!size) {
-        return NULL;
-    }
-    // Search free list for any available block with matching size
-    Block* block = free_list_search(size);
-    if(!block) {
-        // Try to allocate if there isn't a free block
-        block = block_allocate(size);
+    uint64_t start = profile_start();
+    void *   ptr   = heap_allocate(size);
+    if (ptr) {
+        profile_malloc(size, start, __builtin_return_address(0));
     }
-    else {
-        // Try to split found entry from the free list
-        block = block_split(block, size); 
-        block = block_detach(block);
-    }
-    // Could not find free block or allocate a block, so just return NULL
-    if (!block) {
-        return NULL;
-    }
-    block->size = size;     
-    // Check if allocated block makes sense
-    assert(block->capacity >= block->size);
-    assert(block->size     == size);
-    assert(block->next     == block);
-    assert(block->prev     == block);
-    // Update counters
-    Counters[MALLOCS]++;
-    Counters[REQUESTED] += size;
-    // Return data address associated with block
-    return block->data;
+    return ptr;
 }
 
 /**
@@ -55,14 +58,14 @@ void free(void *ptr) {
     if (!ptr) {
         return;
     }
-    // Update counters
-    Counters[FREES]++;
+    // Initialize counters (a thread may free before it ever allocates)
+    init_counters();
+    tcache_init();
+    profile_poll();
 
-    Block* block_head = BLOCK_FROM_POINTER(ptr);
-    // Try to release block, otherwise insert it into the free list
-    if(!block_release(block_head)) {
-        free_list_insert(block_head);
-    }
+    uint64_t start = profile_start();
+    heap_free(ptr);
+    profile_free(start);
 }
 
 /**
@@ -70,16 +73,29 @@ void free(void *ptr) {
  * to 0.
  * @param   nmemb   Number of elements.
  * @param   size    Size of each element.
- * @return  Pointer to requested amount of memory.
+ * @return  Pointer to requested amount of memory (NULL with errno set to
+ *          ENOMEM if nmemb * size overflows).
  **/
 void *calloc(size_t nmemb, size_t size) {
-    size_t truesize = nmemb*size;
-    void* ptr = malloc(truesize);
-    // Return NULL if malloc fails
+    size_t truesize;
+    if (__builtin_mul_overflow(nmemb, size, &truesize)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    // Initialize counters and thread cache
+    init_counters();
+    tcache_init();
+    profile_poll();
+
+    uint64_t start = profile_start();
+    void *   ptr   = heap_allocate(truesize);
+    // Return NULL if allocation fails
     if(!ptr) {
         return NULL;
     }
     memset(ptr,0,truesize);
+    profile_malloc(truesize, start, __builtin_return_address(0));
     Counters[CALLOCS]++;
     return ptr;
 }
@@ -91,27 +107,314 @@ void *calloc(size_t nmemb, size_t size) {
  * @return  Pointer to requested amount of memory.
  **/
 void *realloc(void *ptr, size_t size) {
-    Counters[REALLOCS]++;
-
     if (!ptr) {
         return malloc(size);
     }
-    Block* block = BLOCK_FROM_POINTER(ptr);
+    if (!size) {
+        free(ptr);
+        return NULL;
+    }
 
-    if(block->size >= size) {
-        if(size==0) {
-            free(ptr);
-            return NULL;
+    size_t used;
+    if(slab_contains(ptr)) {
+        // Slab objects can grow up to the size of their slab
+        used = slab_size(ptr);
+        if(size <= used) {
+            Counters[IN_PLACE]++;
+            return ptr;
         }
-        block = block_split(block,size);
-        free_list_insert(block->next);
-        return block->data;
     }
+    else {
+        // Keep anything written up to the usable size (see malloc_usable_size)
+        Block* block = BLOCK_FROM_POINTER(ptr);
+        used = block->capacity;
+        if(block_is_mapped(block)) {
+            // Resize mapped blocks with mremap as long as they stay large
+            if(ALIGN(size) >= MMAP_THRESHOLD) {
+                Block* moved = block_remap(block, size);
+                if(!moved) {
+                    return NULL;
+                }
+                Counters[moved == block ? IN_PLACE : MOVED]++;
+                return moved->data;
+            }
+        }
+        else {
+            // Grow into the next free block or the end of the heap if possible
+            pthread_mutex_lock(&HeapLock);
+            bool resized = block_extend(block, size);
+            if(resized) {
+                block = block_split(block, size);
+                // Detach the remainder (if any) so it enters the free list on its own
+                if(block->next != block) {
+                    block_release(free_list_insert(block_detach(block->next)));
+                }
+                block->size = size;
+            }
+            pthread_mutex_unlock(&HeapLock);
+            if(resized) {
+                Counters[IN_PLACE]++;
+                return ptr;
+            }
+        }
+    }
+    // Otherwise move the data to a new allocation
     void* new_ptr = malloc(size);
     if(!new_ptr) {
         return NULL;
     }
-    memcpy(new_ptr,ptr,block->size);
+    memcpy(new_ptr,ptr,used < size ? used : size);
     free(ptr);
+    Counters[MOVED]++;
     return new_ptr;
-}
\ No newline at end of file
+}
+
+/**
+ * Allocate specified amount memory aligned to the specified alignment.
+ * @param   alignment   Alignment of the memory (rounded up to a power of two).
+ * @param   size        Amount of bytes to allocate.
+ * @return  Pointer to the requested amount of memory.
+ **/
+void *memalign(size_t alignment, size_t size) {
+    // Initialize counters and thread cache
+    init_counters();
+    tcache_init();
+    profile_poll();
+
+    size_t rounded = ALIGNMENT;
+    while (rounded < alignment) {
+        if (rounded > SIZE_MAX / 2) {
+            errno = EINVAL;
+            return NULL;
+        }
+        rounded *= 2;
+    }
+
+    uint64_t start = profile_start();
+    void *   ptr   = heap_allocate_aligned(rounded, size);
+    if (ptr) {
+        profile_malloc(size, start, __builtin_return_address(0));
+    }
+    return ptr;
+}
+
+/**
+ * Allocate specified amount memory aligned to the specified alignment.
+ * @param   memptr      Where to store the pointer to the memory.
+ * @param   alignment   Alignment of the memory (a power of two multiple of
+ *                      sizeof(void *)).
+ * @param   size        Amount of bytes to allocate.
+ * @return  0 on success, EINVAL for an invalid alignment, or ENOMEM.
+ **/
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+    if (!IS_POWER_OF_TWO(alignment) || alignment % sizeof(void *)) {
+        return EINVAL;
+    }
+    void *ptr = memalign(alignment, size);
+    if (!ptr && size) {
+        return ENOMEM;
+    }
+    *memptr = ptr;
+    return 0;
+}
+
+/**
+ * Allocate specified amount memory aligned to the specified alignment.
+ * @param   alignment   Alignment of the memory (a power of two).
+ * @param   size        Amount of bytes to allocate.
+ * @return  Pointer to the requested amount of memory.
+ **/
+void *aligned_alloc(size_t alignment, size_t size) {
+    if (!IS_POWER_OF_TWO(alignment)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return memalign(alignment, size);
+}
+
+/**
+ * Return number of bytes usable at specified allocation (at least the amount
+ * requested).
+ * @param   ptr     Pointer to previously allocated memory.
+ * @return  Number of usable bytes (0 for NULL).
+ **/
+size_t malloc_usable_size(void *ptr) {
+    if (!ptr) {
+        return 0;
+    }
+    if (slab_contains(ptr)) {
+        return slab_size(ptr);
+    }
+    Block* block = BLOCK_FROM_POINTER(ptr);
+    return block->capacity;
+}
+
+/* Internal Functions */
+
+/**
+ * Allocate specified amount memory from a slab, the thread cache, the free
+ * lists, or new heap memory (in that order).
+ * @param   size    Amount of bytes to allocate.
+ * @return  Pointer to the requested amount of memory.
+ **/
+void *heap_allocate(size_t size) {
+    // Handle empty size
+    if (!size) {
+        return NULL;
+    }
+    // Serve small objects from slabs (falling back to blocks if none are left)
+    if (ALIGN(size) <= SLAB_MAX) {
+        void *object = slab_allocate(size);
+        if (object) {
+            Counters[MALLOCS]++;
+            Counters[REQUESTED] += size;
+            return object;
+        }
+    }
+    // Reuse a block cached by this thread without taking the heap lock
+    Block* block = tcache_get(size);
+    if(!block) {
+        pthread_mutex_lock(&HeapLock);
+        // Search free list for any available block with matching size
+        block = free_list_search(size);
+        if(!block) {
+            // Try to allocate if there isn't a free block
+            block = block_allocate(size);
+            // Return the rest of a new arena chunk to the free list
+            if(block && !block_is_mapped(block)) {
+                block = block_split(block, size);
+                if(block->next != block) {
+                    free_list_insert(block_detach(block->next));
+                }
+            }
+        }
+        else {
+            // Try to split found entry from the free list
+            block = block_split(block, size); 
+            block = block_detach(block);
+        }
+        pthread_mutex_unlock(&HeapLock);
+    }
+    // Could not find free block or allocate a block, so just return NULL
+    if (!block) {
+        return NULL;
+    }
+    block->size = size;     
+    // Check if allocated block makes sense
+    assert(block->capacity >= block->size);
+    assert(block->size     == size);
+    assert(block->next     == block);
+    assert(block->prev     == block || block_is_mapped(block));
+    // Update counters
+    Counters[MALLOCS]++;
+    Counters[REQUESTED] += size;
+    // Return data address associated with block
+    return block->data;
+}
+
+/**
+ * Allocate specified amount memory aligned to the specified alignment by
+ * doing the following:
+ *
+ *  1. Serve default alignments with heap_allocate, and small objects whose
+ *  size rounds up to the alignment from slabs (which align those).
+ *
+ *  2. Map large requests directly, placing the data at the alignment.
+ *
+ *  3. Otherwise find (or allocate) a block with room for the padding, split off
+ *  the unaligned front and the unused tail, and return both to the free list.
+ *
+ * @param   alignment   Alignment of the memory (a power of two).
+ * @param   size        Amount of bytes to allocate.
+ * @return  Pointer to the requested amount of memory.
+ **/
+void *heap_allocate_aligned(size_t alignment, size_t size) {
+    if (alignment <= ALIGNMENT) {
+        return heap_allocate(size);
+    }
+    // Handle empty and overflowing sizes
+    if (!size || size > SIZE_MAX - alignment - BLOCK_OVERHEAD - ALIGNMENT) {
+        return NULL;
+    }
+    // Slab objects are aligned to the largest power of two dividing their size
+    size_t rounded = (size + alignment - 1) & ~(alignment - 1);
+    if (rounded <= SLAB_MAX) {
+        void *object = slab_allocate(rounded);
+        if (object) {
+            Counters[MALLOCS]++;
+            Counters[REQUESTED] += size;
+            return object;
+        }
+    }
+
+    Block* block;
+    size_t padded = size + alignment + BLOCK_OVERHEAD;
+    if (ALIGN(padded) >= MMAP_THRESHOLD) {
+        block = block_map(size, alignment);
+    }
+    else {
+        pthread_mutex_lock(&HeapLock);
+        block = free_list_search(padded);
+        if (block) {
+            block = block_detach(block);
+        }
+        else {
+            block = block_allocate(padded);
+        }
+        if (block) {
+            // Return the front padding and the unused tail to the free list
+            Block* aligned = block_align(block, alignment);
+            if (aligned != block) {
+                free_list_insert(block);
+            }
+            block = block_split(aligned, size);
+            if (block->next != block) {
+                free_list_insert(block_detach(block->next));
+            }
+        }
+        pthread_mutex_unlock(&HeapLock);
+    }
+    if (!block) {
+        return NULL;
+    }
+    block->size = size;
+    // Check if allocated block makes sense
+    assert(((uintptr_t)block->data & (alignment - 1)) == 0);
+    assert(block->capacity >= block->size);
+    assert(block->next     == block);
+    // Update counters
+    Counters[MALLOCS]++;
+    Counters[REQUESTED] += size;
+    return block->data;
+}
+
+/**
+ * Release previously allocated memory to its slab, the thread cache, the
+ * system, or the free lists (whichever applies first).
+ * @param   ptr     Pointer to previously allocated memory.
+ **/
+void heap_free(void *ptr) {
+    Counters[FREES]++;
+
+    // Slab objects have no block header
+    if(slab_contains(ptr)) {
+        slab_free(ptr);
+        return;
+    }
+    Block* block_head = BLOCK_FROM_POINTER(ptr);
+    // Keep small blocks in the thread cache for the next malloc
+    if(tcache_put(block_head)) {
+        return;
+    }
+    // Unmap large blocks without taking the heap lock
+    if(block_is_mapped(block_head)) {
+        block_release(block_head);
+        return;
+    }
+    // Give unused pages back, then insert it into the free list and try to
+    // release whatever it was merged into
+    block_advise(block_head);
+    pthread_mutex_lock(&HeapLock);
+    block_release(free_list_insert(block_head));
+    pthread_mutex_unlock(&HeapLock);
+}
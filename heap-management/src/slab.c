@@ -0,0 +1,317 @@
+/* slab.c: Slab Allocator
+ *
+ * Small objects are carved out of slabs rather than blocks, so they carry no
+ * header of their own.  Each slab holds objects of a single size and starts
+ * with a Slab header, which is found by rounding an object address down to
+ * SLAB_SIZE.  Slabs come from one reserved region of address
+ * space, so whether a pointer belongs to a slab is a simple range check.
+ * Freed objects are kept on an inline list inside the slab, and slabs that
+ * become empty give their pages back and are reused by any class.
+ *
+ * Objects start a cache line into the slab, so objects whose size is a
+ * multiple of a power of two (up to SLAB_HEADER) are aligned to it.  When
+ * built with SPREAD=1, each class also has SLAB_LANES separate lists of
+ * slabs and threads are spread across them, so small objects allocated by
+ * different threads do not share cache lines (at the cost of more partly
+ * used slabs).
+ **/
+
+#include "malloc/counters.h"
+#include "malloc/slab.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* Internal Macros */
+
+#define SLAB_CLASS(i)       {PTHREAD_MUTEX_INITIALIZER, NULL}
+#define SLAB_CLASSES_4(i)   SLAB_CLASS(i), SLAB_CLASS(i), SLAB_CLASS(i), SLAB_CLASS(i)
+#define SLAB_LANE(i)        {SLAB_CLASSES_4(i), SLAB_CLASSES_4(i + 4)}
+#define SLAB_LANES_4(i)     SLAB_LANE(i), SLAB_LANE(i), SLAB_LANE(i), SLAB_LANE(i)
+
+/* Global Variables */
+
+#if	SLAB_LANES == 1
+SlabClass       SlabClasses[SLAB_LANES][SLAB_CLASSES] = {SLAB_LANE(0)};
+#else
+SlabClass       SlabClasses[SLAB_LANES][SLAB_CLASSES] = {
+    SLAB_LANES_4(0), SLAB_LANES_4(0), SLAB_LANES_4(0), SLAB_LANES_4(0)
+};
+#endif
+THREAD_LOCAL size_t SlabLane = SLAB_LANES;     /* Lane of calling thread (SLAB_LANES until picked) */
+size_t          SlabLanes = 0;      /* Number of lanes handed out to threads */
+pthread_mutex_t SlabLock  = PTHREAD_MUTEX_INITIALIZER; /* Protects region and free slabs */
+char *          SlabStart = NULL;   /* Start of reserved region */
+char *          SlabEnd   = NULL;   /* End of reserved region */
+char *          SlabTop   = NULL;   /* End of slabs carved from region so far */
+Slab *          SlabFree  = NULL;   /* Empty slabs available to any class */
+
+/* Internal Prototypes */
+
+Slab *  slab_create(SlabClass *class, size_t size);
+void    slab_destroy(Slab *slab);
+void    slab_link(SlabClass *class, Slab *slab);
+void    slab_unlink(SlabClass *class, Slab *slab);
+bool    slab_full(Slab *slab);
+size_t  slab_lane();
+
+/* Functions */
+
+/**
+ * Allocate an object of at least the specified size from a slab by doing the
+ * following:
+ *
+ *  1. Take the first partial slab of the size class (creating one if there
+ *  are none).
+ *  2. Pop an object from its free list, or hand out the next unused object.
+ *  3. Remove the slab from the partial list if it is now full.
+ *
+ * @param   size    Number of bytes to allocate (at most SLAB_MAX).
+ * @return  Pointer to object (otherwise NULL if no slab is available).
+ **/
+void *  slab_allocate(size_t size) {
+    SlabClass *class = &SlabClasses[slab_lane()][ALIGN(size) / ALIGNMENT - 1];
+
+    pthread_mutex_lock(&class->lock);
+    Slab *slab = class->partial;
+    if (!slab) {
+        slab = slab_create(class, ALIGN(size));
+        if (!slab) {
+            pthread_mutex_unlock(&class->lock);
+            return NULL;
+        }
+        slab_link(class, slab);
+    }
+
+    void *object = slab->free;
+    if (object) {
+        slab->free = *(void **)object;
+        Counters[REUSES]++;
+    }
+    else {
+        object        = slab->unused;
+        slab->unused += slab->size;
+    }
+    slab->used++;
+
+    if (slab_full(slab)) {
+        slab_unlink(class, slab);
+    }
+    pthread_mutex_unlock(&class->lock);
+    return object;
+}
+
+/**
+ * Return specified object to its slab by doing the following:
+ *
+ *  1. Push the object onto the free list of its slab.
+ *  2. Put the slab back on the partial list of its class if it was full.
+ *  3. Give the slab up if it is now empty (unless it is the only partial slab
+ *  of its class, so alternating malloc and free does not thrash).
+ *
+ * @param   ptr     Pointer to object previously returned by slab_allocate.
+ **/
+void    slab_free(void *ptr) {
+    Slab *     slab  = SLAB_FROM_POINTER(ptr);
+    SlabClass *class = slab->class;
+
+    pthread_mutex_lock(&class->lock);
+    *(void **)ptr = slab->free;
+    slab->free    = ptr;
+    slab->used--;
+
+    if (!slab->listed) {
+        slab_link(class, slab);
+    }
+    if (!slab->used && (slab->prev || slab->next)) {
+        slab_unlink(class, slab);
+        slab_destroy(slab);
+    }
+    pthread_mutex_unlock(&class->lock);
+}
+
+/**
+ * Return whether or not the specified pointer belongs to a slab.
+ * @param   ptr     Pointer to check.
+ * @return  Whether or not pointer is inside the slab region.
+ **/
+bool    slab_contains(void *ptr) {
+    char *start = __atomic_load_n(&SlabStart, __ATOMIC_ACQUIRE);
+    return start && (char *)ptr >= start && (char *)ptr < start + SLAB_REGION;
+}
+
+/**
+ * Return usable size of the specified slab object.
+ * @param   ptr     Pointer to object.
+ * @return  Size of objects in the slab.
+ **/
+size_t  slab_size(void *ptr) {
+    return SLAB_FROM_POINTER(ptr)->size;
+}
+
+/**
+ * Take every slab lock before fork (in the same order as slab_allocate).
+ **/
+void    slab_fork_prepare() {
+    for (size_t lane = 0; lane < SLAB_LANES; lane++) {
+        for (size_t class = 0; class < SLAB_CLASSES; class++) {
+            pthread_mutex_lock(&SlabClasses[lane][class].lock);
+        }
+    }
+    pthread_mutex_lock(&SlabLock);
+}
+
+/**
+ * Release every slab lock in the parent after fork.
+ **/
+void    slab_fork_parent() {
+    pthread_mutex_unlock(&SlabLock);
+    for (size_t lane = 0; lane < SLAB_LANES; lane++) {
+        for (size_t class = 0; class < SLAB_CLASSES; class++) {
+            pthread_mutex_unlock(&SlabClasses[lane][class].lock);
+        }
+    }
+}
+
+/**
+ * Reset every slab lock in the child after fork (only the forking thread
+ * remains, and it owns them).
+ **/
+void    slab_fork_child() {
+    pthread_mutex_init(&SlabLock, NULL);
+    for (size_t lane = 0; lane < SLAB_LANES; lane++) {
+        for (size_t class = 0; class < SLAB_CLASSES; class++) {
+            pthread_mutex_init(&SlabClasses[lane][class].lock, NULL);
+        }
+    }
+}
+
+/* Internal Functions */
+
+/**
+ * Create an empty slab for objects of the specified size, reusing a free slab
+ * if there is one and otherwise carving a new one from the region (which is
+ * reserved on first use).
+ * @param   class   Pointer to size class the slab will belong to.
+ * @param   size    Size of each object (aligned).
+ * @return  Pointer to new slab (otherwise NULL if the region is exhausted).
+ **/
+Slab *  slab_create(SlabClass *class, size_t size) {
+    pthread_mutex_lock(&SlabLock);
+    Slab *slab = SlabFree;
+    if (slab) {
+        SlabFree = slab->next;
+    }
+    else {
+        if (!SlabStart) {
+            void *region = mmap(NULL, SLAB_REGION + SLAB_SIZE, PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            if (region == MAP_FAILED) {
+                pthread_mutex_unlock(&SlabLock);
+                return NULL;
+            }
+            // Slabs must be aligned, so headers can be found from objects
+            SlabTop = (char *)(((uintptr_t)region + SLAB_SIZE - 1) & ~(uintptr_t)(SLAB_SIZE - 1));
+            SlabEnd = SlabTop + SLAB_REGION;
+            __atomic_store_n(&SlabStart, SlabTop, __ATOMIC_RELEASE);
+        }
+        if (SlabTop + SLAB_SIZE > SlabEnd) {
+            pthread_mutex_unlock(&SlabLock);
+            return NULL;
+        }
+        slab     = (Slab *)SlabTop;
+        SlabTop += SLAB_SIZE;
+    }
+    pthread_mutex_unlock(&SlabLock);
+
+    slab->prev   = NULL;
+    slab->next   = NULL;
+    slab->free   = NULL;
+    slab->unused = (char *)slab + SLAB_HEADER;
+    slab->size   = size;
+    slab->used   = 0;
+    slab->class  = class;
+    slab->listed = false;
+    // Update counters
+    update_heap_size(SLAB_SIZE);
+    Counters[SLABS]++;
+    return slab;
+}
+
+/**
+ * Give the pages of an empty, unlinked slab back to the system and add it to
+ * the free slabs.
+ * @param   slab    Pointer to slab to destroy.
+ **/
+void    slab_destroy(Slab *slab) {
+    // Keep the page holding the header, since it links the free slabs
+    size_t page = getpagesize();
+    madvise((char *)slab + page, SLAB_SIZE - page, MADV_DONTNEED);
+
+    pthread_mutex_lock(&SlabLock);
+    slab->next = SlabFree;
+    SlabFree   = slab;
+    pthread_mutex_unlock(&SlabLock);
+    // Update counters
+    update_heap_size(-(intptr_t)SLAB_SIZE);
+    Counters[SLABS]--;
+}
+
+/**
+ * Add specified slab to the front of the partial list of its class.
+ * @param   class   Pointer to size class.
+ * @param   slab    Pointer to slab to add.
+ **/
+void    slab_link(SlabClass *class, Slab *slab) {
+    slab->prev = NULL;
+    slab->next = class->partial;
+    if (class->partial) {
+        class->partial->prev = slab;
+    }
+    class->partial = slab;
+    slab->listed   = true;
+}
+
+/**
+ * Remove specified slab from the partial list of its class.
+ * @param   class   Pointer to size class.
+ * @param   slab    Pointer to slab to remove.
+ **/
+void    slab_unlink(SlabClass *class, Slab *slab) {
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    }
+    else {
+        class->partial = slab->next;
+    }
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+    slab->prev   = NULL;
+    slab->next   = NULL;
+    slab->listed = false;
+}
+
+/**
+ * Return whether or not the specified slab has no room for another object.
+ * @param   slab    Pointer to slab.
+ * @return  Whether or not slab is full.
+ **/
+bool    slab_full(Slab *slab) {
+    return !slab->free && slab->unused + slab->size > (char *)slab + SLAB_SIZE;
+}
+
+/**
+ * Return the lane of slabs the calling thread allocates from (threads are
+ * assigned lanes round robin the first time they allocate).
+ * @return  Index of lane.
+ **/
+size_t  slab_lane() {
+    if (SLAB_LANES == 1) {
+        return 0;
+    }
+    if (SlabLane == SLAB_LANES) {
+        SlabLane = __atomic_fetch_add(&SlabLanes, 1, __ATOMIC_RELAXED) % SLAB_LANES;
+    }
+    return SlabLane;
+}
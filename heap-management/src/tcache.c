@@ -0,0 +1,141 @@
+/* tcache.c: Per-Thread Block Cache
+ *
+ * Each thread keeps a few recently freed small blocks in bins by capacity, so
+ * the common malloc/free pair reuses them without taking the heap lock.
+ * Cached blocks stay allocated as far as the free lists are concerned (they
+ * are only linked through their data), so they are never merged.  When the
+ * thread exits, its cached blocks are returned to the free lists.
+ **/
+
+#include "malloc/counters.h"
+#include "malloc/freelist.h"
+#include "malloc/slab.h"
+#include "malloc/tcache.h"
+
+#include <pthread.h>
+
+/* Global Variables */
+
+THREAD_LOCAL TCache ThreadCache = {{0}};
+pthread_key_t       ThreadCacheKey;
+pthread_once_t      ThreadCacheOnce = PTHREAD_ONCE_INIT;
+
+/* Internal Prototypes */
+
+void    tcache_setup();
+void    tcache_exit(void *arg);
+void    tcache_fork_prepare();
+void    tcache_fork_parent();
+void    tcache_fork_child();
+
+/* Functions */
+
+/**
+ * Take a cached block that can hold the specified size from the bins of the
+ * calling thread.
+ * @param   size    Amount of memory required.
+ * @return  Pointer to detached block (otherwise NULL if none is cached).
+ **/
+Block * tcache_get(size_t size) {
+    if (ALIGN(size) > TCACHE_MAX) {
+        return NULL;
+    }
+
+    size_t bin   = ALIGN(size) / ALIGNMENT - 1;
+    Block *block = ThreadCache.bins[bin];
+    if (!block) {
+        return NULL;
+    }
+    ThreadCache.bins[bin] = TCACHE_NEXT(block);
+    ThreadCache.counts[bin]--;
+    Counters[REUSES]++;
+    return block;
+}
+
+/**
+ * Cache specified block in the bins of the calling thread.
+ * @param   block   Pointer to block to cache.
+ * @return  Whether or not the block was cached (otherwise it must be freed).
+ **/
+bool    tcache_put(Block *block) {
+    if (block->capacity > TCACHE_MAX || block_is_mapped(block) || ThreadCache.exiting) {
+        return false;
+    }
+
+    size_t bin = block->capacity / ALIGNMENT - 1;
+    if (ThreadCache.counts[bin] >= TCACHE_COUNT) {
+        return false;
+    }
+    TCACHE_NEXT(block)    = ThreadCache.bins[bin];
+    ThreadCache.bins[bin] = block;
+    ThreadCache.counts[bin]++;
+    return true;
+}
+
+/**
+ * Return every block cached by the calling thread to the free lists.
+ **/
+void    tcache_flush() {
+    pthread_mutex_lock(&HeapLock);
+    for (size_t bin = 0; bin < TCACHE_BINS; bin++) {
+        while (ThreadCache.bins[bin]) {
+            Block *block = ThreadCache.bins[bin];
+            ThreadCache.bins[bin] = TCACHE_NEXT(block);
+            free_list_insert(block);
+        }
+        ThreadCache.counts[bin] = 0;
+    }
+    pthread_mutex_unlock(&HeapLock);
+}
+
+/**
+ * Hook the exit of the calling thread, so its cache can be flushed and its
+ * counters retired (only done once per thread).
+ **/
+void    tcache_init() {
+    if (ThreadCache.initialized) {
+        return;
+    }
+    // Set first, since setting the key may allocate memory itself
+    ThreadCache.initialized = true;
+    pthread_once(&ThreadCacheOnce, tcache_setup);
+    pthread_setspecific(ThreadCacheKey, &ThreadCache);
+}
+
+/* Internal Functions */
+
+/**
+ * Create the thread exit key and keep the heap and slab locks consistent
+ * across fork.
+ **/
+void    tcache_setup() {
+    pthread_key_create(&ThreadCacheKey, tcache_exit);
+    pthread_atfork(tcache_fork_prepare, tcache_fork_parent, tcache_fork_child);
+}
+
+/**
+ * Flush the cache and counters of an exiting thread (blocks freed after this
+ * go straight to the free lists).
+ * @param   arg     Pointer to TCache of the exiting thread (unused).
+ **/
+void    tcache_exit(void *arg) {
+    ThreadCache.exiting = true;
+    tcache_flush();
+    retire_counters();
+}
+
+void    tcache_fork_prepare() {
+    slab_fork_prepare();
+    pthread_mutex_lock(&HeapLock);
+}
+
+void    tcache_fork_parent() {
+    pthread_mutex_unlock(&HeapLock);
+    slab_fork_parent();
+}
+
+void    tcache_fork_child() {
+    // The child only has the forking thread, which owns the locks
+    pthread_mutex_init(&HeapLock, NULL);
+    slab_fork_child();
+}
@@ -3,13 +3,41 @@
 #ifndef CLIENT_H
 #define CLIENT_H
 
+#include "mq/connection.h"
 #include "mq/queue.h"
+#include "mq/reactor.h"
 
 #include <netdb.h>
 #include <stdbool.h>
+#include <stdint.h>
+
+/* Constants */
+
+#define MQ_BATCH    (64)    // Default maximum number of requests sent per burst
+#define MQ_LINGER   (0.0)   // Default seconds to wait for a burst to fill
+#define MQ_WINDOW   (4)     // Long-poll requests puller keeps outstanding
+#define MQ_BACKOFF  (0.1)   // Most seconds puller waits after an empty poll
+#define MQ_WORKERS  (1)	    // Default number of threads running message handlers
+#define MQ_COMPRESS (4096)  // Default size above which binary frames are compressed
 
 /* Structures */
 
+typedef enum {
+    MQ_PLAIN,		// Bodies as they are (any receiver understands them, but not their topic)
+    MQ_TEXT,		// Topic framed in front of text bodies (see request_publish)
+    MQ_BINARY,		// Binary frames with sequence numbers (see request_frame)
+} Framing;
+
+typedef void (*MessageHandler)(const char *topic, const char *body, size_t length, void *arg);
+
+typedef struct Subscription Subscription;
+struct Subscription {
+    char *	    topic;	// Topic messages are dispatched for
+    MessageHandler  handler;	// Function called with each message
+    void *	    arg;	// Argument passed to handler
+    Subscription *  next;
+};
+
 typedef struct MessageQueue MessageQueue;
 struct MessageQueue {
     char    name[NI_MAXHOST];	// Name of message queue
@@ -18,7 +46,20 @@ struct MessageQueue {
 
     Queue*  outgoing;		// Requests to be sent to server
     Queue*  incoming;		// Requests received from server
+    Pool*   pool;		// Keep-alive connections to server
+    size_t  batch;		// Maximum number of requests sent per burst
+    double  linger;		// Seconds pusher waits for a burst to fill
     bool    shutdown;		// Whether or not to shutdown
+    Reactor*reactor;		// Shared event loop serving queue (instead of threads)
+    Connection* pulling;	// Connection puller is blocked on (shut down by mq_stop)
+    Framing framing;		// How messages are published (MQ_PLAIN by default)
+    size_t  compress;		// Size above which binary frames are compressed (0 for never)
+    uint64_t sequence;		// Sequence number of last binary frame published
+
+    Subscription* subscriptions;// Topics with message handlers
+    Queue*  dispatch;		// Messages waiting for their handlers
+    Thread* workers;		// Threads running message handlers (if any)
+    size_t  nworkers;		// Number of worker threads
 
     Mutex lock;
     Thread thread1;
@@ -28,10 +69,22 @@ struct MessageQueue {
 MessageQueue *	mq_create(const char *name, const char *host, const char *port);
 void		mq_delete(MessageQueue *mq);
 
-void		mq_publish(MessageQueue *mq, const char *topic, const char *body);
+void		mq_batch(MessageQueue *mq, size_t batch, double linger);
+
+bool		mq_capacity(MessageQueue *mq, size_t capacity, bool block);
+void		mq_attach(MessageQueue *mq, Reactor *reactor);
+void		mq_workers(MessageQueue *mq, size_t nworkers);
+void		mq_framing(MessageQueue *mq, Framing framing, size_t compress);
+
+bool		mq_publish(MessageQueue *mq, const char *topic, const char *body);
+size_t		mq_publish_many(MessageQueue *mq, const char *topic, const char **bodies, size_t n);
+bool		mq_publish_binary(MessageQueue *mq, const char *topic, const void *data, size_t length);
 char *		mq_retrieve(MessageQueue *mq);
+char *		mq_retrieve_binary(MessageQueue *mq, size_t *length, uint64_t *sequence);
+size_t		mq_retrieve_batch(MessageQueue *mq, char **messages, size_t n, double timeout);
 
 void		mq_subscribe(MessageQueue *mq, const char *topic);
+bool		mq_subscribe_cb(MessageQueue *mq, const char *topic, MessageHandler handler, void *arg);
 void		mq_unsubscribe(MessageQueue *mq, const char *topic);
 
 void		mq_start(MessageQueue *mq);
@@ -39,4 +92,6 @@ void		mq_stop(MessageQueue *mq);
 
 bool		mq_shutdown(MessageQueue *mq);
 
+bool		mq_deliver(MessageQueue *mq, Request *r, bool block);
+
 #endif
\ No newline at end of file
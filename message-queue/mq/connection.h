@@ -0,0 +1,64 @@
+/* connection.h: Persistent HTTP connections */
+
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include "mq/request.h"
+#include "mq/thread.h"
+
+#include <netdb.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+/* Constants */
+
+#define POOL_MAX	    (4)		// Idle connections kept open per pool
+#define CONNECTION_BUFFER   (BUFSIZ)	// Initial size of receive buffer
+#define CONNECTION_HEADER   (1<<16)	// Largest response header accepted
+#define CONNECTION_IOV	    (64)	// Most buffers gathered into one write
+#define CONNECTION_PARTIAL  (-2)	// Response has not all been received yet
+
+/* Structures */
+
+typedef struct Connection Connection;
+struct Connection {
+    int		    fd;		// Socket file descriptor
+    bool	    alive;	// Whether or not server will keep connection open
+    bool	    reused;	// Whether or not connection has served a request
+
+    char *	    buffer;	// Receive buffer (reused for every response)
+    size_t	    capacity;	// Size of receive buffer
+    size_t	    start;	// Offset of first byte not parsed yet
+    size_t	    end;	// Offset after last byte received
+
+    Connection *    next;	// Next idle connection in pool
+};
+
+typedef struct Pool Pool;
+struct Pool {
+    char		host[NI_MAXHOST];   // Host of server (for Host header)
+    struct addrinfo *	address;	    // Address of server (resolved once)
+
+    Connection *	idle;		    // Open connections not in use
+    size_t		nidle;		    // Number of idle connections
+    Mutex		lock;
+};
+
+/* Functions */
+
+Pool *	    pool_create(const char *host, const char *port);
+void	    pool_delete(Pool *p);
+
+Connection *pool_acquire(Pool *p);
+void	    pool_release(Pool *p, Connection *c);
+int	    pool_send(Pool *p, Request *r, char **body);
+size_t	    pool_send_many(Pool *p, Request **rs, size_t n);
+
+int	    connection_send(Connection *c, const char *host, Request *r, char **body);
+bool	    connection_write(Connection *c, const char *host, Request **rs, size_t n);
+int	    connection_read(Connection *c, char **body, size_t *length);
+int	    connection_parse(Connection *c, char **body, size_t *length);
+ssize_t	    connection_fill(Connection *c);
+void	    connection_close(Connection *c);
+
+#endif
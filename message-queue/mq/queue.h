@@ -4,6 +4,7 @@
 #define QUEUE_H
 
 #include "mq/request.h"
+#include "mq/ring.h"
 #include "mq/thread.h"
 
 /* Structures */
@@ -17,14 +18,24 @@ struct Queue {
     // Add any necessary thread and synchronization primitives
     Mutex lock;
     Cond cv;
+
+    Ring *   ring;	// Bounded lock-free ring used instead of list (if any)
+    bool     block;	// Whether pushing to a full ring waits (or fails)
+    int      event;	// Eventfd signalled whenever requests are pushed (-1 if none)
 };
 
 /* Functions */
 
 Queue *	    queue_create();
+Queue *	    queue_create_bounded(size_t capacity, bool block);
 void        queue_delete(Queue *q);
 
-void	    queue_push(Queue *q, Request *r);
+void	    queue_notify(Queue *q, int event);
+
+bool	    queue_push(Queue *q, Request *r);
+bool	    queue_offer(Queue *q, Request *r);
+size_t	    queue_push_many(Queue *q, Request **rs, size_t n);
 Request *   queue_pop(Queue *q);
+size_t	    queue_pop_many(Queue *q, Request **rs, size_t n, double timeout, double linger);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,91 @@
+/* reactor.h: Shared event loop for Message Queue clients */
+
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include "mq/connection.h"
+#include "mq/request.h"
+#include "mq/thread.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Constants */
+
+#define REACTOR_EVENTS	(64)	// Most events handled per epoll_wait
+#define REACTOR_RETRIES	(3)	// Fresh connections a request may go unanswered on
+
+/* Structures */
+
+struct MessageQueue;
+
+typedef struct Reactor Reactor;
+typedef struct Channel Channel;
+
+typedef struct Watch Watch;
+struct Watch {
+    Channel *	channel;    // Channel the file descriptor belongs to
+    bool	queue;	    // Whether it signals the outgoing queue (otherwise it is the socket)
+};
+
+struct Channel {
+    struct MessageQueue *mq;	// Message Queue served by channel
+    Reactor *	    reactor;	// Reactor channel is attached to
+    bool	    pusher;	// Whether channel sends outgoing requests (otherwise it polls)
+
+    Connection *    c;		// Non-blocking connection to server (NULL if closed)
+    Watch	    socket;	// Registration of connection with epoll
+    uint32_t	    events;	// Events registered for connection
+    bool	    fresh;	// Whether connection never served a request before
+    bool	    progress;	// Whether connection has received a response
+
+    char *	    output;	// Requests formatted but not sent yet
+    size_t	    capacity;	// Size of output buffer
+    size_t	    length;	// Number of bytes in output buffer
+    size_t	    sent;	// Number of those bytes already sent
+
+    int		    event;	// Eventfd signalled by outgoing queue (pusher only)
+    Watch	    signal;	// Registration of eventfd with epoll
+    Request *	    head;	// First request taken but not answered (pusher only)
+    Request *	    tail;	// Last request taken but not answered (pusher only)
+    Request *	    unsent;	// First of those not sent on connection (pusher only)
+    size_t	    taken;	// Number of requests taken (at most batch of queue)
+    size_t	    failures;	// Fresh connections first request went unanswered on
+    bool	    closing;	// Whether mq_stop is waiting for channel to drain
+    bool	    drained;	// Whether everything queued before closing was sent
+
+    Request *	    get;	// Long-poll request (puller only)
+    size_t	    outstanding;// Number of long-polls not answered (puller only)
+    Request *	    pending;	// Message waiting for room in incoming queue (puller only)
+
+    double	    backoff;	// Seconds waited before last retry
+    double	    wakeup;	// Time of next retry (if timed)
+    bool	    timed;	// Whether channel is in list of timers
+    bool	    dead;	// Whether channel was removed from reactor
+    Channel *	    next;	// Next channel attached (or removed)
+    Channel *	    next_timer;	// Next channel waiting for retry
+};
+
+struct Reactor {
+    int		epoll;	    // Epoll instance
+    int		wake;	    // Eventfd that wakes loop
+    bool	stopped;    // Whether loop should exit
+
+    Channel *	channels;   // Channels attached
+    Channel *	timers;	    // Channels waiting for retry
+    Channel *	removed;    // Channels removed but not deleted yet
+
+    Mutex	lock;	    // Held by loop while handling events
+    Cond	drained;    // Broadcast whenever a closing channel drained
+    Thread	thread;
+};
+
+/* Functions */
+
+Reactor *   reactor_create();
+void	    reactor_delete(Reactor *r);
+
+bool	    reactor_add(Reactor *r, struct MessageQueue *mq);
+void	    reactor_remove(Reactor *r, struct MessageQueue *mq);
+
+#endif
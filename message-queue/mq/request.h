@@ -3,8 +3,19 @@
 #ifndef REQUEST_H
 #define REQUEST_H
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 
+/* Constants */
+
+#define REQUEST_POOL_MAX    (256)	// Most unused Requests kept for reuse
+#define REQUEST_BUFFER_MAX  (BUFSIZ)	// Largest buffer kept with an unused Request
+#define REQUEST_FRAME	    ('\036')	// Marks topic framed in front of a published body
+#define REQUEST_BINARY	    ('\0')	// Marks binary frame (text bodies never start with NUL)
+#define REQUEST_HEADER	    (16)	// Size of binary frame header
+#define REQUEST_LZ4	    (0x01)	// Flag of binary frame with LZ4 compressed payload
+
 /* Structures */
 
 typedef struct Request Request;
@@ -12,14 +23,27 @@ struct Request {
     char *	method;
     char *	uri;
     char *	body;
-    
+    size_t	length;	    // Length of body
+    char *	topic;	    // Topic received message was published to (NULL if unknown)
+    uint64_t	sequence;   // Sequence number of binary frame (0 if none)
+    bool	sentinel;   // Whether Request only marks shutdown (and is not a message)
+
+    char *	buffer;	    // Single allocation holding body, method, and uri (in that order)
+    size_t	capacity;   // Size of buffer
+
     Request *	next;
 };
 
 /* Functions */
 
 Request *   request_create(const char *method, const char *uri, const char *body);
+Request *   request_publish(const char *topic, const char *body, bool framed);
+Request *   request_frame(const char *topic, const void *data, size_t length, uint64_t sequence, size_t compress);
+Request *   request_adopt(char *body, size_t length);
+Request *   request_sentinel();
+bool	    request_topic(Request *r);
+char *	    request_release(Request *r);
 void	    request_delete(Request *r);
-void        request_write(Request *r, FILE *fs);
+size_t      request_header(Request *r, const char *host, char *buffer, size_t size);
 
-#endif
\ No newline at end of file
+#endif
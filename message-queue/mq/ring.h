@@ -0,0 +1,46 @@
+/* ring.h: Lock-free Bounded Ring of Requests */
+
+#ifndef RING_H
+#define RING_H
+
+#include "mq/request.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/* Constants */
+
+#define RING_LINE   (64)    // Bytes per cache line (hot fields never share one)
+
+/* Structures */
+
+typedef struct RingCell RingCell;
+struct RingCell {
+    size_t	sequence;   // Position the cell is ready for (see ring.c)
+    Request *	request;    // Request stored in cell
+};
+
+typedef struct Ring Ring;
+struct Ring {
+    RingCell *	cells;	    // Array of capacity cells
+    size_t	mask;	    // Capacity - 1 (capacity is a power of two)
+
+    size_t	enqueue __attribute__((aligned(RING_LINE)));	// Next position to push to
+    size_t	dequeue __attribute__((aligned(RING_LINE)));	// Next position to pop from
+
+    uint32_t	not_empty __attribute__((aligned(RING_LINE)));	// Futex bumped when pushed
+    uint32_t	empty_waiters;					// Threads waiting to pop
+    uint32_t	not_full __attribute__((aligned(RING_LINE)));	// Futex bumped when popped
+    uint32_t	full_waiters;					// Threads waiting to push
+};
+
+/* Functions */
+
+Ring *	    ring_create(size_t capacity);
+void	    ring_delete(Ring *r);
+
+bool	    ring_push(Ring *r, Request *request, bool block);
+Request *   ring_pop(Ring *r, double timeout);
+
+#endif
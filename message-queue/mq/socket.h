@@ -3,10 +3,14 @@
 #ifndef SOCKET_H
 #define SOCKET_H
 
+#include <netdb.h>
 #include <stdio.h>
 
 /* Functions */
 
+struct addrinfo *socket_resolve(const char *host, const char *port);
+int     socket_dial(struct addrinfo *results);
+FILE *  socket_open(struct addrinfo *results);
 FILE *  socket_connect(const char *host, const char *port);
 
 #endif
\ No newline at end of file
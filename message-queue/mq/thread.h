@@ -38,5 +38,6 @@ typedef pthread_cond_t              Cond;
 #define cond_init(c, a)             PTHREAD_CHECK(pthread_cond_init(c, a))
 #define cond_wait(c, l)             PTHREAD_CHECK(pthread_cond_wait(c, l))
 #define cond_signal(c)              PTHREAD_CHECK(pthread_cond_signal(c))
+#define cond_timedwait(c, l, t)     pthread_cond_timedwait(c, l, t)	/* Returns ETIMEDOUT */
 
 #endif
\ No newline at end of file
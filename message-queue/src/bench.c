@@ -0,0 +1,469 @@
+/* bench.c: Message Queue Benchmark
+ *
+ * Runs publisher and subscriber Message Queues against a server and reports
+ * end-to-end latency (from publish to retrieve), messages per second, and
+ * CPU time per message.  Publishers spread their messages over the topics
+ * (round robin) and every subscriber subscribes to every topic, so each
+ * message is delivered once per subscriber.  Each body starts with the time
+ * it was published at, padded to the requested size.
+ *
+ * Build from the message-queue directory with:
+ *
+ *      gcc -std=gnu99 -O2 -pthread -I. -o bench src/bench.c src/clinent.c \
+ *          src/connection.c src/queue.c src/reactor.c src/request.c \
+ *          src/ring.c src/socket.c
+ *
+ * (add -DHAVE_LZ4 and -llz4 for compressed binary frames).
+ **/
+
+#include "mq/client.h"
+#include "mq/string.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define BENCH_SUB_BUCKETS   (16)    // Linear buckets per power of two of latency
+#define BENCH_BUCKETS	    (BENCH_SUB_BUCKETS * 41)	// Enough for latencies up to 2^41 us
+#define BENCH_RETRIEVE	    (64)    // Most messages retrieved at once
+#define BENCH_IDLE	    (5.0)   // Seconds subscribers wait for stragglers
+
+/* Structures */
+
+typedef struct Histogram Histogram;
+struct Histogram {
+    uint64_t	counts[BENCH_BUCKETS];	// Messages per latency bucket
+    uint64_t	total;			// Number of messages
+    uint64_t	sum;			// Sum of latencies (us)
+    uint64_t	max;			// Largest latency (us)
+};
+
+typedef struct Client Client;
+struct Client {
+    MessageQueue *  mq;		// Message Queue of publisher or subscriber
+    size_t	    index;	// Index among publishers or subscribers
+    Histogram	    latency;	// Latencies of retrieved messages (subscribers only)
+    Mutex	    lock;	// Protects latency (called back on worker threads)
+    Thread	    thread;
+};
+
+/* Global Variables */
+
+char *	    Host	= "localhost";
+char *	    Port	= "9620";
+size_t	    Publishers	= 1;	    // Number of publishing queues
+size_t	    Subscribers	= 1;	    // Number of subscribing queues
+size_t	    Topics	= 1;	    // Number of topics
+size_t	    Messages	= 10000;    // Messages sent by each publisher
+size_t	    Size	= 64;	    // Bytes per message body
+double	    Rate	= 0;	    // Messages per second per publisher (0 for no limit)
+size_t	    Batch	= MQ_BATCH; // Most requests per burst
+double	    Linger	= MQ_LINGER;// Seconds to wait for a burst to fill
+size_t	    Capacity	= 0;	    // Bounded queue capacity (0 for unbounded)
+size_t	    Reactors	= 0;	    // Number of shared reactors (0 for threads per queue)
+size_t	    Workers	= 0;	    // Worker threads for callbacks (0 to retrieve instead)
+Framing	    Frames	= MQ_PLAIN; // How messages are published
+size_t	    Compress	= MQ_COMPRESS;// Size above which binary frames are compressed
+
+char	    Prefix[64];		    // Prefix of queue and topic names (unique per run)
+bool	    Published	= false;    // Whether every publisher is done
+
+/* Functions */
+
+/**
+ * Return current time.
+ * @return  Nanoseconds on monotonic clock.
+ */
+uint64_t bench_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Return CPU time used by the process so far.
+ * @return  Microseconds of user and system time.
+ */
+uint64_t bench_cpu() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (uint64_t)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000 +
+	   usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+/**
+ * Return histogram bucket of latency (exact below BENCH_SUB_BUCKETS us, and
+ * within 1/BENCH_SUB_BUCKETS of it above).
+ * @param   latency Latency in microseconds.
+ * @return  Index of bucket.
+ */
+size_t bench_bucket(uint64_t latency) {
+    if(latency < BENCH_SUB_BUCKETS) {
+	return latency;
+    }
+    size_t power = 63 - __builtin_clzll(latency);
+    size_t index = (power - 3) * BENCH_SUB_BUCKETS + ((latency >> (power - 4)) & (BENCH_SUB_BUCKETS - 1));
+    return index < BENCH_BUCKETS ? index : BENCH_BUCKETS - 1;
+}
+
+/**
+ * Return smallest latency of histogram bucket.
+ * @param   index   Index of bucket.
+ * @return  Latency in microseconds.
+ */
+uint64_t bench_bucket_start(size_t index) {
+    if(index < BENCH_SUB_BUCKETS) {
+	return index;
+    }
+    size_t power = index / BENCH_SUB_BUCKETS + 3;
+    return (uint64_t)(BENCH_SUB_BUCKETS + index % BENCH_SUB_BUCKETS) << (power - 4);
+}
+
+/**
+ * Record latency of message body in histogram.
+ * @param   h       Histogram structure.
+ * @param   body    Message body (starting with the time it was published).
+ */
+void bench_record(Histogram *h, const char *body) {
+    uint64_t published = strtoull(body, NULL, 10);
+    uint64_t now       = bench_now();
+    uint64_t latency   = now > published ? (now - published) / 1000 : 0;
+    h->counts[bench_bucket(latency)]++;
+    h->total++;
+    h->sum += latency;
+    h->max  = latency > h->max ? latency : h->max;
+}
+
+/**
+ * Return latency at percentile of histogram.
+ * @param   h           Histogram structure.
+ * @param   percentile  Percentile (0 to 100).
+ * @return  Smallest latency of bucket holding percentile (us).
+ */
+uint64_t bench_percentile(Histogram *h, double percentile) {
+    uint64_t rank = (uint64_t)(h->total * percentile / 100);
+    uint64_t seen = 0;
+    for(size_t i = 0; i < BENCH_BUCKETS; i++) {
+	seen += h->counts[i];
+	if(seen > rank) {
+	    return bench_bucket_start(i);
+	}
+    }
+    return h->max;
+}
+
+/**
+ * Print latency percentiles and the non-empty buckets of histogram (as
+ * cumulative fractions, so distributions are easy to compare).
+ * @param   h       Histogram structure.
+ */
+void bench_report(Histogram *h) {
+    if(!h->total) {
+	return;
+    }
+    printf("latency (us): mean %.1f p50 %lu p90 %lu p99 %lu p99.9 %lu max %lu\n",
+	   (double)h->sum / h->total, bench_percentile(h, 50), bench_percentile(h, 90),
+	   bench_percentile(h, 99), bench_percentile(h, 99.9), h->max);
+    printf("%12s %10s %8s\n", ">= us", "count", "cumul");
+    uint64_t seen = 0;
+    for(size_t i = 0; i < BENCH_BUCKETS; i++) {
+	if(h->counts[i]) {
+	    seen += h->counts[i];
+	    printf("%12lu %10lu %7.3f%%\n", bench_bucket_start(i), h->counts[i], 100.0 * seen / h->total);
+	}
+    }
+}
+
+/**
+ * Record latency of message dispatched to callback of subscriber.
+ * @param   topic   Topic message was published to.
+ * @param   body    Message body.
+ * @param   length  Length of message body.
+ * @param   arg     Client structure of subscriber.
+ */
+void bench_handler(const char *topic, const char *body, size_t length, void *arg) {
+    Client *c = (Client *)arg;
+    mutex_lock(&c->lock);
+    bench_record(&c->latency, body);
+    mutex_unlock(&c->lock);
+}
+
+/* Threads */
+
+/**
+ * Publisher thread publishes its messages round robin over the topics (at
+ * the requested rate, if any).
+ **/
+void *publisher_thread(void *arg) {
+    Client * c    = (Client *)arg;
+    char *   body = malloc(Size + 32);
+    char     topic[BUFSIZ];
+    uint64_t start = bench_now();
+    if(!body) {
+	return NULL;
+    }
+
+    for(size_t i = 0; i < Messages; i++) {
+	if(Rate > 0) {
+	    // Keep to the schedule rather than sleeping a fixed amount
+	    uint64_t due = start + (uint64_t)(i * 1e9 / Rate);
+	    uint64_t now = bench_now();
+	    if(due > now) {
+		usleep((due - now) / 1000);
+	    }
+	}
+	sprintf(topic, "%s-t%zu", Prefix, (c->index + i) % Topics);
+	int length = sprintf(body, "%lu ", bench_now());
+	if((size_t)length < Size) {
+	    memset(body + length, 'x', Size - length);
+	    length = Size;
+	}
+	body[length] = 0;
+	while(!mq_publish(c->mq, topic, body)) {
+	    // Bounded outgoing queue that does not block is full
+	    usleep(100);
+	}
+    }
+    free(body);
+    return NULL;
+}
+
+/**
+ * Subscriber thread retrieves messages until it has every one (or none came
+ * for BENCH_IDLE seconds after the publishers were done).
+ **/
+void *subscriber_thread(void *arg) {
+    Client * c        = (Client *)arg;
+    size_t   expected = Publishers * Messages;
+    char *   messages[BENCH_RETRIEVE];
+    uint64_t idle     = 0;
+
+    while(c->latency.total < expected) {
+	size_t n = mq_retrieve_batch(c->mq, messages, BENCH_RETRIEVE, 0.1);
+	for(size_t i = 0; i < n; i++) {
+	    bench_record(&c->latency, messages[i]);
+	    free(messages[i]);
+	}
+	idle = n || !__atomic_load_n(&Published, __ATOMIC_ACQUIRE) ? 0 : idle + 1;
+	if(idle * 0.1 >= BENCH_IDLE) {
+	    break;
+	}
+    }
+    return NULL;
+}
+
+/* Other Functions */
+
+void usage(int status) {
+    printf("usage: bench [options]\n");
+    printf("    -H HOST      Host of server (default: %s)\n", Host);
+    printf("    -P PORT      Port of server (default: %s)\n", Port);
+    printf("    -p N         Number of publishers (default: %zu)\n", Publishers);
+    printf("    -s M         Number of subscribers (default: %zu)\n", Subscribers);
+    printf("    -t TOPICS    Number of topics (default: %zu)\n", Topics);
+    printf("    -n MESSAGES  Messages per publisher (default: %zu)\n", Messages);
+    printf("    -b BYTES     Bytes per message (default: %zu)\n", Size);
+    printf("    -r RATE      Messages per second per publisher (default: no limit)\n");
+    printf("    -B BATCH     Most requests per burst (default: %d)\n", MQ_BATCH);
+    printf("    -l SECONDS   Seconds to wait for a burst to fill (default: %.1f)\n", MQ_LINGER);
+    printf("    -c CAPACITY  Bound queues with rings of capacity (default: unbounded)\n");
+    printf("    -R REACTORS  Serve queues from shared reactors (default: threads)\n");
+    printf("    -w WORKERS   Dispatch to callbacks on workers (default: retrieve)\n");
+    printf("    -T           Publish text frames with topics (default: plain, text with -w)\n");
+    printf("    -F           Publish binary frames (default: plain, text with -w)\n");
+    printf("    -z BYTES     Compress binary frames above size (default: %d, 0 for never)\n", MQ_COMPRESS);
+    exit(status);
+}
+
+/**
+ * Create and configure Message Queue for benchmark client.
+ * @param   name        Name of queue.
+ * @param   reactors    Array of reactors (if any).
+ * @param   index       Index of client (picks reactor).
+ * @return  Newly allocated Message Queue structure (exits on failure).
+ */
+MessageQueue *bench_queue(const char *name, Reactor **reactors, size_t index) {
+    MessageQueue *mq = mq_create(name, Host, Port);
+    if(!mq || (Capacity && !mq_capacity(mq, Capacity, true))) {
+	fprintf(stderr, "Unable to create queue %s\n", name);
+	exit(EXIT_FAILURE);
+    }
+    mq_batch(mq, Batch, Linger);
+    mq_framing(mq, Frames, Compress);
+    if(Reactors) {
+	mq_attach(mq, reactors[index % Reactors]);
+    }
+    return mq;
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    /* Parse command-line arguments */
+    int option;
+    while((option = getopt(argc, argv, "H:P:p:s:t:n:b:r:B:l:c:R:w:TFz:h")) != -1) {
+	switch(option) {
+	    case 'H': Host        = optarg; break;
+	    case 'P': Port        = optarg; break;
+	    case 'p': Publishers  = strtoul(optarg, NULL, 10); break;
+	    case 's': Subscribers = strtoul(optarg, NULL, 10); break;
+	    case 't': Topics      = strtoul(optarg, NULL, 10); break;
+	    case 'n': Messages    = strtoul(optarg, NULL, 10); break;
+	    case 'b': Size        = strtoul(optarg, NULL, 10); break;
+	    case 'r': Rate        = strtod(optarg, NULL); break;
+	    case 'B': Batch       = strtoul(optarg, NULL, 10); break;
+	    case 'l': Linger      = strtod(optarg, NULL); break;
+	    case 'c': Capacity    = strtoul(optarg, NULL, 10); break;
+	    case 'R': Reactors    = strtoul(optarg, NULL, 10); break;
+	    case 'w': Workers     = strtoul(optarg, NULL, 10); break;
+	    case 'T': Frames      = MQ_TEXT; break;
+	    case 'F': Frames      = MQ_BINARY; break;
+	    case 'z': Compress    = strtoul(optarg, NULL, 10); break;
+	    case 'h': usage(0); break;
+	    default:  usage(1); break;
+	}
+    }
+    if(!Publishers || !Subscribers || !Topics || optind != argc) {
+	usage(1);
+    }
+    // Callbacks only see messages that say which topic they belong to
+    if(Workers && Frames == MQ_PLAIN) {
+	Frames = MQ_TEXT;
+    }
+    snprintf(Prefix, sizeof(Prefix), "bench%d", getpid());
+
+    /* Create reactors and queues, and subscribe to every topic */
+    Reactor **reactors    = calloc(Reactors + 1, sizeof(Reactor *));
+    Client *  publishers  = calloc(Publishers, sizeof(Client));
+    Client *  subscribers = calloc(Subscribers, sizeof(Client));
+    Histogram *latency    = NULL;
+    int       status      = EXIT_FAILURE;
+    char      name[BUFSIZ];
+    if(!reactors || !publishers || !subscribers) {
+	fprintf(stderr, "Unable to allocate clients: %s\n", strerror(errno));
+	goto cleanup;
+    }
+    for(size_t i = 0; i < Reactors; i++) {
+	if(!(reactors[i] = reactor_create())) {
+	    fprintf(stderr, "Unable to create reactor: %s\n", strerror(errno));
+	    goto cleanup;
+	}
+    }
+    for(size_t i = 0; i < Subscribers; i++) {
+	snprintf(name, sizeof(name), "%s-s%zu", Prefix, i);
+	subscribers[i].mq    = bench_queue(name, reactors, i);
+	subscribers[i].index = i;
+	mutex_init(&subscribers[i].lock, NULL);
+	if(Workers) {
+	    mq_workers(subscribers[i].mq, Workers);
+	}
+	for(size_t t = 0; t < Topics; t++) {
+	    snprintf(name, sizeof(name), "%s-t%zu", Prefix, t);
+	    if(Workers) {
+		mq_subscribe_cb(subscribers[i].mq, name, bench_handler, &subscribers[i]);
+	    }
+	    else {
+		mq_subscribe(subscribers[i].mq, name);
+	    }
+	}
+	mq_start(subscribers[i].mq);
+    }
+    for(size_t i = 0; i < Publishers; i++) {
+	snprintf(name, sizeof(name), "%s-p%zu", Prefix, i);
+	publishers[i].mq    = bench_queue(name, reactors, Subscribers + i);
+	publishers[i].index = i;
+	mq_start(publishers[i].mq);
+    }
+    // Give the subscriptions time to reach the server
+    sleep(1);
+
+    /* Publish and retrieve everything */
+    uint64_t start     = bench_now();
+    uint64_t cpu_start = bench_cpu();
+    for(size_t i = 0; i < Subscribers && !Workers; i++) {
+	thread_create(&subscribers[i].thread, NULL, subscriber_thread, &subscribers[i]);
+    }
+    for(size_t i = 0; i < Publishers; i++) {
+	thread_create(&publishers[i].thread, NULL, publisher_thread, &publishers[i]);
+    }
+    for(size_t i = 0; i < Publishers; i++) {
+	thread_join(publishers[i].thread, NULL);
+    }
+    double published = (bench_now() - start) / 1e9;
+    __atomic_store_n(&Published, true, __ATOMIC_RELEASE);
+    if(Workers) {
+	// Wait for the callbacks to see everything (or for stragglers to stop coming)
+	uint64_t last = 0, idle = 0;
+	while(idle * 0.1 < BENCH_IDLE) {
+	    uint64_t total = 0;
+	    for(size_t i = 0; i < Subscribers; i++) {
+		mutex_lock(&subscribers[i].lock);
+		total += subscribers[i].latency.total;
+		mutex_unlock(&subscribers[i].lock);
+	    }
+	    if(total == Publishers * Messages * Subscribers) {
+		break;
+	    }
+	    idle = total == last ? idle + 1 : 0;
+	    last = total;
+	    usleep(100000);
+	}
+    }
+    else {
+	for(size_t i = 0; i < Subscribers; i++) {
+	    thread_join(subscribers[i].thread, NULL);
+	}
+    }
+    double   elapsed = (bench_now() - start) / 1e9;
+    uint64_t cpu     = bench_cpu() - cpu_start;
+
+    /* Merge histograms and report */
+    if(!(latency = calloc(1, sizeof(Histogram)))) {
+	fprintf(stderr, "Unable to allocate histogram: %s\n", strerror(errno));
+	goto cleanup;
+    }
+    for(size_t i = 0; i < Subscribers; i++) {
+	mutex_lock(&subscribers[i].lock);
+	Histogram *h = &subscribers[i].latency;
+	for(size_t b = 0; b < BENCH_BUCKETS; b++) {
+	    latency->counts[b] += h->counts[b];
+	}
+	latency->total += h->total;
+	latency->sum   += h->sum;
+	latency->max    = h->max > latency->max ? h->max : latency->max;
+	mutex_unlock(&subscribers[i].lock);
+    }
+    size_t sent     = Publishers * Messages;
+    size_t expected = sent * Subscribers;
+    printf("publishers %zu subscribers %zu topics %zu size %zu batch %zu linger %.3f capacity %zu reactors %zu workers %zu framing %s\n",
+	   Publishers, Subscribers, Topics, Size, Batch, Linger, Capacity, Reactors, Workers,
+	   Frames == MQ_BINARY ? "binary" : Frames == MQ_TEXT ? "text" : "plain");
+    printf("published %zu in %.3fs (%.0f msgs/s)\n", sent, published, sent / published);
+    printf("delivered %lu of %zu in %.3fs (%.0f msgs/s)\n", latency->total, expected, elapsed, latency->total / elapsed);
+    printf("cpu %.3fs (%.2f us per message)\n", cpu / 1e6, latency->total ? (double)cpu / latency->total : 0);
+    bench_report(latency);
+    status = latency->total == expected ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    /* Stop everything (whatever was created before any failure) */
+cleanup:
+    for(size_t i = 0; publishers && i < Publishers && publishers[i].mq; i++) {
+	mq_stop(publishers[i].mq);
+	mq_delete(publishers[i].mq);
+    }
+    for(size_t i = 0; subscribers && i < Subscribers && subscribers[i].mq; i++) {
+	mq_stop(subscribers[i].mq);
+	mq_delete(subscribers[i].mq);
+    }
+    for(size_t i = 0; reactors && i < Reactors && reactors[i]; i++) {
+	reactor_delete(reactors[i]);
+    }
+    free(latency);
+    free(reactors);
+    free(publishers);
+    free(subscribers);
+    return status;
+}
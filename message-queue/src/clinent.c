@@ -2,17 +2,21 @@
 
 #include "mq/client.h"
 #include "mq/logging.h"
-#include "mq/socket.h"
 #include "mq/string.h"
 
-/* Internal Constants */
-
-#define SENTINEL "SHUTDOWN"
+#include <errno.h>
+#include <sys/socket.h>
+#include <unistd.h>
 
 /* Internal Prototypes */
 
 void * mq_pusher(void *);
 void * mq_puller(void *);
+void * mq_worker(void *);
+bool   mq_pulling(MessageQueue *mq, Connection *c);
+bool   mq_handler(MessageQueue *mq, const char *topic, MessageHandler *handler, void **arg);
+void   mq_dispatch_stop(MessageQueue *mq);
+Request *mq_message(MessageQueue *mq, const char *topic, const void *data, size_t length);
 
 /* External Functions */
 
@@ -38,8 +42,15 @@ MessageQueue * mq_create(const char *name, const char *host, const char *port) {
     // Create the incoming and outgoing queues
     mq->outgoing = queue_create();
     mq->incoming = queue_create();
-    // Check that the queues were successfully created
-    if(!mq->outgoing || !mq->incoming) {
+    // Resolve the server once for all connections
+    mq->pool = pool_create(host, port);
+    mq->batch  = MQ_BATCH;
+    mq->linger = MQ_LINGER;
+    mq->nworkers = MQ_WORKERS;
+    mq->compress = MQ_COMPRESS;
+    mutex_init(&mq->lock, NULL);
+    // Check that the queues and pool were successfully created
+    if(!mq->outgoing || !mq->incoming || !mq->pool) {
         return NULL;
     }
     return mq;
@@ -54,27 +65,174 @@ void mq_delete(MessageQueue *mq) {
     if(!mq) {
         return;
     }
-    // Delete the incoming and outgoing queues
+    // Stop the message handlers and forget them
+    mq_dispatch_stop(mq);
+    while(mq->subscriptions) {
+        Subscription *s = mq->subscriptions;
+        mq->subscriptions = s->next;
+        free(s->topic);
+        free(s);
+    }
+    // Delete the incoming, outgoing, and dispatch queues
     queue_delete(mq->incoming);
     queue_delete(mq->outgoing);
+    queue_delete(mq->dispatch);
+    // Close the connections to the server
+    pool_delete(mq->pool);
     // Free the mq structure
     free(mq);
 }
 
+/**
+ * Set flush policy of pusher (must be called before mq_start): requests are
+ * sent in pipelined bursts of up to batch requests, and once a request is
+ * waiting the pusher waits up to linger seconds for a burst to fill.
+ * @param   mq      Message Queue structure.
+ * @param   batch   Maximum number of requests per burst (at least 1).
+ * @param   linger  Seconds to wait for a burst to fill (0 sends what is queued).
+ */
+void mq_batch(MessageQueue *mq, size_t batch, double linger) {
+    mq->batch  = batch ? batch : 1;
+    mq->linger = linger;
+}
+
+/**
+ * Bound the incoming and outgoing queues with lock-free rings (must be called
+ * before mq_start): once capacity messages are waiting to be sent, publishing
+ * either blocks until the pusher catches up or fails right away, while the
+ * puller always waits for the application to retrieve messages.
+ * @param   mq          Message Queue structure.
+ * @param   capacity    Most requests each queue holds (rounded up to a power of two).
+ * @param   block       Whether publishing to a full queue blocks (otherwise it fails).
+ * @return  Whether or not the queues were replaced.
+ */
+bool mq_capacity(MessageQueue *mq, size_t capacity, bool block) {
+    Queue* outgoing = queue_create_bounded(capacity, block);
+    Queue* incoming = queue_create_bounded(capacity, true);
+    if(!outgoing || !incoming) {
+        queue_delete(outgoing);
+        queue_delete(incoming);
+        return false;
+    }
+    queue_delete(mq->outgoing);
+    queue_delete(mq->incoming);
+    mq->outgoing = outgoing;
+    mq->incoming = incoming;
+    return true;
+}
+
+/**
+ * Serve queue from the specified shared reactor instead of threads of its own
+ * (must be called before mq_start).  The reactor sends requests as soon as
+ * they are queued, so the linger of mq_batch does not apply.
+ * @param   mq      Message Queue structure.
+ * @param   reactor Reactor structure (NULL to go back to threads).
+ */
+void mq_attach(MessageQueue *mq, Reactor *reactor) {
+    mq->reactor = reactor;
+}
+
+/**
+ * Set number of worker threads running message handlers (must be called
+ * before the first mq_subscribe_cb, which starts them).
+ * @param   mq          Message Queue structure.
+ * @param   nworkers    Number of worker threads (at least 1).
+ */
+void mq_workers(MessageQueue *mq, size_t nworkers) {
+    mq->nworkers = nworkers ? nworkers : 1;
+}
+
+/**
+ * Set how messages are published: as plain bodies that any receiver
+ * understands (the default), in text frames that also carry the topic (see
+ * request_publish), or in binary frames that also carry a sequence number and
+ * compress large payloads (see request_frame).  Receivers decode all three,
+ * so publishers can switch once every receiver is upgraded.  Only framed
+ * messages reach handlers (see mq_subscribe_cb), since plain bodies do not
+ * say which topic they were published to.
+ * @param   mq          Message Queue structure.
+ * @param   framing     How to publish messages (MQ_PLAIN, MQ_TEXT, or MQ_BINARY).
+ * @param   compress    Size above which binary frames are compressed (0 for
+ *                      never, ignored without HAVE_LZ4).
+ */
+void mq_framing(MessageQueue *mq, Framing framing, size_t compress) {
+    mq->framing  = framing;
+    mq->compress = compress;
+}
+
 /**
  * Publish one message to topic (by placing new Request in outgoing queue).
  * @param   mq      Message Queue structure.
  * @param   topic   Topic to publish to.
  * @param   body    Message body to publish.
+ * @return  Whether or not the message was queued (false if the bounded
+ * outgoing queue is full and does not block).
  */
-void mq_publish(MessageQueue *mq, const char *topic, const char *body) {
-    // Build message to send
-    char* method = "PUT";
-    char concat_buf[BUFSIZ] = "/topic/";
-    strcat(concat_buf, topic);
-    // Create new request and put it in the outgoing queue
-    Request* new_request = request_create(method, concat_buf, body);
-    queue_push(mq->outgoing, new_request);
+bool mq_publish(MessageQueue *mq, const char *topic, const char *body) {
+    // Create new request (framed as configured) and put it in the outgoing queue
+    Request* new_request = mq_message(mq, topic, body, body ? strlen(body) : 0);
+    if(!new_request) {
+        return false;
+    }
+    if(!queue_push(mq->outgoing, new_request)) {
+        request_delete(new_request);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Publish several messages to topic (by placing new Requests in outgoing queue
+ * all at once).
+ * @param   mq      Message Queue structure.
+ * @param   topic   Topic to publish to.
+ * @param   bodies  Message bodies to publish.
+ * @param   n       Number of messages.
+ * @return  Number of messages queued (the first ones, if the bounded
+ * outgoing queue filled up and does not block).
+ */
+size_t mq_publish_many(MessageQueue *mq, const char *topic, const char **bodies, size_t n) {
+    // Create new requests and put them in the outgoing queue together
+    Request** requests = calloc(n, sizeof(Request*));
+    if(!requests) {
+        return 0;
+    }
+    size_t created = 0;
+    for(size_t i = 0; i < n; i++) {
+        Request* new_request = mq_message(mq, topic, bodies[i], bodies[i] ? strlen(bodies[i]) : 0);
+        if(new_request) {
+            requests[created++] = new_request;
+        }
+    }
+    size_t pushed = queue_push_many(mq->outgoing, requests, created);
+    for(size_t i = pushed; i < created; i++) {
+        request_delete(requests[i]);
+    }
+    free(requests);
+    return pushed;
+}
+
+/**
+ * Publish one binary message to topic (always in a binary frame, since the
+ * payload may hold NULs).
+ * @param   mq      Message Queue structure.
+ * @param   topic   Topic to publish to.
+ * @param   data    Payload to publish.
+ * @param   length  Length of payload.
+ * @return  Whether or not the message was queued (false if the bounded
+ * outgoing queue is full and does not block).
+ */
+bool mq_publish_binary(MessageQueue *mq, const char *topic, const void *data, size_t length) {
+    uint64_t sequence    = __atomic_add_fetch(&mq->sequence, 1, __ATOMIC_RELAXED);
+    Request* new_request = request_frame(topic, data, length, sequence, mq->compress);
+    if(!new_request) {
+        return false;
+    }
+    if(!queue_push(mq->outgoing, new_request)) {
+        request_delete(new_request);
+        return false;
+    }
+    return true;
 }
 
 /**
@@ -85,21 +243,73 @@ void mq_publish(MessageQueue *mq, const char *topic, const char *body) {
 char * mq_retrieve(MessageQueue *mq) {
     // Retrieve the next incoming request
     Request *r = queue_pop(mq->incoming);
-    // Str dup and return non sentinel messages
+    // Return the body of messages (but nothing for the sentinel)
     if(r) {
-        if(r->body) {
-            if(!strstr(r->body, SENTINEL)) {
-                // Delete the request after we have extracted the body
-                char* msg = strdup(r->body);
-                request_delete(r);
-                return msg;
-            }
+        if(r->body && !r->sentinel) {
+            // Delete the request but hand its body over (rather than copying it)
+            return request_release(r);
         }
         request_delete(r);
     }
     return NULL;
 }
 
+/**
+ * Retrieve one message along with its length (which the body may not be
+ * able to tell, since binary payloads may hold NULs).
+ * @param   mq          Message Queue structure.
+ * @param   length      Where to store the length of the message.
+ * @param   sequence    Where to store the sequence number of the message (0
+ *                      if it was not in a binary frame, may be NULL).
+ * @return  Newly allocated message body (must be freed, NUL-terminated).
+ */
+char * mq_retrieve_binary(MessageQueue *mq, size_t *length, uint64_t *sequence) {
+    Request *r = queue_pop(mq->incoming);
+    *length = 0;
+    if(sequence) {
+        *sequence = 0;
+    }
+    if(r && r->body && !r->sentinel) {
+        *length = r->length;
+        if(sequence) {
+            *sequence = r->sequence;
+        }
+        return request_release(r);
+    }
+    request_delete(r);
+    return NULL;
+}
+
+/**
+ * Retrieve up to n messages at once (by taking Requests from incoming queue).
+ * @param   mq          Message Queue structure.
+ * @param   messages    Array to store newly allocated message bodies in
+ *                      (each must be freed).
+ * @param   n           Maximum number of messages.
+ * @param   timeout     Seconds to wait for the first message (negative to block).
+ * @return  Number of messages retrieved.
+ */
+size_t mq_retrieve_batch(MessageQueue *mq, char **messages, size_t n, double timeout) {
+    Request** requests = calloc(n, sizeof(Request*));
+    if(!requests) {
+        return 0;
+    }
+    size_t popped    = queue_pop_many(mq->incoming, requests, n, timeout, 0);
+    size_t retrieved = 0;
+    for(size_t i = 0; i < popped; i++) {
+        Request *r = requests[i];
+        // Hand the body over instead of copying it, and drop sentinels
+        if(r->body && !r->sentinel) {
+            messages[retrieved++] = request_release(r);
+        }
+        else {
+            request_delete(r);
+        }
+    }
+    free(requests);
+    return retrieved;
+}
+
 /**
  * Subscribe to specified topic.
  * @param   mq      Message Queue structure.
@@ -114,7 +324,54 @@ void mq_subscribe(MessageQueue *mq, const char *topic) {
     strcat(concat_buf, topic);
     // Create the request and put it in the outgoing queue
     Request* new_request = request_create(method, concat_buf, NULL);
-    queue_push(mq->outgoing, new_request);
+    if(new_request && !queue_push(mq->outgoing, new_request)) {
+        error("Unable to subscribe to %s: outgoing queue is full", topic);
+        request_delete(new_request);
+    }
+}
+
+/**
+ * Subscribe to specified topic, dispatching its messages to handler (on the
+ * worker threads, see mq_workers) rather than to mq_retrieve.  Publishers
+ * must frame their messages (see mq_framing), or they go to mq_retrieve.
+ * @param   mq      Message Queue structure.
+ * @param   topic   Topic string to subscribe to.
+ * @param   handler Function called with the topic and body of each message
+ *                  (which it must not keep).
+ * @param   arg     Argument passed to handler.
+ * @return  Whether or not the handler was registered.
+ **/
+bool mq_subscribe_cb(MessageQueue *mq, const char *topic, MessageHandler handler, void *arg) {
+    Subscription *s = calloc(1, sizeof(Subscription));
+    if(!s || !(s->topic = strdup(topic))) {
+        free(s);
+        return false;
+    }
+    s->handler = handler;
+    s->arg     = arg;
+
+    mutex_lock(&mq->lock);
+    // Start the worker threads with the first handler
+    if(!mq->workers) {
+        mq->dispatch = mq->dispatch ? mq->dispatch : queue_create();
+        mq->workers  = mq->dispatch ? calloc(mq->nworkers, sizeof(Thread)) : NULL;
+        for(size_t i = 0; mq->workers && i < mq->nworkers; i++) {
+            thread_create(&mq->workers[i], NULL, mq_worker, (void*)mq);
+        }
+    }
+    bool registered = mq->workers != NULL;
+    if(registered) {
+        s->next = mq->subscriptions;
+        mq->subscriptions = s;
+    }
+    mutex_unlock(&mq->lock);
+    if(!registered) {
+        free(s->topic);
+        free(s);
+        return false;
+    }
+    mq_subscribe(mq, topic);
+    return true;
 }
 
 /**
@@ -130,36 +387,94 @@ void mq_unsubscribe(MessageQueue *mq, const char *topic) {
     strcat(buffer,"/");
     strcat(buffer, topic);
     Request *r = request_create(method,buffer,NULL);
-    queue_push(mq->outgoing,r);
+    if(r && !queue_push(mq->outgoing,r)) {
+        error("Unable to unsubscribe from %s: outgoing queue is full", topic);
+        request_delete(r);
+    }
+    // Forget the handlers of the topic
+    mutex_lock(&mq->lock);
+    Subscription **link = &mq->subscriptions;
+    while(*link) {
+        Subscription *s = *link;
+        if(streq(s->topic, topic)) {
+            *link = s->next;
+            free(s->topic);
+            free(s);
+        }
+        else {
+            link = &s->next;
+        }
+    }
+    mutex_unlock(&mq->lock);
 }
 
 /**
  * Start running the background threads:
  *  1. First thread should continuously send requests from outgoing queue.
  *  2. Second thread should continuously receive reqeusts to incoming queue.
+ * If queue is attached to a reactor, then it is registered with the reactor
+ * instead (falling back to threads if that fails).
  * @param   mq      Message Queue structure.
  */
 void mq_start(MessageQueue *mq) {
-    mq_subscribe(mq, SENTINEL);
+    if(mq->reactor) {
+        if(reactor_add(mq->reactor, mq)) {
+            return;
+        }
+        error("Unable to attach %s to reactor, using threads", mq->name);
+        mq->reactor = NULL;
+    }
     thread_create(&mq->thread1, NULL, mq_pusher, (void*)mq);
     thread_create(&mq->thread2, NULL, mq_puller, (void*)mq);
 }
 
 /**
- * Stop the message queue client by setting shutdown attribute and sending
- * sentinel messages
+ * Stop the message queue client by doing the following:
+ *
+ *  1. Set the shutdown attribute and shut down the connection the puller
+ *  is blocked on (or detach the queue from its reactor).
+ *
+ *  2. Queue a sentinel behind the outgoing requests, so the pusher sends
+ *  everything before it and then stops.
+ *
+ *  3. Stop the worker threads once they handled what was dispatched, and
+ *  wake any thread blocked in mq_retrieve with a sentinel.
+ *
+ * Sentinels are marked out of band (see request_sentinel), so no message
+ * body can be mistaken for one.
  * @param   mq      Message Queue structure.
  */
 void mq_stop(MessageQueue *mq) {
-    // Push a sentinel to force both puller and pusher unblock so they can terminate when needed
-    mq_publish(mq, SENTINEL, SENTINEL);
     // Lock before undating shared shutdown variable
     mutex_lock(&mq->lock);
     mq->shutdown = true;
+    if(mq->pulling) {
+        shutdown(mq->pulling->fd, SHUT_RDWR);
+    }
     mutex_unlock(&mq->lock);
-    // Wait for the pusher and puller threads
-    thread_join(mq->thread1, NULL);
-    thread_join(mq->thread2, NULL);
+
+    if(mq->reactor) {
+        // The reactor sends what is queued before it lets go of the queue
+        reactor_remove(mq->reactor, mq);
+    }
+    else {
+        Request *sentinel = request_sentinel();
+        if(sentinel) {
+            // A bounded outgoing queue that does not block has room once the pusher catches up
+            while(!queue_push(mq->outgoing, sentinel)) {
+                usleep(1000);
+            }
+        }
+        // Wait for the pusher and puller threads
+        thread_join(mq->thread1, NULL);
+        thread_join(mq->thread2, NULL);
+    }
+    mq_dispatch_stop(mq);
+
+    Request *sentinel = request_sentinel();
+    if(sentinel && !queue_offer(mq->incoming, sentinel)) {
+        request_delete(sentinel);
+    }
 }
 
 /**
@@ -175,80 +490,259 @@ bool mq_shutdown(MessageQueue *mq) {
     return shutdown;
 }
 
+/**
+ * Deliver message received from server: to the worker threads if its topic
+ * has a handler, and otherwise to the incoming queue.
+ * @param   mq      Message Queue structure.
+ * @param   r       Request structure (with its topic stripped, see request_topic).
+ * @param   block   Whether to wait for room in a full bounded incoming queue.
+ * @return  Whether or not the message was queued.
+ */
+bool mq_deliver(MessageQueue *mq, Request *r, bool block) {
+    if(r->topic && mq_handler(mq, r->topic, NULL, NULL)) {
+        return queue_push(mq->dispatch, r);
+    }
+    return block ? queue_push(mq->incoming, r) : queue_offer(mq->incoming, r);
+}
+
 /* Internal Functions */
 
 /**
- * Pusher thread takes messages from outgoing queue and sends them to server.
+ * Pusher thread takes messages from outgoing queue and sends them to server
+ * (everything queued, up to the batch size, is pipelined in one burst) until
+ * it takes the sentinel.
  **/
 void * mq_pusher(void *arg) {
     MessageQueue* mq = (MessageQueue*) arg;
 
-    while(!mq_shutdown(mq)) {
-        Request* r = queue_pop(mq->outgoing);
-        if(r) {
-            // Try to open connection to server
-            FILE* fs = socket_connect(mq->host, mq->port);
-            if(fs) {
-                // Write request to the server
-                request_write(r, fs);
-                // Read sever response (who cares, not me)
-                char resp_buf[BUFSIZ];
-                while(fgets(resp_buf, BUFSIZ, fs)) {} // Continues to read response until nothing is left
-                fclose(fs);
-            }
-            // Delete the sent request
-            request_delete(r);
+    Request** requests = calloc(mq->batch, sizeof(Request*));
+    if(!requests) {
+        error("Unable to allocate batch: %s", strerror(errno));
+        return NULL;
+    }
+    bool stopped = false;
+    while(!stopped) {
+        size_t n = queue_pop_many(mq->outgoing, requests, mq->batch, -1, mq->linger);
+        // Send requests up to the sentinel (if any) on a kept-alive connection (the responses do not matter)
+        size_t sent = 0;
+        while(sent < n && !requests[sent]->sentinel) {
+            sent++;
+        }
+        stopped = sent < n;
+        pool_send_many(mq->pool, requests, sent);
+        // Delete the sent requests (and the sentinel)
+        for(size_t i = 0; i < n; i++) {
+            request_delete(requests[i]);
         }
     }
+    free(requests);
     return NULL;
 }
 
 /**
  * Puller thread requests new messages from server and then puts them in
- * incoming queue.
+ * incoming queue by doing the following:
+ *
+ *  1. Keep MQ_WINDOW GET requests outstanding on one kept-alive connection
+ *  (the server holds each until there is a message for it), so several
+ *  messages are in flight per round trip.
+ *
+ *  2. As each response arrives, put its message in the incoming queue and
+ *  send another GET to replace it.  A full bounded queue is retried until
+ *  there is room or mq_stop is called (never blocking, so mq_stop can join).
+ *
+ *  3. Back off (up to MQ_BACKOFF seconds) after empty responses or failed
+ *  connections, rather than polling the server as fast as possible.
+ *
+ * Note, mq_stop shuts the connection down to interrupt the GET requests
+ * still outstanding (which are abandoned along with it).
  **/
 void * mq_puller(void *arg) {
     MessageQueue* mq = (MessageQueue*) arg;
 
+    // Build the GET request (written again for every poll)
+    char get_uri[BUFSIZ] = "/queue/";
+    strcat(get_uri, mq->name);
+    Request* get = request_create("GET", get_uri, NULL);
+    if(!get) {
+        return NULL;
+    }
+    Request* window[MQ_WINDOW];
+    for(size_t i = 0; i < MQ_WINDOW; i++) {
+        window[i] = get;
+    }
+
+    Connection* c           = NULL;
+    size_t      outstanding = 0;
+    double      backoff     = 0;
     while(!mq_shutdown(mq)) {
-        // Build the GET request
-        char get_uri[BUFSIZ] = "/queue/";
-        strcat(get_uri, mq->name);
-        Request* r = request_create("GET", get_uri, NULL);
-
-        if(r) {
-            // Try to open connection to server
-            FILE* fs = socket_connect(mq->host, mq->port);
-            if(fs) {
-                request_write(r, fs);
-                // Read response status
-                char resp_buf[BUFSIZ];
-                fgets(resp_buf, BUFSIZ, fs);
-                // Check to see if the return status is ok
-                if(!strstr(resp_buf, "200 OK")) {
-                    // Close stream and try again
-                    fclose(fs);
-                    continue;
-                }
-                // Process headers to find the content length
-                size_t resp_len;
-                while(fgets(resp_buf, BUFSIZ, fs) && !streq(resp_buf, "\r\n")) {
-                    sscanf(resp_buf, "Content-Length: %ld", &resp_len);
+        if(backoff > 0) {
+            usleep(backoff * 1000000);
+        }
+        // Fill the window of outstanding requests (reconnecting if necessary)
+        if(!c) {
+            c = pool_acquire(mq->pool);
+            outstanding = 0;
+            if(c && !mq_pulling(mq, c)) {
+                break;
+            }
+        }
+        if(c && outstanding < MQ_WINDOW && connection_write(c, mq->pool->host, window, MQ_WINDOW - outstanding)) {
+            outstanding = MQ_WINDOW;
+        }
+        char*  body   = NULL;
+        size_t length = 0;
+        int    status = c && outstanding ? connection_read(c, &body, &length) : -1;
+        if(status < 0) {
+            if(c) {
+                mq_pulling(mq, NULL);
+                connection_close(c);
+                c = NULL;
+            }
+            backoff = backoff ? 2 * backoff : 0.001;
+            backoff = backoff < MQ_BACKOFF ? backoff : MQ_BACKOFF;
+            continue;
+        }
+        outstanding--;
+
+        if(status == 200) {
+            // If we have a valid body deliver it (without copying it) by its topic
+            Request *r = request_adopt(body, length);
+            if(r && !request_topic(r)) {
+                error("Dropping message for %s: unable to decode frame", mq->name);
+                request_delete(r);
+            }
+            else if(r) {
+                // Wait for room in a bounded incoming queue, but give up once mq_stop is waiting for us
+                bool delivered;
+                while(!(delivered = mq_deliver(mq, r, false)) && !mq_shutdown(mq)) {
+                    usleep(1000);
                 }
-                // Update the body of the old request with the response
-                r->body = calloc(1,resp_len+1);
-                fread(r->body, 1, resp_len, fs);
-                // Cleanup the request if we don't receive a body
-                if(!r->body) {
+                if(!delivered) {
                     request_delete(r);
                 }
-                // If we have a valid body add the request to the incoming queue
-                else {
-                    queue_push(mq->incoming, r);
-                }
-                fclose(fs);
             }
+            backoff = 0;
+        }
+        else {
+            // Nothing for us yet, so wait a little before asking again
+            free(body);
+            backoff = backoff ? 2 * backoff : 0.001;
+            backoff = backoff < MQ_BACKOFF ? backoff : MQ_BACKOFF;
+        }
+        // Requests after a Connection: close will never be answered
+        if(!c->alive) {
+            mq_pulling(mq, NULL);
+            connection_close(c);
+            c = NULL;
+        }
+    }
+    if(c) {
+        mq_pulling(mq, NULL);
+        connection_close(c);
+    }
+    request_delete(get);
+    return NULL;
+}
+
+/**
+ * Worker thread runs the handlers of dispatched messages until it takes a
+ * sentinel (messages whose topic lost its handler meanwhile go to the
+ * incoming queue instead).
+ **/
+void * mq_worker(void *arg) {
+    MessageQueue* mq = (MessageQueue*) arg;
+
+    while(true) {
+        Request *r = queue_pop(mq->dispatch);
+        if(r->sentinel) {
+            request_delete(r);
+            break;
+        }
+        MessageHandler handler;
+        void *         handler_arg;
+        if(mq_handler(mq, r->topic, &handler, &handler_arg)) {
+            handler(r->topic, r->body, r->length, handler_arg);
+            request_delete(r);
+        }
+        else if(!queue_push(mq->incoming, r)) {
+            request_delete(r);
         }
     }
     return NULL;
-}
\ No newline at end of file
+}
+
+/**
+ * Record connection puller is blocked on (so mq_stop can shut it down).
+ * @param   mq      Message Queue structure.
+ * @param   c       Connection structure (NULL before closing it).
+ * @return  Whether or not the puller should keep going (false once stopped).
+ */
+bool mq_pulling(MessageQueue *mq, Connection *c) {
+    mutex_lock(&mq->lock);
+    mq->pulling = c;
+    bool shutdown = mq->shutdown;
+    mutex_unlock(&mq->lock);
+    return !shutdown;
+}
+
+/**
+ * Look up handler of specified topic.
+ * @param   mq      Message Queue structure.
+ * @param   topic   Topic string.
+ * @param   handler Where to store the handler (may be NULL).
+ * @param   arg     Where to store the argument of handler (may be NULL).
+ * @return  Whether or not the topic has a handler.
+ */
+bool mq_handler(MessageQueue *mq, const char *topic, MessageHandler *handler, void **arg) {
+    mutex_lock(&mq->lock);
+    Subscription *s = mq->subscriptions;
+    while(s && !streq(s->topic, topic)) {
+        s = s->next;
+    }
+    if(s && handler) {
+        *handler = s->handler;
+        *arg     = s->arg;
+    }
+    mutex_unlock(&mq->lock);
+    return s != NULL;
+}
+
+/**
+ * Stop the worker threads (if running) once they handled everything that
+ * was dispatched before.
+ * @param   mq      Message Queue structure.
+ */
+void mq_dispatch_stop(MessageQueue *mq) {
+    if(!mq->workers) {
+        return;
+    }
+    for(size_t i = 0; i < mq->nworkers; i++) {
+        Request *sentinel = request_sentinel();
+        if(sentinel) {
+            queue_push(mq->dispatch, sentinel);
+        }
+    }
+    for(size_t i = 0; i < mq->nworkers; i++) {
+        thread_join(mq->workers[i], NULL);
+    }
+    free(mq->workers);
+    mq->workers = NULL;
+}
+
+/**
+ * Create Request publishing message to topic in the framing of queue (see
+ * mq_framing).
+ * @param   mq      Message Queue structure.
+ * @param   topic   Topic to publish to.
+ * @param   data    Message to publish (NUL-terminated).
+ * @param   length  Length of message.
+ * @return  Newly allocated Request structure.
+ */
+Request * mq_message(MessageQueue *mq, const char *topic, const void *data, size_t length) {
+    if(mq->framing != MQ_BINARY) {
+        return request_publish(topic, data, mq->framing == MQ_TEXT);
+    }
+    uint64_t sequence = __atomic_add_fetch(&mq->sequence, 1, __ATOMIC_RELAXED);
+    return request_frame(topic, data, length, sequence, mq->compress);
+}
@@ -0,0 +1,584 @@
+/* connection.c: Persistent HTTP connections
+ *
+ * Connections talk to the socket directly rather than through stdio: each
+ * burst of requests is gathered (headers formatted on the stack, bodies
+ * sent in place) into as few sendmsg calls as possible, and responses are
+ * parsed incrementally out of a receive buffer that lives as long as the
+ * connection, so partial reads and pipelined responses need no special care.
+ **/
+
+#define _GNU_SOURCE	/* For memmem */
+
+#include "mq/connection.h"
+#include "mq/logging.h"
+#include "mq/socket.h"
+#include "mq/string.h"
+
+#include <errno.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/* Internal Prototypes */
+
+ssize_t	connection_head(Connection *c, int *status, bool *alive, long *content_length);
+bool	connection_header(const char *line, const char *name, const char **value);
+bool	connection_flush(Connection *c, struct iovec *iov, size_t count);
+bool	connection_receive(Connection *c, char *data, size_t size);
+
+/* Pool Functions */
+
+/**
+ * Create connection pool for specified host and port (resolving the address
+ * only once).
+ * @param   host        Address of server.
+ * @param   port        Port of server.
+ * @return  Newly allocated Pool structure (NULL if address is unresolvable).
+ */
+Pool * pool_create(const char *host, const char *port) {
+    Pool *p = calloc(1, sizeof(Pool));
+    if(!p) {
+        return NULL;
+    }
+
+    p->address = socket_resolve(host, port);
+    if(!p->address) {
+        free(p);
+        return NULL;
+    }
+    strncpy(p->host, host, NI_MAXHOST - 1);
+    mutex_init(&p->lock, NULL);
+    return p;
+}
+
+/**
+ * Delete connection pool (closing any idle connections).
+ * @param   p           Pool structure.
+ */
+void pool_delete(Pool *p) {
+    if(!p) {
+        return;
+    }
+    while(p->idle) {
+        Connection *c = p->idle;
+        p->idle = c->next;
+        connection_close(c);
+    }
+    freeaddrinfo(p->address);
+    free(p);
+}
+
+/**
+ * Take an idle connection from the pool (opening a new one if there are none).
+ * @param   p           Pool structure.
+ * @return  Connection structure if successful, otherwise NULL.
+ */
+Connection * pool_acquire(Pool *p) {
+    mutex_lock(&p->lock);
+    Connection *c = p->idle;
+    if(c) {
+        p->idle = c->next;
+        p->nidle--;
+    }
+    mutex_unlock(&p->lock);
+    if(c) {
+        return c;
+    }
+
+    c = calloc(1, sizeof(Connection));
+    if(!c) {
+        return NULL;
+    }
+    c->buffer = malloc(CONNECTION_BUFFER);
+    c->fd     = c->buffer ? socket_dial(p->address) : -1;
+    if(c->fd < 0) {
+        free(c->buffer);
+        free(c);
+        return NULL;
+    }
+    c->capacity = CONNECTION_BUFFER;
+    c->alive    = true;
+    return c;
+}
+
+/**
+ * Return connection to the pool, closing it instead if the server will not
+ * keep it open or the pool is full.
+ * @param   p           Pool structure.
+ * @param   c           Connection structure.
+ */
+void pool_release(Pool *p, Connection *c) {
+    if(c->alive) {
+        mutex_lock(&p->lock);
+        if(p->nidle < POOL_MAX) {
+            c->next = p->idle;
+            p->idle = c;
+            p->nidle++;
+            c = NULL;
+        }
+        mutex_unlock(&p->lock);
+    }
+    if(c) {
+        connection_close(c);
+    }
+}
+
+/**
+ * Send request on a pooled connection and read the response by doing the
+ * following:
+ *
+ *  1. Acquire a connection and send the request on it.
+ *
+ *  2. If that fails on a connection that served earlier requests, then the
+ *  server probably closed it while it was idle, so reconnect and send the
+ *  request once more.
+ *
+ *  3. Release the connection back to the pool.
+ *
+ * @param   p           Pool structure.
+ * @param   r           Request structure.
+ * @param   body        Where to store the response body (NULL to discard it).
+ * @return  HTTP status of response (otherwise -1).
+ */
+int pool_send(Pool *p, Request *r, char **body) {
+    for(int attempt = 0; attempt < 2; attempt++) {
+        Connection *c = pool_acquire(p);
+        if(!c) {
+            return -1;
+        }
+        bool reused = c->reused;
+        int  status = connection_send(c, p->host, r, body);
+        pool_release(p, c);
+        if(status >= 0 || !reused) {
+            return status;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Send several requests pipelined on one pooled connection (all requests are
+ * written before any response is read) by doing the following:
+ *
+ *  1. Acquire a connection, write every unanswered request, and flush them
+ *  together.
+ *
+ *  2. Read one response per request (discarding the bodies).
+ *
+ *  3. If the connection fails (or the server closes it) part way, then
+ *  reconnect and send the unanswered requests again, as long as the attempt
+ *  made progress or failed on a connection that may have gone stale.
+ *
+ * @param   p           Pool structure.
+ * @param   rs          Array of Request structures.
+ * @param   n           Number of requests.
+ * @return  Number of requests that received a response.
+ */
+size_t pool_send_many(Pool *p, Request **rs, size_t n) {
+    size_t answered = 0;
+    while(answered < n) {
+        Connection *c = pool_acquire(p);
+        if(!c) {
+            break;
+        }
+        bool   reused = c->reused;
+        size_t before = answered;
+        c->reused = true;
+        c->alive  = false;
+        if(connection_write(c, p->host, rs + answered, n - answered)) {
+            while(answered < n && connection_read(c, NULL, NULL) >= 0) {
+                answered++;
+                // Requests after a Connection: close will never be answered
+                if(!c->alive) {
+                    break;
+                }
+            }
+        }
+        pool_release(p, c);
+        if(answered == before && !reused) {
+            break;
+        }
+    }
+    return answered;
+}
+
+/* Connection Functions */
+
+/**
+ * Send request on connection and read the whole response (see
+ * connection_read).
+ * @param   c           Connection structure.
+ * @param   host        Host of server.
+ * @param   r           Request structure.
+ * @param   body        Where to store the response body (NULL to discard it).
+ * @return  HTTP status of response (otherwise -1).
+ */
+int connection_send(Connection *c, const char *host, Request *r, char **body) {
+    if(!connection_write(c, host, &r, 1)) {
+        return -1;
+    }
+    return connection_read(c, body, NULL);
+}
+
+/**
+ * Write requests on connection without waiting for their responses (so
+ * several requests can be outstanding at once):
+ *
+ *  1. Format the header of each request into a buffer on the stack, and
+ *  gather it and the body (which is sent where it is) into an iovec.
+ *
+ *  2. Send everything gathered with one sendmsg whenever the header buffer
+ *  or the iovec is full, and once more at the end.
+ *
+ * @param   c           Connection structure.
+ * @param   host        Host of server.
+ * @param   rs          Array of Request structures.
+ * @param   n           Number of requests.
+ * @return  Whether or not every request was sent.
+ */
+bool connection_write(Connection *c, const char *host, Request **rs, size_t n) {
+    char         headers[2 * BUFSIZ];
+    size_t       used  = 0;
+    struct iovec iov[CONNECTION_IOV];
+    size_t       count = 0;
+
+    c->reused = true;
+    for(size_t i = 0; i < n; i++) {
+        size_t length = request_header(rs[i], host, headers + used, sizeof(headers) - used);
+        if(!length || count + 2 > CONNECTION_IOV) {
+            // Send what was gathered so far to make room
+            if(!connection_flush(c, iov, count)) {
+                c->alive = false;
+                return false;
+            }
+            used   = 0;
+            count  = 0;
+            length = request_header(rs[i], host, headers, sizeof(headers));
+            if(!length) {
+                error("Request header for %s is too long", rs[i]->uri);
+                c->alive = false;
+                return false;
+            }
+        }
+        iov[count].iov_base = headers + used;
+        iov[count].iov_len  = length;
+        count++;
+        used += length;
+        if(rs[i]->body && rs[i]->length) {
+            iov[count].iov_base = rs[i]->body;
+            iov[count].iov_len  = rs[i]->length;
+            count++;
+        }
+    }
+    if(!connection_flush(c, iov, count)) {
+        c->alive = false;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Read one whole response from connection by doing the following:
+ *
+ *  1. Receive until the buffer holds the whole header (anything received
+ *  after it stays buffered for the next response).
+ *
+ *  2. Parse the status, the Content-Length, and whether the server will keep
+ *  the connection alive.
+ *
+ *  3. Move the buffered part of the body into a new allocation and receive
+ *  the rest straight into it.
+ *
+ * Without a Content-Length the body runs until the server closes the
+ * connection, so the connection is marked as no longer alive (as it is on any
+ * error or if the server asks to close it).
+ *
+ * @param   c           Connection structure.
+ * @param   body        Where to store the response body (NULL to discard it).
+ * @param   length      Where to store the length of the body (may be NULL).
+ * @return  HTTP status of response (otherwise -1).
+ */
+int connection_read(Connection *c, char **body, size_t *length) {
+    c->alive = false;
+
+    // Receive and parse the whole header
+    int     status;
+    bool    alive;
+    long    content_length;
+    ssize_t header;
+    while(!(header = connection_head(c, &status, &alive, &content_length))) {
+        if(connection_fill(c) <= 0) {
+            return -1;
+        }
+    }
+    if(header < 0) {
+        return -1;
+    }
+    c->start += header;
+
+    // Read the body (until the connection closes if its length is unknown)
+    size_t capacity = content_length >= 0 ? content_length + 1 : CONNECTION_BUFFER;
+    size_t nread    = 0;
+    char * data     = NULL;
+    if(body || content_length < 0) {
+        data = malloc(capacity);
+        if(!data) {
+            return -1;
+        }
+    }
+    while(content_length < 0 || nread < (size_t)content_length) {
+        size_t buffered = c->end - c->start;
+        size_t wanted   = content_length < 0 ? capacity - nread - 1 : content_length - nread;
+        if(buffered) {
+            size_t moved = buffered < wanted ? buffered : wanted;
+            if(data) {
+                memcpy(data + nread, c->buffer + c->start, moved);
+            }
+            c->start += moved;
+            nread    += moved;
+        }
+        else if(data && content_length >= 0) {
+            // Receive the rest of a known length body straight into it
+            if(!connection_receive(c, data + nread, wanted)) {
+                break;
+            }
+            nread += wanted;
+        }
+        else if(connection_fill(c) <= 0) {
+            break;
+        }
+        if(content_length < 0 && nread + 1 == capacity) {
+            char *grown = realloc(data, capacity *= 2);
+            if(!grown) {
+                break;
+            }
+            data = grown;
+        }
+    }
+
+    if(content_length >= 0 && nread < (size_t)content_length) {
+        free(data);
+        return -1;
+    }
+    c->alive = alive && content_length >= 0;
+    if(length) {
+        *length = nread;
+    }
+    if(body) {
+        data[nread] = 0;
+        *body = data;
+    }
+    else {
+        free(data);
+    }
+    return status;
+}
+
+/**
+ * Parse one whole response out of the receive buffer without receiving
+ * anything (for non-blocking connections, which receive with connection_fill
+ * whenever the socket is readable).  The response stays buffered until all
+ * of it has arrived, and responses without a Content-Length are rejected,
+ * since they only end when the connection does.
+ * @param   c           Connection structure.
+ * @param   body        Where to store the response body (NULL to discard it).
+ * @param   length      Where to store the length of the body (may be NULL).
+ * @return  HTTP status of response, CONNECTION_PARTIAL if it has not all
+ * arrived yet (otherwise -1).
+ */
+int connection_parse(Connection *c, char **body, size_t *length) {
+    int     status;
+    bool    alive;
+    long    content_length;
+    ssize_t header = connection_head(c, &status, &alive, &content_length);
+    if(header <= 0) {
+        return header < 0 ? -1 : CONNECTION_PARTIAL;
+    }
+    if(content_length < 0) {
+        c->alive = false;
+        return -1;
+    }
+    if(c->end - c->start < header + (size_t)content_length) {
+        return CONNECTION_PARTIAL;
+    }
+
+    if(body) {
+        *body = malloc(content_length + 1);
+        if(!*body) {
+            return -1;
+        }
+        memcpy(*body, c->buffer + c->start + header, content_length);
+        (*body)[content_length] = 0;
+    }
+    if(length) {
+        *length = content_length;
+    }
+    c->start += header + content_length;
+    c->alive  = alive;
+    return status;
+}
+
+/**
+ * Receive more data into the receive buffer (moving unparsed data to the
+ * front first, and growing the buffer if it is still full).  The received
+ * data is always followed by a NUL, so headers can be parsed in place.
+ * @param   c           Connection structure.
+ * @return  Number of bytes received (0 once closed, otherwise -1 and errno
+ * is set, to EAGAIN if a non-blocking socket has nothing to receive).
+ */
+ssize_t connection_fill(Connection *c) {
+    if(c->start) {
+        memmove(c->buffer, c->buffer + c->start, c->end - c->start);
+        c->end  -= c->start;
+        c->start = 0;
+        c->buffer[c->end] = 0;
+    }
+    if(c->end + 1 >= c->capacity) {
+        char *grown = realloc(c->buffer, 2 * c->capacity);
+        if(!grown) {
+            errno = ENOMEM;
+            return -1;
+        }
+        c->buffer    = grown;
+        c->capacity *= 2;
+    }
+
+    ssize_t received;
+    do {
+        received = recv(c->fd, c->buffer + c->end, c->capacity - c->end - 1, 0);
+    } while(received < 0 && errno == EINTR);
+    if(received > 0) {
+        c->end += received;
+        c->buffer[c->end] = 0;
+    }
+    return received;
+}
+
+/**
+ * Close connection and delete Connection structure.
+ * @param   c           Connection structure.
+ */
+void connection_close(Connection *c) {
+    if(c) {
+        close(c->fd);
+        free(c->buffer);
+        free(c);
+    }
+}
+
+/* Internal Functions */
+
+/**
+ * Parse the response header at the front of the receive buffer (without
+ * consuming it, so a partly received response can be parsed again later).
+ * @param   c               Connection structure.
+ * @param   status          Where to store the HTTP status.
+ * @param   alive           Where to store whether the server keeps the
+ *                          connection open.
+ * @param   content_length  Where to store the Content-Length (-1 if none).
+ * @return  Length of header, 0 if it has not all arrived yet (otherwise -1).
+ */
+ssize_t connection_head(Connection *c, int *status, bool *alive, long *content_length) {
+    char * header   = c->buffer + c->start;
+    size_t buffered = c->end - c->start;
+    char * end      = memmem(header, buffered, "\r\n\r\n", 4);
+    if(!end) {
+        return buffered >= CONNECTION_HEADER ? -1 : 0;
+    }
+    if(sscanf(header, "HTTP/%*d.%*d %d", status) != 1) {
+        return -1;
+    }
+
+    // Every line up to the final empty one ends with \r\n
+    char *last = end + 2;
+    const char *value;
+    *alive          = !strncmp(header, "HTTP/1.1", 8);
+    *content_length = -1;
+    for(char *line = (char *)memmem(header, last - header, "\r\n", 2) + 2; line < last; line = (char *)memmem(line, last - line, "\r\n", 2) + 2) {
+        if(connection_header(line, "Content-Length", &value)) {
+            *content_length = strtol(value, NULL, 10);
+        }
+        else if(connection_header(line, "Connection", &value)) {
+            *alive = !strncasecmp(value, "keep-alive", 10);
+        }
+    }
+    return end + 4 - header;
+}
+
+/**
+ * Check whether header line has the specified name (ignoring case).
+ * @param   line        Header line.
+ * @param   name        Header name.
+ * @param   value       Where to store the start of the header value.
+ * @return  Whether or not the line is the specified header.
+ */
+bool connection_header(const char *line, const char *name, const char **value) {
+    size_t length = strlen(name);
+    if(strncasecmp(line, name, length) || line[length] != ':') {
+        return false;
+    }
+    *value = line + length + 1;
+    while(**value == ' ') {
+        (*value)++;
+    }
+    return true;
+}
+
+/**
+ * Send every buffer of iovec on connection (sendmsg may send only part).
+ * @param   c           Connection structure.
+ * @param   iov         Array of buffers (updated as they are sent).
+ * @param   count       Number of buffers.
+ * @return  Whether or not everything was sent.
+ */
+bool connection_flush(Connection *c, struct iovec *iov, size_t count) {
+    struct msghdr message = {
+        .msg_iov    = iov,
+        .msg_iovlen = count,
+    };
+    while(message.msg_iovlen) {
+        // Fail with EPIPE rather than raising SIGPIPE if the server hung up
+        ssize_t sent = sendmsg(c->fd, &message, MSG_NOSIGNAL);
+        if(sent < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        // Skip whatever was sent
+        while(message.msg_iovlen && (size_t)sent >= message.msg_iov->iov_len) {
+            sent -= message.msg_iov->iov_len;
+            message.msg_iov++;
+            message.msg_iovlen--;
+        }
+        if(message.msg_iovlen) {
+            message.msg_iov->iov_base  = (char *)message.msg_iov->iov_base + sent;
+            message.msg_iov->iov_len  -= sent;
+        }
+    }
+    return true;
+}
+
+/**
+ * Receive exactly the specified number of bytes straight into data (the
+ * receive buffer must be empty).
+ * @param   c           Connection structure.
+ * @param   data        Where to store the bytes.
+ * @param   size        Number of bytes.
+ * @return  Whether or not every byte was received.
+ */
+bool connection_receive(Connection *c, char *data, size_t size) {
+    while(size) {
+        ssize_t received = recv(c->fd, data, size, 0);
+        if(received < 0 && errno == EINTR) {
+            continue;
+        }
+        if(received <= 0) {
+            return false;
+        }
+        data += received;
+        size -= received;
+    }
+    return true;
+}
@@ -1,7 +1,24 @@
-/* queue.c: Concurrent Queue of Requests */
+/* queue.c: Concurrent Queue of Requests
+ *
+ * Queues are unbounded linked lists protected by a lock by default.  Bounded
+ * queues keep their requests in a lock-free ring instead (see ring.c), and
+ * either block or fail when it is full.  Either kind can also signal an
+ * eventfd when pushed to, so an event loop can wait for requests along with
+ * its sockets (see reactor.c).
+ **/
 
 #include "mq/queue.h"
 
+#include <errno.h>
+#include <sys/eventfd.h>
+#include <time.h>
+
+/* Internal Prototypes */
+
+void	queue_signal(Queue *q);
+void	queue_deadline(struct timespec *deadline, double seconds);
+size_t	queue_pop_ring(Queue *q, Request **rs, size_t n, double timeout, double linger);
+
 /**
  * Create queue structure.
  * @return  Newly allocated queue structure.
@@ -13,18 +30,40 @@ Queue* queue_create() {
         q->head = NULL;
         q->tail = NULL;
         q->size = 0;
+        q->event = -1;
         mutex_init(&q->lock, NULL);
         cond_init(&q->cv, NULL);
     }
     return q;
 }
 
+/**
+ * Create bounded queue structure backed by a lock-free ring.
+ * @param   capacity    Most requests queue holds (rounded up to a power of two).
+ * @param   block       Whether pushing to a full queue waits (otherwise it fails).
+ * @return  Newly allocated queue structure.
+ */
+Queue* queue_create_bounded(size_t capacity, bool block) {
+    Queue* q = queue_create();
+
+    if(q) {
+        q->ring  = ring_create(capacity);
+        q->block = block;
+        if(!q->ring) {
+            queue_delete(q);
+            return NULL;
+        }
+    }
+    return q;
+}
+
 /**
  * Delete queue structure.
  * @param   q       Queue structure.
  */
 void queue_delete(Queue *q) {
     if(q) {
+        ring_delete(q->ring);
         while(q->size > 0) {
             Request* removed = queue_pop(q);
             request_delete(removed);
@@ -33,12 +72,32 @@ void queue_delete(Queue *q) {
     }
 }
 
+/**
+ * Signal the specified eventfd whenever requests are pushed to queue (so an
+ * event loop can wait for them along with its sockets).
+ * @param   q       Queue structure.
+ * @param   event   Eventfd to signal (-1 to stop signalling).
+ */
+void queue_notify(Queue *q, int event) {
+    __atomic_store_n(&q->event, event, __ATOMIC_RELEASE);
+}
+
 /**
  * Push request to the back of queue.
  * @param   q       Queue structure.
  * @param   r       Request structure.
+ * @return  Whether or not the request was pushed (false if bounded queue is
+ * full and does not block).
  */
-void queue_push(Queue *q, Request *r) {
+bool queue_push(Queue *q, Request *r) {
+    if(q->ring) {
+        if(!ring_push(q->ring, r, q->block)) {
+            return false;
+        }
+        queue_signal(q);
+        return true;
+    }
+    r->next = NULL;
     // Grab the lock 
     mutex_lock(&q->lock);
     
@@ -55,6 +114,80 @@ void queue_push(Queue *q, Request *r) {
     cond_signal(&q->cv);
     // Unlock
     mutex_unlock(&q->lock);
+    queue_signal(q);
+    return true;
+}
+
+/**
+ * Push request to the back of queue without ever waiting (even if bounded
+ * queue blocks when full).
+ * @param   q       Queue structure.
+ * @param   r       Request structure.
+ * @return  Whether or not the request was pushed (false if bounded queue is
+ * full).
+ */
+bool queue_offer(Queue *q, Request *r) {
+    if(q->ring) {
+        if(!ring_push(q->ring, r, false)) {
+            return false;
+        }
+        queue_signal(q);
+        return true;
+    }
+    return queue_push(q, r);
+}
+
+/**
+ * Push several requests to the back of queue (taking the lock only once).
+ * @param   q       Queue structure.
+ * @param   rs      Array of Request structures.
+ * @param   n       Number of requests.
+ * @return  Number of requests pushed (fewer than n only if bounded queue is
+ * full and does not block).
+ */
+size_t queue_push_many(Queue *q, Request **rs, size_t n) {
+    if(q->ring) {
+        size_t pushed = 0;
+        while(pushed < n) {
+            if(!ring_push(q->ring, rs[pushed], false)) {
+                // Signal what was pushed so far before waiting for room
+                if(pushed) {
+                    queue_signal(q);
+                }
+                if(!q->block || !ring_push(q->ring, rs[pushed], true)) {
+                    break;
+                }
+            }
+            pushed++;
+        }
+        if(pushed) {
+            queue_signal(q);
+        }
+        return pushed;
+    }
+    if(!n) {
+        return 0;
+    }
+    // Link the requests together first
+    for(size_t i = 0; i + 1 < n; i++) {
+        rs[i]->next = rs[i + 1];
+    }
+    rs[n - 1]->next = NULL;
+
+    mutex_lock(&q->lock);
+    if(!q->head) {
+        q->head = rs[0];
+    }
+    else {
+        q->tail->next = rs[0];
+    }
+    q->tail  = rs[n - 1];
+    q->size += n;
+    // Wake every sleeping pop thread, since there may be work for all of them
+    PTHREAD_CHECK(pthread_cond_broadcast(&q->cv));
+    mutex_unlock(&q->lock);
+    queue_signal(q);
+    return n;
 }
 
 /**
@@ -63,6 +196,9 @@ void queue_push(Queue *q, Request *r) {
  * @return  Request structure.
  */
 Request * queue_pop(Queue *q) {
+    if(q->ring) {
+        return ring_pop(q->ring, -1);
+    }
     mutex_lock(&q->lock);
     while(q->size == 0) {
         cond_wait(&q->cv, &q->lock);
@@ -77,4 +213,115 @@ Request * queue_pop(Queue *q) {
 
     mutex_unlock(&q->lock);
     return popped;
-}
\ No newline at end of file
+}
+
+/**
+ * Pop up to n requests from the front of queue by doing the following:
+ *
+ *  1. Block until there is at least one request (or timeout seconds pass).
+ *
+ *  2. Wait up to linger seconds (measured from when the first request was
+ *  available) for the queue to hold n requests.
+ *
+ *  3. Pop as many requests as are available (at most n).
+ *
+ * @param   q       Queue structure.
+ * @param   rs      Array to store Request structures in.
+ * @param   n       Maximum number of requests to pop.
+ * @param   timeout Seconds to wait for the first request (negative to block,
+ *                  0 to not wait).
+ * @param   linger  Seconds to wait for more requests (0 to not wait).
+ * @return  Number of requests popped (0 if the timeout passed).
+ */
+size_t queue_pop_many(Queue *q, Request **rs, size_t n, double timeout, double linger) {
+    if(q->ring) {
+        return queue_pop_ring(q, rs, n, timeout, linger);
+    }
+    struct timespec deadline;
+    mutex_lock(&q->lock);
+    if(timeout < 0) {
+        while(q->size == 0) {
+            cond_wait(&q->cv, &q->lock);
+        }
+    }
+    else if(timeout > 0) {
+        queue_deadline(&deadline, timeout);
+        while(q->size == 0 && cond_timedwait(&q->cv, &q->lock, &deadline) != ETIMEDOUT) {}
+    }
+    if(q->size && linger > 0 && q->size < n) {
+        queue_deadline(&deadline, linger);
+        while(q->size < n && cond_timedwait(&q->cv, &q->lock, &deadline) != ETIMEDOUT) {}
+    }
+
+    size_t popped = 0;
+    while(popped < n && q->head) {
+        rs[popped++] = q->head;
+        q->head      = q->head->next;
+        q->size--;
+    }
+    if(!q->head) {
+        q->tail = NULL;
+    }
+    mutex_unlock(&q->lock);
+    return popped;
+}
+
+/* Internal Functions */
+
+/**
+ * Signal the eventfd of queue (if any) that requests were pushed.
+ * @param   q       Queue structure.
+ */
+void queue_signal(Queue *q) {
+    int event = __atomic_load_n(&q->event, __ATOMIC_ACQUIRE);
+    if(event >= 0) {
+        eventfd_write(event, 1);
+    }
+}
+
+/**
+ * Compute absolute deadline (for cond_timedwait) the specified number of
+ * seconds from now.
+ * @param   deadline    Where to store the deadline.
+ * @param   seconds     Seconds from now.
+ */
+void queue_deadline(struct timespec *deadline, double seconds) {
+    clock_gettime(CLOCK_REALTIME, deadline);
+    deadline->tv_sec  += (time_t)seconds;
+    deadline->tv_nsec += (long)((seconds - (time_t)seconds) * 1e9);
+    if(deadline->tv_nsec >= 1000000000) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000;
+    }
+}
+
+/**
+ * Pop up to n requests from the ring of bounded queue (see queue_pop_many).
+ * @param   q       Queue structure.
+ * @param   rs      Array to store Request structures in.
+ * @param   n       Maximum number of requests to pop.
+ * @param   timeout Seconds to wait for the first request (negative to block).
+ * @param   linger  Seconds to wait for more requests (0 to not wait).
+ * @return  Number of requests popped (0 if the timeout passed).
+ */
+size_t queue_pop_ring(Queue *q, Request **rs, size_t n, double timeout, double linger) {
+    if(!n || !(rs[0] = ring_pop(q->ring, timeout))) {
+        return 0;
+    }
+
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t popped = 1;
+    while(popped < n) {
+        double remaining = 0;
+        if(linger > 0) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            remaining = linger - (now.tv_sec - start.tv_sec) - (now.tv_nsec - start.tv_nsec) / 1e9;
+        }
+        if(!(rs[popped] = ring_pop(q->ring, remaining > 0 ? remaining : 0))) {
+            break;
+        }
+        popped++;
+    }
+    return popped;
+}
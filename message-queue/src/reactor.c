@@ -0,0 +1,862 @@
+/* reactor.c: Shared event loop for Message Queue clients
+ *
+ * Rather than running a pusher and a puller thread per Message Queue, a
+ * reactor serves every queue attached to it from one thread with epoll.  Each
+ * queue gets two channels with a non-blocking connection each:
+ *
+ *  - The pusher channel is woken through an eventfd whenever the outgoing
+ *  queue is pushed to, and keeps up to a batch of requests pipelined, each
+ *  until it is answered (so it can be sent again after reconnecting).
+ *
+ *  - The puller channel keeps MQ_WINDOW long-poll GETs outstanding and
+ *  delivers each message it receives (see mq_deliver).
+ *
+ * Reconnecting and backing off are timers on the loop, so an idle queue costs
+ * two sockets and an eventfd, but no threads and no wakeups.  Processes with
+ * many busy queues can spread them over a few reactors.
+ *
+ * Note, connections are still opened with a blocking connect (they are long
+ * lived, so this only stalls the loop while a server is being reached).
+ **/
+
+#include "mq/client.h"
+#include "mq/logging.h"
+#include "mq/reactor.h"
+#include "mq/string.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Internal Prototypes */
+
+void *	    reactor_loop(void *arg);
+void	    reactor_wake(Reactor *r);
+double	    reactor_now();
+int	    reactor_timeout(Reactor *r);
+void	    reactor_expire(Reactor *r);
+void	    reactor_reap(Reactor *r);
+
+Channel *   channel_create(Reactor *r, MessageQueue *mq, bool pusher);
+void	    channel_delete(Channel *ch);
+void	    channel_detach(Channel *ch);
+bool	    channel_connect(Channel *ch);
+void	    channel_disconnect(Channel *ch);
+void	    channel_ready(Channel *ch, uint32_t events);
+void	    channel_signal(Channel *ch);
+void	    channel_drain(Channel *ch);
+void	    channel_answered(Channel *ch);
+bool	    channel_feed(Channel *ch);
+void	    channel_parse(Channel *ch);
+void	    channel_poll(Channel *ch);
+void	    channel_timer(Channel *ch);
+bool	    channel_append(Channel *ch, Request *r);
+bool	    channel_flush(Channel *ch);
+void	    channel_watch(Channel *ch);
+void	    channel_schedule(Channel *ch, double seconds);
+void	    channel_unschedule(Channel *ch);
+void	    channel_backoff(Channel *ch);
+void	    channel_settle(Channel *ch);
+
+/* Functions */
+
+/**
+ * Create reactor and start its event loop thread.
+ * @return  Newly allocated Reactor structure (NULL on failure).
+ */
+Reactor * reactor_create() {
+    Reactor *r = calloc(1, sizeof(Reactor));
+    if(!r) {
+        return NULL;
+    }
+
+    r->epoll = epoll_create1(EPOLL_CLOEXEC);
+    r->wake  = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};
+    if(r->epoll < 0 || r->wake < 0 || epoll_ctl(r->epoll, EPOLL_CTL_ADD, r->wake, &event) < 0) {
+        error("Unable to create reactor: %s", strerror(errno));
+        if(r->epoll >= 0) {
+            close(r->epoll);
+        }
+        if(r->wake >= 0) {
+            close(r->wake);
+        }
+        free(r);
+        return NULL;
+    }
+    mutex_init(&r->lock, NULL);
+    cond_init(&r->drained, NULL);
+    thread_create(&r->thread, NULL, reactor_loop, r);
+    return r;
+}
+
+/**
+ * Stop event loop and delete reactor (queues should be stopped first, since
+ * any still attached are abandoned).
+ * @param   r       Reactor structure.
+ */
+void reactor_delete(Reactor *r) {
+    if(!r) {
+        return;
+    }
+    mutex_lock(&r->lock);
+    r->stopped = true;
+    mutex_unlock(&r->lock);
+    reactor_wake(r);
+    thread_join(r->thread, NULL);
+
+    while(r->channels) {
+        channel_detach(r->channels);
+    }
+    reactor_reap(r);
+    close(r->wake);
+    close(r->epoll);
+    free(r);
+}
+
+/**
+ * Attach message queue to reactor, which then sends its outgoing requests and
+ * polls for its incoming messages (instead of threads of its own).
+ * @param   r       Reactor structure.
+ * @param   mq      Message Queue structure.
+ * @return  Whether or not the queue was attached.
+ */
+bool reactor_add(Reactor *r, MessageQueue *mq) {
+    Channel *pusher = channel_create(r, mq, true);
+    Channel *puller = channel_create(r, mq, false);
+    if(!pusher || !puller) {
+        channel_delete(pusher);
+        channel_delete(puller);
+        return false;
+    }
+
+    mutex_lock(&r->lock);
+    pusher->signal.channel = pusher;
+    pusher->signal.queue   = true;
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = &pusher->signal};
+    if(epoll_ctl(r->epoll, EPOLL_CTL_ADD, pusher->event, &event) < 0) {
+        error("Unable to watch outgoing queue: %s", strerror(errno));
+        mutex_unlock(&r->lock);
+        channel_delete(pusher);
+        channel_delete(puller);
+        return false;
+    }
+    pusher->next = puller;
+    puller->next = r->channels;
+    r->channels  = pusher;
+    // Send whatever was queued before, and start polling right away
+    queue_notify(mq->outgoing, pusher->event);
+    eventfd_write(pusher->event, 1);
+    channel_schedule(puller, 0);
+    mutex_unlock(&r->lock);
+    reactor_wake(r);
+    return true;
+}
+
+/**
+ * Detach message queue from reactor by doing the following:
+ *
+ *  1. Wait until the pusher channel sent everything queued so far and got
+ *  the responses (or cannot reach the server).
+ *
+ *  2. Close both channels (abandoning the long-polls of the puller).
+ *
+ * @param   r       Reactor structure.
+ * @param   mq      Message Queue structure.
+ */
+void reactor_remove(Reactor *r, MessageQueue *mq) {
+    mutex_lock(&r->lock);
+    for(Channel *ch = r->channels; ch; ch = ch->next) {
+        if(ch->mq == mq && ch->pusher) {
+            ch->closing = true;
+            eventfd_write(ch->event, 1);
+            while(!ch->drained && !r->stopped) {
+                cond_wait(&r->drained, &r->lock);
+            }
+            break;
+        }
+    }
+    Channel **link = &r->channels;
+    while(*link) {
+        if((*link)->mq == mq) {
+            channel_detach(*link);
+        }
+        else {
+            link = &(*link)->next;
+        }
+    }
+    mutex_unlock(&r->lock);
+    reactor_wake(r);
+}
+
+/* Internal Functions */
+
+/**
+ * Event loop handles the events of every channel by doing the following:
+ *
+ *  1. Delete channels removed since the last round, and wait for events until
+ *  the earliest timer is due.
+ *
+ *  2. Handle each event (skipping channels removed while waiting).
+ *
+ *  3. Run the channels whose timers are due.
+ *
+ * The reactor is locked except while waiting.
+ **/
+void * reactor_loop(void *arg) {
+    Reactor *r = (Reactor *)arg;
+    struct epoll_event events[REACTOR_EVENTS];
+
+    mutex_lock(&r->lock);
+    while(!r->stopped) {
+        reactor_reap(r);
+        int timeout = reactor_timeout(r);
+        mutex_unlock(&r->lock);
+        int n = epoll_wait(r->epoll, events, REACTOR_EVENTS, timeout);
+        mutex_lock(&r->lock);
+        if(n < 0 && errno != EINTR) {
+            error("Unable to wait for events: %s", strerror(errno));
+            break;
+        }
+
+        for(int i = 0; i < n; i++) {
+            Watch *w = (Watch *)events[i].data.ptr;
+            if(!w) {
+                eventfd_t value;
+                eventfd_read(r->wake, &value);
+            }
+            else if(!w->channel->dead) {
+                if(w->queue) {
+                    channel_signal(w->channel);
+                }
+                else {
+                    channel_ready(w->channel, events[i].events);
+                }
+            }
+        }
+        reactor_expire(r);
+    }
+    // Let anyone waiting in reactor_remove go
+    r->stopped = true;
+    PTHREAD_CHECK(pthread_cond_broadcast(&r->drained));
+    mutex_unlock(&r->lock);
+    return NULL;
+}
+
+/**
+ * Wake event loop (so it notices new channels and timers).
+ * @param   r       Reactor structure.
+ */
+void reactor_wake(Reactor *r) {
+    eventfd_write(r->wake, 1);
+}
+
+/**
+ * Return current time.
+ * @return  Seconds on monotonic clock.
+ */
+double reactor_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/**
+ * Compute how long the event loop may wait for events.
+ * @param   r       Reactor structure.
+ * @return  Milliseconds until earliest timer is due (-1 if there are none).
+ */
+int reactor_timeout(Reactor *r) {
+    if(!r->timers) {
+        return -1;
+    }
+    double earliest = r->timers->wakeup;
+    for(Channel *ch = r->timers->next_timer; ch; ch = ch->next_timer) {
+        earliest = ch->wakeup < earliest ? ch->wakeup : earliest;
+    }
+    double remaining = earliest - reactor_now();
+    return remaining > 0 ? (int)(remaining * 1000) + 1 : 0;
+}
+
+/**
+ * Run the channels whose timers are due (taking them off the list of timers
+ * first, since running them may schedule them again).
+ * @param   r       Reactor structure.
+ */
+void reactor_expire(Reactor *r) {
+    double   now     = reactor_now();
+    Channel *expired = NULL;
+    Channel **link   = &r->timers;
+    while(*link) {
+        Channel *ch = *link;
+        if(ch->wakeup <= now) {
+            *link          = ch->next_timer;
+            ch->timed      = false;
+            ch->next_timer = expired;
+            expired        = ch;
+        }
+        else {
+            link = &ch->next_timer;
+        }
+    }
+    while(expired) {
+        Channel *ch = expired;
+        expired = ch->next_timer;
+        channel_timer(ch);
+    }
+}
+
+/**
+ * Delete channels removed from reactor (only between rounds of events, so no
+ * event returned by epoll_wait refers to a deleted channel).
+ * @param   r       Reactor structure.
+ */
+void reactor_reap(Reactor *r) {
+    while(r->removed) {
+        Channel *ch = r->removed;
+        r->removed = ch->next;
+        channel_delete(ch);
+    }
+}
+
+/**
+ * Create channel for message queue (not attached to reactor yet).
+ * @param   r       Reactor structure.
+ * @param   mq      Message Queue structure.
+ * @param   pusher  Whether channel sends outgoing requests (otherwise it polls).
+ * @return  Newly allocated Channel structure (NULL on failure).
+ */
+Channel * channel_create(Reactor *r, MessageQueue *mq, bool pusher) {
+    Channel *ch = calloc(1, sizeof(Channel));
+    if(!ch) {
+        return NULL;
+    }
+    ch->mq             = mq;
+    ch->reactor        = r;
+    ch->pusher         = pusher;
+    ch->socket.channel = ch;
+    ch->event          = -1;
+    if(pusher) {
+        ch->event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if(ch->event < 0) {
+            free(ch);
+            return NULL;
+        }
+    }
+    else {
+        char uri[BUFSIZ] = "/queue/";
+        strcat(uri, mq->name);
+        ch->get = request_create("GET", uri, NULL);
+        if(!ch->get) {
+            free(ch);
+            return NULL;
+        }
+    }
+    return ch;
+}
+
+/**
+ * Delete channel (closing its connection and deleting any requests it holds).
+ * @param   ch      Channel structure.
+ */
+void channel_delete(Channel *ch) {
+    if(!ch) {
+        return;
+    }
+    connection_close(ch->c);
+    if(ch->event >= 0) {
+        close(ch->event);
+    }
+    while(ch->head) {
+        Request *r = ch->head;
+        ch->head = r->next;
+        request_delete(r);
+    }
+    request_delete(ch->pending);
+    request_delete(ch->get);
+    free(ch->output);
+    free(ch);
+}
+
+/**
+ * Take channel off the reactor (it is deleted once the current round of
+ * events is handled, see reactor_reap).
+ * @param   ch      Channel structure.
+ */
+void channel_detach(Channel *ch) {
+    Reactor *r = ch->reactor;
+    for(Channel **link = &r->channels; *link; link = &(*link)->next) {
+        if(*link == ch) {
+            *link = ch->next;
+            break;
+        }
+    }
+    channel_unschedule(ch);
+    if(ch->c) {
+        epoll_ctl(r->epoll, EPOLL_CTL_DEL, ch->c->fd, NULL);
+    }
+    if(ch->pusher) {
+        queue_notify(ch->mq->outgoing, -1);
+        epoll_ctl(r->epoll, EPOLL_CTL_DEL, ch->event, NULL);
+    }
+    ch->dead   = true;
+    ch->next   = r->removed;
+    r->removed = ch;
+}
+
+/**
+ * Open non-blocking connection for channel and send what it has to send (the
+ * unanswered requests of a pusher, or the long-polls of a puller).
+ * @param   ch      Channel structure.
+ * @return  Whether or not the connection was opened.
+ */
+bool channel_connect(Channel *ch) {
+    Connection *c = pool_acquire(ch->mq->pool);
+    int flags = c ? fcntl(c->fd, F_GETFL) : -1;
+    if(flags < 0 || fcntl(c->fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        connection_close(c);
+        if(ch->pusher && ch->closing) {
+            // Nobody will send what is left, so let mq_stop go
+            channel_settle(ch);
+        }
+        else {
+            channel_backoff(ch);
+        }
+        return false;
+    }
+
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = &ch->socket};
+    if(epoll_ctl(ch->reactor->epoll, EPOLL_CTL_ADD, c->fd, &event) < 0) {
+        error("Unable to watch connection: %s", strerror(errno));
+        connection_close(c);
+        channel_backoff(ch);
+        return false;
+    }
+    ch->c        = c;
+    ch->events   = EPOLLIN;
+    ch->fresh    = !c->reused;
+    ch->progress = false;
+    ch->length   = 0;
+    ch->sent     = 0;
+    c->reused    = true;
+
+    if(ch->pusher) {
+        ch->unsent = ch->head;
+        return channel_feed(ch);
+    }
+    ch->outstanding = 0;
+    channel_poll(ch);
+    return ch->c != NULL;
+}
+
+/**
+ * Close connection of channel and arrange to reconnect: right away if it made
+ * progress (or may just have gone stale in the pool), and otherwise after
+ * backing off.  A pusher gives up on its first request once it went
+ * unanswered on REACTOR_RETRIES fresh connections in a row, since the server
+ * will apparently not take it.
+ * @param   ch      Channel structure.
+ */
+void channel_disconnect(Channel *ch) {
+    epoll_ctl(ch->reactor->epoll, EPOLL_CTL_DEL, ch->c->fd, NULL);
+    connection_close(ch->c);
+    ch->c      = NULL;
+    ch->events = 0;
+    ch->length = 0;
+    ch->sent   = 0;
+
+    if(ch->pusher) {
+        ch->unsent = ch->head;
+        if(ch->head && !ch->progress && ch->fresh && ++ch->failures >= REACTOR_RETRIES) {
+            error("Giving up on %s %s", ch->head->method, ch->head->uri);
+            channel_answered(ch);
+            ch->failures = 0;
+        }
+    }
+    ch->outstanding = 0;
+    if(ch->progress || !ch->fresh) {
+        ch->backoff = 0;
+        channel_schedule(ch, 0);
+    }
+    else {
+        channel_backoff(ch);
+    }
+}
+
+/**
+ * Handle events of the connection of channel.
+ * @param   ch      Channel structure.
+ * @param   events  Events reported by epoll.
+ */
+void channel_ready(Channel *ch, uint32_t events) {
+    if(!ch->c) {
+        return;
+    }
+    if(events & EPOLLERR) {
+        channel_disconnect(ch);
+        return;
+    }
+    if((events & EPOLLOUT) && !channel_flush(ch)) {
+        return;
+    }
+    if(events & (EPOLLIN | EPOLLHUP)) {
+        if(ch->pending) {
+            // Nothing more can be read until the incoming queue has room
+            channel_disconnect(ch);
+            return;
+        }
+        ssize_t received = connection_fill(ch->c);
+        if(received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if(received <= 0) {
+            channel_disconnect(ch);
+            return;
+        }
+        channel_parse(ch);
+    }
+}
+
+/**
+ * Handle signal of outgoing queue of pusher channel (see channel_drain).
+ * @param   ch      Channel structure.
+ */
+void channel_signal(Channel *ch) {
+    eventfd_t value;
+    eventfd_read(ch->event, &value);
+    channel_drain(ch);
+}
+
+/**
+ * Take requests from the outgoing queue of pusher channel (while fewer than a
+ * batch are unanswered) and send them, connecting first if necessary, or let
+ * mq_stop go if channel is closing and has nothing left.
+ * @param   ch      Channel structure.
+ */
+void channel_drain(Channel *ch) {
+    Request *rs[MQ_BATCH];
+    while(ch->taken < ch->mq->batch) {
+        size_t room = ch->mq->batch - ch->taken;
+        size_t n    = queue_pop_many(ch->mq->outgoing, rs, room < MQ_BATCH ? room : MQ_BATCH, 0, 0);
+        if(!n) {
+            break;
+        }
+        for(size_t i = 0; i < n; i++) {
+            rs[i]->next = NULL;
+            if(ch->tail) {
+                ch->tail->next = rs[i];
+            }
+            else {
+                ch->head = rs[i];
+            }
+            ch->tail = rs[i];
+            if(!ch->unsent) {
+                ch->unsent = rs[i];
+            }
+        }
+        ch->taken += n;
+    }
+
+    if(ch->head) {
+        if(ch->c) {
+            channel_feed(ch);
+        }
+        else if(!ch->timed) {
+            channel_connect(ch);
+        }
+    }
+    else if(ch->closing) {
+        channel_settle(ch);
+    }
+}
+
+/**
+ * Delete first request taken by pusher channel (once it is answered).
+ * @param   ch      Channel structure.
+ */
+void channel_answered(Channel *ch) {
+    Request *r = ch->head;
+    if(!r) {
+        return;
+    }
+    ch->head = r->next;
+    if(!ch->head) {
+        ch->tail = NULL;
+    }
+    if(ch->unsent == r) {
+        ch->unsent = r->next;
+    }
+    ch->taken--;
+    request_delete(r);
+}
+
+/**
+ * Send the requests taken by pusher channel that were not sent on its
+ * connection yet.
+ * @param   ch      Channel structure.
+ * @return  Whether or not the connection is still open.
+ */
+bool channel_feed(Channel *ch) {
+    for(; ch->unsent; ch->unsent = ch->unsent->next) {
+        if(!channel_append(ch, ch->unsent)) {
+            channel_disconnect(ch);
+            return false;
+        }
+    }
+    return channel_flush(ch);
+}
+
+/**
+ * Handle every whole response received on the connection of channel: a
+ * pusher deletes the request it answers (and takes more), while a puller moves the message
+ * into the incoming queue (holding it back if the queue is full) and sends
+ * another long-poll, or backs off after an empty one.
+ * @param   ch      Channel structure.
+ */
+void channel_parse(Channel *ch) {
+    bool answered = false;
+    while(ch->c && !ch->pending) {
+        char * body   = NULL;
+        size_t length = 0;
+        int    status = connection_parse(ch->c, ch->pusher ? NULL : &body, &length);
+        if(status == CONNECTION_PARTIAL) {
+            break;
+        }
+        if(status < 0) {
+            channel_disconnect(ch);
+            break;
+        }
+        ch->progress = true;
+
+        if(ch->pusher) {
+            channel_answered(ch);
+            ch->failures = 0;
+            answered     = true;
+        }
+        else {
+            ch->outstanding -= ch->outstanding ? 1 : 0;
+            if(status == 200) {
+                Request *r = request_adopt(body, length);
+                if(r && !request_topic(r)) {
+                    error("Dropping message for %s: unable to decode frame", ch->mq->name);
+                    request_delete(r);
+                    r = NULL;
+                }
+                if(r && !mq_deliver(ch->mq, r, false)) {
+                    ch->pending = r;
+                    channel_watch(ch);
+                    channel_schedule(ch, 0.001);
+                }
+                ch->backoff = 0;
+                if(ch->timed && !ch->pending) {
+                    channel_unschedule(ch);
+                }
+                channel_poll(ch);
+            }
+            else {
+                free(body);
+                channel_backoff(ch);
+            }
+        }
+
+        // Requests after a Connection: close will never be answered
+        if(ch->c && !ch->c->alive) {
+            channel_disconnect(ch);
+        }
+    }
+    // Answered requests make room for more
+    if(answered) {
+        channel_drain(ch);
+    }
+}
+
+/**
+ * Send long-polls (up to MQ_WINDOW) on the connection of puller channel,
+ * unless it is backing off or holding a message back.
+ * @param   ch      Channel structure.
+ */
+void channel_poll(Channel *ch) {
+    if(!ch->c || ch->pending || ch->timed) {
+        return;
+    }
+    while(ch->outstanding < MQ_WINDOW) {
+        if(!channel_append(ch, ch->get)) {
+            channel_disconnect(ch);
+            return;
+        }
+        ch->outstanding++;
+    }
+    channel_flush(ch);
+}
+
+/**
+ * Run channel whose timer is due: a pusher reconnects if it has requests to
+ * send, while a puller retries moving a held back message into the incoming
+ * queue, reconnects, or sends the long-polls held back while backing off.
+ * @param   ch      Channel structure.
+ */
+void channel_timer(Channel *ch) {
+    if(ch->pusher) {
+        if(!ch->c) {
+            channel_drain(ch);
+        }
+        return;
+    }
+    if(ch->pending) {
+        if(!mq_deliver(ch->mq, ch->pending, false)) {
+            channel_schedule(ch, 0.001);
+            return;
+        }
+        ch->pending = NULL;
+        if(ch->c) {
+            channel_watch(ch);
+            channel_parse(ch);
+        }
+    }
+    if(!ch->c) {
+        channel_connect(ch);
+    }
+    else {
+        channel_poll(ch);
+    }
+}
+
+/**
+ * Format request (header and body) at the end of the output buffer of
+ * channel (growing it as necessary).
+ * @param   ch      Channel structure.
+ * @param   r       Request structure.
+ * @return  Whether or not the request was added.
+ */
+bool channel_append(Channel *ch, Request *r) {
+    const char *host = ch->mq->pool->host;
+    size_t      length;
+    while(!(length = request_header(r, host, ch->output + ch->length, ch->capacity - ch->length)) ||
+          ch->length + length + r->length > ch->capacity) {
+        size_t capacity = ch->capacity ? 2 * ch->capacity : CONNECTION_BUFFER;
+        char * grown    = realloc(ch->output, capacity);
+        if(!grown) {
+            error("Unable to buffer request for %s: %s", r->uri, strerror(errno));
+            return false;
+        }
+        ch->output   = grown;
+        ch->capacity = capacity;
+    }
+    ch->length += length;
+    if(r->body && r->length) {
+        memcpy(ch->output + ch->length, r->body, r->length);
+        ch->length += r->length;
+    }
+    return true;
+}
+
+/**
+ * Send as much of the output buffer of channel as the socket takes (watching
+ * for it to become writable again if it does not take everything).
+ * @param   ch      Channel structure.
+ * @return  Whether or not the connection is still open.
+ */
+bool channel_flush(Channel *ch) {
+    while(ch->sent < ch->length) {
+        // Fail with EPIPE rather than raising SIGPIPE if the server hung up
+        ssize_t sent = send(ch->c->fd, ch->output + ch->sent, ch->length - ch->sent, MSG_NOSIGNAL);
+        if(sent < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            channel_disconnect(ch);
+            return false;
+        }
+        ch->sent += sent;
+    }
+    if(ch->sent == ch->length) {
+        ch->sent   = 0;
+        ch->length = 0;
+    }
+    else if(ch->sent) {
+        memmove(ch->output, ch->output + ch->sent, ch->length - ch->sent);
+        ch->length -= ch->sent;
+        ch->sent    = 0;
+    }
+    channel_watch(ch);
+    return true;
+}
+
+/**
+ * Register the events channel currently needs with epoll: readable unless a
+ * message is held back, and writable while output is waiting.
+ * @param   ch      Channel structure.
+ */
+void channel_watch(Channel *ch) {
+    if(!ch->c) {
+        return;
+    }
+    uint32_t events = (ch->pending ? 0 : EPOLLIN) | (ch->length > ch->sent ? EPOLLOUT : 0);
+    if(events != ch->events) {
+        struct epoll_event event = {.events = events, .data.ptr = &ch->socket};
+        epoll_ctl(ch->reactor->epoll, EPOLL_CTL_MOD, ch->c->fd, &event);
+        ch->events = events;
+    }
+}
+
+/**
+ * Run channel (see channel_timer) once the specified time passed (keeping any
+ * earlier timer it already has).
+ * @param   ch      Channel structure.
+ * @param   seconds Seconds from now.
+ */
+void channel_schedule(Channel *ch, double seconds) {
+    double wakeup = reactor_now() + seconds;
+    if(!ch->timed) {
+        ch->timed               = true;
+        ch->wakeup              = wakeup;
+        ch->next_timer          = ch->reactor->timers;
+        ch->reactor->timers     = ch;
+    }
+    else if(wakeup < ch->wakeup) {
+        ch->wakeup = wakeup;
+    }
+}
+
+/**
+ * Cancel timer of channel (if any).
+ * @param   ch      Channel structure.
+ */
+void channel_unschedule(Channel *ch) {
+    if(!ch->timed) {
+        return;
+    }
+    for(Channel **link = &ch->reactor->timers; *link; link = &(*link)->next_timer) {
+        if(*link == ch) {
+            *link = ch->next_timer;
+            break;
+        }
+    }
+    ch->timed = false;
+}
+
+/**
+ * Retry channel after backing off (doubling the wait up to MQ_BACKOFF seconds).
+ * @param   ch      Channel structure.
+ */
+void channel_backoff(Channel *ch) {
+    ch->backoff = ch->backoff ? 2 * ch->backoff : 0.001;
+    ch->backoff = ch->backoff < MQ_BACKOFF ? ch->backoff : MQ_BACKOFF;
+    channel_schedule(ch, ch->backoff);
+}
+
+/**
+ * Mark closing pusher channel as drained and wake reactor_remove.
+ * @param   ch      Channel structure.
+ */
+void channel_settle(Channel *ch) {
+    ch->drained = true;
+    PTHREAD_CHECK(pthread_cond_broadcast(&ch->reactor->drained));
+}
@@ -1,10 +1,60 @@
-/* request.c: Request structure */
+/* request.c: Request structure
+ *
+ * The strings of a Request are slices of one buffer, with the body first so
+ * that the buffer itself can be handed to the application as the message.
+ * Deleted Requests (and their buffers, if small) are kept in a pool and
+ * reused, so steady traffic does not allocate at all.
+ *
+ * Text frames carry the topic of a published body in front of it (only if
+ * the publisher asks for them, see mq_framing):
+ *
+ *  \036$TOPIC\036$BODY
+ *
+ * which request_topic strips again on the receiving side (bodies without the
+ * frame are delivered as they are, with no topic).
+ *
+ * Binary frames carry arbitrary payloads (including NULs) behind a fixed
+ * header in network byte order:
+ *
+ *  0   u8	REQUEST_BINARY
+ *  1   u8	Flags (REQUEST_LZ4)
+ *  2   u16	Length of topic
+ *  4   u32	Length of payload (once decompressed)
+ *  8   u64	Sequence number
+ *  16		$TOPIC$PAYLOAD
+ *
+ * Text bodies never start with a NUL, so receivers tell the two apart by the
+ * first byte and understand both.  With HAVE_LZ4, payloads above a threshold
+ * are compressed (when that makes them smaller).
+ **/
+
+#define _GNU_SOURCE	/* For mempcpy */
 
 #include "mq/request.h"
+#include "mq/thread.h"
 
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+/* Global Variables */
+
+Request *   RequestPool	    = NULL;	// Unused Requests
+size_t	    RequestPoolSize = 0;	// Number of unused Requests
+Mutex	    RequestPoolLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Internal Prototypes */
+
+Request *   request_allocate(size_t capacity);
+bool	    request_unframe(Request *r);
+void	    request_put(unsigned char *p, uint64_t value, size_t size);
+uint64_t    request_get(const unsigned char *p, size_t size);
+
+/* Functions */
+
 /**
  * Create Request structure.
  * @param   method      Request method string.
@@ -13,61 +63,420 @@
  * @return  Newly allocated Request structure.
  */
 Request * request_create(const char *method, const char *uri, const char *body) {
-    Request* new_request = calloc(1, sizeof(Request));
-
-    if(!new_request || !method || !uri) {
+    if(!method || !uri) {
         return NULL;
     }
-    new_request->method = strdup(method);
-    new_request->uri = strdup(uri);
+    size_t method_length = strlen(method) + 1;
+    size_t uri_length    = strlen(uri) + 1;
+    size_t body_length   = body ? strlen(body) + 1 : 0;
 
+    Request* new_request = request_allocate(body_length + method_length + uri_length);
+    if(!new_request) {
+        return NULL;
+    }
+    // Copy each string into the buffer
+    char *slice = new_request->buffer;
     if(body) {
-        new_request->body = strdup(body);
+        new_request->body   = memcpy(slice, body, body_length);
+        new_request->length = body_length - 1;
+        slice += body_length;
     }
+    new_request->method = memcpy(slice, method, method_length);
+    slice += method_length;
+    new_request->uri    = memcpy(slice, uri, uri_length);
+    return new_request;
+}
+
+/**
+ * Create Request publishing body to topic (with the topic framed in front of
+ * the body if requested, see request_topic).
+ * @param   topic       Topic to publish to.
+ * @param   body        Message body to publish.
+ * @param   framed      Whether or not to frame the topic in front of the body.
+ * @return  Newly allocated Request structure.
+ */
+Request * request_publish(const char *topic, const char *body, bool framed) {
+    if(!topic || !body) {
+        return NULL;
+    }
+    size_t topic_length  = strlen(topic);
+    size_t body_length   = strlen(body);
+    size_t frame_length  = (framed ? 1 + topic_length + 1 : 0) + body_length + 1;
+    size_t uri_length    = sizeof("/topic/") - 1 + topic_length + 1;
 
+    Request* new_request = request_allocate(frame_length + sizeof("PUT") + uri_length);
+    if(!new_request) {
+        return NULL;
+    }
+    // Frame the topic in front of the body, then add the method and uri
+    char *slice = new_request->buffer;
+    new_request->body   = slice;
+    new_request->length = frame_length - 1;
+    if(framed) {
+        *slice++ = REQUEST_FRAME;
+        slice    = mempcpy(slice, topic, topic_length);
+        *slice++ = REQUEST_FRAME;
+    }
+    slice    = mempcpy(slice, body, body_length + 1);
+    new_request->method = memcpy(slice, "PUT", sizeof("PUT"));
+    slice += sizeof("PUT");
+    new_request->uri    = slice;
+    slice  = mempcpy(slice, "/topic/", sizeof("/topic/") - 1);
+    memcpy(slice, topic, topic_length + 1);
     return new_request;
 }
 
 /**
- * Delete Request structure.
+ * Create Request publishing binary payload to topic in a binary frame by
+ * doing the following:
+ *
+ *  1. Compress the payload into the frame if it is larger than compress bytes
+ *  (and compression makes it smaller).
+ *
+ *  2. Otherwise, copy the payload into the frame as it is.
+ *
+ *  3. Add the header in front of it, and the method and uri behind it.
+ *
+ * @param   topic       Topic to publish to (shorter than BUFSIZ).
+ * @param   data        Payload to publish.
+ * @param   length      Length of payload.
+ * @param   sequence    Sequence number of frame.
+ * @param   compress    Size above which payload is compressed (0 to never
+ *                      compress, ignored without HAVE_LZ4).
+ * @return  Newly allocated Request structure.
+ */
+Request * request_frame(const char *topic, const void *data, size_t length, uint64_t sequence, size_t compress) {
+    if(!topic || (!data && length)) {
+        return NULL;
+    }
+    size_t topic_length = strlen(topic);
+    size_t uri_length   = sizeof("/topic/") - 1 + topic_length + 1;
+    size_t room         = length;
+    if(topic_length >= BUFSIZ || length > UINT32_MAX) {
+        return NULL;
+    }
+#ifdef HAVE_LZ4
+    bool squeeze = compress && length > compress && length <= LZ4_MAX_INPUT_SIZE;
+    if(squeeze && (size_t)LZ4_compressBound(length) > room) {
+        room = LZ4_compressBound(length);
+    }
+#else
+    (void)compress;
+#endif
+
+    Request* new_request = request_allocate(REQUEST_HEADER + topic_length + room + sizeof("PUT") + uri_length);
+    if(!new_request) {
+        return NULL;
+    }
+    unsigned char *frame   = (unsigned char *)new_request->buffer;
+    char *         payload = new_request->buffer + REQUEST_HEADER + topic_length;
+    size_t         packed  = 0;
+    uint8_t        flags   = 0;
+#ifdef HAVE_LZ4
+    if(squeeze) {
+        int compressed = LZ4_compress_default(data, payload, length, room);
+        if(compressed > 0 && (size_t)compressed < length) {
+            packed = compressed;
+            flags |= REQUEST_LZ4;
+        }
+    }
+#endif
+    if(!(flags & REQUEST_LZ4)) {
+        packed = length;
+        if(length) {
+            memcpy(payload, data, length);
+        }
+    }
+
+    frame[0] = REQUEST_BINARY;
+    frame[1] = flags;
+    request_put(frame + 2, topic_length, 2);
+    request_put(frame + 4, length, 4);
+    request_put(frame + 8, sequence, 8);
+    memcpy(frame + REQUEST_HEADER, topic, topic_length);
+    new_request->body   = new_request->buffer;
+    new_request->length = REQUEST_HEADER + topic_length + packed;
+
+    char *slice = payload + packed;
+    new_request->method = memcpy(slice, "PUT", sizeof("PUT"));
+    slice += sizeof("PUT");
+    new_request->uri    = slice;
+    slice  = mempcpy(slice, "/topic/", sizeof("/topic/") - 1);
+    memcpy(slice, topic, topic_length + 1);
+    return new_request;
+}
+
+/**
+ * Create Request structure around received body (without copying it).
+ * @param   body        Newly allocated body string (now owned by Request).
+ * @param   length      Length of body.
+ * @return  Newly allocated Request structure (NULL, freeing body, on failure).
+ */
+Request * request_adopt(char *body, size_t length) {
+    Request* new_request = request_allocate(0);
+    if(!new_request) {
+        free(body);
+        return NULL;
+    }
+    new_request->body     = body;
+    new_request->length   = length;
+    new_request->buffer   = body;
+    new_request->capacity = length + 1;
+    return new_request;
+}
+
+/**
+ * Create Request that marks shutdown (it is never sent, and consumers stop
+ * when they take it from a queue rather than treating it as a message).
+ * @return  Newly allocated Request structure.
+ */
+Request * request_sentinel() {
+    Request* new_request = request_allocate(0);
+    if(new_request) {
+        new_request->sentinel = true;
+    }
+    return new_request;
+}
+
+/**
+ * Strip the topic framed in front of received body (if any) by doing the
+ * following:
+ *
+ *  1. Save the topic, then move the body to the front of the buffer (so it
+ *  can still be handed over as is).
+ *
+ *  2. Store the topic after the body, in the room the frame took up.
+ *
+ * Binary frames are decoded the same way (see request_unframe), while text
+ * topics of BUFSIZ or more bytes are not treated as frames.
+ * @param   r           Request structure (with the body starting the buffer).
+ * @return  Whether or not the body could be decoded (false for corrupt
+ * binary frames, or compressed ones without HAVE_LZ4).
+ */
+bool request_topic(Request *r) {
+    char *body = r->body;
+    if(body && r->length && body[0] == REQUEST_BINARY) {
+        return request_unframe(r);
+    }
+    char *end  = body && r->length > 1 && body[0] == REQUEST_FRAME ? memchr(body + 1, REQUEST_FRAME, r->length - 1) : NULL;
+    if(!end || end - body - 1 >= BUFSIZ) {
+        return true;
+    }
+    size_t topic_length = end - body - 1;
+    size_t body_length  = r->length - topic_length - 2;
+    char   topic[BUFSIZ];
+    memcpy(topic, body + 1, topic_length);
+    topic[topic_length] = 0;
+
+    memmove(body, end + 1, body_length);
+    body[body_length] = 0;
+    r->length = body_length;
+    r->topic  = memcpy(body + body_length + 1, topic, topic_length + 1);
+    return true;
+}
+
+/**
+ * Delete Request structure but hand its body over to the caller (rather
+ * than copying it).
+ * @param   r           Request structure.
+ * @return  Body string (must be freed, NULL if there was none).
+ */
+char * request_release(Request *r) {
+    char *body = r->body;
+    if(body) {
+        // The body starts the buffer, so the buffer goes with it
+        r->buffer   = NULL;
+        r->capacity = 0;
+    }
+    request_delete(r);
+    return body;
+}
+
+/**
+ * Delete Request structure (keeping it for reuse if the pool has room).
  * @param   r           Request structure.
  */
 void request_delete(Request *r) {
+    if(!r) {
+        return;
+    }
+    if(r->capacity > REQUEST_BUFFER_MAX) {
+        free(r->buffer);
+        r->buffer   = NULL;
+        r->capacity = 0;
+    }
+
+    mutex_lock(&RequestPoolLock);
+    if(RequestPoolSize < REQUEST_POOL_MAX) {
+        r->next     = RequestPool;
+        RequestPool = r;
+        RequestPoolSize++;
+        r = NULL;
+    }
+    mutex_unlock(&RequestPoolLock);
+
     if(r) {
-        if(r->method) {
-            free(r->method);
-        }
-        if(r->uri) {
-            free(r->uri);
-        }
-        if(r->body) {
-            free(r->body);
-        }
+        free(r->buffer);
         free(r);
     }
 }
 
 /**
- * Write HTTP Request to stream:
+ * Format header of HTTP Request into buffer (the body is sent after it as is,
+ * and the connection is kept alive for further requests):
  *
- *  $METHOD $URI HTTP/1.0\r\n
+ *  $METHOD $URI HTTP/1.1\r\n
+ *  Host: $HOST\r\n
  *  Content-Length: Length($BODY)\r\n
  *  \r\n
- *  $BODY
  *
  * @param   r           Request structure.
- * @param   fs          Socket file stream.
+ * @param   host        Host of server.
+ * @param   buffer      Buffer to format header into.
+ * @param   size        Size of buffer.
+ * @return  Length of header (0 if it does not fit in buffer).
+ */
+size_t request_header(Request *r, const char *host, char *buffer, size_t size) {
+    size_t content_length = r->body ? r->length : 0;
+    int    length = snprintf(buffer, size, "%s %s HTTP/1.1\r\n"
+                                           "Host: %s\r\n"
+                                           "Content-Length: %zu\r\n"
+                                           "\r\n", r->method, r->uri, host, content_length);
+    if(length < 0 || (size_t)length >= size) {
+        return 0;
+    }
+    return length;
+}
+
+/* Internal Functions */
+
+/**
+ * Take a Request structure from the pool (or allocate one) with a buffer of
+ * at least the specified capacity.
+ * @param   capacity    Number of bytes the buffer must hold (0 for no buffer).
+ * @return  Request structure with every string unset (NULL on failure).
  */
-void request_write(Request *r, FILE *fs) {
-    if(r->body) {
-        int content_length = strlen(r->body);
-        fprintf(fs, "%s %s HTTP/1.0\r\n", r->method, r->uri);
-        fprintf(fs, "Content-Length: %d\r\n", content_length);
-        fprintf(fs, "\r\n");
-        fprintf(fs, "%s", r->body);
+Request * request_allocate(size_t capacity) {
+    mutex_lock(&RequestPoolLock);
+    Request *r = RequestPool;
+    if(r) {
+        RequestPool = r->next;
+        RequestPoolSize--;
+    }
+    mutex_unlock(&RequestPoolLock);
+
+    if(!r && !(r = calloc(1, sizeof(Request)))) {
+        return NULL;
+    }
+    if(!capacity) {
+        // Caller supplies its own buffer, so drop any pooled one
+        free(r->buffer);
+        r->buffer   = NULL;
+        r->capacity = 0;
+    }
+    else if(r->capacity < capacity) {
+        char *buffer = realloc(r->buffer, capacity);
+        if(!buffer) {
+            request_delete(r);
+            return NULL;
+        }
+        r->buffer   = buffer;
+        r->capacity = capacity;
+    }
+    r->method = NULL;
+    r->uri    = NULL;
+    r->body   = NULL;
+    r->length   = 0;
+    r->topic    = NULL;
+    r->sequence = 0;
+    r->sentinel = false;
+    r->next     = NULL;
+    return r;
+}
+
+/**
+ * Decode binary frame of received body by doing the following:
+ *
+ *  1. Check that the header is consistent with the length of the body.
+ *
+ *  2. Save the topic, then move (or decompress) the payload to the front of
+ *  the buffer, and store the topic after it (as request_topic does).
+ *
+ * @param   r           Request structure (with the body starting the buffer).
+ * @return  Whether or not the frame could be decoded.
+ */
+bool request_unframe(Request *r) {
+    unsigned char *frame = (unsigned char *)r->body;
+    if(r->length < REQUEST_HEADER || (frame[1] & ~REQUEST_LZ4)) {
+        return false;
+    }
+    size_t topic_length = request_get(frame + 2, 2);
+    size_t length       = request_get(frame + 4, 4);
+    if(topic_length >= BUFSIZ || REQUEST_HEADER + topic_length > r->length) {
+        return false;
+    }
+    size_t packed  = r->length - REQUEST_HEADER - topic_length;
+    char * payload = r->body + REQUEST_HEADER + topic_length;
+    char   topic[BUFSIZ];
+    memcpy(topic, frame + REQUEST_HEADER, topic_length);
+    topic[topic_length] = 0;
+
+    if(frame[1] & REQUEST_LZ4) {
+#ifdef HAVE_LZ4
+        // LZ4 expands data at most 255 times, so bigger claims are corrupt
+        if(length > 255 * packed + 16) {
+            return false;
+        }
+        char *buffer = malloc(length + 1 + topic_length + 1);
+        if(!buffer || LZ4_decompress_safe(payload, buffer, packed, length) != (int)length) {
+            free(buffer);
+            return false;
+        }
+        r->sequence = request_get(frame + 8, 8);
+        free(r->buffer);
+        r->buffer   = buffer;
+        r->capacity = length + 1 + topic_length + 1;
+        r->body     = buffer;
+#else
+        return false;
+#endif
     }
     else {
-        fprintf(fs, "%s %s HTTP/1.0\r\n", r->method, r->uri);
-        fprintf(fs, "\r\n");
+        if(packed != length) {
+            return false;
+        }
+        r->sequence = request_get(frame + 8, 8);
+        memmove(r->body, payload, length);
+    }
+    r->body[length] = 0;
+    r->length = length;
+    r->topic  = memcpy(r->body + length + 1, topic, topic_length + 1);
+    return true;
+}
+
+/**
+ * Store value in network byte order.
+ * @param   p           Where to store value.
+ * @param   value       Value to store.
+ * @param   size        Number of bytes to store.
+ */
+void request_put(unsigned char *p, uint64_t value, size_t size) {
+    for(size_t i = size; i > 0; i--) {
+        p[i - 1] = value & 0xff;
+        value  >>= 8;
+    }
+}
+
+/**
+ * Load value stored in network byte order.
+ * @param   p           Where value is stored.
+ * @param   size        Number of bytes to load.
+ * @return  Value.
+ */
+uint64_t request_get(const unsigned char *p, size_t size) {
+    uint64_t value = 0;
+    for(size_t i = 0; i < size; i++) {
+        value = (value << 8) | p[i];
     }
-}
\ No newline at end of file
+    return value;
+}
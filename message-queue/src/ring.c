@@ -0,0 +1,242 @@
+/* ring.c: Lock-free Bounded Ring of Requests
+ *
+ * A bounded multi-producer, multi-consumer ring (after Dmitry Vyukov's).  Each
+ * cell records the position it is ready for: a producer may fill the cell at
+ * position pos once its sequence is pos, and a consumer may empty it once its
+ * sequence is pos + 1.  Producers and consumers claim positions with a
+ * compare and swap on their own index, so neither ever takes a lock.
+ *
+ * Threads only sleep when the ring is empty (or full), on a futex used as an
+ * event count: the waiter registers itself, reads the count, and tries once
+ * more before sleeping on that value, while the other side bumps the count
+ * and wakes it only if somebody is registered.
+ **/
+
+#include "mq/ring.h"
+
+#include <linux/futex.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Internal Prototypes */
+
+bool	    ring_try_push(Ring *r, Request *request);
+Request *   ring_try_pop(Ring *r);
+void	    ring_wait(uint32_t *event, uint32_t value, double timeout);
+void	    ring_wake(uint32_t *event, uint32_t *waiters);
+double	    ring_now();
+
+/* Functions */
+
+/**
+ * Create ring structure.
+ * @param   capacity    Number of requests ring can hold (rounded up to a power of two).
+ * @return  Newly allocated ring structure.
+ */
+Ring * ring_create(size_t capacity) {
+    // A single cell could not tell a full ring from an empty one a lap later
+    size_t rounded = 2;
+    while(rounded < capacity) {
+        rounded <<= 1;
+    }
+
+    Ring *r = NULL;
+    if(posix_memalign((void **)&r, RING_LINE, sizeof(Ring))) {
+        return NULL;
+    }
+    memset(r, 0, sizeof(Ring));
+    r->cells = calloc(rounded, sizeof(RingCell));
+    if(!r->cells) {
+        free(r);
+        return NULL;
+    }
+    r->mask = rounded - 1;
+    for(size_t i = 0; i < rounded; i++) {
+        r->cells[i].sequence = i;
+    }
+    return r;
+}
+
+/**
+ * Delete ring structure (and any requests still in it).
+ * @param   r           Ring structure.
+ */
+void ring_delete(Ring *r) {
+    if(r) {
+        Request *request;
+        while((request = ring_try_pop(r))) {
+            request_delete(request);
+        }
+        free(r->cells);
+        free(r);
+    }
+}
+
+/**
+ * Push request to the back of ring.
+ * @param   r           Ring structure.
+ * @param   request     Request structure.
+ * @param   block       Whether to wait for room when the ring is full.
+ * @return  Whether or not the request was pushed.
+ */
+bool ring_push(Ring *r, Request *request, bool block) {
+    while(!ring_try_push(r, request)) {
+        if(!block) {
+            return false;
+        }
+        // Register before the last attempt, so a pop cannot miss us
+        __atomic_add_fetch(&r->full_waiters, 1, __ATOMIC_SEQ_CST);
+        uint32_t value  = __atomic_load_n(&r->not_full, __ATOMIC_SEQ_CST);
+        bool     pushed = ring_try_push(r, request);
+        if(!pushed) {
+            ring_wait(&r->not_full, value, -1);
+        }
+        __atomic_sub_fetch(&r->full_waiters, 1, __ATOMIC_SEQ_CST);
+        if(pushed) {
+            break;
+        }
+    }
+    ring_wake(&r->not_empty, &r->empty_waiters);
+    return true;
+}
+
+/**
+ * Pop request from the front of ring.
+ * @param   r           Ring structure.
+ * @param   timeout     Seconds to wait when the ring is empty (negative to block).
+ * @return  Request structure (NULL if the timeout passed).
+ */
+Request * ring_pop(Ring *r, double timeout) {
+    double   deadline = timeout > 0 ? ring_now() + timeout : 0;
+    Request *request;
+    while(!(request = ring_try_pop(r))) {
+        double remaining = timeout < 0 ? -1 : deadline - ring_now();
+        if(timeout >= 0 && remaining <= 0) {
+            return NULL;
+        }
+        // Register before the last attempt, so a push cannot miss us
+        __atomic_add_fetch(&r->empty_waiters, 1, __ATOMIC_SEQ_CST);
+        uint32_t value = __atomic_load_n(&r->not_empty, __ATOMIC_SEQ_CST);
+        request = ring_try_pop(r);
+        if(!request) {
+            ring_wait(&r->not_empty, value, remaining);
+        }
+        __atomic_sub_fetch(&r->empty_waiters, 1, __ATOMIC_SEQ_CST);
+        if(request) {
+            break;
+        }
+    }
+    ring_wake(&r->not_full, &r->full_waiters);
+    return request;
+}
+
+/* Internal Functions */
+
+/**
+ * Try to push request without waiting.
+ * @param   r           Ring structure.
+ * @param   request     Request structure.
+ * @return  Whether or not the request was pushed (false if the ring is full).
+ */
+bool ring_try_push(Ring *r, Request *request) {
+    size_t    position = __atomic_load_n(&r->enqueue, __ATOMIC_RELAXED);
+    RingCell *cell;
+    while(true) {
+        cell = &r->cells[position & r->mask];
+        size_t   sequence   = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+        if(difference == 0) {
+            // Cell is empty, so claim its position (which reloads position on failure)
+            if(__atomic_compare_exchange_n(&r->enqueue, &position, position + 1, true,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        }
+        else if(difference < 0) {
+            // Cell still holds the request from one lap ago
+            return false;
+        }
+        else {
+            position = __atomic_load_n(&r->enqueue, __ATOMIC_RELAXED);
+        }
+    }
+    cell->request = request;
+    __atomic_store_n(&cell->sequence, position + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/**
+ * Try to pop request without waiting.
+ * @param   r           Ring structure.
+ * @return  Request structure (NULL if the ring is empty).
+ */
+Request * ring_try_pop(Ring *r) {
+    size_t    position = __atomic_load_n(&r->dequeue, __ATOMIC_RELAXED);
+    RingCell *cell;
+    while(true) {
+        cell = &r->cells[position & r->mask];
+        size_t   sequence   = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)(position + 1);
+        if(difference == 0) {
+            // Cell is full, so claim its position (which reloads position on failure)
+            if(__atomic_compare_exchange_n(&r->dequeue, &position, position + 1, true,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        }
+        else if(difference < 0) {
+            // Cell has not been filled yet
+            return NULL;
+        }
+        else {
+            position = __atomic_load_n(&r->dequeue, __ATOMIC_RELAXED);
+        }
+    }
+    Request *request = cell->request;
+    // Ready the cell for the push one lap later
+    __atomic_store_n(&cell->sequence, position + r->mask + 1, __ATOMIC_RELEASE);
+    return request;
+}
+
+/**
+ * Sleep on event count as long as it still holds the specified value.
+ * @param   event       Event count.
+ * @param   value       Value read before the last attempt.
+ * @param   timeout     Most seconds to sleep (negative to sleep until woken).
+ */
+void ring_wait(uint32_t *event, uint32_t value, double timeout) {
+    struct timespec  duration;
+    struct timespec *limit = NULL;
+    if(timeout >= 0) {
+        duration.tv_sec  = (time_t)timeout;
+        duration.tv_nsec = (long)((timeout - (time_t)timeout) * 1e9);
+        limit = &duration;
+    }
+    // Spurious and interrupted wake ups are fine, the caller tries again
+    syscall(SYS_futex, event, FUTEX_WAIT_PRIVATE, value, limit, NULL, 0);
+}
+
+/**
+ * Bump event count and wake one thread sleeping on it (if any are waiting).
+ * @param   event       Event count.
+ * @param   waiters     Number of threads waiting on event.
+ */
+void ring_wake(uint32_t *event, uint32_t *waiters) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(__atomic_load_n(waiters, __ATOMIC_SEQ_CST)) {
+        __atomic_add_fetch(event, 1, __ATOMIC_SEQ_CST);
+        syscall(SYS_futex, event, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
+
+/**
+ * Return current monotonic time.
+ * @return  Seconds since arbitrary point.
+ */
+double ring_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
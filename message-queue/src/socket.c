@@ -6,17 +6,18 @@
 #include <errno.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
 /**
- * Create socket connection to specified host and port.
- * @param   host    Host string to connect to.
- * @param   port    Port string to connect to.
- * @return  Socket file stream of connection if successful, otherwise NULL.
+ * Lookup address information for specified host and port.
+ * @param   host    Host string to resolve.
+ * @param   port    Port string to resolve.
+ * @return  Address information (must be freed with freeaddrinfo) if
+ * successful, otherwise NULL.
  */
-FILE*  socket_connect(const char *host, const char *port) {
-    /* Lookup server address information */
+struct addrinfo *socket_resolve(const char *host, const char *port) {
     struct addrinfo *results;
     struct addrinfo  hints = {
 	.ai_family   = AF_UNSPEC,   /* Return IPv4 and IPv6 choices */
@@ -27,7 +28,15 @@ FILE*  socket_connect(const char *host, const char *port) {
         error("Unable to resolve %s:%s: %s", host, port, gai_strerror(status));
         return NULL;
     }
+    return results;
+}
 
+/**
+ * Create socket connection to first reachable entry of resolved address.
+ * @param   results Address information from socket_resolve.
+ * @return  Socket file descriptor of connection if successful, otherwise -1.
+ */
+int    socket_dial(struct addrinfo *results) {
     /* For each server entry, allocate socket and try to connect */
     int socket_fd = -1;
     for (struct addrinfo *p = results; p != NULL && socket_fd < 0; p = p->ai_next) {
@@ -44,11 +53,26 @@ FILE*  socket_connect(const char *host, const char *port) {
             continue;
         }
     }
-    /* Release allocate address information */
-    freeaddrinfo(results);
 
     if (socket_fd < 0) {
-        error("Unable to connect to %s:%s: %s", host, port, strerror(errno));
+        error("Unable to connect: %s", strerror(errno));
+        return -1;
+    }
+    /* Send small requests immediately (connections are kept alive, so
+     * Nagle's algorithm would hold each one back for the previous ACK) */
+    int nodelay = 1;
+    setsockopt(socket_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    return socket_fd;
+}
+
+/**
+ * Create socket connection to first reachable entry of resolved address.
+ * @param   results Address information from socket_resolve.
+ * @return  Socket file stream of connection if successful, otherwise NULL.
+ */
+FILE*  socket_open(struct addrinfo *results) {
+    int socket_fd = socket_dial(results);
+    if (socket_fd < 0) {
         return NULL;
     }
     /* Make file stream */
@@ -58,4 +82,23 @@ FILE*  socket_connect(const char *host, const char *port) {
         close(socket_fd);
     }
     return fs;
-}
\ No newline at end of file
+}
+
+/**
+ * Create socket connection to specified host and port.
+ * @param   host    Host string to connect to.
+ * @param   port    Port string to connect to.
+ * @return  Socket file stream of connection if successful, otherwise NULL.
+ */
+FILE*  socket_connect(const char *host, const char *port) {
+    /* Lookup server address information */
+    struct addrinfo *results = socket_resolve(host, port);
+    if (!results) {
+        return NULL;
+    }
+
+    FILE *fs = socket_open(results);
+    /* Release allocate address information */
+    freeaddrinfo(results);
+    return fs;
+}
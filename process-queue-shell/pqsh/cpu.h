@@ -0,0 +1,22 @@
+/* cpu.h: PQSH CPU Discovery and Binding */
+
+#ifndef PQSH_CPU_H
+#define PQSH_CPU_H
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+/* Constants */
+
+#define CPUS_MAX        1024    /* Most CPUs considered (CPU_SETSIZE) */
+
+/* Functions */
+
+size_t  cpu_available(int *cpus, size_t n);
+size_t  cpu_quota();
+bool    cpu_bind(pid_t pid, int cpu);
+bool    cpu_pin(int cpu);
+bool    cpu_unpin();
+
+#endif
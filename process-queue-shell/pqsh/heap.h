@@ -0,0 +1,33 @@
+/* heap.h: PQSH Priority Queue */
+
+#ifndef PQSH_HEAP_H
+#define PQSH_HEAP_H
+
+#include "pqsh/process.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+
+/* Constants */
+
+#define HEAP_CAPACITY   64      /* Initial number of slots */
+
+/* Structure */
+
+typedef struct Heap Heap;
+
+struct Heap {
+    Process **items;    /* Binary min-heap of processes (by key) */
+    size_t    capacity; /* Number of slots */
+    size_t    size;     /* Size of heap */
+};
+
+/* Functions */
+
+bool        heap_push(Heap *h, Process *p, double key);
+Process *   heap_pop(Heap *h);
+Process *   heap_peek(Heap *h);
+void        heap_remove(Heap *h, Process *p);
+void        heap_dump(Heap *h, FILE *fs);
+
+#endif
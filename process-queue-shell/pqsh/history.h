@@ -0,0 +1,37 @@
+/* history.h: PQSH Runtime History */
+
+#ifndef PQSH_HISTORY_H
+#define PQSH_HISTORY_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+/* Constants */
+
+#define HISTORY_BUCKETS 256     /* Number of chains of estimates */
+#define HISTORY_WEIGHT  0.5     /* Weight of newest runtime in estimate */
+
+/* Structure */
+
+typedef struct Estimate Estimate;
+
+struct Estimate {
+    char     *command;  /* Command (or program) runtimes were measured for */
+    double    runtime;  /* Exponential average of its runtimes (seconds) */
+    Estimate *next;     /* Pointer to next estimate in same bucket */
+};
+
+typedef struct History History;
+
+struct History {
+    Estimate *buckets[HISTORY_BUCKETS];
+    double    total;    /* Sum of every runtime recorded */
+    size_t    samples;  /* Number of runtimes recorded */
+};
+
+/* Functions */
+
+void    history_update(History *h, const char *command, double runtime);
+double  history_estimate(History *h, const char *command);
+
+#endif
@@ -10,26 +10,66 @@
 /* Constants */
 
 #define MAX_ARGUMENTS   1024
+#define PATH_BUCKETS    64      /* Number of chains of cached executables */
 
 /* Structure */
 
 typedef struct Process      Process;
+typedef struct Queue        Queue;
+typedef struct Dependent    Dependent;
 
 struct Process {
-    char    command[BUFSIZ];    /* Command to execute */
+    char   *command;            /* Command to execute (stored behind the structure) */
+    char  **argv;               /* Arguments of command (NULL-terminated, stored behind the structure) */
     pid_t   pid;                /* Process identifier (0 == invalid) */
+    int     cpu;                /* CPU process last ran on (-1 if none) */
+    int     slot;               /* Scheduler slot process runs in (-1 if none) */
     double  arrival_time;       /* Process arrival time (is placed into waiting queue) */
     double  start_time;         /* Process start time (is first placed into running queue) */
     double  end_time;           /* Process end time (is placed into finished queue) */
+    double  resume_time;        /* Time process last started running */
+    double  run_time;           /* Time spent running before it was last resumed */
+    double  cpu_time;           /* CPU time used when its current slice started */
+    double  slice_time;         /* Time its current slice started */
+    double  quantum;            /* Length of its time slices (seconds, round robin) */
+    size_t  slices;             /* Number of times it was started or resumed */
+
+    int     status;             /* Exit status (from wait4) */
+    double  user_time;          /* User CPU time (seconds, from wait4) */
+    double  system_time;        /* System CPU time (seconds, from wait4) */
+    long    max_rss;            /* Maximum resident set size (KiB, from wait4) */
+    long    voluntary_switches;   /* Context switches while blocking (from wait4) */
+    long    involuntary_switches; /* Context switches by preemption (from wait4) */
+
+    size_t  level;              /* Level of multilevel feedback queue (0 is highest) */
+    size_t  allotment;          /* Time slices used at that level */
+    double  estimate;           /* Estimated runtime (seconds, from history) */
+    double  key;                /* Priority in priority queue (smallest first) */
+    size_t  heap_index;         /* Slot in priority queue (0 if none) */
+
+    int     priority;           /* Batch priority (higher starts first) */
+    size_t  pending;            /* Dependencies that did not finish yet */
+    Dependent *dependents;      /* Processes that wait for it to finish */
 
     Process *next;              /* Pointer to next process */
+    Process *prev;              /* Pointer to previous process */
+    Queue   *queue;             /* Queue process is in (NULL if none) */
+    Process *hash_next;         /* Pointer to next process in same table bucket */
+};
+
+struct Dependent {
+    Process   *process;         /* Process waiting for dependency */
+    Dependent *next;            /* Pointer to next dependent of same dependency */
 };
 
 /* Functions */
 
 Process *   process_create(const char *command);
+void        process_delete(Process *p);
 bool        process_start(Process *p);
 bool        process_pause(Process *p);
 bool        process_resume(Process *p);
+bool        process_bind(Process *p);
+double      process_cpu(Process *p);
 
 #endif
\ No newline at end of file
@@ -3,8 +3,13 @@
 #ifndef PQSH_SCHEDULER_H
 #define PQSH_SCHEDULER_H
 
+#include "pqsh/cpu.h"
+#include "pqsh/heap.h"
+#include "pqsh/history.h"
 #include "pqsh/queue.h"
+#include "pqsh/table.h"
 
+#include <stdbool.h>
 #include <stdio.h>
 
 /* Constants */
@@ -12,8 +17,16 @@
 typedef enum {
     FIFO_POLICY,        /* First in, first out */
     RDRN_POLICY,        /* Round robin */
+    MLFQ_POLICY,        /* Multilevel feedback queue */
+    SJF_POLICY,         /* Shortest (remaining) job first */
 } Policy;
 
+#define MLFQ_LEVELS     4       /* Number of levels of multilevel feedback queue */
+#define MLFQ_BOOST      50      /* Ticks between moving every process back to the top level */
+#define RDRN_QUANTUM    8       /* Most time slices the quantum of a CPU-bound process grows to */
+#define RDRN_BUSY       0.75    /* Share of its quantum a process must compute for it to grow */
+#define RDRN_SLACK      1e-3    /* Seconds early a quantum may end (rather than arming the timer again) */
+
 enum {
     RUNNING  = 1<<0,    /* Running queue */
     WAITING  = 1<<1,    /* Waiting queue */
@@ -28,29 +41,66 @@ struct Scheduler {
     Policy  policy;     /* Scheduling policy */
     size_t  cores;      /* Number of CPU cores to utilize */
     time_t  timeout;    /* Time slice (microseconds) */
+    bool    expired;    /* Whether time slice expired (set by timer) */
+    bool    adaptive;   /* Whether round robin adapts the quantum of each process */
+    const char *batch;  /* Batch file to run without a shell (NULL for none) */
+    double  tick;       /* When next periodic tick is due (0 if none) */
 
     Queue   running;    /* Queue of running processes */
     Queue   waiting;    /* Queue of waiting processes */
-    Queue   finished;   /* Queue of finished processes */
-
-    /* Total turnaround and response time */
+    Queue   blocked;    /* Queue of processes waiting for dependencies */
+    Queue   finished;   /* Queue of most recently finished processes */
+    size_t  retain;     /* Most finished processes kept (older ones are deleted) */
+    Table   processes;  /* Started processes that were not reaped (by pid) */
+    Queue   levels[MLFQ_LEVELS];/* Waiting processes by level (multilevel feedback queue) */
+    Heap    ready;      /* Waiting processes by remaining time (shortest job first) */
+    History history;    /* Runtimes of finished commands */
+    size_t  ticks;      /* Number of time slices that expired */
+
+    size_t  ncpus;              /* Number of slots bound to CPUs (0 for no binding) */
+    int     cpus[CPUS_MAX];     /* CPU of each slot */
+    Process *slots[CPUS_MAX];   /* Process running in each slot (NULL if free) */
+
+    /* Totals over every finished process (including deleted ones) */
+    size_t  total_finished;
+    size_t  total_failed;
     double  total_turnaround_time;
     double  total_response_time;
+    double  total_user_time;
+    double  total_system_time;
+    long    total_voluntary_switches;
+    long    total_involuntary_switches;
+    size_t  total_slices;
+    long    max_rss;
 };
 
 /* Commands */
 
 void    scheduler_add(Scheduler *s, FILE *fs, const char *command);
 void    scheduler_status(Scheduler *s, FILE *fs, int queue);
+void    scheduler_export(Scheduler *s, FILE *fs);
+bool    scheduler_batch(Scheduler *s, FILE *fs, const char *path);
 
 /* Functions */
 
+void    scheduler_bind(Scheduler *s);
 void    scheduler_next(Scheduler *s);
 void    scheduler_wait(Scheduler *s);
+void    scheduler_run(Scheduler *s, Process *p);
+void    scheduler_preempt(Scheduler *s, Process *p);
+void    scheduler_finish(Scheduler *s, Process *p);
+void    scheduler_unblock(Scheduler *s, Process *p, int status);
+void    scheduler_claim(Scheduler *s, Process *p);
+void    scheduler_release(Scheduler *s, Process *p);
+size_t  scheduler_waiting(Scheduler *s);
+bool    scheduler_idle(Scheduler *s);
+double  scheduler_timeout(Scheduler *s);
 
 /* Policies */
 
 void    scheduler_fifo(Scheduler *s);
 void    scheduler_rdrn(Scheduler *s);
+void    scheduler_mlfq(Scheduler *s);
+void    scheduler_sjf(Scheduler *s);
 
 #endif
\ No newline at end of file
@@ -13,9 +13,7 @@ typedef void (*sighandler_t)(int);
 /* Functions */
 
 bool    signal_register(int signum, int flags, sighandler_t handler);
-
-/* Handlers */
-
-void	sigalrm_handler(int signum);
+int     signal_descriptor(int signum);
+void    signal_drain(int fd);
 
 #endif
\ No newline at end of file
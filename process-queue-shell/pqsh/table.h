@@ -0,0 +1,32 @@
+/* table.h: PQSH Process Table */
+
+#ifndef PQSH_TABLE_H
+#define PQSH_TABLE_H
+
+#include "pqsh/process.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+
+/* Constants */
+
+#define TABLE_CAPACITY  64      /* Initial number of buckets */
+
+/* Structure */
+
+typedef struct Table Table;
+
+struct Table {
+    Process **buckets;  /* Chains of processes (linked by hash_next) */
+    size_t    capacity; /* Number of buckets (power of two) */
+    size_t    size;     /* Number of processes */
+};
+
+/* Functions */
+
+bool        table_insert(Table *t, Process *p);
+Process *   table_lookup(Table *t, pid_t pid);
+Process *   table_remove(Table *t, pid_t pid);
+void        table_delete(Table *t);
+
+#endif
@@ -0,0 +1,261 @@
+/* cpu.c: PQSH CPU Discovery and Binding
+ *
+ * The CPUs the shell may use are those in its affinity mask that its cgroup
+ * cpuset also allows, and a cgroup CPU quota (cpu.max in cgroup v2, or
+ * cpu.cfs_quota_us in v1) further limits how many of them can be kept busy.
+ **/
+
+#define _GNU_SOURCE     /* For CPU_SET and sched_setaffinity */
+
+#include "pqsh/cpu.h"
+#include "pqsh/macros.h"
+
+#include <errno.h>
+#include <sched.h>
+
+/* Global Variables */
+
+cpu_set_t   ShellAffinity;          /* Affinity mask of shell while it is pinned */
+bool        ShellPinned = false;    /* Whether the shell is pinned (see cpu_pin) */
+
+/* Internal Prototypes */
+
+bool    cpu_cgroup(const char *controller, char *path, size_t size);
+bool    cpu_read(const char *path, char *buffer, size_t size);
+void    cpu_parse(const char *list, cpu_set_t *set);
+double  cpu_limit(const char *quota, const char *period);
+
+/**
+ * Discover CPUs processes may run on.
+ * @param   cpus        Array to store CPU numbers in (in increasing order).
+ * @param   n           Size of array.
+ * @return  Number of CPUs stored (0 if the affinity mask cannot be read).
+ **/
+size_t cpu_available(int *cpus, size_t n) {
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        error("Unable to get CPU affinity: %s", strerror(errno));
+        return 0;
+    }
+
+    // Restrict to the cpuset of the cgroup (v2, then v1)
+    char path[BUFSIZ];
+    char list[BUFSIZ];
+    if ((cpu_cgroup("", path, sizeof(path)) &&
+         (cpu_read(strcat(path, "/cpuset.cpus.effective"), list, sizeof(list)) && *list)) ||
+        (cpu_cgroup("cpuset", path, sizeof(path)) &&
+         (cpu_read(strcat(path, "/cpuset.effective_cpus"), list, sizeof(list)) && *list))) {
+        cpu_set_t cpuset;
+        cpu_parse(list, &cpuset);
+        CPU_AND(&allowed, &allowed, &cpuset);
+    }
+
+    size_t count = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE && count < n; cpu++) {
+        if (CPU_ISSET(cpu, &allowed)) {
+            cpus[count++] = cpu;
+        }
+    }
+    return count;
+}
+
+/**
+ * Return how many CPUs the cgroup CPU quota lets processes keep busy (the
+ * tightest quota of the cgroup and its ancestors, rounded up).
+ * @return  Number of CPUs (0 if there is no quota).
+ **/
+size_t cpu_quota() {
+    char   path[BUFSIZ];
+    char   value[BUFSIZ];
+    double limit = 0;
+
+    if (cpu_cgroup("", path, sizeof(path))) {
+        // cgroup v2: "$QUOTA $PERIOD" (or "max $PERIOD") at each level
+        size_t length = strlen(path);
+        while (true) {
+            strcpy(path + length, "/cpu.max");
+            char quota[64], period[64];
+            if (cpu_read(path, value, sizeof(value)) && sscanf(value, "%63s %63s", quota, period) == 2) {
+                double cores = cpu_limit(quota, period);
+                limit = cores > 0 && (!limit || cores < limit) ? cores : limit;
+            }
+            path[length] = 0;
+            if (length <= strlen("/sys/fs/cgroup")) {
+                break;
+            }
+            length = strrchr(path, '/') - path;
+            path[length] = 0;
+        }
+    }
+    else if (cpu_cgroup("cpu", path, sizeof(path))) {
+        // cgroup v1: quota and period in separate files
+        char quota[BUFSIZ];
+        size_t length = strlen(path);
+        if (cpu_read(strcat(path, "/cpu.cfs_quota_us"), quota, sizeof(quota))) {
+            strcpy(path + length, "/cpu.cfs_period_us");
+            if (cpu_read(path, value, sizeof(value))) {
+                limit = cpu_limit(quota, value);
+            }
+        }
+    }
+
+    size_t cpus = (size_t)limit;
+    return cpus < limit ? cpus + 1 : cpus;
+}
+
+/**
+ * Bind process to CPU.
+ * @param   pid         Pid of process (0 for the calling process).
+ * @param   cpu         CPU number.
+ * @return  Whether or not the process was bound.
+ **/
+bool cpu_bind(pid_t pid, int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return sched_setaffinity(pid, sizeof(set), &set) == 0;
+}
+
+/**
+ * Bind the shell itself to CPU until cpu_unpin, so processes it spawns
+ * meanwhile inherit the binding before they execute anything.
+ * @param   cpu         CPU number.
+ * @return  Whether or not the shell was bound.
+ **/
+bool cpu_pin(int cpu) {
+    if (sched_getaffinity(0, sizeof(ShellAffinity), &ShellAffinity) < 0 || !cpu_bind(0, cpu)) {
+        return false;
+    }
+    ShellPinned = true;
+    return true;
+}
+
+/**
+ * Restore the affinity mask the shell had before cpu_pin (if it was pinned).
+ * @return  Whether or not the mask was restored.
+ **/
+bool cpu_unpin() {
+    if (!ShellPinned) {
+        return true;
+    }
+    ShellPinned = false;
+    return sched_setaffinity(0, sizeof(ShellAffinity), &ShellAffinity) == 0;
+}
+
+/* Internal Functions */
+
+/**
+ * Find directory of cgroup the shell belongs to (from /proc/self/cgroup).
+ * @param   controller  Controller of v1 hierarchy ("" for the v2 hierarchy).
+ * @param   path        Buffer to store directory in.
+ * @param   size        Size of buffer.
+ * @return  Whether or not the directory exists.
+ **/
+bool cpu_cgroup(const char *controller, char *path, size_t size) {
+    FILE *fs = fopen("/proc/self/cgroup", "r");
+    if (!fs) {
+        return false;
+    }
+
+    // Lines are "$ID:$CONTROLLERS:$PATH" (v2 has no controllers)
+    char line[BUFSIZ];
+    bool found = false;
+    while (!found && fgets(line, sizeof(line), fs)) {
+        chomp(line);
+        char *controllers = strchr(line, ':');
+        char *group       = controllers ? strchr(controllers + 1, ':') : NULL;
+        if (!group) {
+            continue;
+        }
+        *controllers++ = 0;
+        *group++       = 0;
+
+        if (!*controller) {
+            found = !*controllers && streq(line, "0");
+            if (found) {
+                snprintf(path, size, "/sys/fs/cgroup%s", streq(group, "/") ? "" : group);
+            }
+            continue;
+        }
+        for (char *name = strtok(controllers, ","); name && !found; name = strtok(NULL, ",")) {
+            found = streq(name, controller);
+        }
+        if (found) {
+            snprintf(path, size, "/sys/fs/cgroup/%s%s", controller, streq(group, "/") ? "" : group);
+        }
+    }
+    fclose(fs);
+    if (!found) {
+        return false;
+    }
+
+    // Hybrid systems list the v2 hierarchy without mounting controllers on it
+    char probe[BUFSIZ];
+    snprintf(probe, sizeof(probe), "%s/%s", path, *controller ? "cgroup.procs" : "cgroup.controllers");
+    FILE *exists = fopen(probe, "r");
+    if (exists) {
+        fclose(exists);
+    }
+    return exists != NULL;
+}
+
+/**
+ * Read first line of file (without trailing newline).
+ * @param   path        Path of file.
+ * @param   buffer      Buffer to store line in.
+ * @param   size        Size of buffer.
+ * @return  Whether or not the file could be read.
+ **/
+bool cpu_read(const char *path, char *buffer, size_t size) {
+    FILE *fs = fopen(path, "r");
+    if (!fs) {
+        return false;
+    }
+    bool read = fgets(buffer, size, fs) != NULL;
+    fclose(fs);
+    if (read && strchr(buffer, '\n')) {
+        *strchr(buffer, '\n') = 0;
+    }
+    return read;
+}
+
+/**
+ * Parse list of CPUs (such as "0-3,8,10-11") into set.
+ * @param   list        List of CPUs.
+ * @param   set         Set to store CPUs in.
+ **/
+void cpu_parse(const char *list, cpu_set_t *set) {
+    CPU_ZERO(set);
+    while (*list) {
+        char *end;
+        long first = strtol(list, &end, 10);
+        long last  = first;
+        if (end == list) {
+            break;
+        }
+        if (*end == '-') {
+            list = end + 1;
+            last = strtol(list, &end, 10);
+        }
+        for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+            CPU_SET(cpu, set);
+        }
+        list = *end == ',' ? end + 1 : end;
+        if (*end != ',') {
+            break;
+        }
+    }
+}
+
+/**
+ * Return number of CPUs quota allows per period.
+ * @param   quota       Microseconds per period ("max" or negative for no quota).
+ * @param   period      Microseconds in period.
+ * @return  Number of CPUs (0 if there is no quota).
+ **/
+double cpu_limit(const char *quota, const char *period) {
+    double q = streq(quota, "max") ? -1 : atof(quota);
+    double p = atof(period);
+    return q > 0 && p > 0 ? q / p : 0;
+}
@@ -0,0 +1,157 @@
+/* heap.c: PQSH Priority Queue
+ *
+ * Binary min-heap of processes ordered by their key (smallest first).  Each
+ * process remembers its slot (heap_index, 0 when it is in no heap), so it can
+ * be removed from the middle of the heap when it exits while waiting.
+ **/
+
+#include "pqsh/macros.h"
+#include "pqsh/heap.h"
+
+#include <errno.h>
+
+/* Internal Prototypes */
+
+void    heap_place(Heap *h, size_t slot, Process *p);
+void    heap_up(Heap *h, size_t slot);
+void    heap_down(Heap *h, size_t slot);
+
+/**
+ * Push process into heap with specified key.
+ * @param h     Pointer to Heap structure.
+ * @param p     Pointer to Process structure (in no heap).
+ * @param key   Priority of process (smallest is popped first).
+ * @return  Whether or not the process was pushed.
+ **/
+bool heap_push(Heap *h, Process *p, double key) {
+    // Error checking
+    if(!h || !p || p->heap_index) {
+        return false;
+    }
+    // Grow slots (slot 0 is unused, so the children of slot i are 2i and 2i+1)
+    if(h->size + 1 >= h->capacity) {
+        size_t    capacity = h->capacity ? 2 * h->capacity : HEAP_CAPACITY;
+        Process **items    = realloc(h->items, capacity * sizeof(Process *));
+        if(!items) {
+            error("Unable to grow priority queue: %s", strerror(errno));
+            return false;
+        }
+        h->items    = items;
+        h->capacity = capacity;
+    }
+
+    p->key = key;
+    heap_place(h, ++h->size, p);
+    heap_up(h, h->size);
+    return true;
+}
+
+/**
+ * Pop process with smallest key from heap.
+ * @param h     Pointer to Heap structure.
+ * @return  Process with smallest key (NULL if heap is empty).
+ **/
+Process * heap_pop(Heap *h) {
+    Process *top = heap_peek(h);
+    if(top) {
+        heap_remove(h, top);
+    }
+    return top;
+}
+
+/**
+ * Return process with smallest key (without removing it).
+ * @param h     Pointer to Heap structure.
+ * @return  Process with smallest key (NULL if heap is empty).
+ **/
+Process * heap_peek(Heap *h) {
+    if(!h || !h->size) {
+        return NULL;
+    }
+    return h->items[1];
+}
+
+/**
+ * Remove process from heap.
+ * @param h     Pointer to Heap structure.
+ * @param p     Pointer to Process structure (in heap).
+ **/
+void heap_remove(Heap *h, Process *p) {
+    // Error checking
+    if(!h || !p || !p->heap_index || p->heap_index > h->size || h->items[p->heap_index] != p) {
+        return;
+    }
+
+    // Fill the hole with the last process and move it to where it belongs
+    size_t   slot = p->heap_index;
+    Process *last = h->items[h->size--];
+    p->heap_index = 0;
+    if(last != p) {
+        heap_place(h, slot, last);
+        heap_up(h, slot);
+        heap_down(h, last->heap_index);
+    }
+}
+
+/**
+ * Dump the contents of the Heap to the specified stream (in heap order).
+ * @param h     Heap structure.
+ * @param fs    Output file stream.
+ **/
+void heap_dump(Heap *h, FILE *fs) {
+    fprintf(fs, "%6s %-30s %-13s %-13s %-13s\n",
+                "PID", "COMMAND", "ARRIVAL", "START", "END");
+    for(size_t i = 1; i <= h->size; i++) {
+        Process *c = h->items[i];
+        fprintf(fs, "%6ld %-30s %13.2lf %13.2lf %13.2lf\n",
+                (long)c->pid, c->command, c->arrival_time, c->start_time, c->end_time);
+    }
+}
+
+/* Internal Functions */
+
+/**
+ * Store process in slot of heap.
+ * @param h     Pointer to Heap structure.
+ * @param slot  Slot to store process in.
+ * @param p     Pointer to Process structure.
+ **/
+void heap_place(Heap *h, size_t slot, Process *p) {
+    h->items[slot] = p;
+    p->heap_index  = slot;
+}
+
+/**
+ * Move process in slot towards the top while its parent has a larger key.
+ * @param h     Pointer to Heap structure.
+ * @param slot  Slot of process.
+ **/
+void heap_up(Heap *h, size_t slot) {
+    Process *p = h->items[slot];
+    while(slot > 1 && h->items[slot / 2]->key > p->key) {
+        heap_place(h, slot, h->items[slot / 2]);
+        slot /= 2;
+    }
+    heap_place(h, slot, p);
+}
+
+/**
+ * Move process in slot towards the bottom while a child has a smaller key.
+ * @param h     Pointer to Heap structure.
+ * @param slot  Slot of process.
+ **/
+void heap_down(Heap *h, size_t slot) {
+    Process *p = h->items[slot];
+    while(2 * slot <= h->size) {
+        size_t child = 2 * slot;
+        if(child < h->size && h->items[child + 1]->key < h->items[child]->key) {
+            child++;
+        }
+        if(h->items[child]->key >= p->key) {
+            break;
+        }
+        heap_place(h, slot, h->items[child]);
+        slot = child;
+    }
+    heap_place(h, slot, p);
+}
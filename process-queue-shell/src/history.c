@@ -0,0 +1,92 @@
+/* history.c: PQSH Runtime History
+ *
+ * Remembers how long commands ran, both by the whole command line and by
+ * program (its first word), so the scheduler can guess how long a new job
+ * will take: from earlier runs of the same command, else of the same
+ * program, else from the average of everything that ran so far.
+ **/
+
+#include "pqsh/macros.h"
+#include "pqsh/history.h"
+
+/* Internal Prototypes */
+
+Estimate *  history_lookup(History *h, const char *command, size_t length, bool create);
+
+/**
+ * Record runtime of command (for both the command and its program).
+ * @param h         Pointer to History structure.
+ * @param command   Command that ran.
+ * @param runtime   Seconds it ran for.
+ **/
+void history_update(History *h, const char *command, double runtime) {
+    size_t lengths[] = {strlen(command), strcspn(command, " ")};
+
+    for(size_t i = 0; i < 2; i++) {
+        // Commands without arguments are their own program
+        if(i && lengths[i] == lengths[0]) {
+            break;
+        }
+        Estimate *e = history_lookup(h, command, lengths[i], true);
+        if(e) {
+            e->runtime = e->runtime < 0 ? runtime : HISTORY_WEIGHT * runtime + (1 - HISTORY_WEIGHT) * e->runtime;
+        }
+    }
+    h->total += runtime;
+    h->samples++;
+}
+
+/**
+ * Guess how long command will run.
+ * @param h         Pointer to History structure.
+ * @param command   Command to run.
+ * @return  Estimated seconds (negative if nothing ran yet).
+ **/
+double history_estimate(History *h, const char *command) {
+    Estimate *e = history_lookup(h, command, strlen(command), false);
+    if(!e) {
+        e = history_lookup(h, command, strcspn(command, " "), false);
+    }
+    if(e) {
+        return e->runtime;
+    }
+    return h->samples ? h->total / h->samples : -1;
+}
+
+/* Internal Functions */
+
+/**
+ * Find estimate of command prefix (optionally creating it).
+ * @param h         Pointer to History structure.
+ * @param command   Command string.
+ * @param length    Length of prefix of command to look up.
+ * @param create    Whether to create estimate if there is none.
+ * @return  Estimate of command prefix (NULL if there is none).
+ **/
+Estimate * history_lookup(History *h, const char *command, size_t length, bool create) {
+    // FNV-1a hash of the prefix
+    size_t hash = 2166136261u;
+    for(size_t i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char)command[i]) * 16777619u;
+    }
+
+    Estimate **bucket = &h->buckets[hash % HISTORY_BUCKETS];
+    for(Estimate *e = *bucket; e; e = e->next) {
+        if(strlen(e->command) == length && !strncmp(e->command, command, length)) {
+            return e;
+        }
+    }
+    if(!create) {
+        return NULL;
+    }
+
+    Estimate *e = calloc(1, sizeof(Estimate));
+    if(!e || !(e->command = strndup(command, length))) {
+        free(e);
+        return NULL;
+    }
+    e->runtime = -1;
+    e->next    = *bucket;
+    *bucket    = e;
+    return e;
+}
@@ -10,9 +10,12 @@
 void usage(const char *program) {
     fprintf(stderr, "Usage: %s [options]\n\n", program);
     fprintf(stderr, "Options:\n");
-    fprintf(stderr, "    -n CORES           Number of CPU cores to utilize\n");
-    fprintf(stderr, "    -p POLICY          Scheduling policy (fifo, rdrn)\n");
+    fprintf(stderr, "    -n CORES           Number of CPU cores to utilize (0 for all available)\n");
+    fprintf(stderr, "    -p POLICY          Scheduling policy (fifo, rdrn, mlfq, sjf)\n");
     fprintf(stderr, "    -t MICROSECONDS    Timer interrupt interval\n");
+    fprintf(stderr, "    -b FILE            Run jobs in batch FILE without a shell, then exit\n");
+    fprintf(stderr, "    -r COUNT           Number of finished processes to keep (default 1024)\n");
+    fprintf(stderr, "    -f                 Fixed time slice (round robin does not adapt quanta)\n");
     fprintf(stderr, "    -h                 Print this help message\n");
 }
 
@@ -42,6 +45,12 @@ bool parse_command_line_options(int argc, char *argv[], Scheduler *s) {
                 else if (streq(opt, "rdrn")) {
       	            s->policy = RDRN_POLICY;
                 } 
+                else if (streq(opt, "mlfq")) {
+      	            s->policy = MLFQ_POLICY;
+                } 
+                else if (streq(opt, "sjf")) {
+      	            s->policy = SJF_POLICY;
+                } 
                 else {
                     fprintf(stderr, "Unknown policy: %s\n", opt);
                     return false;
@@ -50,6 +59,15 @@ bool parse_command_line_options(int argc, char *argv[], Scheduler *s) {
       	    case 't':
       	    	s->timeout = atoi(argv[argind++]);
       	    	break;
+      	    case 'b':
+      	    	s->batch = argv[argind++];
+      	    	break;
+      	    case 'r':
+      	    	s->retain = atoi(argv[argind++]);
+      	    	break;
+      	    case 'f':
+      	    	s->adaptive = false;
+      	    	break;
       	    case 'h':
       	    	usage(argv[0]);
       	    	return false;
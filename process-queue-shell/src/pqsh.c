@@ -6,8 +6,20 @@
 #include "pqsh/signal.h"
 
 #include <errno.h>
+#include <poll.h>
 #include <string.h>
-#include <sys/time.h>
+#include <stdint.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+/* Constants */
+
+enum {
+    INPUT_EVENT,        /* Commands on standard input */
+    CHILD_EVENT,        /* SIGCHLD reported by signalfd */
+    TIMER_EVENT,        /* Time slice expired (timerfd) */
+    NEVENTS,
+};
 
 /* Global Variables */
 
@@ -15,6 +27,8 @@ Scheduler PQShellScheduler = {
     .policy    = FIFO_POLICY,
     .cores     = 1,
     .timeout   = 250000,
+    .adaptive  = true,
+    .retain    = 1024,
 };
 
 /* Help Message */
@@ -22,11 +36,169 @@ Scheduler PQShellScheduler = {
 void help() {
     printf("Commands:\n");
     printf("  add    command    Add command to waiting queue.\n");
+    printf("  batch  FILE       Add every job in FILE (name=, priority=, after= attributes).\n");
+    printf("                    priority= only orders jobs under the fifo and rdrn policies.\n");
     printf("  status [queue]    Display status of specified queue (default is all).\n");
+    printf("  status json [PATH] Export status snapshot as JSON (to stdout or file).\n");
     printf("  help              Display help message.\n");
     printf("  exit|quit         Exit shell.\n");
 }
 
+/* Shell Commands */
+
+/**
+ * Export status snapshot as JSON.
+ * @param   s	    Pointer to Scheduler structure.
+ * @param   path    File to write snapshot to (replaced all at once, so
+ *                  readers never see half of it), or NULL for stdout.
+ **/
+void shell_export(Scheduler *s, const char *path) {
+    if(!path) {
+        scheduler_export(s, stdout);
+        return;
+    }
+
+    char temporary[BUFSIZ];
+    snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+    FILE *fs = fopen(temporary, "w");
+    if(!fs) {
+        printf("Unable to open %s: %s\n", temporary, strerror(errno));
+        return;
+    }
+    scheduler_export(s, fs);
+    if(fclose(fs) != 0 || rename(temporary, path) < 0) {
+        printf("Unable to write %s: %s\n", path, strerror(errno));
+        unlink(temporary);
+    }
+}
+
+/**
+ * Arm timer to expire once, when the next tick is due (or disarm it if no
+ * tick is needed).
+ * @param   s	    Pointer to Scheduler structure.
+ * @param   timer   Timer descriptor (timerfd).
+ **/
+void shell_timer(Scheduler *s, int timer) {
+    double seconds = scheduler_timeout(s);
+    struct itimerspec alarm = {{0}};
+
+    if(seconds >= 0) {
+        alarm.it_value.tv_sec  = (time_t)seconds;
+        alarm.it_value.tv_nsec = (long)((seconds - (time_t)seconds) * 1e9);
+        // All zeros would disarm the timer instead of expiring right away
+        if(!alarm.it_value.tv_sec && !alarm.it_value.tv_nsec) {
+            alarm.it_value.tv_nsec = 1;
+        }
+    }
+    if(timerfd_settime(timer, 0, &alarm, NULL) < 0) {
+        error("Failed to arm timer: %s", strerror(errno));
+    }
+}
+
+/**
+ * Execute shell command.
+ * @param   s	    Pointer to Scheduler structure.
+ * @param   command Command line (without trailing newline).
+ * @return  Whether or not the shell should keep going.
+ **/
+bool shell_execute(Scheduler *s, char *command) {
+    char* split_cmd = strtok(command," \n");
+    if(!split_cmd) {
+        return true;
+    }
+    if (streq(split_cmd, "help")) {
+        help();
+    }
+    else if (streq(split_cmd, "exit") || streq(split_cmd, "quit")) {
+        return false;
+    }
+    else if (streq(split_cmd, "status")) {
+        split_cmd = strtok(NULL," ");
+
+        if(!split_cmd) {
+            scheduler_status(s,stdout,RUNNING | WAITING | FINISHED);
+        }
+        else if (streq(split_cmd, "running")) {
+            scheduler_status(s,stdout,RUNNING);
+        }
+        else if (streq(split_cmd, "waiting")) {
+            scheduler_status(s,stdout,WAITING);
+        }
+        else if (streq(split_cmd, "finished")) {
+            scheduler_status(s,stdout,FINISHED);
+        }
+        else if (streq(split_cmd, "json")) {
+            shell_export(s, strtok(NULL," "));
+        }
+        else {
+            printf("Unknown queue: %s\n",split_cmd);
+        }
+    }
+    else if (streq(split_cmd, "batch")) {
+        split_cmd = strtok(NULL," ");
+        if(split_cmd) {
+            // Start whatever is ready on every free core right away
+            if(scheduler_batch(s,stdout,split_cmd)) {
+                scheduler_next(s);
+            }
+        }
+        else {
+            printf("Unknown command: %s\n", command);
+        }
+    }
+    else if (streq(split_cmd, "add")) {
+        split_cmd = strtok(NULL,"\n");
+        if(split_cmd) {
+            scheduler_add(s,stdout,split_cmd);
+            // Start it right away if a core is free
+            scheduler_next(s);
+        }
+        else {
+            printf("Unknown command: %s\n", command);
+        }
+    }
+    else {
+        printf("Unknown command: %s\n", command);
+    }
+    return true;
+}
+
+/**
+ * Read whatever is available on standard input and execute each complete
+ * command line in it (partial lines are kept in buffer for the next read).
+ * @param   s	    Pointer to Scheduler structure.
+ * @param   buffer  Buffer of BUFSIZ bytes holding partial line.
+ * @param   length  Number of bytes in buffer.
+ * @return  Whether or not the shell should keep going (false on exit or EOF).
+ **/
+bool shell_input(Scheduler *s, char *buffer, size_t *length) {
+    ssize_t nread = read(STDIN_FILENO, buffer + *length, BUFSIZ - 1 - *length);
+    if(nread < 0) {
+        return errno == EINTR || errno == EAGAIN;
+    }
+    *length += nread;
+    buffer[*length] = 0;
+
+    // Execute each line (and what is left at EOF or when the buffer is full)
+    char *line = buffer;
+    char *end;
+    while((end = strchr(line, '\n')) || (*line && (!nread || *length == BUFSIZ - 1))) {
+        if(end) {
+            *end = 0;
+        }
+        char *next = end ? end + 1 : line + strlen(line);
+        if(!shell_execute(s, line)) {
+            return false;
+        }
+        printf("\nPQSH> ");
+        line = next;
+    }
+    *length -= line - buffer;
+    memmove(buffer, line, *length + 1);
+    fflush(stdout);
+    return nread > 0;
+}
+
 /* Main Execution */
 
 int main(int argc, char *argv[]) {
@@ -38,66 +210,78 @@ int main(int argc, char *argv[]) {
         exit(EXIT_FAILURE);
     }
 
-    /* Register signal handlers */
-    bool success = signal_register(SIGALRM, 0, sigalrm_handler);
-    if(!success) {
+    /* Bind cores to the CPUs that are actually available */
+    scheduler_bind(s);
+
+    /* Report child exits through a signalfd */
+    int children = signal_descriptor(SIGCHLD);
+    if(children < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    /* Timer interrupt (armed one tick at a time, only when one is due) */
+    int timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if(timer < 0) {
+        error("Failed to create timerfd: %s", strerror(errno));
         exit(EXIT_FAILURE);
     }
 
-    /* Timer interrupt */
-    struct itimerval interval = {
-        .it_interval = { .tv_sec = 0, .tv_usec = s->timeout },
-        .it_value    = { .tv_sec = 0, .tv_usec = s->timeout },
+    /* Process shell comands, child exits, and timer ticks as they happen */
+    struct pollfd events[NEVENTS] = {
+        [INPUT_EVENT] = { .fd = STDIN_FILENO, .events = POLLIN },
+        [CHILD_EVENT] = { .fd = children,     .events = POLLIN },
+        [TIMER_EVENT] = { .fd = timer,        .events = POLLIN },
     };
+    char   command[BUFSIZ] = "";
+    size_t length          = 0;
 
-    if(setitimer(ITIMER_REAL, &interval, NULL) < 0) {
-        exit(EXIT_FAILURE);
+    /* Run batch without a shell (until every job of it finished) */
+    if(s->batch) {
+        if(!scheduler_batch(s, stdout, s->batch)) {
+            exit(EXIT_FAILURE);
+        }
+        events[INPUT_EVENT].fd = -1;
+        scheduler_next(s);
+        shell_timer(s, timer);
     }
-
-    /* Process shell comands */
-    while (!feof(stdin)) {
-        char command[BUFSIZ]  = "";
+    else {
         printf("\nPQSH> ");
-
-        while (!fgets(command, BUFSIZ, stdin) && !feof(stdin));
-
-        // Prevent seg fault by catching last run after the while
-        if(!strlen(command)) {
+    }
+    fflush(stdout);
+    while (!s->batch || !scheduler_idle(s)) {
+        if(poll(events, NEVENTS, -1) < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            error("Failed to poll: %s", strerror(errno));
             break;
         }
 
-        char* split_cmd = strtok(command," \n");
-        /* TODO: Handle add and status commands */
-        if(strcmp(command,"\n")) {
-            if (streq(split_cmd, "help")) {
-                help();
+        // Reap finished children first, so their cores can be reused
+        if(events[CHILD_EVENT].revents & POLLIN) {
+            signal_drain(children);
+            scheduler_wait(s);
+            scheduler_next(s);
+        }
+        if(events[TIMER_EVENT].revents & POLLIN) {
+            uint64_t expirations;
+            if(read(timer, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+                s->expired = true;
+                s->tick    = 0;
+                scheduler_wait(s);
+                scheduler_next(s);
             }
-            else if (streq(split_cmd, "exit") || streq(command, "quit")) {
+        }
+        if(events[INPUT_EVENT].revents & (POLLIN | POLLHUP | POLLERR)) {
+            if(!shell_input(s, command, &length)) {
                 break;
-            } 
-            else if (streq(split_cmd, "status")) {
-                split_cmd = strtok(NULL," ");
-
-                if(split_cmd) {
-                    printf("%s\n",split_cmd);
-                }
-                else {
-                    scheduler_status(s,stdout,7);
-                }
-            } 
-            else if (streq(split_cmd, "add")) {
-                split_cmd = strtok(NULL,"\n");
-                if(split_cmd) {
-                    scheduler_add(s,stdout,split_cmd);
-                }
-                else {
-                    printf("Unknown command: %s\n", command);
-                }
-            }
-            else if (strlen(command)) {
-                printf("Unknown command: %s\n", command);
             }
         }
+        shell_timer(s, timer);
+    }
+    if(s->batch) {
+        printf("Finished %lu processes (%lu failed).\n", s->total_finished, s->total_failed);
+        return s->total_failed ? EXIT_FAILURE : EXIT_SUCCESS;
     }
     return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
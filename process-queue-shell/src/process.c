@@ -1,5 +1,6 @@
 /* process.c: PQSH Process */
 
+#include "pqsh/cpu.h"
 #include "pqsh/macros.h"
 #include "pqsh/process.h"
 #include "pqsh/timestamp.h"
@@ -7,58 +8,149 @@
 #include <errno.h>
 #include <limits.h>
 #include <signal.h>
+#include <spawn.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+/* Structures */
+
+typedef struct Executable Executable;
+
+struct Executable {
+    char       *name;   /* Program name (as given in commands) */
+    char       *path;   /* Where PATH lookup found it */
+    Executable *next;   /* Pointer to next executable in same bucket */
+};
+
+/* Global Variables */
+
+Executable *PathCache[PATH_BUCKETS];    /* Programs resolved through PATH */
+
+extern char **environ;
+
+/* Internal Prototypes */
+
+const char *process_path(const char *name, bool refresh);
+
 /**
- * Create new process structure given command.
+ * Create new process structure given command (which is tokenized right
+ * away, so starting it later does no parsing).
+ *
+ * The structure, the argument array, the command, and the tokenized copy of
+ * it share one allocation sized for the command, so short commands take
+ * little memory and freeing the process is a single free.
+ *
  * @param   command     String with command to execute.
  * @return  Pointer to new process structure
  **/
 Process *process_create(const char *command) {
-    // Allocate space for new process
-    Process* new_process = calloc(1, sizeof(Process));
-    // Copy the command into the new process struct
-    strcpy(new_process->command,command);
+    // Count the arguments
+    size_t arg_count = 0;
+    for(const char *c = command; *c; c += strcspn(c, " \t")) {
+        c += strspn(c, " \t");
+        arg_count += *c ? 1 : 0;
+    }
+    arg_count = min(arg_count, MAX_ARGUMENTS - 1);
+
+    // Allocate space for new process (and its command behind it)
+    size_t   length      = strlen(command) + 1;
+    Process* new_process = calloc(1, sizeof(Process) + (arg_count + 1) * sizeof(char *) + 2 * length);
+    if(!new_process) {
+        return NULL;
+    }
+    new_process->argv    = (char **)(new_process + 1);
+    new_process->command = memcpy(new_process->argv + arg_count + 1, command, length);
+
+    // Split a copy of the command behind it, for the array to point at
+    char *arguments = memcpy(new_process->command + length, command, length);
+    char *state     = NULL;
+    size_t argc     = 0;
+    for(char* token = strtok_r(arguments, " \t", &state); token && argc < arg_count; token = strtok_r(NULL, " \t", &state)) {
+        new_process->argv[argc++] = token;
+    }
+    new_process->argv[argc] = NULL;
+
     // Update the arrival time
     new_process->arrival_time = timestamp();
+    new_process->cpu  = -1;
+    new_process->slot = -1;
     return new_process;
 }
 
 /**
- * Start process by forking and executing the command.
+ * Delete process structure (along with its command).
+ * @param   p           Pointer to Process structure (not in any queue).
+ **/
+void process_delete(Process *p) {
+    if(!p) {
+        return;
+    }
+    while(p->dependents) {
+        Dependent *next = p->dependents->next;
+        free(p->dependents);
+        p->dependents = next;
+    }
+    free(p);
+}
+
+/**
+ * Start process by spawning the command (posix_spawn shares the memory of
+ * the shell until exec instead of copying its page tables, so launching
+ * stays cheap however large the shell grows).
  * @param   p           Pointer to Process structure.
  * @return  Whether or not starting the process was successful
  **/
 bool process_start(Process *p) {
-    // Create child process
-    pid_t pid = fork();
-    p->pid = pid;
-
-    // Fork failed
-    if(p-pid < 0)
-    {
+    if(!p->argv || !p->argv[0]) {
         return false;
     }
-    // Child
-    else if(!pid) {
-        char* argv[MAX_ARGUMENTS] = {0};
-        int arg_count = 0;
 
-        // Extract the arguments from the entire command and store pointers these new substrings
-        for(char* token = strtok(p->command, " "); token; token =  strtok(NULL, " ")) {
-            argv[arg_count++] = token;
-        }
+    // The shell blocks the signals it polls for, but the command should not
+    posix_spawnattr_t attributes;
+    sigset_t          mask;
+    sigemptyset(&mask);
+    posix_spawnattr_init(&attributes);
+    posix_spawnattr_setsigmask(&attributes, &mask);
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGMASK);
+
+    // Pin the shell to the CPU of the slot the scheduler picked (if any) while
+    // spawning, so the command is bound before it executes anything
+    if(p->cpu >= 0 && !cpu_pin(p->cpu)) {
+        error("Unable to bind %s to CPU %d: %s", p->argv[0], p->cpu, strerror(errno));
+    }
 
-        execvp(argv[0], argv);
-        // Exec only returns if it fails, if it does then we hit exit(1)
-        exit(1);
+    // Spawn the cached executable (looking it up again if it moved)
+    pid_t pid    = 0;
+    int   status = ENOENT;
+    const char *path = NULL;
+    for(int attempt = 0; attempt < 2 && (status == ENOENT || status == EACCES); attempt++) {
+        path   = process_path(p->argv[0], attempt > 0);
+        status = path ? posix_spawn(&pid, path, NULL, &attributes, p->argv, environ) : ENOENT;
     }
-    // Parent
-    else {
-        // Record start time
-        p->start_time = timestamp();
+
+    // Run scripts without an interpreter line through the shell (as execvp
+    // does, but posix_spawn does not)
+    if(status == ENOEXEC) {
+        char *script[MAX_ARGUMENTS + 1] = {"/bin/sh", (char *)path};
+        for(size_t i = 1; p->argv[i]; i++) {
+            script[i + 1] = p->argv[i];
+        }
+        status = posix_spawn(&pid, script[0], NULL, &attributes, script, environ);
+    }
+    posix_spawnattr_destroy(&attributes);
+    if(!cpu_unpin()) {
+        error("Unable to restore CPU affinity: %s", strerror(errno));
+    }
+
+    if(status) {
+        error("Unable to start %s: %s", p->argv[0], strerror(status));
+        return false;
     }
+    p->pid = pid;
+
+    // Record start time
+    p->start_time = timestamp();
     return true;
 }
 
@@ -80,4 +172,105 @@ bool process_pause(Process *p) {
 bool process_resume(Process *p) {
     int sig_sent = kill(p->pid, SIGCONT);
     return sig_sent == 0;
-}
\ No newline at end of file
+}
+
+/**
+ * Bind process to its CPU (before resuming it on another slot than before).
+ * @param   p           Pointer to Process structure.
+ * @return  Whether or not binding the process was successful.
+ **/
+bool process_bind(Process *p) {
+    return p->cpu < 0 || cpu_bind(p->pid, p->cpu);
+}
+
+/**
+ * Return CPU time used by process so far (from /proc/[pid]/stat).
+ * @param   p           Pointer to Process structure.
+ * @return  Seconds of user and system time (0 if it cannot be read).
+ **/
+double process_cpu(Process *p) {
+    char path[BUFSIZ];
+    char stat[BUFSIZ] = "";
+    snprintf(path, sizeof(path), "/proc/%ld/stat", (long)p->pid);
+
+    FILE *fs = fopen(path, "r");
+    if(!fs) {
+        return 0;
+    }
+    size_t nread = fread(stat, 1, sizeof(stat) - 1, fs);
+    stat[nread] = 0;
+    fclose(fs);
+
+    // Skip past the command name (which may contain spaces) to the state field
+    char *fields = strrchr(stat, ')');
+    unsigned long utime = 0, stime = 0;
+    if(!fields || sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2) {
+        return 0;
+    }
+    return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+/* Internal Functions */
+
+/**
+ * Resolve program name to the executable the PATH lookup of execvp would
+ * run (names with a slash are used as they are), caching what was found.
+ * @param   name        Program name.
+ * @param   refresh     Whether to look it up again (the cached one failed).
+ * @return  Path of executable (NULL if there is none).
+ **/
+const char *process_path(const char *name, bool refresh) {
+    if(strchr(name, '/')) {
+        return name;
+    }
+
+    // Look for the cached executable
+    size_t hash = 5381;
+    for(const char *c = name; *c; c++) {
+        hash = hash * 33 + (unsigned char)*c;
+    }
+    Executable **link = &PathCache[hash % PATH_BUCKETS];
+    while(*link && !streq((*link)->name, name)) {
+        link = &(*link)->next;
+    }
+    if(*link && !refresh) {
+        return (*link)->path;
+    }
+    if(*link) {
+        Executable *stale = *link;
+        *link = stale->next;
+        free(stale->name);
+        free(stale->path);
+        free(stale);
+    }
+
+    // Search each directory of PATH in order
+    const char *search = getenv("PATH");
+    char        path[PATH_MAX];
+    for(search = search ? search : "/bin:/usr/bin"; search; search = strchr(search, ':') ? strchr(search, ':') + 1 : NULL) {
+        size_t length = strcspn(search, ":");
+        snprintf(path, sizeof(path), "%.*s/%s", length ? (int)length : 1, length ? search : ".", name);
+        // Skip directories (and others that cannot be executed), as execvp
+        // does when they fail to exec
+        struct stat status;
+        if(stat(path, &status) == 0 && S_ISREG(status.st_mode) && access(path, X_OK) == 0) {
+            break;
+        }
+        path[0] = 0;
+    }
+    if(!search || !path[0]) {
+        return NULL;
+    }
+
+    Executable *found = calloc(1, sizeof(Executable));
+    if(!found || !(found->name = strdup(name)) || !(found->path = strdup(path))) {
+        if(found) {
+            free(found->name);
+        }
+        free(found);
+        return NULL;
+    }
+    found->next = *link;
+    *link = found;
+    return found->path;
+}
@@ -21,10 +21,48 @@ void queue_push(Queue *q, Process *p) {
     else {
         q->tail->next = p;
     }
+    p->prev  = q->tail;
+    p->next  = NULL;
+    p->queue = q;
     q->tail = p;
     (q->size)++;
 }
 
+/**
+ * Insert process into queue by priority (behind every process with at least
+ * its priority, so processes of equal priority stay in arrival order).
+ * @param q     Pointer to Queue structure.
+ * @param p     Pointer to Process structure.
+ **/
+void queue_insert(Queue *q, Process *p) {
+    // Error checking
+    if(!q || !p) {
+        return;
+    }
+    // Search from the back, since most processes share the same priority
+    Process *after = q->tail;
+    while(after && after->priority < p->priority) {
+        after = after->prev;
+    }
+
+    p->prev = after;
+    p->next = after ? after->next : q->head;
+    if(p->next) {
+        p->next->prev = p;
+    }
+    else {
+        q->tail = p;
+    }
+    if(after) {
+        after->next = p;
+    }
+    else {
+        q->head = p;
+    }
+    p->queue = q;
+    (q->size)++;
+}
+
 /**
  * Pop process from front of queue.
  * @param q     Pointer to Queue structure.
@@ -36,15 +74,8 @@ Process* queue_pop(Queue *q) {
         return NULL;
     }
 
-    // If size == 1, set tail to NULL
-    if(q->size ==1) {
-      q->tail = NULL;
-    }
-    // Update head
     Process* front = q->head;
-    q->head = q->head->next;
-    front->next = NULL;
-    q->size--;
+    queue_unlink(q, front);
     return front;
 }
 
@@ -60,35 +91,49 @@ Process*  queue_remove(Queue *q, pid_t pid) {
         return NULL;
     }
 
-    Process* curr = q->head;
-    Process* prev = NULL;
-
     // Loop over queue elements
-    while(curr) {
-        // Desired pid found
-        if(curr->pid == pid) {
-            // Element at the start (avoids using prev)
-            if(curr == q->head) {
-                q->head = curr->next;
-            }
-            // Element at the end
-            if(curr == q->tail) {
-                q->tail = prev;
-            }
-            if(prev) {
-                prev->next = curr->next;
-            }
-
-            q->size--;
-            curr->next = NULL;
-            break;
-        }
-        prev = curr;
+    Process* curr = q->head;
+    while(curr && curr->pid != pid) {
         curr = curr->next;
     }
+    // Desired pid found
+    if(curr) {
+        queue_unlink(q, curr);
+    }
     return curr;
 }
 
+/**
+ * Remove process from queue (in constant time, since processes know their
+ * neighbors).
+ * @param q     Pointer to Queue structure.
+ * @param p     Pointer to Process structure (in queue).
+ **/
+void queue_unlink(Queue *q, Process *p) {
+    // Error handling
+    if(!q || !p || p->queue != q) {
+        return;
+    }
+
+    if(p->prev) {
+        p->prev->next = p->next;
+    }
+    else {
+        q->head = p->next;
+    }
+    if(p->next) {
+        p->next->prev = p->prev;
+    }
+    else {
+        q->tail = p->prev;
+    }
+
+    q->size--;
+    p->next  = NULL;
+    p->prev  = NULL;
+    p->queue = NULL;
+}
+
 /**
  * Dump the contents of the Queue to the specified stream.
  * @param q     Queue structure.
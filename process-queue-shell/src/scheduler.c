@@ -5,6 +5,8 @@
 #include "pqsh/timestamp.h"
 
 #include <errno.h>
+#include <sys/resource.h>
+#include <sys/types.h>
 #include <sys/wait.h>
 
 /**
@@ -15,7 +17,11 @@
  **/
 void scheduler_add(Scheduler *s, FILE *fs, const char *command) {
     Process *new_process = process_create(command);
-    queue_push(&(s->waiting),new_process);
+    if(!new_process) {
+        fprintf(fs,"Unable to add process \"%s\".\n",command);
+        return;
+    }
+    queue_insert(&(s->waiting),new_process);
     fprintf(fs,"Added process \"%s\" to waiting queue.\n",command);
 }
 
@@ -26,39 +32,95 @@ void scheduler_add(Scheduler *s, FILE *fs, const char *command) {
  * @param   queue   Bitmask specifying which queues to display.
  **/
 void scheduler_status(Scheduler *s, FILE *fs, int queue) {
+    // Nothing finished yet means no averages (rather than dividing by zero)
+    size_t finished = s->total_finished;
     fprintf(fs, "Running = %4lu, Waiting = %4lu, Finished = %4lu, Turnaround = %05.2lf, Response = %05.2lf\n",
-                s->running.size,s->waiting.size,s->finished.size,(s->total_turnaround_time/s->finished.size),
-                (s->total_response_time/s->finished.size));
+                s->running.size,scheduler_waiting(s),finished,finished ? s->total_turnaround_time/finished : 0,
+                finished ? s->total_response_time/finished : 0);
 
     /* Complement implementation. */
-    if(queue && RUNNING && s->running.size) {
+    if((queue & RUNNING) && s->running.size) {
         fprintf(fs,"Running Queue:\n");
         queue_dump(&(s->running) ,fs);
         fprintf(fs,"\n");
     }
-    if(queue && WAITING && s->waiting.size) {
+    if((queue & WAITING) && s->waiting.size) {
         fprintf(fs,"Waiting Queue:\n");
         queue_dump(&(s->waiting) ,fs);
         fprintf(fs,"\n");
     }
-    if(queue && FINISHED && s->finished.size) {
+    if((queue & WAITING) && s->blocked.size) {
+        fprintf(fs,"Blocked Queue:\n");
+        queue_dump(&(s->blocked) ,fs);
+        fprintf(fs,"\n");
+    }
+    for(size_t level = 0; (queue & WAITING) && level < MLFQ_LEVELS; level++) {
+        if(s->levels[level].size) {
+            fprintf(fs,"Waiting Queue (Level %lu):\n", level);
+            queue_dump(&(s->levels[level]) ,fs);
+            fprintf(fs,"\n");
+        }
+    }
+    if((queue & WAITING) && s->ready.size) {
+        fprintf(fs,"Waiting Queue (Shortest First):\n");
+        heap_dump(&(s->ready) ,fs);
+        fprintf(fs,"\n");
+    }
+    if((queue & FINISHED) && s->finished.size) {
         fprintf(fs,"Finished Queue:\n");
         queue_dump(&(s->finished) ,fs);
         fprintf(fs,"\n");
     }
 }
 
+/**
+ * Bind the cores of Scheduler to the CPUs that are actually available by
+ * doing the following:
+ *
+ *  1. Discover the CPUs the affinity mask and cgroup cpuset allow.
+ *
+ *  2. Limit the number of cores to those CPUs and to the cgroup CPU quota
+ *  (0 cores means use all of them).
+ *
+ *  3. Give each core a slot bound to one of those CPUs.
+ *
+ * @param   s	    Pointer to Scheduler structure.
+ **/
+void scheduler_bind(Scheduler *s) {
+    int    cpus[CPUS_MAX];
+    size_t available = cpu_available(cpus, CPUS_MAX);
+    size_t quota     = cpu_quota();
+    size_t limit     = quota && quota < available ? quota : available;
+
+    if(!available) {
+        s->cores = s->cores ? s->cores : 1;
+        return;
+    }
+    if(!s->cores || s->cores > limit) {
+        if(s->cores) {
+            info("Using %lu cores (%lu CPUs available, quota %lu)", limit, available, quota);
+        }
+        s->cores = limit;
+    }
+
+    s->ncpus = s->cores;
+    for(size_t slot = 0; slot < s->ncpus; slot++) {
+        s->cpus[slot]  = cpus[slot];
+        s->slots[slot] = NULL;
+    }
+}
+
 /**
  * Schedule next process using appropriate policy.
  * @param   s	    Pointer to Scheduler structure.
  **/
 void scheduler_next(Scheduler *s) {
     /* Dispatch to appropriate scheduler function. */
-    if(s->policy == FIFO_POLICY) {
-        scheduler_fifo(s);
-    }
-    else {
-        scheduler_rdrn(s);
+    switch(s->policy) {
+        case FIFO_POLICY: scheduler_fifo(s); break;
+        case MLFQ_POLICY: scheduler_mlfq(s); break;
+        case SJF_POLICY:  scheduler_sjf(s);  break;
+        default:          scheduler_rdrn(s); break;
     }
 }
 
@@ -74,19 +136,250 @@ void scheduler_wait(Scheduler *s) {
      *  - Update Scheduler metrics.
      **/
 
-    pid_t pid;
-    while((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
-        // Remove process from running queue
-        Process* found = queue_remove(&s->running, pid);
+    pid_t         pid;
+    int           status;
+    struct rusage usage;
+    while((pid = wait4(-1, &status, WNOHANG, &usage)) > 0) {
+        // Find the process by pid and remove it from whichever queue holds it
+        Process* found = table_remove(&s->processes, pid);
+        if(!found) {
+            continue;
+        }
+        if(found->queue == &s->running) {
+            found->run_time += timestamp() - found->resume_time;
+        }
+        scheduler_release(s, found);
+        queue_unlink(found->queue, found);
+        heap_remove(&s->ready, found);
+
+        // Remember how long the command ran (for shortest job first)
+        history_update(&s->history, found->command, found->run_time);
+
+        // Record the resources it used
+        found->status               = status;
+        found->user_time            = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+        found->system_time          = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+        found->max_rss              = usage.ru_maxrss;
+        found->voluntary_switches   = usage.ru_nvcsw;
+        found->involuntary_switches = usage.ru_nivcsw;
 
         found->end_time = timestamp();
-        // Put process into finished queue
-        queue_push(&s->finished, found);
+        scheduler_finish(s, found);
+    }
+}
+
+/**
+ * Start process (or resume it if it was started before) and place it in the
+ * back of the running queue.
+ * @param   s	    Pointer to Scheduler structure.
+ * @param   p	    Pointer to Process structure (not in any queue).
+ **/
+void scheduler_run(Scheduler *s, Process *p) {
+    scheduler_claim(s, p);
+    if(p->pid == 0) {
+        if(!process_start(p)) {
+            // Commands that cannot be started finish right away
+            scheduler_release(s, p);
+            p->status     = 127 << 8;
+            p->start_time = p->end_time = timestamp();
+            scheduler_finish(s, p);
+            return;
+        }
+        table_insert(&s->processes, p);
+    }
+    else {
+        if(!process_bind(p)) {
+            error("Unable to bind %d to CPU %d: %s", p->pid, p->cpu, strerror(errno));
+        }
+        process_resume(p);
+    }
+    p->resume_time = timestamp();
+    p->slice_time  = p->resume_time;
+    p->cpu_time    = p->pid > 0 ? process_cpu(p) : 0;
+    if(!p->quantum) {
+        p->quantum = s->timeout / 1e6;
+    }
+    p->slices++;
+    queue_push(&s->running, p);
+}
+
+/**
+ * Pause running process and remove it from the running queue (the policy
+ * decides where it waits).
+ * @param   s	    Pointer to Scheduler structure.
+ * @param   p	    Pointer to Process structure (in running queue).
+ **/
+void scheduler_preempt(Scheduler *s, Process *p) {
+    queue_unlink(&s->running, p);
+    scheduler_release(s, p);
+    process_pause(p);
+    p->run_time += timestamp() - p->resume_time;
+}
+
+/**
+ * Add finished process to the totals and place it in the back of the
+ * finished queue (deleting the oldest finished processes beyond the ones
+ * retained, so memory stays bounded however many processes run).
+ * @param   s	    Pointer to Scheduler structure.
+ * @param   p	    Pointer to Process structure (not in any queue).
+ **/
+void scheduler_finish(Scheduler *s, Process *p) {
+    // Release the processes waiting for it (before it may be deleted)
+    while(p->dependents) {
+        Dependent *dependent = p->dependents;
+        p->dependents = dependent->next;
+        scheduler_unblock(s, dependent->process, p->status);
+        free(dependent);
+    }
+
+    s->total_finished++;
+    s->total_failed               += p->status != 0;
+    s->total_turnaround_time      += p->end_time - p->arrival_time;
+    s->total_response_time        += p->start_time - p->arrival_time;
+    s->total_user_time            += p->user_time;
+    s->total_system_time          += p->system_time;
+    s->total_voluntary_switches   += p->voluntary_switches;
+    s->total_involuntary_switches += p->involuntary_switches;
+    s->total_slices               += p->slices;
+    s->max_rss                     = p->max_rss > s->max_rss ? p->max_rss : s->max_rss;
 
-        double turnaround_time = found->end_time - found->arrival_time;
-        double response_time = found->start_time - found->arrival_time;
+    queue_push(&s->finished, p);
+    while(s->finished.size > s->retain) {
+        process_delete(queue_pop(&s->finished));
+    }
+}
+
+/**
+ * Note that a dependency of blocked process finished, and once none is left
+ * place it in the waiting queue (or finish it without running if any of
+ * them failed).
+ * @param   s	    Pointer to Scheduler structure.
+ * @param   p	    Pointer to Process structure (in blocked queue).
+ * @param   status  Exit status of dependency.
+ **/
+void scheduler_unblock(Scheduler *s, Process *p, int status) {
+    if(status) {
+        p->status = status;
+    }
+    if(--p->pending) {
+        return;
+    }
+    queue_unlink(&s->blocked, p);
+
+    // It only arrives now (waiting for dependencies is not scheduling delay)
+    p->arrival_time = timestamp();
+    if(p->status) {
+        error("Skipping %s: dependency failed", p->command);
+        p->start_time = p->end_time = p->arrival_time;
+        scheduler_finish(s, p);
+    }
+    else {
+        queue_insert(&s->waiting, p);
+    }
+}
+
+/**
+ * Give process a free slot (preferring the one bound to the CPU it last ran
+ * on, so it finds its cache warm).
+ * @param   s	    Pointer to Scheduler structure.
+ * @param   p	    Pointer to Process structure.
+ **/
+void scheduler_claim(Scheduler *s, Process *p) {
+    ssize_t free_slot = -1;
+    for(size_t slot = 0; slot < s->ncpus; slot++) {
+        if(!s->slots[slot] && (free_slot < 0 || s->cpus[slot] == p->cpu)) {
+            free_slot = slot;
+            if(s->cpus[slot] == p->cpu) {
+                break;
+            }
+        }
+    }
+    if(free_slot >= 0) {
+        s->slots[free_slot] = p;
+        p->slot = free_slot;
+        p->cpu  = s->cpus[free_slot];
+    }
+}
+
+/**
+ * Free slot of process (it remembers its CPU for next time).
+ * @param   s	    Pointer to Scheduler structure.
+ * @param   p	    Pointer to Process structure.
+ **/
+void scheduler_release(Scheduler *s, Process *p) {
+    if(p->slot >= 0) {
+        s->slots[p->slot] = NULL;
+        p->slot = -1;
+    }
+}
 
-        s->total_turnaround_time += turnaround_time;
-        s->total_response_time += response_time;
+/**
+ * Return number of processes waiting to run (in whichever queues the policy
+ * keeps them).
+ * @param   s	    Pointer to Scheduler structure.
+ * @return  Number of waiting processes.
+ **/
+size_t scheduler_waiting(Scheduler *s) {
+    size_t waiting = s->waiting.size + s->ready.size;
+    for(size_t level = 0; level < MLFQ_LEVELS; level++) {
+        waiting += s->levels[level].size;
     }
+    return waiting;
+}
+
+/**
+ * Return how long until the timer has to expire next, so it only fires when
+ * a preemption is due instead of every time slice:
+ *
+ *  - Round robin needs a tick only once all cores are busy and a process is
+ *  waiting, when the earliest quantum of the running processes runs out.
+ *
+ *  - Multilevel feedback queue and shortest job first account for every
+ *  slice, so they tick periodically (measured from the last tick) while
+ *  anything is running.
+ *
+ * @param   s	    Pointer to Scheduler structure.
+ * @return  Seconds until next tick (negative if no tick is needed).
+ **/
+double scheduler_timeout(Scheduler *s) {
+    double now = timestamp();
+    double due = -1;
+
+    switch(s->policy) {
+        case FIFO_POLICY:
+            break;
+        case RDRN_POLICY:
+            if(s->running.size >= s->cores && s->waiting.size != 0) {
+                for(Process *p = s->running.head; p; p = p->next) {
+                    double end = p->slice_time + p->quantum;
+                    due = due < 0 ? end : min(due, end);
+                }
+            }
+            break;
+        default:
+            if(!s->running.size) {
+                s->tick = 0;
+            }
+            else {
+                if(!s->tick) {
+                    s->tick = now + s->timeout / 1e6;
+                }
+                due = s->tick;
+            }
+            break;
+    }
+    if(due < 0) {
+        return -1;
+    }
+    return due > now ? due - now : 0;
+}
+
+/**
+ * Return whether Scheduler has nothing left to do (no process is running,
+ * waiting, or blocked).
+ * @param   s	    Pointer to Scheduler structure.
+ * @return  Whether or not every process finished.
+ **/
+bool scheduler_idle(Scheduler *s) {
+    return !s->running.size && !scheduler_waiting(s) && !s->blocked.size;
 }
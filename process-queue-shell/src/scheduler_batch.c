@@ -0,0 +1,213 @@
+/* scheduler_batch.c: PQSH Batch Submission */
+
+#include "pqsh/macros.h"
+#include "pqsh/scheduler.h"
+
+#include <errno.h>
+#include <string.h>
+
+/* Structures */
+
+typedef struct {
+    const char *name;       /* Name of job (NULL if it has none) */
+    Process    *process;    /* Process running job */
+} Job;
+
+/* Internal Prototypes */
+
+bool    scheduler_batch_parse(Job **jobs, size_t *njobs, size_t *capacity, char *line);
+bool    scheduler_batch_depend(Job *jobs, size_t njobs, Process *p, char *after);
+void    scheduler_batch_discard(Job *jobs, size_t njobs);
+
+/**
+ * Add every job of batch file to Scheduler by doing the following:
+ *
+ *  1. Parse each line as optional attributes followed by the command:
+ *
+ *      name=NAME       Name later jobs can depend on this one by.
+ *      priority=N      Start before waiting jobs with lower priority (default 0;
+ *                      only fifo and rdrn order by it, mlfq and sjf ignore it).
+ *      after=A,B,...   Start only once jobs A, B, ... (named on earlier
+ *                      lines) succeeded (otherwise skip it).
+ *
+ *  Blank lines and lines starting with # are ignored.
+ *
+ *  2. Place jobs without dependencies in the waiting queue (by priority) and
+ *  the others in the blocked queue (until their dependencies finish).
+ *
+ * The whole file is parsed before any job is added, so a bad line adds
+ * nothing.  Dependencies only refer back to earlier lines, so they can never
+ * form a cycle.
+ *
+ * @param   s	    Pointer to Scheduler structure.
+ * @param   fs      File stream to write to.
+ * @param   path    Path of batch file.
+ * @return  Whether or not the jobs were added.
+ **/
+bool scheduler_batch(Scheduler *s, FILE *fs, const char *path) {
+    FILE *stream = fopen(path, "r");
+    if(!stream) {
+        fprintf(fs, "Unable to open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    Job    *jobs     = NULL;
+    size_t  njobs    = 0;
+    size_t  capacity = 0;
+    size_t  number   = 0;
+    char   *line     = NULL;
+    size_t  length   = 0;
+    bool    parsed   = true;
+    while(parsed && getline(&line, &length, stream) >= 0) {
+        number++;
+        if(!(parsed = scheduler_batch_parse(&jobs, &njobs, &capacity, line))) {
+            fprintf(fs, "%s:%lu: Unable to add job (bad attribute, unknown dependency, or no command)\n", path, number);
+        }
+    }
+    free(line);
+    fclose(stream);
+
+    if(!parsed) {
+        scheduler_batch_discard(jobs, njobs);
+        return false;
+    }
+
+    size_t blocked = 0;
+    for(size_t i = 0; i < njobs; i++) {
+        Process *p = jobs[i].process;
+        if(p->pending) {
+            queue_push(&s->blocked, p);
+            blocked++;
+        }
+        else {
+            queue_insert(&s->waiting, p);
+        }
+        free((char *)jobs[i].name);
+    }
+    free(jobs);
+    fprintf(fs, "Added %lu processes from %s (%lu blocked).\n", njobs, path, blocked);
+    return true;
+}
+
+/* Internal Functions */
+
+/**
+ * Parse line of batch file and append its job (if any) to the jobs.
+ * @param   jobs        Array of jobs parsed so far (grown as needed).
+ * @param   njobs       Number of jobs parsed so far (updated).
+ * @param   capacity    Number of jobs array holds (updated).
+ * @param   line        Line of batch file (modified).
+ * @return  Whether or not the line was valid.
+ **/
+bool scheduler_batch_parse(Job **jobs, size_t *njobs, size_t *capacity, char *line) {
+    line[strcspn(line, "\n")] = 0;
+    char *c = line + strspn(line, " \t");
+    if(!*c || *c == '#') {
+        return true;
+    }
+
+    // Split off the attributes in front of the command
+    char *name     = NULL;
+    char *after    = NULL;
+    long  priority = 0;
+    while(true) {
+        size_t size  = strcspn(c, " \t");
+        char  *value = strchr(c, '=');
+        if(!value || value > c + size) {
+            break;
+        }
+        bool last  = !c[size];
+        c[size]    = 0;
+        *value++   = 0;
+        if(streq(c, "name")) {
+            name = value;
+        }
+        else if(streq(c, "after")) {
+            after = value;
+        }
+        else if(streq(c, "priority")) {
+            char *end;
+            priority = strtol(value, &end, 10);
+            if(!*value || *end) {
+                return false;
+            }
+        }
+        else {
+            // Not an attribute after all, so restore it as part of the command
+            value[-1] = '=';
+            c[size]   = last ? 0 : ' ';
+            break;
+        }
+        c += size + !last;
+        c += strspn(c, " \t");
+    }
+    if(!*c) {
+        return false;
+    }
+
+    if(*njobs == *capacity) {
+        size_t capacity_new = *capacity ? 2 * *capacity : 64;
+        Job   *jobs_new     = realloc(*jobs, capacity_new * sizeof(Job));
+        if(!jobs_new) {
+            return false;
+        }
+        *jobs     = jobs_new;
+        *capacity = capacity_new;
+    }
+
+    Process *p = process_create(c);
+    if(!p) {
+        return false;
+    }
+    p->priority = priority;
+    Job *job    = &(*jobs)[*njobs];
+    job->process = p;
+    job->name    = name ? strdup(name) : NULL;
+    (*njobs)++;
+    return (!name || job->name) && (!after || scheduler_batch_depend(*jobs, *njobs - 1, p, after));
+}
+
+/**
+ * Make process depend on the jobs named in comma-separated list.
+ * @param   jobs        Array of earlier jobs.
+ * @param   njobs       Number of earlier jobs.
+ * @param   p           Pointer to Process structure.
+ * @param   after       Comma-separated names of jobs (modified).
+ * @return  Whether or not every job was found.
+ **/
+bool scheduler_batch_depend(Job *jobs, size_t njobs, Process *p, char *after) {
+    char *state = NULL;
+    for(char *name = strtok_r(after, ",", &state); name; name = strtok_r(NULL, ",", &state)) {
+        // Later jobs with the same name replace earlier ones
+        ssize_t i = njobs - 1;
+        while(i >= 0 && !(jobs[i].name && streq(jobs[i].name, name))) {
+            i--;
+        }
+        if(i < 0) {
+            return false;
+        }
+
+        Dependent *dependent = malloc(sizeof(Dependent));
+        if(!dependent) {
+            return false;
+        }
+        dependent->process = p;
+        dependent->next    = jobs[i].process->dependents;
+        jobs[i].process->dependents = dependent;
+        p->pending++;
+    }
+    return true;
+}
+
+/**
+ * Delete jobs of batch that could not be added.
+ * @param   jobs        Array of jobs.
+ * @param   njobs       Number of jobs.
+ **/
+void scheduler_batch_discard(Job *jobs, size_t njobs) {
+    for(size_t i = 0; i < njobs; i++) {
+        process_delete(jobs[i].process);
+        free((char *)jobs[i].name);
+    }
+    free(jobs);
+}
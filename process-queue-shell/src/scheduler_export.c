@@ -0,0 +1,185 @@
+/* scheduler_export.c: PQSH Scheduler Metrics Export */
+
+#include "pqsh/macros.h"
+#include "pqsh/scheduler.h"
+#include "pqsh/timestamp.h"
+
+#include <assert.h>
+#include <sys/wait.h>
+
+/* Constants */
+
+#define PERCENTILES     5       /* Number of percentiles reported */
+
+/* Internal Prototypes */
+
+void    scheduler_export_string(FILE *fs, const char *string);
+void    scheduler_export_latency(FILE *fs, const char *name, double *samples, size_t n);
+void    scheduler_export_queue(FILE *fs, Queue *q, const char *state, double now, bool *first);
+void    scheduler_export_process(FILE *fs, Process *p, const char *state, double now, bool *first);
+int     scheduler_export_compare(const void *a, const void *b);
+
+/**
+ * Export snapshot of Scheduler as JSON by doing the following:
+ *
+ *  1. Report the configuration and the size of each queue.
+ *
+ *  2. Report percentiles of the response and turnaround times of retained
+ *  finished processes, and the resources every finished process used
+ *  altogether.
+ *
+ *  3. Report every process with its timestamps, time spent running and
+ *  waiting, number of run slices, and resource usage (from wait4, once it
+ *  finished).
+ *
+ * @param   s	    Pointer to Scheduler structure.
+ * @param   fs      File stream to write to.
+ **/
+void scheduler_export(Scheduler *s, FILE *fs) {
+    static const char *policies[] = {"fifo", "rdrn", "mlfq", "sjf"};
+    double now = timestamp();
+
+    fprintf(fs, "{\"time\": %.6lf, \"policy\": \"%s\", \"cores\": %lu, \"timeout\": %ld,\n",
+                now, policies[s->policy], s->cores, (long)s->timeout);
+    fprintf(fs, " \"running\": %lu, \"waiting\": %lu, \"blocked\": %lu, \"finished\": %lu, \"failed\": %lu, \"retained\": %lu,\n",
+                s->running.size, scheduler_waiting(s), s->blocked.size, s->total_finished, s->total_failed, s->finished.size);
+
+    // Collect the latencies of retained finished processes
+    size_t  n          = s->finished.size;
+    double *response   = calloc(2 * n + 1, sizeof(double));
+    double *turnaround = response + n;
+    size_t  i = 0;
+    for(Process *p = s->finished.head; p && response; p = p->next, i++) {
+        response[i]   = p->start_time - p->arrival_time;
+        turnaround[i] = p->end_time - p->arrival_time;
+    }
+    scheduler_export_latency(fs, "response", response, response ? n : 0);
+    scheduler_export_latency(fs, "turnaround", turnaround, response ? n : 0);
+    free(response);
+    fprintf(fs, " \"usage\": {\"user\": %.6lf, \"system\": %.6lf, \"max_rss\": %ld, "
+                "\"voluntary_switches\": %ld, \"involuntary_switches\": %ld, \"slices\": %lu},\n",
+                s->total_user_time, s->total_system_time, s->max_rss,
+                s->total_voluntary_switches, s->total_involuntary_switches, s->total_slices);
+
+    // Report every process by state
+    bool first = true;
+    fprintf(fs, " \"processes\": [");
+    scheduler_export_queue(fs, &s->running, "running", now, &first);
+    scheduler_export_queue(fs, &s->waiting, "waiting", now, &first);
+    for(size_t level = 0; level < MLFQ_LEVELS; level++) {
+        scheduler_export_queue(fs, &s->levels[level], "waiting", now, &first);
+    }
+    for(size_t slot = 1; slot <= s->ready.size; slot++) {
+        scheduler_export_process(fs, s->ready.items[slot], "waiting", now, &first);
+    }
+    scheduler_export_queue(fs, &s->blocked, "blocked", now, &first);
+    scheduler_export_queue(fs, &s->finished, "finished", now, &first);
+    fprintf(fs, "\n ]}\n");
+    fflush(fs);
+}
+
+/* Internal Functions */
+
+/**
+ * Write string as JSON string (quoted and escaped).
+ * @param   fs      File stream to write to.
+ * @param   string  String to write.
+ **/
+void scheduler_export_string(FILE *fs, const char *string) {
+    fputc('"', fs);
+    for(const unsigned char *c = (const unsigned char *)string; *c; c++) {
+        if(*c == '"' || *c == '\\') {
+            fprintf(fs, "\\%c", *c);
+        }
+        else if(*c < 0x20) {
+            fprintf(fs, "\\u%04x", *c);
+        }
+        else {
+            fputc(*c, fs);
+        }
+    }
+    fputc('"', fs);
+}
+
+/**
+ * Write mean, percentiles, and maximum of latencies as JSON member.
+ * @param   fs      File stream to write to.
+ * @param   name    Name of member.
+ * @param   samples Latencies (sorted in place).
+ * @param   n       Number of latencies.
+ **/
+void scheduler_export_latency(FILE *fs, const char *name, double *samples, size_t n) {
+    static const double  percentiles[PERCENTILES] = {50, 90, 95, 99, 99.9};
+    static const char   *labels[PERCENTILES]      = {"p50", "p90", "p95", "p99", "p999"};
+
+    double total = 0;
+    for(size_t i = 0; i < n; i++) {
+        total += samples[i];
+    }
+    qsort(samples, n, sizeof(double), scheduler_export_compare);
+
+    fprintf(fs, " \"%s\": {\"mean\": %.6lf", name, n ? total / n : 0);
+    for(size_t i = 0; i < PERCENTILES; i++) {
+        // Nearest rank: the ceil(p/100 * n)-th smallest sample (1-based)
+        double position = percentiles[i] * n / 100;
+        size_t rank     = (size_t)position + ((size_t)position < position);
+        fprintf(fs, ", \"%s\": %.6lf", labels[i], n ? samples[min(rank ? rank - 1 : 0, n - 1)] : 0);
+    }
+    fprintf(fs, ", \"max\": %.6lf},\n", n ? samples[n - 1] : 0);
+}
+
+/**
+ * Write each process of queue as JSON object (in array of processes).
+ * @param   fs      File stream to write to.
+ * @param   q       Queue structure.
+ * @param   state   State of processes in queue.
+ * @param   now     Current timestamp.
+ * @param   first   Whether no process was written yet (updated).
+ **/
+void scheduler_export_queue(FILE *fs, Queue *q, const char *state, double now, bool *first) {
+    for(Process *p = q->head; p; p = p->next) {
+        scheduler_export_process(fs, p, state, now, first);
+    }
+}
+
+/**
+ * Write process as JSON object (in array of processes).
+ * @param   fs      File stream to write to.
+ * @param   p       Process structure.
+ * @param   state   State of process.
+ * @param   now     Current timestamp.
+ * @param   first   Whether no process was written yet (updated).
+ **/
+void scheduler_export_process(FILE *fs, Process *p, const char *state, double now, bool *first) {
+    bool   running = streq(state, "running");
+    bool   ended   = streq(state, "finished");
+    double ran     = p->run_time + (running ? now - p->resume_time : 0);
+    double elapsed = (ended ? p->end_time : now) - p->arrival_time;
+
+    fprintf(fs, "%s\n  {\"pid\": %ld, \"command\": ", *first ? "" : ",", (long)p->pid);
+    scheduler_export_string(fs, p->command);
+    fprintf(fs, ", \"state\": \"%s\", \"cpu\": %d, \"arrival\": %.6lf, \"start\": %.6lf, \"end\": %.6lf, "
+                "\"run\": %.6lf, \"wait\": %.6lf, \"slices\": %lu, \"quantum\": %.6lf",
+                state, p->cpu, p->arrival_time, p->start_time, p->end_time,
+                ran, elapsed > ran ? elapsed - ran : 0, p->slices, p->quantum);
+    if(ended) {
+        fprintf(fs, ", \"exit\": %d, \"user\": %.6lf, \"system\": %.6lf, \"max_rss\": %ld, "
+                    "\"voluntary_switches\": %ld, \"involuntary_switches\": %ld",
+                    WIFEXITED(p->status) ? WEXITSTATUS(p->status) : -1, p->user_time, p->system_time,
+                    p->max_rss, p->voluntary_switches, p->involuntary_switches);
+    }
+    fprintf(fs, "}");
+    *first = false;
+}
+
+/**
+ * Compare two latencies (for qsort).
+ * @param   a       Pointer to first latency.
+ * @param   b       Pointer to second latency.
+ * @return  Negative, zero, or positive as a is less, equal, or greater.
+ **/
+int scheduler_export_compare(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
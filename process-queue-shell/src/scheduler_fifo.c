@@ -18,7 +18,6 @@ void scheduler_fifo(Scheduler *s) {
     /* Implement FIFO Policy */
     while(s->cores > s->running.size && s->waiting.size > 0) {
         Process* up_next = queue_pop(&s->waiting);
-        process_start(up_next);
-        queue_push(&s->running, up_next);
+        scheduler_run(s, up_next);
     }
 }
\ No newline at end of file
@@ -0,0 +1,120 @@
+/* scheduler_mlfq.c: PQSH Multilevel Feedback Queue Scheduler */
+
+#include "pqsh/macros.h"
+#include "pqsh/scheduler.h"
+
+#include <assert.h>
+
+/* Internal Prototypes */
+
+Process *   scheduler_mlfq_pop(Scheduler *s);
+size_t      scheduler_mlfq_best(Scheduler *s);
+void        scheduler_mlfq_boost(Scheduler *s);
+
+/**
+ * Schedule next process using multilevel feedback queue policy:
+ *
+ *  1. Place new processes in the top level.
+ *
+ *  2. When the time slice expires, charge every running process for it: one
+ *  that used less than half the slice on the CPU (it was blocked on I/O)
+ *  moves up a level, while one that used up its allotment at its level
+ *  (2^level slices) moves down a level, and is preempted if anything of at
+ *  least its new priority is waiting.
+ *
+ *  3. Every MLFQ_BOOST ticks, move everything back to the top level (so
+ *  CPU-bound processes do not starve).
+ *
+ *  4. Move processes from the highest non-empty level to the running queue
+ *  until all cores are busy.
+ *
+ * @param   s	    Scheduler structure
+ **/
+void scheduler_mlfq(Scheduler *s) {
+    // New processes start at the top
+    while(s->waiting.size) {
+        Process *arrived = queue_pop(&s->waiting);
+        arrived->level     = 0;
+        arrived->allotment = 0;
+        queue_push(&s->levels[0], arrived);
+    }
+
+    bool expired = s->expired;
+    s->expired   = false;
+    if(expired && ++s->ticks % MLFQ_BOOST == 0) {
+        scheduler_mlfq_boost(s);
+    }
+
+    // Charge running processes for the slice that expired
+    Process *next;
+    for(Process *p = s->running.head; expired && p; p = next) {
+        next = p->next;
+
+        double cpu = process_cpu(p);
+        double used = cpu - p->cpu_time;
+        p->cpu_time = cpu;
+        if(used < s->timeout / 2e6) {
+            p->level     = p->level ? p->level - 1 : 0;
+            p->allotment = 0;
+            continue;
+        }
+        if(++p->allotment < (1ul << p->level)) {
+            continue;
+        }
+        p->level     = min(p->level + 1, MLFQ_LEVELS - 1);
+        p->allotment = 0;
+        if(s->running.size >= s->cores && scheduler_mlfq_best(s) <= p->level) {
+            scheduler_preempt(s, p);
+            queue_push(&s->levels[p->level], p);
+        }
+    }
+
+    // Start (or resume) the highest priority processes on all available cores
+    while(s->running.size < s->cores && (next = scheduler_mlfq_pop(s))) {
+        scheduler_run(s, next);
+    }
+}
+
+/* Internal Functions */
+
+/**
+ * Pop process from the highest non-empty level.
+ * @param   s	    Scheduler structure
+ * @return  Process with highest priority (NULL if none is waiting).
+ **/
+Process * scheduler_mlfq_pop(Scheduler *s) {
+    size_t level = scheduler_mlfq_best(s);
+    return level < MLFQ_LEVELS ? queue_pop(&s->levels[level]) : NULL;
+}
+
+/**
+ * Return highest non-empty level.
+ * @param   s	    Scheduler structure
+ * @return  Level (MLFQ_LEVELS if none is waiting).
+ **/
+size_t scheduler_mlfq_best(Scheduler *s) {
+    size_t level = 0;
+    while(level < MLFQ_LEVELS && !s->levels[level].size) {
+        level++;
+    }
+    return level;
+}
+
+/**
+ * Move every process (waiting or running) back to the top level.
+ * @param   s	    Scheduler structure
+ **/
+void scheduler_mlfq_boost(Scheduler *s) {
+    for(size_t level = 1; level < MLFQ_LEVELS; level++) {
+        while(s->levels[level].size) {
+            queue_push(&s->levels[0], queue_pop(&s->levels[level]));
+        }
+    }
+    Queue *queues[] = {&s->levels[0], &s->running};
+    for(size_t i = 0; i < 2; i++) {
+        for(Process *p = queues[i]->head; p; p = p->next) {
+            p->level     = 0;
+            p->allotment = 0;
+        }
+    }
+}
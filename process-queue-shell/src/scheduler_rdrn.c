@@ -2,40 +2,84 @@
 
 #include "pqsh/macros.h"
 #include "pqsh/scheduler.h"
+#include "pqsh/timestamp.h"
 
 #include <assert.h>
 
+/* Internal Prototypes */
+
+void    scheduler_rdrn_adapt(Scheduler *s, Process *p, double now);
+
 /**
  * Schedule next process using round robin policy:
  *
- *  1. If there no waiting processes, then do nothing.
+ *  1. Find running processes whose quantum ran out.  If all cores are busy
+ *  and there are waiting processes, then move them (up to as many as
+ *  are waiting) from the running queue and place them in back of waiting
+ *  queue (behind waiting processes of the same or higher priority).  The
+ *  others keep their core for another quantum, since nothing else could
+ *  use it.
  *
- *  2. Move one process from front of running queue and place in back of
- *  waiting queue.
+ *  2. Move processes from front of waiting queue and place in back of
+ *  running queue until all cores are busy.
  *
- *  3. Move one process from front of waiting queue and place in back of
- *  running queue.
+ * Each process has its own quantum, which starts at the timeout and doubles
+ * (up to RDRN_QUANTUM timeouts) every time the process computes for nearly
+ * all of it, and goes back to the timeout once it does not (so CPU-bound
+ * processes are stopped and continued less often, while interactive ones
+ * still take turns quickly).
  *
- * @param   s	    Scheduler structure
+ * @param   s	    Pointer to Scheduler structure.
  **/
 void scheduler_rdrn(Scheduler *s) {
-    // Check if we need to pause a running process
-    if(s->running.size == s->cores) {
-        // Pause and remove running process from running queue
-        Process* paused = queue_pop(&s->running);
-        process_pause(paused);
-        queue_push(&s->waiting, paused);
+    // Quanta are checked whenever anything happens (the timer only makes sure
+    // this happens once the earliest one is due)
+    s->expired     = false;
+    double now     = timestamp();
+    size_t preempt = s->running.size >= s->cores ? s->waiting.size : 0;
+
+    Process *next;
+    for(Process *p = s->running.head; p; p = next) {
+        next = p->next;
+        if(p->slice_time + p->quantum > now + RDRN_SLACK) {
+            continue;
+        }
+        scheduler_rdrn_adapt(s, p, now);
+        if(preempt) {
+            // Pause and remove running process from running queue
+            preempt--;
+            scheduler_preempt(s, p);
+            queue_insert(&s->waiting, p);
+        }
+        else {
+            p->slice_time = now;
+            p->cpu_time   = process_cpu(p);
+        }
     }
     // Start new processes on all available cores
     while(s->running.size < s->cores && s->waiting.size != 0) {
         Process* run_next = queue_pop(&s->waiting);
-        
-        if(run_next->pid == 0) {
-            process_start(run_next);
-        }
-        else {
-            process_resume(run_next);
-        }
-        queue_push(&s->running, run_next);
+        scheduler_run(s, run_next);
+    }
+}
+
+/* Internal Functions */
+
+/**
+ * Adapt quantum of process whose time slice ran out to how much of it the
+ * process spent computing.
+ * @param   s	    Pointer to Scheduler structure.
+ * @param   p	    Pointer to Process structure (in running queue).
+ * @param   now     Current timestamp.
+ **/
+void scheduler_rdrn_adapt(Scheduler *s, Process *p, double now) {
+    double base = s->timeout / 1e6;
+    double used = process_cpu(p) - p->cpu_time;
+
+    if(s->adaptive && used >= RDRN_BUSY * (now - p->slice_time)) {
+        p->quantum = min(p->quantum * 2, base * RDRN_QUANTUM);
+    }
+    else {
+        p->quantum = base;
     }
-}
\ No newline at end of file
+}
@@ -0,0 +1,87 @@
+/* scheduler_sjf.c: PQSH Shortest Job First Scheduler */
+
+#include "pqsh/macros.h"
+#include "pqsh/scheduler.h"
+#include "pqsh/timestamp.h"
+
+#include <assert.h>
+
+/* Internal Prototypes */
+
+double      scheduler_sjf_remaining(Scheduler *s, Process *p, double now);
+
+/**
+ * Schedule next process using shortest (remaining) job first policy:
+ *
+ *  1. Estimate how long new processes will run from the runtimes of earlier
+ *  runs of the same command (or program), and place them in the priority
+ *  queue by that estimate.
+ *
+ *  2. When the time slice expires and all cores are busy, preempt the running
+ *  process with the most time remaining whenever a waiting process needs
+ *  less than that.
+ *
+ *  3. Move the processes with the least time remaining to the running queue
+ *  until all cores are busy.
+ *
+ * Processes that outrun their estimate have it doubled, so a wrong guess
+ * does not let them hold on to a core forever.
+ *
+ * @param   s	    Scheduler structure
+ **/
+void scheduler_sjf(Scheduler *s) {
+    double now = timestamp();
+
+    // New processes wait by estimated runtime (unknown commands get one slice)
+    while(s->waiting.size) {
+        Process *arrived = queue_pop(&s->waiting);
+        arrived->estimate = history_estimate(&s->history, arrived->command);
+        if(arrived->estimate < 0) {
+            arrived->estimate = s->timeout / 1e6;
+        }
+        heap_push(&s->ready, arrived, scheduler_sjf_remaining(s, arrived, now));
+    }
+
+    bool expired = s->expired;
+    s->expired   = false;
+    for(size_t swaps = 0; expired && swaps < s->cores && s->running.size >= s->cores && s->ready.size; swaps++) {
+        // Find the running process with the most time remaining
+        Process *longest   = NULL;
+        double   remaining = 0;
+        for(Process *p = s->running.head; p; p = p->next) {
+            double left = scheduler_sjf_remaining(s, p, now);
+            if(!longest || left > remaining) {
+                longest   = p;
+                remaining = left;
+            }
+        }
+        if(heap_peek(&s->ready)->key >= remaining) {
+            break;
+        }
+        scheduler_preempt(s, longest);
+        heap_push(&s->ready, longest, scheduler_sjf_remaining(s, longest, now));
+        scheduler_run(s, heap_pop(&s->ready));
+    }
+
+    // Start (or resume) the shortest processes on all available cores
+    while(s->running.size < s->cores && s->ready.size) {
+        scheduler_run(s, heap_pop(&s->ready));
+    }
+}
+
+/* Internal Functions */
+
+/**
+ * Return estimated time process still needs to run.
+ * @param   s	    Scheduler structure
+ * @param   p	    Process structure
+ * @param   now	    Current timestamp
+ * @return  Seconds remaining (by estimate).
+ **/
+double scheduler_sjf_remaining(Scheduler *s, Process *p, double now) {
+    double ran = p->run_time + (p->queue == &s->running ? now - p->resume_time : 0);
+    while(p->estimate > 0 && ran >= p->estimate) {
+        p->estimate *= 2;
+    }
+    return p->estimate - ran;
+}
@@ -1,7 +1,6 @@
 /* signal.c: PQSH Signal Handlers */
 
 #include "pqsh/macros.h"
-#include "pqsh/scheduler.h"
 #include "pqsh/signal.h"
 
 #include <errno.h>
@@ -9,6 +8,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/signalfd.h>
+#include <unistd.h>
 
 /**
  * Register signal handler with specified flags.
@@ -30,12 +31,33 @@ bool signal_register(int signum, int flags, sighandler_t handler) {
 }
 
 /**
- * SIGALRM handler.
- * @param   signum      Signal number.
+ * Block signal and return file descriptor that reports it instead (so the
+ * main loop can poll for it along with everything else).
+ * @param   signum      Signal number
+ * @return  Non-blocking signalfd (-1 on failure).
  **/
-void sigalrm_handler(int signum) {
-    /* TODO: Handle timer event. */
-    extern Scheduler PQShellScheduler;
-    scheduler_wait(&PQShellScheduler);
-    scheduler_next(&PQShellScheduler);
-}
\ No newline at end of file
+int signal_descriptor(int signum) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, signum);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0) {
+        error("Failed to block signal: %s", strerror(errno));
+        return -1;
+    }
+
+    int fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (fd < 0) {
+        error("Failed to create signalfd: %s", strerror(errno));
+    }
+    return fd;
+}
+
+/**
+ * Read every pending signal from signalfd (several deliveries of the same
+ * signal may have been merged into one, so callers handle them all at once).
+ * @param   fd          Non-blocking signalfd.
+ **/
+void signal_drain(int fd) {
+    struct signalfd_siginfo info;
+    while (read(fd, &info, sizeof(info)) == sizeof(info));
+}
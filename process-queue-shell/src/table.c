@@ -0,0 +1,122 @@
+/* table.c: PQSH Process Table
+ *
+ * Hash table of started processes indexed by pid, so the scheduler finds a
+ * reaped child without walking its queues.  Pids are handed out mostly in
+ * sequence, so the low bits of the pid spread them over the buckets evenly.
+ **/
+
+#include "pqsh/macros.h"
+#include "pqsh/table.h"
+
+#include <errno.h>
+
+/* Internal Prototypes */
+
+bool    table_resize(Table *t, size_t capacity);
+
+/**
+ * Insert process into table (by its pid).
+ * @param t     Pointer to Table structure.
+ * @param p     Pointer to Process structure (with valid pid).
+ * @return  Whether or not the process was inserted.
+ **/
+bool table_insert(Table *t, Process *p) {
+    // Error checking
+    if(!t || !p || p->pid <= 0) {
+        return false;
+    }
+    // Grow the table once chains would get longer than one on average
+    if(t->size >= t->capacity && !table_resize(t, t->capacity ? 2 * t->capacity : TABLE_CAPACITY)) {
+        return false;
+    }
+
+    size_t bucket = (size_t)p->pid & (t->capacity - 1);
+    p->hash_next = t->buckets[bucket];
+    t->buckets[bucket] = p;
+    t->size++;
+    return true;
+}
+
+/**
+ * Return process with specified pid.
+ * @param t     Pointer to Table structure.
+ * @param pid   Pid of process to return.
+ * @return  Process with specified pid (NULL if there is none).
+ **/
+Process * table_lookup(Table *t, pid_t pid) {
+    if(!t || !t->capacity) {
+        return NULL;
+    }
+    Process *p = t->buckets[(size_t)pid & (t->capacity - 1)];
+    while(p && p->pid != pid) {
+        p = p->hash_next;
+    }
+    return p;
+}
+
+/**
+ * Remove and return process with specified pid.
+ * @param t     Pointer to Table structure.
+ * @param pid   Pid of process to return.
+ * @return  Process with specified pid (NULL if there is none).
+ **/
+Process * table_remove(Table *t, pid_t pid) {
+    if(!t || !t->capacity) {
+        return NULL;
+    }
+    Process **link = &t->buckets[(size_t)pid & (t->capacity - 1)];
+    while(*link && (*link)->pid != pid) {
+        link = &(*link)->hash_next;
+    }
+
+    Process *p = *link;
+    if(p) {
+        *link = p->hash_next;
+        p->hash_next = NULL;
+        t->size--;
+    }
+    return p;
+}
+
+/**
+ * Release the buckets of table (the processes themselves are not freed).
+ * @param t     Pointer to Table structure.
+ **/
+void table_delete(Table *t) {
+    if(t) {
+        free(t->buckets);
+        t->buckets  = NULL;
+        t->capacity = 0;
+        t->size     = 0;
+    }
+}
+
+/* Internal Functions */
+
+/**
+ * Rehash every process of table into the specified number of buckets.
+ * @param t         Pointer to Table structure.
+ * @param capacity  New number of buckets (power of two).
+ * @return  Whether or not the table was resized.
+ **/
+bool table_resize(Table *t, size_t capacity) {
+    Process **buckets = calloc(capacity, sizeof(Process *));
+    if(!buckets) {
+        error("Unable to resize process table: %s", strerror(errno));
+        return false;
+    }
+    for(size_t i = 0; i < t->capacity; i++) {
+        Process *p = t->buckets[i];
+        while(p) {
+            Process *next = p->hash_next;
+            size_t bucket = (size_t)p->pid & (capacity - 1);
+            p->hash_next = buckets[bucket];
+            buckets[bucket] = p;
+            p = next;
+        }
+    }
+    free(t->buckets);
+    t->buckets  = buckets;
+    t->capacity = capacity;
+    return true;
+}
@@ -0,0 +1,53 @@
+/* bench.h: SimpleFS benchmarks */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "sfs/disk.h"
+#include "sfs/fs.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Bench Constants */
+
+#define BENCH_CHUNK         (4*BUFSIZ)          /* Bytes per sequential read or write */
+#define BENCH_FILE_BYTES    (64<<20)            /* Default bytes per sequential file */
+#define BENCH_RANDOM_READS  (4096)              /* Default number of random reads */
+#define BENCH_CHURN_FILES   (1024)              /* Default number of files created and removed */
+#define BENCH_CHURN_BYTES   (10000)             /* Bytes written to each churned file */
+
+/* Bench Structures */
+
+typedef struct BenchResult BenchResult;
+struct BenchResult {
+    const char *name;                           /* Name of workload */
+    size_t      operations;                     /* Number of operations timed */
+    size_t      bytes;                          /* Number of logical bytes transferred */
+    double      elapsed;                        /* Total time in seconds */
+    double     *latencies;                      /* Latency of each operation in seconds */
+    size_t      capacity;                       /* Number of latencies that fit */
+    Disk       *disk;                           /* Disk whose transfers are counted */
+    size_t      reads;                          /* Number of disk block reads */
+    size_t      writes;                         /* Number of disk block writes */
+};
+
+/* Bench Functions */
+
+double  bench_timestamp();
+size_t  bench_fill(FileSystem *fs, size_t bytes);
+
+ssize_t bench_write(FileSystem *fs, size_t bytes, BenchResult *result);
+bool    bench_read(FileSystem *fs, size_t inode_number, BenchResult *result);
+bool    bench_random_read(FileSystem *fs, size_t inode_number, size_t count, BenchResult *result);
+bool    bench_churn(FileSystem *fs, size_t files, BenchResult *result);
+bool    bench_mount(const char *path, size_t blocks, int flags, uint32_t format, BenchResult *clean, BenchResult *dirty);
+
+bool    bench_start(BenchResult *result, const char *name, Disk *disk, size_t capacity);
+void    bench_record(BenchResult *result, double start, size_t bytes);
+void    bench_stop(BenchResult *result, double start);
+void    bench_report(const BenchResult *result, FILE *stream);
+void    bench_release(BenchResult *result);
+
+#endif
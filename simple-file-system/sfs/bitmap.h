@@ -0,0 +1,50 @@
+/* bitmap.h: SimpleFS packed bitmap */
+
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/* Bitmap Constants */
+
+#define BITMAP_WORD_BITS    (64)                /* Number of bits per word */
+#define BITMAP_NOT_FOUND    ((size_t)-1)        /* Result of failed search */
+
+/* Bitmap Structure */
+
+typedef struct Bitmap Bitmap;
+
+struct Bitmap {
+    size_t      bits;       /* Number of bits in bitmap */
+    size_t      nwords;     /* Number of words in bitmap */
+    uint64_t   *words;      /* Packed bits (bit i is word i/64, bit i%64) */
+    size_t      nsummary;   /* Number of words in summary */
+    uint64_t   *summary;    /* Summary bits (bit w is set if words[w] != 0) */
+    size_t      hint;       /* Where the next rotating search starts */
+};
+
+/* Bitmap Macros */
+
+#define bitmap_word(i)      ((i) / BITMAP_WORD_BITS)
+#define bitmap_mask(i)      (UINT64_C(1) << ((i) % BITMAP_WORD_BITS))
+
+/* Bitmap Functions */
+
+Bitmap *    bitmap_create(size_t bits, bool value);
+void        bitmap_delete(Bitmap *bitmap);
+
+bool        bitmap_test(const Bitmap *bitmap, size_t bit);
+void        bitmap_set(Bitmap *bitmap, size_t bit);
+void        bitmap_clear(Bitmap *bitmap, size_t bit);
+void        bitmap_clear_range(Bitmap *bitmap, size_t bit, size_t count);
+void        bitmap_load(Bitmap *bitmap, size_t word, const uint64_t *words, size_t count);
+
+size_t      bitmap_find(const Bitmap *bitmap, size_t start);
+size_t      bitmap_find_next(Bitmap *bitmap);
+size_t      bitmap_find_run(const Bitmap *bitmap, size_t start, size_t length, size_t *found);
+size_t      bitmap_run_length(const Bitmap *bitmap, size_t start, size_t length);
+size_t      bitmap_count(const Bitmap *bitmap);
+
+#endif
@@ -0,0 +1,65 @@
+/* cache.h: SimpleFS block cache */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "sfs/disk.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+/* Cache Constants */
+
+#define CACHE_BLOCKS    (1<<10)         /* Default number of cached blocks */
+#define CACHE_INVALID   ((size_t)-1)    /* Block number of an empty entry */
+#define CACHE_CLUSTER   (64)            /* Maximum dirty run written on eviction */
+
+/* Cache Structures */
+
+typedef struct CacheEntry CacheEntry;
+
+struct CacheEntry {
+    size_t  block;          /* Disk block held by entry (CACHE_INVALID if empty) */
+    bool    dirty;          /* Whether or not entry differs from disk */
+    bool    referenced;     /* CLOCK reference bit */
+    bool    loading;        /* Whether or not block is being read into entry */
+    bool    writing;        /* Whether or not entry is being written back */
+    ssize_t next;           /* Next entry in hash bucket (-1 terminates) */
+    char   *data;           /* Block data (BLOCK_SIZE bytes) */
+};
+
+typedef struct Cache Cache;
+
+struct Cache {
+    Disk       *disk;       /* Disk backing the cache */
+    size_t      capacity;   /* Number of entries in cache */
+    size_t      hand;       /* CLOCK hand (next eviction candidate) */
+    size_t      nbuckets;   /* Number of hash buckets (power of two) */
+    ssize_t    *buckets;    /* Hash buckets (indices into entries) */
+    CacheEntry *entries;    /* Cache entries */
+    char       *data;       /* Backing storage for all entries */
+    size_t      hits;       /* Number of lookups satisfied by cache */
+    size_t      misses;     /* Number of lookups that went to disk */
+    size_t      loading;    /* Number of entries being read */
+    size_t      writing;    /* Number of entries being written back */
+    pthread_mutex_t lock;   /* Protects every entry and the hash table */
+    pthread_cond_t  ready;  /* Signaled whenever entries finish loading or writing */
+};
+
+/* Cache Functions */
+
+Cache * cache_create(Disk *disk, size_t blocks);
+void    cache_delete(Cache *cache);
+
+ssize_t cache_read(Cache *cache, size_t block, char *data);
+ssize_t cache_write(Cache *cache, size_t block, char *data);
+
+ssize_t cache_read_range(Cache *cache, size_t block, size_t offset, void *data, size_t length);
+ssize_t cache_write_range(Cache *cache, size_t block, size_t offset, const void *data, size_t length);
+
+void    cache_discard(Cache *cache, size_t block);
+bool    cache_prefetch(Cache *cache, const size_t *blocks, size_t nblocks);
+bool    cache_sync(Cache *cache);
+
+#endif
@@ -5,29 +5,94 @@
 
 #include <stdbool.h>
 #include <stdlib.h>
+#include <sys/uio.h>
 
 /* Disk Constants */
 
 #define BLOCK_SIZE      (1<<12)
 #define DISK_FAILURE    (-1)
+#define DISK_IOV_MAX    (1<<10)     /* Maximum number of blocks per vectored call */
+#define DISK_QUEUE_DEPTH (64)       /* Maximum number of requests in flight (io_uring) */
+
+/* Disk Flags */
+
+#define DISK_MMAP       (1<<0)      /* Access disk image through a memory map */
+#define DISK_QUIET      (1<<1)      /* Do not report disk and cache statistics on close */
+#define DISK_SYNC       (1<<2)      /* Perform requests one at a time (no io_uring) */
 
 /* Disk Structure */
 
 typedef struct Disk Disk;
+typedef struct DiskOps DiskOps;
+typedef struct DiskRing DiskRing;
+typedef struct DiskRequest DiskRequest;
 
 struct Disk {
     int	    fd;	        /* File descriptor of disk image	*/
     size_t  blocks;     /* Number of blocks in disk image	*/
     size_t  reads;      /* Number of reads to disk image	*/
     size_t  writes;     /* Number of writes to disk image	*/
+    const DiskOps *ops; /* Backend used to access disk image	*/
+    char *  map;        /* Memory map of disk image (DISK_MMAP) */
+    int     flags;      /* Disk flags (DISK_MMAP, DISK_QUIET, DISK_SYNC) */
+    DiskRing *ring;     /* io_uring used for requests (NULL if synchronous) */
 }; 
 
+/* Disk Request */
+
+struct DiskRequest {
+    size_t  block;      /* First block number of the run	*/
+    char  **data;       /* Array of nblocks data buffers	*/
+    size_t  nblocks;    /* Number of blocks in the run (at most DISK_IOV_MAX) */
+    bool    write;      /* Whether to write (true) or read (false) */
+    ssize_t result;     /* Number of bytes transferred (DISK_FAILURE on failure) */
+    bool    done;       /* Whether or not request completed	*/
+    struct iovec *iov;  /* Buffers of request while in flight	*/
+};
+
+/* Disk Backend */
+
+struct DiskOps {
+    bool    (*open)(Disk *disk);
+    void    (*close)(Disk *disk);
+    ssize_t (*readv)(Disk *disk, size_t block, char **data, size_t nblocks);
+    ssize_t (*writev)(Disk *disk, size_t block, char **data, size_t nblocks);
+    bool    (*zero)(Disk *disk, size_t block, size_t nblocks);
+    char *  (*view)(Disk *disk, size_t block);
+};
+
+extern const DiskOps DiskFileOps;   /* pread/pwrite backend (disk_file.c) */
+extern const DiskOps DiskMmapOps;   /* mmap backend (disk_mmap.c) */
+
+/* Disk Ring (disk_uring.c) */
+
+bool    disk_uring_open(Disk *disk);
+void    disk_uring_close(Disk *disk);
+void    disk_uring_submit(Disk *disk, DiskRequest *requests, size_t nrequests);
+void    disk_uring_reap(Disk *disk, DiskRequest *requests, size_t nrequests);
+
 /* Disk Functions */
 
-Disk *	disk_open(const char *path, size_t blocks);
+Disk *	disk_open(const char *path, size_t blocks, int flags);
 void	disk_close(Disk *disk);
 
 ssize_t	disk_read(Disk *disk, size_t block, char *data);
 ssize_t	disk_write(Disk *disk, size_t block, char *data);
 
+ssize_t	disk_readv(Disk *disk, size_t block, char **data, size_t nblocks);
+ssize_t	disk_writev(Disk *disk, size_t block, char **data, size_t nblocks);
+
+ssize_t	disk_read_blocks(Disk *disk, const size_t *blocks, char **data, size_t nblocks);
+ssize_t	disk_write_blocks(Disk *disk, const size_t *blocks, char **data, size_t nblocks);
+
+bool	disk_submit(Disk *disk, DiskRequest *requests, size_t nrequests);
+ssize_t	disk_reap(Disk *disk, DiskRequest *requests, size_t nrequests);
+
+bool	disk_zero(Disk *disk, size_t block, size_t nblocks);
+
+const char * disk_view(Disk *disk, size_t block, char *data);
+
+size_t	disk_find_data(Disk *disk, size_t block);
+size_t	disk_find_hole(Disk *disk, size_t block);
+
 #endif
\ No newline at end of file
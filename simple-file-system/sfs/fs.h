@@ -3,8 +3,11 @@
 #ifndef FS_H
 #define FS_H
 
+#include "sfs/bitmap.h"
+#include "sfs/cache.h"
 #include "sfs/disk.h"
 
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -15,6 +18,23 @@
 #define INODES_PER_BLOCK    (128)               /* Number of inodes per block */
 #define POINTERS_PER_INODE  (5)                 /* Number of direct pointers per inode */
 #define POINTERS_PER_BLOCK  (1024)              /* Number of pointers per block */
+#define BITS_PER_BLOCK      (BLOCK_SIZE * 8)    /* Number of bitmap bits per block */
+#define WORDS_PER_BLOCK     (BLOCK_SIZE / sizeof(uint64_t)) /* Number of bitmap words per block */
+#define READAHEAD_BLOCKS    (64)                /* Number of blocks prefetched ahead of sequential reads */
+#define READAHEAD_SLOTS     (16)                /* Number of inodes tracked for sequential reads */
+#define EXTENTS_PER_INODE   (2)                 /* Number of inline extents per inode */
+#define EXTENTS_PER_BLOCK   (BLOCK_SIZE / sizeof(Extent)) /* Number of extents per block */
+#define MAX_EXTENTS         (EXTENTS_PER_INODE + EXTENTS_PER_BLOCK) /* Number of extents per file */
+#define INODE_LOCKS         (64)                /* Number of inode lock stripes */
+
+/* File System Flags */
+
+#define FS_EXTENTS          (1<<0)              /* Inodes map data with extents rather than pointers */
+#define FS_FLAGS            (FS_EXTENTS)        /* All supported flags */
+
+/* File System Options */
+
+#define FS_NOSCRUB          (1<<0)              /* Release removed blocks without zeroing them */
 
 /* File System Structures */
 
@@ -24,14 +44,30 @@ struct SuperBlock {
     uint32_t    blocks;                         /* Number of blocks in file system */
     uint32_t    inode_blocks;                   /* Number of blocks reserved for inodes */
     uint32_t    inodes;                         /* Number of inodes in file system */
+    uint32_t    bitmap_blocks;                  /* Number of blocks reserved for free block bitmap (0 if none) */
+    uint32_t    clean;                          /* Whether or not file system was cleanly unmounted */
+    uint32_t    flags;                          /* File system format flags (FS_EXTENTS) */
+    uint32_t    inode_bitmap_blocks;            /* Number of blocks reserved for free inode bitmap (0 if none) */
+};
+
+typedef struct Extent     Extent;
+struct Extent {
+    uint32_t    start;                          /* First disk block of run */
+    uint32_t    length;                         /* Number of blocks in run */
 };
 
 typedef struct Inode      Inode;
 struct Inode {
     uint32_t    valid;                          /* Whether or not inode is valid */
     uint32_t    size;                           /* Size of file */
-    uint32_t    direct[POINTERS_PER_INODE];     /* Direct pointers */
-    uint32_t    indirect;                       /* Indirect pointers */
+    union {
+        uint32_t    direct[POINTERS_PER_INODE]; /* Direct pointers */
+        struct {
+            Extent      extents[EXTENTS_PER_INODE]; /* Inline extents (FS_EXTENTS) */
+            uint32_t    nextents;               /* Number of extents (FS_EXTENTS) */
+        };
+    };
+    uint32_t    indirect;                       /* Indirect pointers (extent block with FS_EXTENTS) */
 };
 
 typedef union  Block      Block;
@@ -39,23 +75,56 @@ union Block {
     SuperBlock  super;                          /* View block as superblock */
     Inode       inodes[INODES_PER_BLOCK];       /* View block as inode */
     uint32_t    pointers[POINTERS_PER_BLOCK];   /* View block as pointers */
+    Extent      extents[EXTENTS_PER_BLOCK];     /* View block as extents */
     char        data[BLOCK_SIZE];               /* View block as data */
 };
 
+typedef struct ReadAhead  ReadAhead;
+struct ReadAhead {
+    size_t      inode_number;                   /* Inode being tracked */
+    size_t      next_offset;                    /* Offset a sequential read would start at */
+    size_t      prefetched;                     /* Logical block read-ahead has reached */
+};
+
+typedef struct FileHandle FileHandle;
+
 typedef struct FileSystem FileSystem;
 struct FileSystem {
     Disk        *disk;                          /* Disk file system is mounted on */
-    bool        *free_blocks;                   /* Free block bitmap */
+    Cache       *cache;                         /* Block cache in front of disk */
+    Bitmap      *free_blocks;                   /* Free block bitmap (set bit == free block) */
+    Bitmap      *free_inodes;                   /* Free inode bitmap (set bit == free inode) */
+    uint32_t     options;                       /* Mount options (FS_NOSCRUB) */
     SuperBlock   meta_data;                     /* File system meta data */
+    ReadAhead    readahead[READAHEAD_SLOTS];    /* Sequential read detection (hashed by inode) */
+    FileHandle  *handles;                       /* Open file handles */
+    pthread_mutex_t  alloc_lock;                /* Protects free block and free inode bitmaps */
+    pthread_mutex_t  handles_lock;              /* Protects list of open handles */
+    pthread_mutex_t  readahead_lock;            /* Protects sequential read detection */
+    pthread_rwlock_t inode_locks[INODE_LOCKS];  /* Reader/writer locks (striped by inode) */
+};
+
+struct FileHandle {
+    FileSystem  *fs;                            /* File system handle belongs to */
+    size_t       inode_number;                  /* Inode handle refers to */
+    Inode        inode;                         /* Pinned copy of Inode */
+    Block        indirect;                      /* Pinned copy of indirect pointer block */
+    bool         inode_dirty;                   /* Whether or not Inode must be written back */
+    bool         indirect_dirty;                /* Whether or not indirect block must be written back */
+    size_t       blocks;                        /* Number of blocks mapped by extents (FS_EXTENTS) */
+    uint32_t     extent_starts[MAX_EXTENTS];    /* Logical block each extent starts at (FS_EXTENTS) */
+    size_t       offset;                        /* Current file offset */
+    FileHandle  *next;                          /* Next open handle */
 };
 
 /* File System Functions */
 
 void    fs_debug(Disk *disk);
-bool    fs_format(FileSystem *fs, Disk *disk);
+bool    fs_format(FileSystem *fs, Disk *disk, uint32_t flags);
 
 bool    fs_mount(FileSystem *fs, Disk *disk);
 void    fs_unmount(FileSystem *fs);
+bool    fs_sync(FileSystem *fs);
 
 ssize_t fs_create(FileSystem *fs);
 bool    fs_remove(FileSystem *fs, size_t inode_number);
@@ -63,9 +132,21 @@ ssize_t fs_stat(FileSystem *fs, size_t inode_number);
 
 ssize_t fs_read(FileSystem *fs, size_t inode_number, char *data, size_t length, size_t offset);
 ssize_t fs_write(FileSystem *fs, size_t inode_number, char *data, size_t length, size_t offset);
+bool    fs_reserve(FileSystem *fs, size_t inode_number, size_t bytes);
+
+size_t  fs_max_blocks(FileSystem *fs);
+bool    fs_write_super_block(FileSystem *fs, Disk *disk, bool clean);
+
+/* File Handle Functions */
+
+FileHandle *fs_open(FileSystem *fs, size_t inode_number);
+bool    fs_close(FileHandle *handle);
+ssize_t fs_handle_read(FileHandle *handle, char *data, size_t length);
+ssize_t fs_handle_write(FileHandle *handle, char *data, size_t length);
+ssize_t fs_seek(FileHandle *handle, size_t offset);
+bool    fs_handle_reserve(FileHandle *handle, size_t bytes);
 
-bool    fs_load_inode(FileSystem *fs, size_t inode_number, Inode *node);
-bool    fs_save_inode(FileSystem *fs, size_t inode_number, Inode *node);
-void    fs_initialize_free_block_bitmap(FileSystem *fs, Block *sb);
+ssize_t fs_handle_pread(FileHandle *handle, char *data, size_t length, size_t offset);
+ssize_t fs_handle_pwrite(FileHandle *handle, char *data, size_t length, size_t offset);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,385 @@
+/* bench.c: SimpleFS benchmarks
+ *
+ * Each workload runs against a mounted FileSystem (or, for mount time, a
+ * scratch image) and fills in a BenchResult with its throughput, the latency
+ * of every operation, and the number of disk blocks it read and wrote, so
+ * the cost of a change to the cache or allocator shows up as both time and
+ * disk traffic per logical byte.
+ **/
+
+#include "sfs/bench.h"
+#include "sfs/utils.h"
+
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Internal Prototypes */
+
+double  bench_percentile(const BenchResult *result, double percentile);
+int     bench_compare(const void *a, const void *b);
+
+/* External Functions */
+
+/**
+ * Return current timestamp in seconds.
+ *
+ * @return      Double representing the current (monotonic) time.
+ **/
+double bench_timestamp() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + (double)now.tv_nsec / 1000000000;
+}
+
+/**
+ * Create files and write to them until the requested number of bytes has been
+ * written or the file system runs out of inodes or blocks.
+ *
+ * @param       fs          Pointer to mounted FileSystem structure.
+ * @param       bytes       Number of bytes to write.
+ *
+ * @return      Number of bytes written.
+ **/
+size_t bench_fill(FileSystem *fs, size_t bytes) {
+    char buffer[BENCH_CHUNK];
+    memset(buffer, 'S', sizeof(buffer));
+
+    size_t written = 0;
+    while(written < bytes) {
+        ssize_t inode_number = fs_create(fs);
+        if(inode_number < 0) { break; }
+
+        size_t offset = 0;
+        while(written < bytes) {
+            size_t  length = min(bytes - written, sizeof(buffer));
+            ssize_t actual = fs_write(fs, inode_number, buffer, length, offset);
+            if(actual <= 0) { break; }
+            offset  += actual;
+            written += actual;
+            if((size_t)actual != length) { break; }
+        }
+        // Nothing fit in a fresh file, so the disk is full
+        if(!offset) { break; }
+    }
+    return written;
+}
+
+/**
+ * Benchmark sequential writes by doing the following:
+ *
+ *  1. Create and open a new file.
+ *
+ *  2. Write bytes bytes to it BENCH_CHUNK bytes at a time.
+ *
+ *  3. Close the file and sync the FileSystem, so write back is counted.
+ *
+ * @param       fs          Pointer to mounted FileSystem structure.
+ * @param       bytes       Number of bytes to write.
+ * @param       result      Pointer to BenchResult structure to fill in.
+ *
+ * @return      Inode number of the new file (-1 on failure).
+ **/
+ssize_t bench_write(FileSystem *fs, size_t bytes, BenchResult *result) {
+    char buffer[BENCH_CHUNK];
+    memset(buffer, 'S', sizeof(buffer));
+
+    ssize_t inode_number = fs_create(fs);
+    if(inode_number < 0) { return -1; }
+
+    FileHandle *handle = fs_open(fs, inode_number);
+    if(!handle || !bench_start(result, "seq-write", fs->disk, (bytes + BENCH_CHUNK - 1)/BENCH_CHUNK)) {
+        fs_close(handle);
+        fs_remove(fs, inode_number);
+        return -1;
+    }
+
+    double begin   = bench_timestamp();
+    size_t written = 0;
+    while(written < bytes) {
+        size_t  length = min(bytes - written, sizeof(buffer));
+        double  start  = bench_timestamp();
+        ssize_t actual = fs_handle_write(handle, buffer, length);
+        if(actual <= 0) { break; }
+        bench_record(result, start, actual);
+        written += actual;
+        if((size_t)actual != length) { break; }
+    }
+    bool synced = fs_close(handle) && fs_sync(fs);
+    bench_stop(result, begin);
+
+    if(!synced || !written) {
+        fs_remove(fs, inode_number);
+        return -1;
+    }
+    return inode_number;
+}
+
+/**
+ * Benchmark sequential reads of the whole specified file, BENCH_CHUNK bytes
+ * at a time.
+ *
+ * @param       fs              Pointer to mounted FileSystem structure.
+ * @param       inode_number    Inode to read.
+ * @param       result          Pointer to BenchResult structure to fill in.
+ *
+ * @return      Whether or not the whole file was read.
+ **/
+bool bench_read(FileSystem *fs, size_t inode_number, BenchResult *result) {
+    char    buffer[BENCH_CHUNK];
+    ssize_t size = fs_stat(fs, inode_number);
+    if(size < 0) { return false; }
+
+    FileHandle *handle = fs_open(fs, inode_number);
+    if(!handle || !bench_start(result, "seq-read", fs->disk, (size + BENCH_CHUNK - 1)/BENCH_CHUNK)) {
+        fs_close(handle);
+        return false;
+    }
+
+    double  begin = bench_timestamp();
+    ssize_t actual;
+    for(;;) {
+        double start = bench_timestamp();
+        actual = fs_handle_read(handle, buffer, sizeof(buffer));
+        if(actual <= 0) { break; }
+        bench_record(result, start, actual);
+    }
+    bench_stop(result, begin);
+    return fs_close(handle) && actual == 0 && result->bytes == (size_t)size;
+}
+
+/**
+ * Benchmark count reads of one block each at random block aligned offsets of
+ * the specified file (with a fixed seed, so runs are repeatable).
+ *
+ * @param       fs              Pointer to mounted FileSystem structure.
+ * @param       inode_number    Inode to read.
+ * @param       count           Number of reads.
+ * @param       result          Pointer to BenchResult structure to fill in.
+ *
+ * @return      Whether or not every read was successful.
+ **/
+bool bench_random_read(FileSystem *fs, size_t inode_number, size_t count, BenchResult *result) {
+    char     buffer[BLOCK_SIZE];
+    unsigned seed = 0x5f5;
+    ssize_t  size = fs_stat(fs, inode_number);
+    if(size <= 0) { return false; }
+    if(!bench_start(result, "rand-read", fs->disk, count)) { return false; }
+
+    size_t blocks = (size + BLOCK_SIZE - 1)/BLOCK_SIZE;
+    double begin  = bench_timestamp();
+    bool   success = true;
+    for(size_t i = 0; i < count; i++) {
+        size_t  offset = (size_t)rand_r(&seed) % blocks * BLOCK_SIZE;
+        double  start  = bench_timestamp();
+        ssize_t actual = fs_read(fs, inode_number, buffer, sizeof(buffer), offset);
+        if(actual <= 0) {
+            success = false;
+            break;
+        }
+        bench_record(result, start, actual);
+    }
+    bench_stop(result, begin);
+    return success;
+}
+
+/**
+ * Benchmark metadata churn: create a file, write BENCH_CHURN_BYTES to it, and
+ * remove it again, files times (each cycle is one operation).
+ *
+ * @param       fs          Pointer to mounted FileSystem structure.
+ * @param       files       Number of files to create and remove.
+ * @param       result      Pointer to BenchResult structure to fill in.
+ *
+ * @return      Whether or not every cycle was successful.
+ **/
+bool bench_churn(FileSystem *fs, size_t files, BenchResult *result) {
+    char buffer[BENCH_CHURN_BYTES];
+    memset(buffer, 'S', sizeof(buffer));
+    if(!bench_start(result, "churn", fs->disk, files)) { return false; }
+
+    double begin   = bench_timestamp();
+    bool   success = true;
+    for(size_t i = 0; i < files && success; i++) {
+        double  start        = bench_timestamp();
+        ssize_t inode_number = fs_create(fs);
+        if(inode_number < 0) {
+            success = false;
+            break;
+        }
+        success = fs_write(fs, inode_number, buffer, sizeof(buffer), 0) == sizeof(buffer);
+        success = fs_remove(fs, inode_number) && success;
+        bench_record(result, start, sizeof(buffer));
+    }
+    success = fs_sync(fs) && success;
+    bench_stop(result, begin);
+    return success;
+}
+
+/**
+ * Benchmark mount time of an image with the specified number of blocks by
+ * doing the following:
+ *
+ *  1. Format the scratch image and fill half of its data blocks.
+ *
+ *  2. Time mounting it after a clean unmount (stored bitmaps are loaded).
+ *
+ *  3. Mark it dirty and time mounting it again (the Inode table is scanned).
+ *
+ *  4. Close and remove the scratch image.
+ *
+ * @param       path        Path of scratch disk image (removed afterwards).
+ * @param       blocks      Number of blocks in scratch image.
+ * @param       flags       Disk flags (DISK_MMAP).
+ * @param       format      Format flags (FS_EXTENTS).
+ * @param       clean       Pointer to BenchResult structure for clean mount.
+ * @param       dirty       Pointer to BenchResult structure for dirty mount.
+ *
+ * @return      Whether or not the image was created and mounted.
+ **/
+bool bench_mount(const char *path, size_t blocks, int flags, uint32_t format, BenchResult *clean, BenchResult *dirty) {
+    Disk *disk = disk_open(path, blocks, flags | DISK_QUIET);
+    if(!disk) {
+        unlink(path);
+        return false;
+    }
+
+    FileSystem fs = {0};
+    bool success  = fs_format(&fs, disk, format) && fs_mount(&fs, disk);
+    if(success) {
+        size_t data = blocks - 1 - fs.meta_data.inode_blocks - fs.meta_data.bitmap_blocks - fs.meta_data.inode_bitmap_blocks;
+        bench_fill(&fs, data/2*BLOCK_SIZE);
+        fs_unmount(&fs);
+    }
+
+    BenchResult *results[] = {clean, dirty};
+    for(size_t i = 0; i < 2 && success; i++) {
+        // The SuperBlock is only marked clean by a successful unmount
+        if(results[i] == dirty && !fs_write_super_block(&fs, disk, false)) {
+            success = false;
+            break;
+        }
+        if(!bench_start(results[i], results[i] == clean ? "mount-clean" : "mount-dirty", disk, 1)) {
+            success = false;
+            break;
+        }
+        double start = bench_timestamp();
+        success = fs_mount(&fs, disk);
+        bench_record(results[i], start, 0);
+        bench_stop(results[i], start);
+        fs_unmount(&fs);
+    }
+
+    disk_close(disk);
+    unlink(path);
+    return success;
+}
+
+/**
+ * Start a benchmark by recording its name, allocating room for capacity
+ * latencies, and taking a snapshot of the disk counters.
+ *
+ * @param       result      Pointer to BenchResult structure to initialize.
+ * @param       name        Name of workload.
+ * @param       disk        Disk whose transfers are counted.
+ * @param       capacity    Maximum number of latencies recorded.
+ *
+ * @return      Whether or not the latency array was allocated.
+ **/
+bool bench_start(BenchResult *result, const char *name, Disk *disk, size_t capacity) {
+    memset(result, 0, sizeof(BenchResult));
+    result->name      = name;
+    result->disk      = disk;
+    result->capacity  = max(capacity, (size_t)1);
+    result->latencies = malloc(result->capacity*sizeof(double));
+    if(!result->latencies) { return false; }
+
+    result->reads  = disk->reads;
+    result->writes = disk->writes;
+    return true;
+}
+
+/**
+ * Record one operation that started at the specified time and transferred the
+ * specified number of bytes (latencies past the capacity are dropped).
+ *
+ * @param       result      Pointer to BenchResult structure.
+ * @param       start       Timestamp the operation started at.
+ * @param       bytes       Number of logical bytes transferred.
+ **/
+void bench_record(BenchResult *result, double start, size_t bytes) {
+    if(result->operations < result->capacity) {
+        result->latencies[result->operations] = bench_timestamp() - start;
+    }
+    result->operations++;
+    result->bytes += bytes;
+}
+
+/**
+ * Stop a benchmark by recording the elapsed time and disk transfers since it
+ * started and sorting the latencies.
+ *
+ * @param       result      Pointer to BenchResult structure.
+ * @param       start       Timestamp the workload started at.
+ **/
+void bench_stop(BenchResult *result, double start) {
+    result->elapsed = bench_timestamp() - start;
+    result->reads   = result->disk->reads - result->reads;
+    result->writes  = result->disk->writes - result->writes;
+    qsort(result->latencies, min(result->operations, result->capacity), sizeof(double), bench_compare);
+}
+
+/**
+ * Report throughput, latency percentiles (in microseconds), and disk blocks
+ * read and written per logical block transferred.
+ *
+ * @param       result      Pointer to BenchResult structure.
+ * @param       stream      File stream to report to.
+ **/
+void bench_report(const BenchResult *result, FILE *stream) {
+    double megabytes = (double)result->bytes / (1<<20);
+    double blocks    = (double)result->bytes / BLOCK_SIZE;
+
+    fprintf(stream, "%-12s %8lu ops %9.3lf s", result->name, result->operations, result->elapsed);
+    if(result->bytes) {
+        fprintf(stream, " %9.2lf MB/s", megabytes / (result->elapsed > 0 ? result->elapsed : 1));
+    }
+    else {
+        fprintf(stream, " %9s     ", "-");
+    }
+    fprintf(stream, "  p50 %9.1lf  p90 %9.1lf  p99 %9.1lf  max %9.1lf us",
+        bench_percentile(result, 0.50) * 1000000, bench_percentile(result, 0.90) * 1000000,
+        bench_percentile(result, 0.99) * 1000000, bench_percentile(result, 1.00) * 1000000);
+    if(result->bytes) {
+        fprintf(stream, "  %7.3lf rd %7.3lf wr blk/blk\n", result->reads / blocks, result->writes / blocks);
+    }
+    else {
+        fprintf(stream, "  %7lu rd %7lu wr blocks\n", result->reads, result->writes);
+    }
+}
+
+/**
+ * Release the latencies of a BenchResult.
+ *
+ * @param       result      Pointer to BenchResult structure.
+ **/
+void bench_release(BenchResult *result) {
+    free(result->latencies);
+    result->latencies = NULL;
+    result->capacity  = 0;
+}
+
+/* Internal Functions */
+
+double bench_percentile(const BenchResult *result, double percentile) {
+    size_t recorded = min(result->operations, result->capacity);
+    if(!recorded) { return 0; }
+
+    size_t index = (size_t)(percentile * recorded);
+    return result->latencies[min(index, recorded - 1)];
+}
+
+int bench_compare(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
@@ -0,0 +1,323 @@
+/* bitmap.c: SimpleFS packed bitmap
+ *
+ * The Bitmap packs one bit per item into 64-bit words, so a free block map
+ * costs one bit (rather than one bool) per disk block.  A second, summary
+ * level keeps one bit per word that is set whenever the word has any bit set,
+ * so searches jump straight to the next non-empty word and then locate the bit
+ * inside it with a count-trailing-zeros instruction.  With 64 * 64 items per
+ * summary word, even a 16 TiB disk needs only 1M summary words.
+ **/
+
+#include "sfs/bitmap.h"
+
+#include <string.h>
+
+/* Internal Prototypes */
+
+void    bitmap_update_summary(Bitmap *bitmap, size_t word);
+size_t  bitmap_find_word(const Bitmap *bitmap, size_t word);
+
+/* External Functions */
+
+/**
+ * Create bitmap with the specified number of bits by doing the following:
+ *
+ *  1. Allocate Bitmap structure, words, and summary words.
+ *
+ *  2. Initialize every bit to value (bits past the end are always clear).
+ *
+ *  3. Initialize summary to match the words.
+ *
+ * @param       bits        Number of bits in bitmap.
+ * @param       value       Initial value of every bit.
+ *
+ * @return      Pointer to newly allocated Bitmap structure (NULL on failure).
+ **/
+Bitmap * bitmap_create(size_t bits, bool value) {
+    Bitmap *bitmap = calloc(1, sizeof(Bitmap));
+    if(!bitmap) { return NULL; }
+
+    bitmap->bits     = bits;
+    bitmap->nwords   = (bits + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS;
+    bitmap->nsummary = (bitmap->nwords + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS;
+    bitmap->words    = calloc(bitmap->nwords + 1, sizeof(uint64_t));
+    bitmap->summary  = calloc(bitmap->nsummary + 1, sizeof(uint64_t));
+    if(!bitmap->words || !bitmap->summary) {
+        bitmap_delete(bitmap);
+        return NULL;
+    }
+
+    if(value) {
+        memset(bitmap->words, 0xff, bitmap->nwords * sizeof(uint64_t));
+        if(bits % BITMAP_WORD_BITS) {
+            bitmap->words[bitmap->nwords - 1] = bitmap_mask(bits) - 1;
+        }
+        memset(bitmap->summary, 0xff, bitmap->nsummary * sizeof(uint64_t));
+        if(bitmap->nwords % BITMAP_WORD_BITS) {
+            bitmap->summary[bitmap->nsummary - 1] = bitmap_mask(bitmap->nwords) - 1;
+        }
+    }
+    return bitmap;
+}
+
+/**
+ * Release bitmap memory.
+ *
+ * @param       bitmap      Pointer to Bitmap structure.
+ **/
+void bitmap_delete(Bitmap *bitmap) {
+    if(!bitmap) { return; }
+
+    free(bitmap->words);
+    free(bitmap->summary);
+    free(bitmap);
+}
+
+/**
+ * Return whether or not the specified bit is set (bits out of range are
+ * reported as clear).
+ *
+ * @param       bitmap      Pointer to Bitmap structure.
+ * @param       bit         Bit to test.
+ *
+ * @return      Value of specified bit.
+ **/
+bool bitmap_test(const Bitmap *bitmap, size_t bit) {
+    if(bit >= bitmap->bits) { return false; }
+
+    return (bitmap->words[bitmap_word(bit)] & bitmap_mask(bit)) != 0;
+}
+
+/**
+ * Set the specified bit (bits out of range are ignored).
+ *
+ * @param       bitmap      Pointer to Bitmap structure.
+ * @param       bit         Bit to set.
+ **/
+void bitmap_set(Bitmap *bitmap, size_t bit) {
+    if(bit >= bitmap->bits) { return; }
+
+    size_t word = bitmap_word(bit);
+    bitmap->words[word] |= bitmap_mask(bit);
+    bitmap->summary[bitmap_word(word)] |= bitmap_mask(word);
+}
+
+/**
+ * Clear the specified bit (bits out of range are ignored).
+ *
+ * @param       bitmap      Pointer to Bitmap structure.
+ * @param       bit         Bit to clear.
+ **/
+void bitmap_clear(Bitmap *bitmap, size_t bit) {
+    if(bit >= bitmap->bits) { return; }
+
+    size_t word = bitmap_word(bit);
+    bitmap->words[word] &= ~bitmap_mask(bit);
+    bitmap_update_summary(bitmap, word);
+}
+
+/**
+ * Clear count bits starting at the specified bit, a whole word at a time
+ * where possible (bits out of range are ignored).
+ *
+ * @param       bitmap      Pointer to Bitmap structure.
+ * @param       bit         First bit to clear.
+ * @param       count       Number of bits to clear.
+ **/
+void bitmap_clear_range(Bitmap *bitmap, size_t bit, size_t count) {
+    if(bit >= bitmap->bits) { return; }
+
+    count = (count > bitmap->bits - bit) ? bitmap->bits - bit : count;
+    size_t end = bit + count;
+
+    while(bit < end && bit % BITMAP_WORD_BITS) {
+        bitmap_clear(bitmap, bit++);
+    }
+    while(end - bit >= BITMAP_WORD_BITS) {
+        bitmap->words[bitmap_word(bit)] = 0;
+        bitmap_update_summary(bitmap, bitmap_word(bit));
+        bit += BITMAP_WORD_BITS;
+    }
+    while(bit < end) {
+        bitmap_clear(bitmap, bit++);
+    }
+}
+
+/**
+ * Load count packed words (such as a bitmap stored on disk) into the bitmap
+ * starting at the specified word.  Words past the end of the bitmap are
+ * ignored, bits past the last bit are dropped, and the summary is updated.
+ *
+ * @param       bitmap      Pointer to Bitmap structure.
+ * @param       word        First word to load.
+ * @param       words       Packed words to copy into bitmap.
+ * @param       count       Number of words to load.
+ **/
+void bitmap_load(Bitmap *bitmap, size_t word, const uint64_t *words, size_t count) {
+    if(word >= bitmap->nwords) { return; }
+
+    count = (count > bitmap->nwords - word) ? bitmap->nwords - word : count;
+    memcpy(bitmap->words + word, words, count * sizeof(uint64_t));
+    if(word + count == bitmap->nwords && bitmap->bits % BITMAP_WORD_BITS) {
+        bitmap->words[bitmap->nwords - 1] &= bitmap_mask(bitmap->bits) - 1;
+    }
+    for(size_t i = word; i < word + count; i++) {
+        bitmap_update_summary(bitmap, i);
+    }
+}
+
+/**
+ * Find the first set bit at or after the specified start bit by doing the
+ * following:
+ *
+ *  1. Check the remainder of the word containing start.
+ *
+ *  2. Use the summary to jump to the next non-empty word.
+ *
+ *  3. Locate the lowest set bit of that word with count-trailing-zeros.
+ *
+ * @param       bitmap      Pointer to Bitmap structure.
+ * @param       start       Bit to start searching from.
+ *
+ * @return      Index of first set bit (BITMAP_NOT_FOUND if there is none).
+ **/
+size_t bitmap_find(const Bitmap *bitmap, size_t start) {
+    if(start >= bitmap->bits) { return BITMAP_NOT_FOUND; }
+
+    size_t   word = bitmap_word(start);
+    uint64_t bits = bitmap->words[word] & ~(bitmap_mask(start) - 1);
+    if(!bits) {
+        word = bitmap_find_word(bitmap, word + 1);
+        if(word == BITMAP_NOT_FOUND) { return BITMAP_NOT_FOUND; }
+        bits = bitmap->words[word];
+    }
+    return word * BITMAP_WORD_BITS + __builtin_ctzll(bits);
+}
+
+/**
+ * Find the next set bit using a rotating (next fit) search: start where the
+ * previous search left off and wrap around to the beginning.  Consecutive
+ * allocations therefore stay close together without rescanning the allocated
+ * prefix of the bitmap.
+ *
+ * @param       bitmap      Pointer to Bitmap structure.
+ *
+ * @return      Index of set bit (BITMAP_NOT_FOUND if there is none).
+ **/
+size_t bitmap_find_next(Bitmap *bitmap) {
+    size_t bit = bitmap_find(bitmap, bitmap->hint);
+    if(bit == BITMAP_NOT_FOUND && bitmap->hint) {
+        bit = bitmap_find(bitmap, 0);
+    }
+    if(bit != BITMAP_NOT_FOUND) {
+        bitmap->hint = bit + 1;
+    }
+    return bit;
+}
+
+/**
+ * Find a run of length consecutive set bits at or after the specified start
+ * bit.  If there is no run that long, the longest shorter run is returned
+ * instead.
+ *
+ * @param       bitmap      Pointer to Bitmap structure.
+ * @param       start       Bit to start searching from.
+ * @param       length      Number of consecutive set bits wanted.
+ * @param       found       Set to the length of the returned run.
+ *
+ * @return      Index of first bit of run (BITMAP_NOT_FOUND if no bit is set).
+ **/
+size_t bitmap_find_run(const Bitmap *bitmap, size_t start, size_t length, size_t *found) {
+    size_t best = BITMAP_NOT_FOUND, best_length = 0;
+
+    for(size_t bit = bitmap_find(bitmap, start); bit != BITMAP_NOT_FOUND; ) {
+        size_t run = bitmap_run_length(bitmap, bit, length);
+        if(run > best_length) {
+            best        = bit;
+            best_length = run;
+        }
+        if(run == length) { break; }
+        bit = bitmap_find(bitmap, bit + run);
+    }
+    *found = best_length;
+    return best;
+}
+
+/**
+ * Count the consecutive set bits starting at the specified bit (stopping at
+ * length), a whole word at a time.
+ *
+ * @param       bitmap      Pointer to Bitmap structure.
+ * @param       start       First bit of run.
+ * @param       length      Maximum number of bits to count.
+ *
+ * @return      Number of consecutive set bits.
+ **/
+size_t bitmap_run_length(const Bitmap *bitmap, size_t start, size_t length) {
+    size_t count = 0;
+
+    // Bits past the end are always clear, so runs never extend beyond it
+    while(count < length && start + count < bitmap->bits) {
+        size_t   bit   = start + count;
+        size_t   avail = BITMAP_WORD_BITS - bit % BITMAP_WORD_BITS;
+        uint64_t clear = ~(bitmap->words[bitmap_word(bit)] >> (bit % BITMAP_WORD_BITS));
+        size_t   ones  = clear ? (size_t)__builtin_ctzll(clear) : avail;
+        ones   = ones < avail ? ones : avail;
+        count += ones;
+        if(ones < avail) { break; }
+    }
+    return count < length ? count : length;
+}
+
+/**
+ * Count the number of set bits.
+ *
+ * @param       bitmap      Pointer to Bitmap structure.
+ *
+ * @return      Number of set bits.
+ **/
+size_t bitmap_count(const Bitmap *bitmap) {
+    size_t count = 0;
+    for(size_t i = 0; i < bitmap->nwords; i++) {
+        count += __builtin_popcountll(bitmap->words[i]);
+    }
+    return count;
+}
+
+/* Internal Functions */
+
+/**
+ * Update the summary bit of the specified word.
+ *
+ * @param       bitmap      Pointer to Bitmap structure.
+ * @param       word        Index of word whose summary bit to update.
+ **/
+void bitmap_update_summary(Bitmap *bitmap, size_t word) {
+    if(bitmap->words[word]) {
+        bitmap->summary[bitmap_word(word)] |= bitmap_mask(word);
+    }
+    else {
+        bitmap->summary[bitmap_word(word)] &= ~bitmap_mask(word);
+    }
+}
+
+/**
+ * Find the first non-empty word at or after the specified word using the
+ * summary level.
+ *
+ * @param       bitmap      Pointer to Bitmap structure.
+ * @param       word        Word to start searching from.
+ *
+ * @return      Index of first non-empty word (BITMAP_NOT_FOUND if none).
+ **/
+size_t bitmap_find_word(const Bitmap *bitmap, size_t word) {
+    if(word >= bitmap->nwords) { return BITMAP_NOT_FOUND; }
+
+    size_t   index = bitmap_word(word);
+    uint64_t bits  = bitmap->summary[index] & ~(bitmap_mask(word) - 1);
+    while(!bits) {
+        if(++index >= bitmap->nsummary) { return BITMAP_NOT_FOUND; }
+        bits = bitmap->summary[index];
+    }
+    return index * BITMAP_WORD_BITS + __builtin_ctzll(bits);
+}
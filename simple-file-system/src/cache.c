@@ -0,0 +1,641 @@
+/* cache.c: SimpleFS block cache
+ *
+ * The Cache is a fixed-size write-back cache of disk blocks that sits between
+ * the file system and the disk emulator.  Entries are located through a
+ * chained hash table keyed by block number and replaced using the CLOCK
+ * (second chance) algorithm.  Dirty entries are only written to disk when
+ * they are evicted or when the cache is explicitly synced, and both paths
+ * coalesce runs of adjacent dirty blocks into vectored disk writes.
+ *
+ * The cache may be shared by several threads.  The cache lock protects every
+ * entry and the hash table, but is released during disk I/O: entries being
+ * read are marked as loading and entries being written back as writing, so
+ * they are never evicted meanwhile.  Threads that need such an entry (to read
+ * it while it loads, or to modify or discard it while it is written back)
+ * sleep on the ready condition until the I/O finishes, while lookups of other
+ * blocks proceed.  Internal functions expect the lock to be held already.
+ **/
+
+#include "sfs/cache.h"
+#include "sfs/logging.h"
+#include "sfs/utils.h"
+
+#include <string.h>
+
+/* Internal Prototypes */
+
+CacheEntry *    cache_find(Cache *cache, size_t block);
+CacheEntry *    cache_lookup(Cache *cache, size_t block, bool load, bool modify);
+CacheEntry *    cache_insert(Cache *cache, size_t block, bool *inserted);
+CacheEntry *    cache_evict(Cache *cache);
+void            cache_unlink(Cache *cache, CacheEntry *entry);
+bool            cache_flush_entry(Cache *cache, CacheEntry *entry);
+
+int             cache_compare(const void *a, const void *b);
+
+/* Internal Macros */
+
+#define cache_bucket(c, b)  ((b) & ((c)->nbuckets - 1))
+#define cache_busy(e)       ((e)->loading || (e)->writing)
+
+/* External Functions */
+
+/**
+ * Create block cache for specified disk by doing the following:
+ *
+ *  1. Allocate Cache structure, entries, and backing storage.
+ *
+ *  2. Allocate hash buckets (rounded up to a power of two).
+ *
+ *  3. Mark every entry and bucket as empty.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       blocks      Number of blocks to cache.
+ *
+ * @return      Pointer to newly allocated Cache structure (NULL on failure).
+ **/
+Cache * cache_create(Disk *disk, size_t blocks) {
+    if(!disk || !blocks) { return NULL; }
+
+    Cache *cache = calloc(1, sizeof(Cache));
+    if(!cache) { return NULL; }
+
+    cache->disk     = disk;
+    cache->capacity = blocks;
+    cache->nbuckets = 1;
+    while(cache->nbuckets < blocks) {
+        cache->nbuckets <<= 1;
+    }
+
+    cache->entries = calloc(blocks, sizeof(CacheEntry));
+    cache->buckets = malloc(cache->nbuckets * sizeof(ssize_t));
+    cache->data    = malloc(blocks * BLOCK_SIZE);
+    if(!cache->entries || !cache->buckets || !cache->data || pthread_mutex_init(&cache->lock, NULL)) {
+        free(cache->entries);
+        free(cache->buckets);
+        free(cache->data);
+        free(cache);
+        return NULL;
+    }
+    if(pthread_cond_init(&cache->ready, NULL)) {
+        pthread_mutex_destroy(&cache->lock);
+        free(cache->entries);
+        free(cache->buckets);
+        free(cache->data);
+        free(cache);
+        return NULL;
+    }
+
+    for(size_t i = 0; i < cache->nbuckets; i++) {
+        cache->buckets[i] = -1;
+    }
+    for(size_t i = 0; i < blocks; i++) {
+        cache->entries[i].block = CACHE_INVALID;
+        cache->entries[i].next  = -1;
+        cache->entries[i].data  = cache->data + i*BLOCK_SIZE;
+    }
+    return cache;
+}
+
+/**
+ * Delete block cache by doing the following:
+ *
+ *  1. Write back all dirty entries.
+ *
+ *  2. Report number of cache hits and misses (unless the disk is DISK_QUIET).
+ *
+ *  3. Release cache memory.
+ *
+ * @param       cache       Pointer to Cache structure.
+ **/
+void cache_delete(Cache *cache) {
+    if(!cache) { return; }
+
+    if(!cache_sync(cache)) {
+        error("Unable to write back dirty blocks");
+    }
+    if(!(cache->disk->flags & DISK_QUIET)) {
+        printf("%ld cache hits\n", cache->hits);
+        printf("%ld cache misses\n", cache->misses);
+    }
+
+    pthread_cond_destroy(&cache->ready);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->entries);
+    free(cache->buckets);
+    free(cache->data);
+    free(cache);
+}
+
+/**
+ * Read specified block through the cache into data buffer (must be
+ * BLOCK_SIZE).
+ *
+ * @param       cache       Pointer to Cache structure.
+ * @param       block       Block number to perform operation on.
+ * @param       data        Data buffer.
+ *
+ * @return      Number of bytes read.
+ *              (BLOCK_SIZE on success, DISK_FAILURE on failure).
+ **/
+ssize_t cache_read(Cache *cache, size_t block, char *data) {
+    return cache_read_range(cache, block, 0, data, BLOCK_SIZE);
+}
+
+/**
+ * Write data buffer (must be BLOCK_SIZE) to specified block through the cache.
+ *
+ * Since the whole block is replaced, the previous contents are never read
+ * from disk.
+ *
+ * @param       cache       Pointer to Cache structure.
+ * @param       block       Block number to perform operation on.
+ * @param       data        Data buffer.
+ *
+ * @return      Number of bytes written.
+ *              (BLOCK_SIZE on success, DISK_FAILURE on failure).
+ **/
+ssize_t cache_write(Cache *cache, size_t block, char *data) {
+    return cache_write_range(cache, block, 0, data, BLOCK_SIZE);
+}
+
+/**
+ * Copy length bytes starting at offset within the specified block into the
+ * data buffer.
+ *
+ * @param       cache       Pointer to Cache structure.
+ * @param       block       Block number to perform operation on.
+ * @param       offset      Byte offset within block.
+ * @param       data        Data buffer.
+ * @param       length      Number of bytes to copy.
+ *
+ * @return      Number of bytes read (DISK_FAILURE on failure).
+ **/
+ssize_t cache_read_range(Cache *cache, size_t block, size_t offset, void *data, size_t length) {
+    if(!cache || !data || offset + length > BLOCK_SIZE) {
+        return DISK_FAILURE;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    CacheEntry *entry = cache_lookup(cache, block, true, false);
+    if(entry) {
+        memcpy(data, entry->data + offset, length);
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return entry ? (ssize_t)length : DISK_FAILURE;
+}
+
+/**
+ * Copy length bytes from the data buffer into the specified block starting at
+ * offset and mark the block as dirty.
+ *
+ * Partial writes load the block first so the untouched bytes are preserved.
+ *
+ * @param       cache       Pointer to Cache structure.
+ * @param       block       Block number to perform operation on.
+ * @param       offset      Byte offset within block.
+ * @param       data        Data buffer.
+ * @param       length      Number of bytes to copy.
+ *
+ * @return      Number of bytes written (DISK_FAILURE on failure).
+ **/
+ssize_t cache_write_range(Cache *cache, size_t block, size_t offset, const void *data, size_t length) {
+    if(!cache || !data || offset + length > BLOCK_SIZE) {
+        return DISK_FAILURE;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    CacheEntry *entry = cache_lookup(cache, block, length != BLOCK_SIZE, true);
+    if(entry) {
+        memcpy(entry->data + offset, data, length);
+        entry->dirty = true;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return entry ? (ssize_t)length : DISK_FAILURE;
+}
+
+/**
+ * Drop the specified block from the cache without writing it back.
+ *
+ * Used when the caller is about to overwrite the whole block on disk directly,
+ * so any cached copy (clean or dirty) is stale.  A write-back already under
+ * way is waited for, so it cannot land on top of the caller's write.
+ *
+ * @param       cache       Pointer to Cache structure.
+ * @param       block       Block number to discard.
+ **/
+void cache_discard(Cache *cache, size_t block) {
+    if(!cache) { return; }
+
+    pthread_mutex_lock(&cache->lock);
+    CacheEntry *entry;
+    while((entry = cache_find(cache, block)) && cache_busy(entry)) {
+        pthread_cond_wait(&cache->ready, &cache->lock);
+    }
+    if(entry) {
+        cache_unlink(cache, entry);
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/**
+ * Load the specified blocks into the cache by doing the following:
+ *
+ *  1. Reserve an entry for every block that is not cached and mark it as
+ *  loading.
+ *
+ *  2. Read all missing blocks with a single scatter-gather disk read (without
+ *  holding the cache lock).
+ *
+ *  3. Mark the entries as loaded (dropping them if the read failed) and wake
+ *  any thread waiting for them.
+ *
+ * Blocks are processed in batches so a batch never reserves the whole cache
+ * (and a batch ends early when every other entry is busy).
+ *
+ * @param       cache       Pointer to Cache structure.
+ * @param       blocks      Array of nblocks block numbers.
+ * @param       nblocks     Number of blocks to load.
+ *
+ * @return      Whether or not all blocks are now cached.
+ **/
+bool cache_prefetch(Cache *cache, const size_t *blocks, size_t nblocks) {
+    if(!cache || !blocks) { return false; }
+
+    size_t       batch   = max(cache->capacity / 2, 1);
+    size_t      *missing = malloc(batch * sizeof(size_t));
+    char       **data    = malloc(batch * sizeof(char *));
+    CacheEntry **loaded  = malloc(batch * sizeof(CacheEntry *));
+    bool         success = missing && data && loaded;
+
+    pthread_mutex_lock(&cache->lock);
+    size_t next = 0;
+    while(success && next < nblocks) {
+        size_t count = 0;
+        while(next < nblocks && count < batch) {
+            bool        inserted;
+            CacheEntry *entry = cache_insert(cache, blocks[next], &inserted);
+            if(!entry) {
+                // Read what was reserved first, or wait for the I/O of others
+                if(count) { break; }
+                if(blocks[next] >= cache->disk->blocks || !(cache->loading + cache->writing)) {
+                    success = false;
+                    break;
+                }
+                pthread_cond_wait(&cache->ready, &cache->lock);
+                continue;
+            }
+            next++;
+            if(!inserted) { continue; }
+
+            entry->loading = true;
+            missing[count] = entry->block;
+            data[count]    = entry->data;
+            loaded[count]  = entry;
+            count++;
+        }
+        if(!count) { continue; }
+
+        cache->loading += count;
+        pthread_mutex_unlock(&cache->lock);
+        bool read = disk_read_blocks(cache->disk, missing, data, count) != DISK_FAILURE;
+        pthread_mutex_lock(&cache->lock);
+        cache->loading -= count;
+
+        for(size_t i = 0; i < count; i++) {
+            loaded[i]->loading = false;
+            if(!read) {
+                cache_unlink(cache, loaded[i]);
+            }
+        }
+        pthread_cond_broadcast(&cache->ready);
+        cache->misses += count;
+        success = read;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    free(missing);
+    free(data);
+    free(loaded);
+    return success;
+}
+
+/**
+ * Write back all dirty entries to disk by doing the following:
+ *
+ *  1. Wait for write-backs already under way (which may fail and leave their
+ *  entries dirty).
+ *
+ *  2. Collect every dirty entry, sort the entries by block number, and mark
+ *  them as writing.
+ *
+ *  3. Write them with a single scatter-gather disk write (runs of adjacent
+ *  blocks become one vectored write each) without holding the cache lock.
+ *
+ * @param       cache       Pointer to Cache structure.
+ *
+ * @return      Whether or not all dirty entries were written successfully.
+ **/
+bool cache_sync(Cache *cache) {
+    if(!cache) { return false; }
+
+    CacheEntry **dirty = malloc(cache->capacity * sizeof(CacheEntry *));
+    size_t      *block = malloc(cache->capacity * sizeof(size_t));
+    char       **data  = malloc(cache->capacity * sizeof(char *));
+    bool       success = dirty && block && data;
+
+    pthread_mutex_lock(&cache->lock);
+    while(cache->writing) {
+        pthread_cond_wait(&cache->ready, &cache->lock);
+    }
+    size_t count = 0;
+    for(size_t i = 0; success && i < cache->capacity; i++) {
+        if(cache->entries[i].block != CACHE_INVALID && cache->entries[i].dirty) {
+            dirty[count++] = &cache->entries[i];
+        }
+    }
+
+    if(success && count) {
+        qsort(dirty, count, sizeof(CacheEntry *), cache_compare);
+        for(size_t i = 0; i < count; i++) {
+            dirty[i]->writing = true;
+            block[i] = dirty[i]->block;
+            data[i]  = dirty[i]->data;
+        }
+        cache->writing += count;
+        pthread_mutex_unlock(&cache->lock);
+        success = disk_write_blocks(cache->disk, block, data, count) != DISK_FAILURE;
+        pthread_mutex_lock(&cache->lock);
+        cache->writing -= count;
+
+        for(size_t i = 0; i < count; i++) {
+            dirty[i]->writing = false;
+            dirty[i]->dirty   = dirty[i]->dirty && !success;
+        }
+        pthread_cond_broadcast(&cache->ready);
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    free(dirty);
+    free(block);
+    free(data);
+    return success;
+}
+
+/* Internal Functions */
+
+/**
+ * Find the entry holding the specified block by doing the following:
+ *
+ *  1. Search the hash bucket for the block, waiting while another thread
+ *  loads it (or, before modifying it, writes it back).
+ *
+ *  2. On a miss, evict an entry and (if requested) read the block from disk
+ *  without holding the cache lock.
+ *
+ *  3. Set the reference bit of the entry.
+ *
+ * @param       cache       Pointer to Cache structure.
+ * @param       block       Block number to lookup.
+ * @param       load        Whether or not to read the block on a miss.
+ * @param       modify      Whether or not the caller modifies the entry.
+ *
+ * @return      Pointer to entry holding block (NULL on failure).
+ **/
+CacheEntry * cache_lookup(Cache *cache, size_t block, bool load, bool modify) {
+    if(block >= cache->disk->blocks) {
+        return NULL;
+    }
+
+    while(true) {
+        bool        inserted;
+        CacheEntry *entry = cache_insert(cache, block, &inserted);
+        if(!entry) {
+            // Every entry is busy, so wait until some I/O finishes
+            if(!(cache->loading + cache->writing)) {
+                return NULL;
+            }
+            pthread_cond_wait(&cache->ready, &cache->lock);
+            continue;
+        }
+
+        if(!inserted) {
+            if(entry->loading || (modify && entry->writing)) {
+                pthread_cond_wait(&cache->ready, &cache->lock);
+                continue;
+            }
+            entry->referenced = true;
+            cache->hits++;
+            return entry;
+        }
+
+        if(load) {
+            entry->loading = true;
+            cache->loading++;
+            pthread_mutex_unlock(&cache->lock);
+            bool read = disk_read(cache->disk, block, entry->data) != DISK_FAILURE;
+            pthread_mutex_lock(&cache->lock);
+            cache->loading--;
+            entry->loading = false;
+            pthread_cond_broadcast(&cache->ready);
+            if(!read) {
+                cache_unlink(cache, entry);
+                return NULL;
+            }
+        }
+        cache->misses++;
+        return entry;
+    }
+}
+
+/**
+ * Search the hash bucket of the specified block for its entry.
+ *
+ * @param       cache       Pointer to Cache structure.
+ * @param       block       Block number to search for.
+ *
+ * @return      Pointer to entry holding block (NULL if not cached).
+ **/
+CacheEntry * cache_find(Cache *cache, size_t block) {
+    size_t bucket = cache_bucket(cache, block);
+    for(ssize_t i = cache->buckets[bucket]; i >= 0; i = cache->entries[i].next) {
+        if(cache->entries[i].block == block) {
+            return &cache->entries[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Evict an entry and assign it to the specified block (without reading the
+ * block from disk) by doing the following:
+ *
+ *  1. Select a victim, writing it back first if it is dirty.
+ *
+ *  2. Since writing back releases the cache lock, check again whether
+ *  another thread cached the block meanwhile (and return its entry if so).
+ *
+ *  3. Remove the victim from its hash bucket and insert it into the bucket of
+ *  the block.
+ *
+ * @param       cache       Pointer to Cache structure.
+ * @param       block       Block number to assign.
+ * @param       inserted    Set to whether or not the entry is newly assigned.
+ *
+ * @return      Pointer to entry now holding block (NULL on failure or if
+ *              every entry is busy).
+ **/
+CacheEntry * cache_insert(Cache *cache, size_t block, bool *inserted) {
+    *inserted = false;
+    if(block >= cache->disk->blocks) {
+        return NULL;
+    }
+
+    CacheEntry *entry = NULL;
+    while(true) {
+        CacheEntry *cached = cache_find(cache, block);
+        if(cached) {
+            return cached;
+        }
+        if(!entry || entry->dirty || cache_busy(entry)) {
+            entry = cache_evict(cache);
+            if(!entry) {
+                return NULL;
+            }
+        }
+        if(!entry->dirty) {
+            break;
+        }
+        if(!cache_flush_entry(cache, entry)) {
+            return NULL;
+        }
+    }
+    cache_unlink(cache, entry);
+
+    size_t bucket     = cache_bucket(cache, block);
+    entry->block      = block;
+    entry->dirty      = false;
+    entry->referenced = true;
+    entry->next       = cache->buckets[bucket];
+    cache->buckets[bucket] = entry - cache->entries;
+    *inserted = true;
+    return entry;
+}
+
+/**
+ * Select a victim entry using the CLOCK algorithm (skipping entries that are
+ * loading or being written back).
+ *
+ * @param       cache       Pointer to Cache structure.
+ *
+ * @return      Pointer to victim entry, possibly dirty (NULL if there is none).
+ **/
+CacheEntry * cache_evict(Cache *cache) {
+    // Two full sweeps clear every reference bit, so a third finds nothing
+    for(size_t i = 0; i < 3*cache->capacity; i++) {
+        CacheEntry *candidate = &cache->entries[cache->hand];
+        cache->hand = (cache->hand + 1) % cache->capacity;
+
+        if(cache_busy(candidate)) { continue; }
+        if(candidate->block == CACHE_INVALID || !candidate->referenced) {
+            return candidate;
+        }
+        candidate->referenced = false;
+    }
+    return NULL;
+}
+
+/**
+ * Remove entry from its hash bucket and mark it as empty.
+ *
+ * @param       cache       Pointer to Cache structure.
+ * @param       entry       Pointer to entry to remove.
+ **/
+void cache_unlink(Cache *cache, CacheEntry *entry) {
+    if(entry->block == CACHE_INVALID) { return; }
+
+    ssize_t  index = entry - cache->entries;
+    ssize_t *link  = &cache->buckets[cache_bucket(cache, entry->block)];
+    while(*link >= 0 && *link != index) {
+        link = &cache->entries[*link].next;
+    }
+    if(*link == index) {
+        *link = entry->next;
+    }
+    entry->block = CACHE_INVALID;
+    entry->next  = -1;
+    entry->dirty = false;
+}
+
+/**
+ * Write entry back to disk if it is dirty by doing the following:
+ *
+ *  1. Extend the run backwards and forwards over adjacent dirty entries
+ *  that are not already being written (up to CACHE_CLUSTER blocks).
+ *
+ *  2. Mark the run as writing and write it with one vectored disk write
+ *  (without holding the cache lock).
+ *
+ *  3. Mark every entry in the run as clean and wake any thread waiting for
+ *  them.
+ *
+ * @param       cache       Pointer to Cache structure.
+ * @param       entry       Pointer to entry to flush (not busy).
+ *
+ * @return      Whether or not the entry is now clean.
+ **/
+bool cache_flush_entry(Cache *cache, CacheEntry *entry) {
+    if(entry->block == CACHE_INVALID || !entry->dirty) {
+        return true;
+    }
+
+    CacheEntry *run[CACHE_CLUSTER];
+    size_t      first = entry->block;
+    size_t      count = 1;
+    while(first > 0 && count < CACHE_CLUSTER / 2) {
+        CacheEntry *prev = cache_find(cache, first - 1);
+        if(!prev || !prev->dirty || prev->writing) { break; }
+        first--;
+        count++;
+    }
+    for(size_t i = 0; i < count; i++) {
+        run[i] = cache_find(cache, first + i);
+    }
+    while(count < CACHE_CLUSTER) {
+        CacheEntry *next = cache_find(cache, first + count);
+        if(!next || !next->dirty || next->writing) { break; }
+        run[count++] = next;
+    }
+
+    char *data[CACHE_CLUSTER];
+    for(size_t i = 0; i < count; i++) {
+        run[i]->writing = true;
+        data[i] = run[i]->data;
+    }
+    cache->writing += count;
+    pthread_mutex_unlock(&cache->lock);
+    bool written = disk_writev(cache->disk, first, data, count) != DISK_FAILURE;
+    pthread_mutex_lock(&cache->lock);
+    cache->writing -= count;
+
+    for(size_t i = 0; i < count; i++) {
+        run[i]->writing = false;
+        run[i]->dirty   = run[i]->dirty && !written;
+    }
+    pthread_cond_broadcast(&cache->ready);
+    return written;
+}
+
+/**
+ * Compare two cache entries by block number (for qsort).
+ *
+ * @param       a           Pointer to first entry pointer.
+ * @param       b           Pointer to second entry pointer.
+ *
+ * @return      Negative, zero, or positive as a is below, equal, or above b.
+ **/
+int cache_compare(const void *a, const void *b) {
+    size_t x = (*(CacheEntry * const *)a)->block;
+    size_t y = (*(CacheEntry * const *)b)->block;
+    return (x > y) - (x < y);
+}
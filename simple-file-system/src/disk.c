@@ -1,14 +1,40 @@
-/* disk.c: SimpleFS disk emulator */
+/* disk.c: SimpleFS disk emulator
+ *
+ * This file implements the backend independent part of the disk emulator:
+ * argument checking and read/write accounting.  The actual block transfers are
+ * performed by the DiskOps backend selected in disk_open (disk_file.c or
+ * disk_mmap.c).
+ *
+ * Every transfer uses positional I/O (or the shared mapping) and the counters
+ * are updated atomically, so a Disk may be used by several threads at once.
+ *
+ * Batches of requests can also be submitted asynchronously (disk_submit) and
+ * reaped once they complete (disk_reap).  The file backend keeps many of
+ * them in flight through io_uring (disk_uring.c), every other disk performs
+ * them synchronously.
+ **/
+
+#define _GNU_SOURCE     /* SEEK_DATA, SEEK_HOLE */
 
 #include "sfs/disk.h"
 #include "sfs/logging.h"
+#include "sfs/utils.h"
 
+#include <errno.h>
 #include <fcntl.h>
+#include <stdint.h>
 #include <unistd.h>
 
 /* Internal Prototyes */
 
 bool    disk_sanity_check(Disk *disk, size_t blocknum, const char *data);
+bool    disk_range_check(Disk *disk, size_t block, char **data, size_t nblocks);
+ssize_t disk_transfer(Disk *disk, size_t block, char **data, size_t nblocks, bool write);
+ssize_t disk_transfer_blocks(Disk *disk, const size_t *blocks, char **data, size_t nblocks, bool write);
+
+/* Internal Macros */
+
+#define disk_count(c, n)    __atomic_fetch_add(&(c), (n), __ATOMIC_RELAXED)
 
 /* External Functions */
 
@@ -23,33 +49,39 @@ bool    disk_sanity_check(Disk *disk, size_t blocknum, const char *data);
  *
  *  3. Truncate file to desired file size (blocks * BLOCK_SIZE).
  *
+ *  4. Select and open the backend (DISK_MMAP maps the image into memory).
+ *
  * @param       path        Path to disk image to create.
  * @param       blocks      Number of blocks to allocate for disk image.
+ * @param       flags       Disk flags (DISK_MMAP, DISK_QUIET).
  *
  * @return      Pointer to newly allocated and configured Disk structure (NULL
  *              on failure).
  **/
-Disk*	disk_open(const char *path, size_t blocks) {
-    if(blocks > 1000) return NULL;
+Disk*	disk_open(const char *path, size_t blocks, int flags) {
+    // Block numbers are stored on disk as 32-bit values
+    if(!blocks || blocks > UINT32_MAX) return NULL;
     Disk* new_disk = calloc(1,sizeof(Disk));
     // If allocation fails, return NULL
     if(!new_disk) {
-        disk_close(new_disk);
         return NULL;
     }
     // Open file descriptor
     int fd = open(path ,O_RDWR | O_CREAT ,0600);
     // If open fails, return NULL
     if(fd == -1) {
-        disk_close(new_disk);
+        free(new_disk);
         return NULL;
     }
     // Reads and writes already set to 0 by calloc
     new_disk->blocks = blocks;
     new_disk->fd = fd;
+    new_disk->flags = flags;
+    new_disk->ops = (flags & DISK_MMAP) ? &DiskMmapOps : &DiskFileOps;
 
-    if(truncate(path, blocks*BLOCK_SIZE) == -1) {
-        disk_close(new_disk);
+    if(ftruncate(fd, (off_t)blocks*BLOCK_SIZE) == -1 || !new_disk->ops->open(new_disk)) {
+        close(fd);
+        free(new_disk);
         return NULL;
     }
     return new_disk;
@@ -58,17 +90,26 @@ Disk*	disk_open(const char *path, size_t blocks) {
 /**
  * Close disk structure by doing the following:
  *
- *  1. Close disk file descriptor.
+ *  1. Close backend (flushing any mapped data).
+ *
+ *  2. Close disk file descriptor.
  *
- *  2. Report number of disk reads and writes.
+ *  3. Report number of disk reads and writes (unless DISK_QUIET is set).
  *
- *  3. Release disk structure memory.
+ *  4. Release disk structure memory.
  *
  * @param       disk        Pointer to Disk structure.
  */
 void	disk_close(Disk *disk) {
-    printf("%ld disk block reads\n", disk->reads);
-    printf("%ld disk block writes\n", disk->writes);
+    if(!disk) {
+        return;
+    }
+    disk->ops->close(disk);
+
+    if(!(disk->flags & DISK_QUIET)) {
+        printf("%ld disk block reads\n", disk->reads);
+        printf("%ld disk block writes\n", disk->writes);
+    }
 
     close(disk->fd);
     free(disk);
@@ -80,9 +121,8 @@ void	disk_close(Disk *disk) {
  *
  *  1. Perform sanity check.
  *
- *  2. Seek to specified block.
- *
- *  3. Read from block to data buffer (must be BLOCK_SIZE).
+ *  2. Read from block to data buffer (must be BLOCK_SIZE) through the
+ *  backend.
  *
  * @param       disk        Pointer to Disk structure.
  * @param       block       Block number to perform operation on.
@@ -97,15 +137,12 @@ ssize_t disk_read(Disk *disk, size_t block, char *data) {
         return DISK_FAILURE;
     }
 
-    if(lseek(disk->fd, block*BLOCK_SIZE, SEEK_SET) == -1) {
-        return DISK_FAILURE;
-    }
     // Read bytes; check if size is valid
-    if(read(disk->fd, data, BLOCK_SIZE) != BLOCK_SIZE) {
+    if(disk->ops->readv(disk, block, &data, 1) != BLOCK_SIZE) {
         return DISK_FAILURE;
     }
     // Increment disk reads, return BLOCK_SIZE
-    disk->reads++;
+    disk_count(disk->reads, 1);
     return BLOCK_SIZE;
 }
 
@@ -115,9 +152,8 @@ ssize_t disk_read(Disk *disk, size_t block, char *data) {
  *
  *  1. Perform sanity check.
  *
- *  2. Seek to specified block.
- *
- *  3. Write data buffer (must be BLOCK_SIZE) to disk block.
+ *  2. Write data buffer (must be BLOCK_SIZE) to disk block through the
+ *  backend.
  *
  * @param       disk        Pointer to Disk structure.
  * @param       block       Block number to perform operation on.
@@ -130,17 +166,261 @@ ssize_t disk_write(Disk *disk, size_t block, char *data) {
     if(!disk_sanity_check(disk, block, data)) {
         return DISK_FAILURE;
     }
-    if(lseek(disk->fd, block*BLOCK_SIZE, SEEK_SET) == -1) {
-        return DISK_FAILURE;
-    }
     // Write bytes; check if size is valid
-    if(write(disk->fd, data, BLOCK_SIZE) != BLOCK_SIZE) {
+    if(disk->ops->writev(disk, block, &data, 1) != BLOCK_SIZE) {
         return DISK_FAILURE;
     }
-    disk->writes++;
+    disk_count(disk->writes, 1);
     return BLOCK_SIZE;
 }
 
+/**
+ * Read a run of nblocks contiguous blocks starting at the specified block
+ * into the data buffers (each must be BLOCK_SIZE) with one backend call
+ * (a single preadv for the file backend).
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       First block number of the run.
+ * @param       data        Array of nblocks data buffers.
+ * @param       nblocks     Number of blocks in the run.
+ *
+ * @return      Number of bytes read.
+ *              (nblocks*BLOCK_SIZE on success, DISK_FAILURE on failure).
+ **/
+ssize_t disk_readv(Disk *disk, size_t block, char **data, size_t nblocks) {
+    return disk_transfer(disk, block, data, nblocks, false);
+}
+
+/**
+ * Write a run of nblocks contiguous blocks starting at the specified block
+ * from the data buffers (each must be BLOCK_SIZE) with one backend call
+ * (a single pwritev for the file backend).
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       First block number of the run.
+ * @param       data        Array of nblocks data buffers.
+ * @param       nblocks     Number of blocks in the run.
+ *
+ * @return      Number of bytes written.
+ *              (nblocks*BLOCK_SIZE on success, DISK_FAILURE on failure).
+ **/
+ssize_t disk_writev(Disk *disk, size_t block, char **data, size_t nblocks) {
+    return disk_transfer(disk, block, data, nblocks, true);
+}
+
+/**
+ * Read an arbitrary list of blocks into the data buffers (each must be
+ * BLOCK_SIZE).  Consecutive block numbers in the list are coalesced into a
+ * single vectored read.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       blocks      Array of nblocks block numbers.
+ * @param       data        Array of nblocks data buffers.
+ * @param       nblocks     Number of blocks to read.
+ *
+ * @return      Number of bytes read.
+ *              (nblocks*BLOCK_SIZE on success, DISK_FAILURE on failure).
+ **/
+ssize_t disk_read_blocks(Disk *disk, const size_t *blocks, char **data, size_t nblocks) {
+    return disk_transfer_blocks(disk, blocks, data, nblocks, false);
+}
+
+/**
+ * Write an arbitrary list of blocks from the data buffers (each must be
+ * BLOCK_SIZE).  Consecutive block numbers in the list are coalesced into a
+ * single vectored write.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       blocks      Array of nblocks block numbers.
+ * @param       data        Array of nblocks data buffers.
+ * @param       nblocks     Number of blocks to write.
+ *
+ * @return      Number of bytes written.
+ *              (nblocks*BLOCK_SIZE on success, DISK_FAILURE on failure).
+ **/
+ssize_t disk_write_blocks(Disk *disk, const size_t *blocks, char **data, size_t nblocks) {
+    return disk_transfer_blocks(disk, blocks, data, nblocks, true);
+}
+
+/**
+ * Submit a batch of requests (each a run of contiguous blocks) to be
+ * transferred asynchronously.  The requests and their buffers must stay
+ * valid until they are reaped with disk_reap.
+ *
+ * Invalid requests complete right away with DISK_FAILURE, and disks without
+ * an io_uring perform every request before returning.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       requests    Array of nrequests requests.
+ * @param       nrequests   Number of requests.
+ *
+ * @return      Whether or not every request was valid.
+ **/
+bool disk_submit(Disk *disk, DiskRequest *requests, size_t nrequests) {
+    if(!disk || !requests) {
+        return false;
+    }
+
+    bool valid = true;
+    for(size_t i = 0; i < nrequests; i++) {
+        DiskRequest *request = &requests[i];
+        request->result = DISK_FAILURE;
+        request->done   = !request->nblocks || request->nblocks > DISK_IOV_MAX ||
+                          !disk_range_check(disk, request->block, request->data, request->nblocks);
+        request->iov    = NULL;
+        valid           = valid && !request->done;
+        if(request->done || disk->ring) {
+            continue;
+        }
+
+        request->result = request->write ? disk->ops->writev(disk, request->block, request->data, request->nblocks)
+                                         : disk->ops->readv(disk, request->block, request->data, request->nblocks);
+        request->done   = true;
+    }
+    if(disk->ring) {
+        disk_uring_submit(disk, requests, nrequests);
+    }
+    return valid;
+}
+
+/**
+ * Wait until every one of a batch of submitted requests completed and
+ * record the number of blocks read or written.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       requests    Array of nrequests submitted requests.
+ * @param       nrequests   Number of requests.
+ *
+ * @return      Number of bytes transferred by all requests
+ *              (DISK_FAILURE if any of them failed).
+ **/
+ssize_t disk_reap(Disk *disk, DiskRequest *requests, size_t nrequests) {
+    if(!disk || !requests) {
+        return DISK_FAILURE;
+    }
+    if(disk->ring) {
+        disk_uring_reap(disk, requests, nrequests);
+    }
+
+    ssize_t total = 0;
+    for(size_t i = 0; i < nrequests; i++) {
+        DiskRequest *request = &requests[i];
+        if(!request->done || request->result != (ssize_t)(request->nblocks*BLOCK_SIZE)) {
+            total = DISK_FAILURE;
+            continue;
+        }
+        if(request->write) {
+            disk_count(disk->writes, request->nblocks);
+        }
+        else {
+            disk_count(disk->reads, request->nblocks);
+        }
+        if(total != DISK_FAILURE) {
+            total += request->result;
+        }
+    }
+    return total;
+}
+
+/**
+ * Zero a run of nblocks contiguous blocks starting at the specified block.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       First block number of the run.
+ * @param       nblocks     Number of blocks in the run.
+ *
+ * @return      Whether or not the run was zeroed successfully.
+ **/
+bool disk_zero(Disk *disk, size_t block, size_t nblocks) {
+    if(!disk || block > disk->blocks || nblocks > disk->blocks - block) {
+        return false;
+    }
+    if(!nblocks) {
+        return true;
+    }
+    if(!disk->ops->zero(disk, block, nblocks)) {
+        return false;
+    }
+    disk_count(disk->writes, nblocks);
+    return true;
+}
+
+/**
+ * Return a read-only view of the specified block.
+ *
+ * Backends that map the disk image return a pointer directly into the map
+ * (zero-copy), otherwise the block is read into the data buffer (must be
+ * BLOCK_SIZE) and the buffer is returned.  Either way one read is recorded.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       Block number to view.
+ * @param       data        Fallback data buffer.
+ *
+ * @return      Pointer to block contents (NULL on failure).
+ **/
+const char * disk_view(Disk *disk, size_t block, char *data) {
+    if(!disk_sanity_check(disk, block, data)) {
+        return NULL;
+    }
+
+    char *view = disk->ops->view(disk, block);
+    if(view) {
+        disk_count(disk->reads, 1);
+        return view;
+    }
+    if(disk_read(disk, block, data) == DISK_FAILURE) {
+        return NULL;
+    }
+    return data;
+}
+
+/**
+ * Find the first block at or after the specified block that may contain data.
+ *
+ * Blocks that have never been written (or were zeroed with disk_zero) are
+ * holes in a sparse disk image and are known to read back as zeroes, so
+ * callers scanning large, mostly empty regions can skip them entirely.  If the
+ * underlying file system cannot report holes, every block may contain data.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       Block number to start searching from.
+ *
+ * @return      First block that may contain data (disk->blocks if none).
+ **/
+size_t disk_find_data(Disk *disk, size_t block) {
+    if(!disk || block >= disk->blocks) {
+        return disk ? disk->blocks : 0;
+    }
+
+    off_t offset = lseek(disk->fd, (off_t)block*BLOCK_SIZE, SEEK_DATA);
+    if(offset < 0) {
+        return (errno == ENXIO) ? disk->blocks : block;
+    }
+    return min((size_t)(offset / BLOCK_SIZE), disk->blocks);
+}
+
+/**
+ * Find the first block at or after the specified block that is a hole (see
+ * disk_find_data).
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       Block number to start searching from.
+ *
+ * @return      First block that is a hole (disk->blocks if none).
+ **/
+size_t disk_find_hole(Disk *disk, size_t block) {
+    if(!disk || block >= disk->blocks) {
+        return disk ? disk->blocks : 0;
+    }
+
+    off_t offset = lseek(disk->fd, (off_t)block*BLOCK_SIZE, SEEK_HOLE);
+    if(offset < 0) {
+        return disk->blocks;
+    }
+    // A hole that starts inside a block does not cover that block
+    return min((size_t)((offset + BLOCK_SIZE - 1) / BLOCK_SIZE), disk->blocks);
+}
+
 /* Internal Functions */
 
 /**
@@ -170,4 +450,116 @@ bool disk_sanity_check(Disk *disk, size_t block, const char *data) {
         return false;
     }
     return true;
+}
+
+/**
+ * Perform sanity check before a vectored read or write operation.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       First block number of the run.
+ * @param       data        Array of data buffers.
+ * @param       nblocks     Number of blocks in the run.
+ *
+ * @return      Whether or not it is safe to perform a read/write operation
+ *              (true for safe, false for unsafe).
+ **/
+bool disk_range_check(Disk *disk, size_t block, char **data, size_t nblocks) {
+    if(!disk || !data) {
+        return false;
+    }
+    if(block >= disk->blocks || nblocks > disk->blocks - block) {
+        return false;
+    }
+    for(size_t i = 0; i < nblocks; i++) {
+        if(!data[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Transfer a run of contiguous blocks to or from the data buffers through the
+ * backend and record the number of blocks read or written.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       First block number of the run.
+ * @param       data        Array of nblocks data buffers.
+ * @param       nblocks     Number of blocks in the run.
+ * @param       write       Whether to write (true) or read (false).
+ *
+ * @return      Number of bytes transferred (DISK_FAILURE on failure).
+ **/
+ssize_t disk_transfer(Disk *disk, size_t block, char **data, size_t nblocks, bool write) {
+    if(!disk_range_check(disk, block, data, nblocks)) {
+        return DISK_FAILURE;
+    }
+
+    ssize_t expected = nblocks*BLOCK_SIZE;
+    ssize_t result   = write ? disk->ops->writev(disk, block, data, nblocks)
+                             : disk->ops->readv(disk, block, data, nblocks);
+    if(result != expected) {
+        return DISK_FAILURE;
+    }
+
+    if(write) {
+        disk_count(disk->writes, nblocks);
+    }
+    else {
+        disk_count(disk->reads, nblocks);
+    }
+    return expected;
+}
+
+/**
+ * Transfer an arbitrary list of blocks by splitting it into runs of
+ * consecutive block numbers (of at most DISK_IOV_MAX blocks) and submitting
+ * them as asynchronous requests, up to DISK_QUEUE_DEPTH at a time.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       blocks      Array of nblocks block numbers.
+ * @param       data        Array of nblocks data buffers.
+ * @param       nblocks     Number of blocks to transfer.
+ * @param       write       Whether to write (true) or read (false).
+ *
+ * @return      Number of bytes transferred (DISK_FAILURE on failure).
+ **/
+ssize_t disk_transfer_blocks(Disk *disk, const size_t *blocks, char **data, size_t nblocks, bool write) {
+    if(!blocks) {
+        return DISK_FAILURE;
+    }
+
+    DiskRequest requests[DISK_QUEUE_DEPTH];
+    size_t      start = 0;
+    while(start < nblocks) {
+        size_t nrequests = 0;
+        while(start < nblocks && nrequests < DISK_QUEUE_DEPTH) {
+            size_t end = start + 1;
+            while(end < nblocks && end - start < DISK_IOV_MAX && blocks[end] == blocks[end - 1] + 1) {
+                end++;
+            }
+            requests[nrequests++] = (DiskRequest){
+                .block   = blocks[start],
+                .data    = data + start,
+                .nblocks = end - start,
+                .write   = write,
+            };
+            start = end;
+        }
+
+        // A single run gains nothing from going through the ring
+        if(nrequests == 1) {
+            if(disk_transfer(disk, requests[0].block, requests[0].data, requests[0].nblocks, write) == DISK_FAILURE) {
+                return DISK_FAILURE;
+            }
+            continue;
+        }
+
+        // Invalid requests fail when reaped (after the others completed)
+        disk_submit(disk, requests, nrequests);
+        if(disk_reap(disk, requests, nrequests) == DISK_FAILURE) {
+            return DISK_FAILURE;
+        }
+    }
+    return nblocks*BLOCK_SIZE;
 }
\ No newline at end of file
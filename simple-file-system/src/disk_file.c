@@ -0,0 +1,182 @@
+/* disk_file.c: SimpleFS disk emulator (file backend)
+ *
+ * The file backend accesses the disk image with positioned vectored system
+ * calls (preadv/pwritev), so every run of contiguous blocks costs at most one
+ * system call per DISK_IOV_MAX blocks.  Asynchronous requests go through an
+ * io_uring instead (see disk_uring.c), unless DISK_SYNC is set or the kernel
+ * does not provide one.
+ **/
+
+#define _GNU_SOURCE     /* fallocate */
+
+#include "sfs/disk.h"
+#include "sfs/utils.h"
+
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/* Internal Prototyes */
+
+bool    disk_file_open(Disk *disk);
+void    disk_file_close(Disk *disk);
+ssize_t disk_file_readv(Disk *disk, size_t block, char **data, size_t nblocks);
+ssize_t disk_file_writev(Disk *disk, size_t block, char **data, size_t nblocks);
+bool    disk_file_zero(Disk *disk, size_t block, size_t nblocks);
+char *  disk_file_view(Disk *disk, size_t block);
+ssize_t disk_file_transfer(Disk *disk, size_t block, char **data, size_t nblocks, bool write);
+
+/* Backend */
+
+const DiskOps DiskFileOps = {
+    .open   = disk_file_open,
+    .close  = disk_file_close,
+    .readv  = disk_file_readv,
+    .writev = disk_file_writev,
+    .zero   = disk_file_zero,
+    .view   = disk_file_view,
+};
+
+/* Backend Functions */
+
+/**
+ * Prepare file backend by setting up an io_uring for asynchronous requests
+ * (the backend works without one, so failing to set it up is fine).
+ *
+ * @param       disk        Pointer to Disk structure.
+ *
+ * @return      Whether or not the backend is ready.
+ **/
+bool disk_file_open(Disk *disk) {
+    if(!(disk->flags & DISK_SYNC)) {
+        disk_uring_open(disk);
+    }
+    return true;
+}
+
+/**
+ * Release file backend (disk_close closes the descriptor itself).
+ *
+ * @param       disk        Pointer to Disk structure.
+ **/
+void disk_file_close(Disk *disk) {
+    disk_uring_close(disk);
+}
+
+/**
+ * Read a run of contiguous blocks into the data buffers using preadv.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       First block number of the run.
+ * @param       data        Array of nblocks data buffers.
+ * @param       nblocks     Number of blocks in the run.
+ *
+ * @return      Number of bytes read (DISK_FAILURE on failure).
+ **/
+ssize_t disk_file_readv(Disk *disk, size_t block, char **data, size_t nblocks) {
+    return disk_file_transfer(disk, block, data, nblocks, false);
+}
+
+/**
+ * Write a run of contiguous blocks from the data buffers using pwritev.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       First block number of the run.
+ * @param       data        Array of nblocks data buffers.
+ * @param       nblocks     Number of blocks in the run.
+ *
+ * @return      Number of bytes written (DISK_FAILURE on failure).
+ **/
+ssize_t disk_file_writev(Disk *disk, size_t block, char **data, size_t nblocks) {
+    return disk_file_transfer(disk, block, data, nblocks, true);
+}
+
+/**
+ * Zero a run of contiguous blocks by doing the following:
+ *
+ *  1. Punch a hole over the run so the file system releases the storage.
+ *
+ *  2. Fall back to zeroing the range in place.
+ *
+ *  3. Fall back to writing zero blocks with vectored writes.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       First block number of the run.
+ * @param       nblocks     Number of blocks in the run.
+ *
+ * @return      Whether or not the run was zeroed successfully.
+ **/
+bool disk_file_zero(Disk *disk, size_t block, size_t nblocks) {
+    off_t offset = (off_t)block*BLOCK_SIZE;
+    off_t length = (off_t)nblocks*BLOCK_SIZE;
+    if(fallocate(disk->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) == 0 ||
+       fallocate(disk->fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, offset, length) == 0) {
+        return true;
+    }
+
+    // Every iovec points at the same empty block
+    static char empty[BLOCK_SIZE] = {0};
+    char *data[DISK_IOV_MAX];
+    for(size_t i = 0; i < DISK_IOV_MAX; i++) {
+        data[i] = empty;
+    }
+    while(nblocks) {
+        size_t count = min(nblocks, DISK_IOV_MAX);
+        if(disk_file_transfer(disk, block, data, count, true) == DISK_FAILURE) {
+            return false;
+        }
+        block   += count;
+        nblocks -= count;
+    }
+    return true;
+}
+
+/**
+ * File backend cannot provide zero-copy views.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       Block number to view.
+ *
+ * @return      Always NULL.
+ **/
+char * disk_file_view(Disk *disk, size_t block) {
+    (void)disk;
+    (void)block;
+    return NULL;
+}
+
+/* Internal Functions */
+
+/**
+ * Transfer a run of contiguous blocks to or from the data buffers with as few
+ * preadv/pwritev calls as possible (at most DISK_IOV_MAX blocks per call).
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       First block number of the run.
+ * @param       data        Array of nblocks data buffers.
+ * @param       nblocks     Number of blocks in the run.
+ * @param       write       Whether to write (true) or read (false).
+ *
+ * @return      Number of bytes transferred (DISK_FAILURE on failure).
+ **/
+ssize_t disk_file_transfer(Disk *disk, size_t block, char **data, size_t nblocks, bool write) {
+    struct iovec iov[DISK_IOV_MAX];
+    size_t done = 0;
+    while(done < nblocks) {
+        size_t count = min(nblocks - done, DISK_IOV_MAX);
+        for(size_t i = 0; i < count; i++) {
+            iov[i].iov_base = data[done + i];
+            iov[i].iov_len  = BLOCK_SIZE;
+        }
+
+        off_t   offset   = (off_t)(block + done)*BLOCK_SIZE;
+        ssize_t expected = count*BLOCK_SIZE;
+        ssize_t result   = write ? pwritev(disk->fd, iov, count, offset)
+                                 : preadv(disk->fd, iov, count, offset);
+        if(result != expected) {
+            return DISK_FAILURE;
+        }
+        done += count;
+    }
+    return nblocks*BLOCK_SIZE;
+}
@@ -0,0 +1,140 @@
+/* disk_mmap.c: SimpleFS disk emulator (mmap backend)
+ *
+ * The mmap backend maps the whole disk image into memory with a shared
+ * mapping.  Block reads and writes become memcpy, disk_view returns pointers
+ * straight into the map, and dirty pages are flushed with msync when the disk
+ * is closed.
+ **/
+
+#include "sfs/disk.h"
+#include "sfs/logging.h"
+
+#include <string.h>
+#include <sys/mman.h>
+
+/* Internal Prototyes */
+
+bool    disk_mmap_open(Disk *disk);
+void    disk_mmap_close(Disk *disk);
+ssize_t disk_mmap_readv(Disk *disk, size_t block, char **data, size_t nblocks);
+ssize_t disk_mmap_writev(Disk *disk, size_t block, char **data, size_t nblocks);
+bool    disk_mmap_zero(Disk *disk, size_t block, size_t nblocks);
+char *  disk_mmap_view(Disk *disk, size_t block);
+
+/* Backend */
+
+const DiskOps DiskMmapOps = {
+    .open   = disk_mmap_open,
+    .close  = disk_mmap_close,
+    .readv  = disk_mmap_readv,
+    .writev = disk_mmap_writev,
+    .zero   = disk_mmap_zero,
+    .view   = disk_mmap_view,
+};
+
+/* Backend Functions */
+
+/**
+ * Map the whole disk image into memory.
+ *
+ * @param       disk        Pointer to Disk structure.
+ *
+ * @return      Whether or not the image was mapped successfully.
+ **/
+bool disk_mmap_open(Disk *disk) {
+    if(!disk->blocks) {
+        return false;
+    }
+
+    void *map = mmap(NULL, disk->blocks*BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, disk->fd, 0);
+    if(map == MAP_FAILED) {
+        error("Unable to map disk image: %s", strerror(errno));
+        return false;
+    }
+    // Block access is mostly sequential (format, mount, copyin, copyout)
+    madvise(map, disk->blocks*BLOCK_SIZE, MADV_SEQUENTIAL);
+    disk->map = map;
+    return true;
+}
+
+/**
+ * Flush dirty pages back to the disk image and remove the map.
+ *
+ * @param       disk        Pointer to Disk structure.
+ **/
+void disk_mmap_close(Disk *disk) {
+    if(!disk->map) {
+        return;
+    }
+    if(msync(disk->map, disk->blocks*BLOCK_SIZE, MS_SYNC) < 0) {
+        error("Unable to sync disk image: %s", strerror(errno));
+    }
+    munmap(disk->map, disk->blocks*BLOCK_SIZE);
+    disk->map = NULL;
+}
+
+/**
+ * Copy a run of contiguous blocks out of the map.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       First block number of the run.
+ * @param       data        Array of nblocks data buffers.
+ * @param       nblocks     Number of blocks in the run.
+ *
+ * @return      Number of bytes read.
+ **/
+ssize_t disk_mmap_readv(Disk *disk, size_t block, char **data, size_t nblocks) {
+    for(size_t i = 0; i < nblocks; i++) {
+        memcpy(data[i], disk->map + (block + i)*BLOCK_SIZE, BLOCK_SIZE);
+    }
+    return nblocks*BLOCK_SIZE;
+}
+
+/**
+ * Copy a run of contiguous blocks into the map.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       First block number of the run.
+ * @param       data        Array of nblocks data buffers.
+ * @param       nblocks     Number of blocks in the run.
+ *
+ * @return      Number of bytes written.
+ **/
+ssize_t disk_mmap_writev(Disk *disk, size_t block, char **data, size_t nblocks) {
+    for(size_t i = 0; i < nblocks; i++) {
+        memcpy(disk->map + (block + i)*BLOCK_SIZE, data[i], BLOCK_SIZE);
+    }
+    return nblocks*BLOCK_SIZE;
+}
+
+/**
+ * Zero a run of contiguous blocks.
+ *
+ * Punching a hole in the image also zeroes the shared mapping (and avoids
+ * touching every page), so the file backend is tried before memset.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       First block number of the run.
+ * @param       nblocks     Number of blocks in the run.
+ *
+ * @return      Whether or not the run was zeroed successfully.
+ **/
+bool disk_mmap_zero(Disk *disk, size_t block, size_t nblocks) {
+    if(DiskFileOps.zero(disk, block, nblocks)) {
+        return true;
+    }
+    memset(disk->map + block*BLOCK_SIZE, 0, nblocks*BLOCK_SIZE);
+    return true;
+}
+
+/**
+ * Return pointer to the specified block inside the map.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       Block number to view.
+ *
+ * @return      Pointer to block contents.
+ **/
+char * disk_mmap_view(Disk *disk, size_t block) {
+    return disk->map + block*BLOCK_SIZE;
+}
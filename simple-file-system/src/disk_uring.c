@@ -0,0 +1,317 @@
+/* disk_uring.c: SimpleFS disk emulator (io_uring requests)
+ *
+ * The file backend keeps an io_uring (set up with raw system calls, so there
+ * is no library to link) for asynchronous requests: disk_submit places every
+ * request in the submission queue and hands them all to the kernel at once,
+ * and disk_reap collects completions until the requests it was given are
+ * done.  Up to DISK_QUEUE_DEPTH requests are in flight at once, so the device
+ * sees a deep queue instead of one block at a time.
+ *
+ * A single lock protects the ring, so a Disk may still be used by several
+ * threads at once (whichever thread reaps completes the requests of others).
+ **/
+
+/* The kernel headers define their own BLOCK_SIZE (linux/fs.h), so they go
+ * first and the one of the disk emulator replaces it */
+#include <linux/io_uring.h>
+#undef  BLOCK_SIZE
+
+#include "sfs/disk.h"
+#include "sfs/logging.h"
+#include "sfs/utils.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* Ring Structure */
+
+struct DiskRing {
+    int         fd;         /* io_uring file descriptor */
+    unsigned    entries;    /* Number of submission queue entries */
+    unsigned    queued;     /* Requests queued but not submitted yet */
+    unsigned    inflight;   /* Requests submitted but not completed yet */
+
+    void       *sq_map;     /* Submission queue ring (shared with kernel) */
+    size_t      sq_size;    /* Size of submission queue ring */
+    unsigned   *sq_head;    /* Next entry kernel consumes */
+    unsigned   *sq_tail;    /* Next entry we fill */
+    unsigned   *sq_mask;    /* Mask of submission queue indices */
+    unsigned   *sq_array;   /* Indices of submitted entries */
+    struct io_uring_sqe *sqes;  /* Submission queue entries */
+
+    void       *cq_map;     /* Completion queue ring (may be sq_map) */
+    size_t      cq_size;    /* Size of completion queue ring */
+    unsigned   *cq_head;    /* Next completion we consume */
+    unsigned   *cq_tail;    /* Next completion kernel fills */
+    unsigned   *cq_mask;    /* Mask of completion queue indices */
+    struct io_uring_cqe *cqes;  /* Completion queue entries */
+
+    pthread_mutex_t lock;   /* Protects ring (and requests in flight) */
+};
+
+/* Internal Prototyes */
+
+bool    disk_uring_enter(DiskRing *ring, unsigned wait);
+void    disk_uring_complete(DiskRequest *request, int result);
+
+/* Internal Macros */
+
+#define disk_uring_load(p)      __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define disk_uring_store(p, v)  __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+/* Ring Functions */
+
+/**
+ * Set up io_uring for disk by doing the following:
+ *
+ *  1. Create io_uring with DISK_QUEUE_DEPTH entries.
+ *
+ *  2. Map the submission and completion rings (a single map if the kernel
+ *  supports it) and the submission queue entries.
+ *
+ * Any failure (old kernel, io_uring disabled) leaves disk without a ring, so
+ * requests are performed synchronously instead.
+ *
+ * @param       disk        Pointer to Disk structure.
+ *
+ * @return      Whether or not the ring was set up.
+ **/
+bool disk_uring_open(Disk *disk) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    int fd = syscall(__NR_io_uring_setup, DISK_QUEUE_DEPTH, &params);
+    if(fd < 0) {
+        return false;
+    }
+
+    DiskRing *ring = calloc(1, sizeof(DiskRing));
+    if(!ring) {
+        close(fd);
+        return false;
+    }
+    ring->fd      = fd;
+    ring->entries = params.sq_entries;
+    ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->sq_size = ring->cq_size = max(ring->sq_size, ring->cq_size);
+    }
+
+    ring->sq_map = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if(ring->sq_map == MAP_FAILED) {
+        goto FAILURE;
+    }
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_map = ring->sq_map;
+    }
+    else {
+        ring->cq_map = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if(ring->cq_map == MAP_FAILED) {
+            munmap(ring->sq_map, ring->sq_size);
+            goto FAILURE;
+        }
+    }
+    ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if(ring->sqes == MAP_FAILED) {
+        if(ring->cq_map != ring->sq_map) {
+            munmap(ring->cq_map, ring->cq_size);
+        }
+        munmap(ring->sq_map, ring->sq_size);
+        goto FAILURE;
+    }
+
+    char *sq = ring->sq_map;
+    char *cq = ring->cq_map;
+    ring->sq_head  = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail  = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask  = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head  = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail  = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask  = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes     = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    pthread_mutex_init(&ring->lock, NULL);
+
+    disk->ring = ring;
+    return true;
+
+FAILURE:
+    close(fd);
+    free(ring);
+    return false;
+}
+
+/**
+ * Tear down io_uring of disk (after waiting for requests in flight).
+ *
+ * @param       disk        Pointer to Disk structure.
+ **/
+void disk_uring_close(Disk *disk) {
+    DiskRing *ring = disk->ring;
+    if(!ring) {
+        return;
+    }
+
+    pthread_mutex_lock(&ring->lock);
+    while((ring->queued || ring->inflight) && disk_uring_enter(ring, ring->inflight ? 1 : 0)) {}
+    pthread_mutex_unlock(&ring->lock);
+
+    munmap(ring->sqes, ring->entries * sizeof(struct io_uring_sqe));
+    if(ring->cq_map != ring->sq_map) {
+        munmap(ring->cq_map, ring->cq_size);
+    }
+    munmap(ring->sq_map, ring->sq_size);
+    close(ring->fd);
+    pthread_mutex_destroy(&ring->lock);
+    free(ring);
+    disk->ring = NULL;
+}
+
+/**
+ * Submit requests (already checked by disk_submit) to the kernel by doing
+ * the following:
+ *
+ *  1. Fill one submission queue entry (a vectored read or write) for each
+ *  request, waiting for completions whenever DISK_QUEUE_DEPTH requests are
+ *  already in flight.
+ *
+ *  2. Hand every queued entry to the kernel with one system call.
+ *
+ * Requests that cannot be queued complete right away with DISK_FAILURE.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       requests    Array of nrequests requests (not done yet).
+ * @param       nrequests   Number of requests.
+ **/
+void disk_uring_submit(Disk *disk, DiskRequest *requests, size_t nrequests) {
+    DiskRing *ring = disk->ring;
+
+    pthread_mutex_lock(&ring->lock);
+    for(size_t i = 0; i < nrequests; i++) {
+        DiskRequest *request = &requests[i];
+        if(request->done) {
+            continue;
+        }
+
+        // Wait for room (completions only arrive for submitted requests)
+        while(ring->queued + ring->inflight >= ring->entries) {
+            if(!disk_uring_enter(ring, ring->inflight ? 1 : 0)) {
+                break;
+            }
+        }
+        request->iov = malloc(request->nblocks * sizeof(struct iovec));
+        if(ring->queued + ring->inflight >= ring->entries || !request->iov) {
+            disk_uring_complete(request, -ENOMEM);
+            continue;
+        }
+        for(size_t b = 0; b < request->nblocks; b++) {
+            request->iov[b].iov_base = request->data[b];
+            request->iov[b].iov_len  = BLOCK_SIZE;
+        }
+
+        unsigned tail  = *ring->sq_tail;
+        unsigned index = tail & *ring->sq_mask;
+        struct io_uring_sqe *sqe = &ring->sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode    = request->write ? IORING_OP_WRITEV : IORING_OP_READV;
+        sqe->fd        = disk->fd;
+        sqe->off       = (uint64_t)request->block * BLOCK_SIZE;
+        sqe->addr      = (uintptr_t)request->iov;
+        sqe->len       = request->nblocks;
+        sqe->user_data = (uintptr_t)request;
+        ring->sq_array[index] = index;
+        disk_uring_store(ring->sq_tail, tail + 1);
+        ring->queued++;
+    }
+    disk_uring_enter(ring, 0);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+/**
+ * Collect completions until every one of the requests is done.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       requests    Array of nrequests submitted requests.
+ * @param       nrequests   Number of requests.
+ **/
+void disk_uring_reap(Disk *disk, DiskRequest *requests, size_t nrequests) {
+    DiskRing *ring = disk->ring;
+
+    pthread_mutex_lock(&ring->lock);
+    for(size_t i = 0; i < nrequests; i++) {
+        while(!requests[i].done && (ring->queued || ring->inflight) && disk_uring_enter(ring, 1)) {}
+    }
+    pthread_mutex_unlock(&ring->lock);
+}
+
+/* Internal Functions */
+
+/**
+ * Submit queued entries (if any), optionally wait for completions, and
+ * complete the requests of every completion available (the caller must hold
+ * the ring lock).
+ *
+ * If the kernel rejects the queued entries, their requests complete with
+ * DISK_FAILURE (so nobody waits for them forever).
+ *
+ * @param       ring        Pointer to DiskRing structure.
+ * @param       wait        Number of completions to wait for.
+ *
+ * @return      Whether or not the ring is still usable.
+ **/
+bool disk_uring_enter(DiskRing *ring, unsigned wait) {
+    wait = min(wait, ring->inflight + ring->queued);
+    if(ring->queued || wait) {
+        int result = syscall(__NR_io_uring_enter, ring->fd, ring->queued, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if(result >= 0) {
+            ring->queued   -= result;
+            ring->inflight += result;
+        }
+        else if(errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            // Take back the entries the kernel did not consume
+            int      failure = errno;
+            unsigned head  = disk_uring_load(ring->sq_head);
+            unsigned tail  = *ring->sq_tail;
+            for(; head != tail; head++) {
+                struct io_uring_sqe *sqe = &ring->sqes[ring->sq_array[head & *ring->sq_mask]];
+                disk_uring_complete((DiskRequest *)(uintptr_t)sqe->user_data, -failure);
+            }
+            disk_uring_store(ring->sq_tail, disk_uring_load(ring->sq_head));
+            ring->queued = 0;
+            if(!ring->inflight) {
+                error("Unable to submit disk requests: %s", strerror(failure));
+                return false;
+            }
+        }
+    }
+
+    unsigned head = *ring->cq_head;
+    unsigned tail = disk_uring_load(ring->cq_tail);
+    for(; head != tail; head++) {
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        disk_uring_complete((DiskRequest *)(uintptr_t)cqe->user_data, cqe->res);
+        ring->inflight--;
+    }
+    disk_uring_store(ring->cq_head, head);
+    return true;
+}
+
+/**
+ * Record result of request and release its buffer vector.
+ *
+ * @param       request     Pointer to DiskRequest structure.
+ * @param       result      Bytes transferred (negative errno on failure).
+ **/
+void disk_uring_complete(DiskRequest *request, int result) {
+    ssize_t expected = request->nblocks*BLOCK_SIZE;
+    request->result  = (result == expected) ? expected : DISK_FAILURE;
+    request->done    = true;
+    free(request->iov);
+    request->iov     = NULL;
+}
@@ -1,4 +1,17 @@
-/* fs.c: SimpleFS file system */
+/* fs.c: SimpleFS file system
+ *
+ * Every file system call may be made from several threads at once (except
+ * fs_format, fs_mount, and fs_unmount).  Each Inode is protected by one of
+ * INODE_LOCKS striped reader/writer locks, so reads of the same file run in
+ * parallel and calls on different files rarely contend; the free block and
+ * free inode bitmaps are protected by the allocator lock, and the block cache
+ * locks itself.  Locks are always acquired in the order: inode lock, then
+ * allocator (or handles or read-ahead) lock, then cache lock.
+ *
+ * Note: The offset of a FileHandle is not protected, so a handle should only
+ * be read or written through by one thread at a time (fs_read and fs_write
+ * may still be used on an open Inode from any thread).
+ **/
 
 #include "sfs/fs.h"
 #include "sfs/logging.h"
@@ -7,6 +20,42 @@
 #include <stdio.h>
 #include <string.h>
 
+/* Internal Prototypes */
+
+static ssize_t fs_find_free(FileSystem *fs);
+static bool    fs_handle_allocate(FileHandle *handle, size_t bytes);
+static bool    fs_handle_load(FileSystem *fs, size_t inode_number, FileHandle *handle);
+static bool    fs_handle_save(FileHandle *handle);
+static FileHandle *fs_find_handle(FileSystem *fs, size_t inode_number);
+static bool    fs_remove_inode(FileSystem *fs, size_t inode_number);
+static bool    fs_load_inode(FileSystem *fs, size_t inode_number, Inode *node);
+static bool    fs_save_inode(FileSystem *fs, size_t inode_number, Inode *node);
+static ssize_t fs_map_block(FileHandle *handle, size_t index, bool allocate);
+static ssize_t fs_map_extent(FileHandle *handle, size_t index, bool allocate);
+static Extent *fs_extent(FileHandle *handle, size_t index);
+static bool    fs_add_extent(FileHandle *handle, size_t start, size_t length);
+static bool    fs_prefetch(FileHandle *handle, size_t start, size_t end);
+static bool    fs_write_run(FileSystem *fs, size_t block, char **data, size_t nblocks);
+static void    fs_initialize_free_block_bitmap(FileSystem *fs, Block *sb);
+static bool    fs_load_bitmaps(FileSystem *fs, Disk *disk, Block *sb);
+static bool    fs_store_bitmaps(FileSystem *fs, Disk *disk, Block *sb);
+static Bitmap *fs_load_bitmap(Disk *disk, size_t start, size_t nblocks, size_t bits);
+static bool    fs_store_bitmap(Disk *disk, Bitmap *bitmap, size_t start, size_t nblocks);
+static bool    fs_save_bitmap_word(FileSystem *fs, Bitmap *bitmap, size_t start, size_t bit);
+static bool    fs_save_free_inode(FileSystem *fs, size_t inode_number);
+static bool    fs_save_free_block(FileSystem *fs, size_t block);
+static bool    fs_save_free_range(FileSystem *fs, size_t block, size_t length);
+static bool    fs_allocate_block(FileSystem *fs, size_t block);
+static bool    fs_release_block(FileSystem *fs, size_t block);
+static bool    fs_release_range(FileSystem *fs, size_t block, size_t length);
+static bool    fs_scrub_block(FileSystem *fs, size_t block);
+static bool    fs_scrub_blocks(FileSystem *fs, const size_t *blocks, size_t nblocks);
+static bool    fs_scan_inodes(FileSystem *fs, Disk *disk, uint32_t flags, const Block *inode_blk, size_t inode_number, Block *indirect);
+static void    fs_lock_inode(FileSystem *fs, size_t inode_number, bool write);
+static void    fs_unlock_inode(FileSystem *fs, size_t inode_number);
+static bool    fs_initialize_locks(FileSystem *fs);
+static void    fs_destroy_locks(FileSystem *fs);
+
 /* External Functions */
 
 /**
@@ -19,64 +68,94 @@
  * @param       disk        Pointer to Disk structure.
  **/
 void fs_debug(Disk *disk) {
-    Block block;
-    /* Read SuperBlock */
-    if (disk_read(disk, 0, block.data) == DISK_FAILURE) {
+    Block buffer;
+    /* Read SuperBlock (zero-copy when the disk is memory mapped) */
+    const Block *block = (const Block *)disk_view(disk, 0, buffer.data);
+    if (!block) {
         return;
     }
+    SuperBlock super = block->super;
     printf("SuperBlock:\n");
     printf("    magic number is %s\n",
-        (block.super.magic_number == MAGIC_NUMBER) ? "valid" : "invalid");
-    printf("    %u blocks\n"         , block.super.blocks);
-    printf("    %u inode blocks\n"   , block.super.inode_blocks);
-    printf("    %u inodes\n"         , block.super.inodes);
+        (super.magic_number == MAGIC_NUMBER) ? "valid" : "invalid");
+    printf("    %u blocks\n"         , super.blocks);
+    printf("    %u inode blocks\n"   , super.inode_blocks);
+    printf("    %u inodes\n"         , super.inodes);
+    printf("    %u bitmap blocks\n"  , super.bitmap_blocks);
+    printf("    %u inode bitmap blocks\n", super.inode_bitmap_blocks);
+    printf("    %s\n", super.clean ? "clean" : "dirty");
+    printf("    %s\n", (super.flags & FS_EXTENTS) ? "extents" : "pointers");
 
     /* Read Inodes */
-    int iblocks = block.super.inode_blocks;
-    for(int i = 1; i <= iblocks; i++) {
-        Block iblock;
-        // Read in the next inode block and check if the read succeedes
-        if(disk_read(disk, i, iblock.data) == DISK_FAILURE) { return; }
+    size_t iblocks = super.inode_blocks;
+    for(size_t run = disk_find_data(disk, 1); run <= iblocks; run = disk_find_data(disk, run)) {
+        // Holes in a sparse image were never written, so they hold no inodes
+        size_t end = min(disk_find_hole(disk, run), iblocks + 1);
+        for(size_t i = run; i < end; i++, run++) {
+            // Read in the next inode block and check if the read succeedes
+            const Block *iblock = (const Block *)disk_view(disk, i, buffer.data);
+            if(!iblock) { return; }
 
-        // Number if inodes in current block
-        int curr_inodes;
-        if(iblocks == i) {
-            curr_inodes = block.super.inodes-((i-1)*INODES_PER_BLOCK);
-        }
-        else {
-            curr_inodes = INODES_PER_BLOCK;
-        }
+            // Number if inodes in current block
+            size_t curr_inodes;
+            if(iblocks == i) {
+                curr_inodes = super.inodes-((i-1)*INODES_PER_BLOCK);
+            }
+            else {
+                curr_inodes = INODES_PER_BLOCK;
+            }
 
-        for(int j = 0; j < curr_inodes; j++) {
-            Inode curr_inode = iblock.inodes[j];
+            for(size_t j = 0; j < curr_inodes; j++) {
+                Inode curr_inode = iblock->inodes[j];
 
-            if(!curr_inode.valid) { continue; }
+                if(!curr_inode.valid) { continue; }
 
-            printf("Inode %d:\n", INODES_PER_BLOCK*(i-1)+j);
-            printf("    size: %u bytes\n", curr_inode.size);
+                printf("Inode %zu:\n", INODES_PER_BLOCK*(i-1)+j);
+                printf("    size: %u bytes\n", curr_inode.size);
 
-            printf("    direct blocks:");
-            for(int k = 0; k < POINTERS_PER_INODE; k++) {
-                if(curr_inode.direct[k]) {
-                    printf(" %d", curr_inode.direct[k]);
+                if(super.flags & FS_EXTENTS) {
+                    // Inline extents first, then the rest from the extent block
+                    Block extent_buffer;
+                    const Block *extent_block = NULL;
+                    if(curr_inode.indirect) {
+                        printf("    extent block: %u\n", curr_inode.indirect);
+                        extent_block = (const Block *)disk_view(disk, curr_inode.indirect, extent_buffer.data);
+                        if(!extent_block) { return; }
+                    }
+
+                    printf("    extents:");
+                    size_t nextents = min(curr_inode.nextents, EXTENTS_PER_INODE + (extent_block ? EXTENTS_PER_BLOCK : 0));
+                    for(size_t k = 0; k < nextents; k++) {
+                        Extent extent = k < EXTENTS_PER_INODE ? curr_inode.extents[k] : extent_block->extents[k - EXTENTS_PER_INODE];
+                        printf(" %u+%u", extent.start, extent.length);
+                    }
+                    printf("\n");
+                    continue;
                 }
-            }
-            printf("\n");
 
-            if(curr_inode.indirect) {
-                printf("    indirect block: %u\n", curr_inode.indirect);
+                printf("    direct blocks:");
+                for(int k = 0; k < POINTERS_PER_INODE; k++) {
+                    if(curr_inode.direct[k]) {
+                        printf(" %d", curr_inode.direct[k]);
+                    }
+                }
+                printf("\n");
 
-                Block indirect_block;
+                if(curr_inode.indirect) {
+                    printf("    indirect block: %u\n", curr_inode.indirect);
 
-                if(disk_read(disk, curr_inode.indirect, indirect_block.data) == DISK_FAILURE) { return; }
+                    Block indirect_buffer;
+                    const Block *indirect_block = (const Block *)disk_view(disk, curr_inode.indirect, indirect_buffer.data);
+                    if(!indirect_block) { return; }
 
-                printf("    indirect data blocks:");
-                for(int z = 0; z < INODES_PER_BLOCK; z++) {
-                    if(indirect_block.pointers[z]) {
-                        printf(" %u", indirect_block.pointers[z]);
+                    printf("    indirect data blocks:");
+                    for(int z = 0; z < POINTERS_PER_BLOCK; z++) {
+                        if(indirect_block->pointers[z]) {
+                            printf(" %u", indirect_block->pointers[z]);
+                        }
                     }
+                    printf("\n");
                 }
-                printf("\n");
             }
         }
     }
@@ -86,26 +165,31 @@ void fs_debug(Disk *disk) {
  * Format Disk by doing the following:
  *
  *  1. Write SuperBlock (with appropriate magic number, number of blocks,
- *  number of inode blocks, and number of inodes).
+ *  number of inode blocks, number of inodes, number of bitmap blocks, and
+ *  format flags).
  *
  *  2. Clear all remaining blocks.
  *
+ *  3. Write free block bitmap (every data block is free).
+ *
  * Note: Do not format a mounted Disk!
  *
  * @param       fs      Pointer to FileSystem structure.
  * @param       disk    Pointer to Disk structure.
+ * @param       flags   Format flags (FS_EXTENTS for extent based inodes).
  * @return      Whether or not all disk operations were successful.
  **/
-bool fs_format(FileSystem *fs, Disk *disk) {
+bool fs_format(FileSystem *fs, Disk *disk, uint32_t flags) {
     // If free_blocks are allocated, fs is mounted!
     if(fs->free_blocks != NULL) { return false; }
+    if(flags & ~FS_FLAGS) { return false; }
 
     Block empty_block = {{0}}; // Empty block data to write to every block
     fs->meta_data.magic_number = MAGIC_NUMBER;
     fs->meta_data.blocks = disk->blocks;
 
     // InodeBlocks should be '10% of the amount of blocks, rounding up'
-    if(fs->meta_data.blocks % 10 == 0) // If superblocks divide by 10, no rounding needed {
+    if(fs->meta_data.blocks % 10 == 0) { // If superblocks divide by 10, no rounding needed
         fs->meta_data.inode_blocks = fs->meta_data.blocks / 10;
     }
     //Otherwise, add 1 to the result of the division
@@ -113,11 +197,28 @@ bool fs_format(FileSystem *fs, Disk *disk) {
         fs->meta_data.inode_blocks = (fs->meta_data.blocks / 10) + 1;
     }
     fs->meta_data.inodes = fs->meta_data.inode_blocks * INODES_PER_BLOCK;
+    // The free block bitmap follows the inode table (one bit per block)
+    fs->meta_data.bitmap_blocks = (fs->meta_data.blocks + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+    // The free inode bitmap follows the free block bitmap (one bit per inode)
+    fs->meta_data.inode_bitmap_blocks = (fs->meta_data.inodes + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+    fs->meta_data.clean = 1;
+    fs->meta_data.flags = flags;
+    if(1 + fs->meta_data.inode_blocks + fs->meta_data.bitmap_blocks + fs->meta_data.inode_bitmap_blocks > fs->meta_data.blocks) { return false; }
 
-    for(int i = 1; i < fs->meta_data.blocks; i++) {
-        if(disk_write(disk,i,empty_block.data) != BLOCK_SIZE) { return false; }
-    }
-    return true;
+    // Clear every block after the SuperBlock in one pass
+    if(!disk_zero(disk, 1, fs->meta_data.blocks - 1)) { return false; }
+    // Record every data block and inode as free so the first mount does not scan
+    empty_block.super = fs->meta_data;
+    fs_initialize_free_block_bitmap(fs, &empty_block);
+    fs->free_inodes = bitmap_create(fs->meta_data.inodes, true);
+    bool stored = fs->free_blocks && fs->free_inodes && fs_store_bitmaps(fs, disk, &empty_block);
+    bitmap_delete(fs->free_blocks);
+    bitmap_delete(fs->free_inodes);
+    fs->free_blocks = NULL;
+    fs->free_inodes = NULL;
+    if(!stored) { return false; }
+    // Write the SuperBlock last so a partially formatted disk never mounts
+    return fs_write_super_block(fs, disk, true);
 }
 
 /**
@@ -129,7 +230,13 @@ bool fs_format(FileSystem *fs, Disk *disk) {
  *
  *  3. Copy SuperBlock to FileSystem meta data attribute
  *
- *  4. Initialize FileSystem free blocks bitmap.
+ *  4. Load FileSystem free blocks and free inodes bitmaps from Disk if the
+ *  FileSystem was cleanly unmounted, otherwise rebuild them from the Inode
+ *  table.
+ *
+ *  5. Create block cache sized for the Disk and initialize locks.
+ *
+ *  6. Mark SuperBlock dirty until the FileSystem is unmounted.
  *
  * Note: Do not mount a Disk that has already been mounted!
  *
@@ -145,6 +252,7 @@ bool fs_mount(FileSystem *fs, Disk *disk) {
     if(!disk) { return false; }
     // Try to read the superblock
     Block sb;
+    Block *indirect_bufs = NULL;
     if(disk_read(disk, 0, sb.data) == DISK_FAILURE) { return false; }
     // Check magic number
     if(sb.super.magic_number != MAGIC_NUMBER) { return false; }
@@ -154,60 +262,162 @@ bool fs_mount(FileSystem *fs, Disk *disk) {
     if(sb.super.inode_blocks != sb.super.blocks / 10 + (sb.super.blocks % 10 != 0)) { return false; }
     // Check inodes
     if(sb.super.inodes != sb.super.inode_blocks * INODES_PER_BLOCK) { return false; }
+    // Check bitmap blocks (images formatted without a bitmap have none)
+    if(sb.super.bitmap_blocks && sb.super.bitmap_blocks != (sb.super.blocks + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK) { return false; }
+    // Check flags
+    if(sb.super.flags & ~FS_FLAGS) { return false; }
+    // Check inode bitmap blocks (only images with a block bitmap have one)
+    if(sb.super.inode_bitmap_blocks && (!sb.super.bitmap_blocks || sb.super.inode_bitmap_blocks != (sb.super.inodes + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK)) { return false; }
 
-    fs->disk = disk;
-    fs->meta_data = sb.super;
+    // Trust the stored bitmaps only if the last unmount wrote them out completely
+    if(sb.super.bitmap_blocks && sb.super.inode_bitmap_blocks && sb.super.clean) {
+        if(!fs_load_bitmaps(fs, disk, &sb)) { return false; }
+        goto CACHE;
+    }
 
-    Block indirect_blk,inode_blk;
     fs_initialize_free_block_bitmap(fs,&sb);
-    // Walk through the inode table, adjusting bitmap as we go
-    for(int i = 1; i <= sb.super.inode_blocks; i++) { // For every inode block
-        disk_read(disk,i, inode_blk.data); // Read current inode block
-        for(int j = 0; j < INODES_PER_BLOCK; j++) { // For every inode in inode block
-            Inode inode = inode_blk.inodes[j];
-            if(inode.valid) {
-                for(int k = 0; k<POINTERS_PER_INODE; k++) { // For every pointer in the inode
-                    if(inode.direct[k]) { // set all direct pointers to false
-                        fs->free_blocks[inode.direct[k]] = false;
-                    }
-                }
-                if(inode.indirect) { // If there is an inode block, check all of its values and set those to false
-                    fs->free_blocks[inode.indirect] = false; // Indirect block
-                    if(disk_read(disk,inode.indirect,indirect_blk.data) == DISK_FAILURE) { return false; }
+    fs->free_inodes = bitmap_create(sb.super.inodes, true);
+    if(!fs->free_blocks || !fs->free_inodes) { goto FAILURE; }
 
-                    for(int l = 0; l < POINTERS_PER_BLOCK; l++) { // For every point in the referenced indirect block, set false
-                        if(indirect_blk.pointers[l]) {
-                            fs->free_blocks[indirect_blk.pointers[l]] = false;
-                        }
-                    }
-                }
-            }
+    // The indirect blocks of each inode block are read together
+    indirect_bufs = malloc(INODES_PER_BLOCK * sizeof(Block));
+    if(!indirect_bufs) { goto FAILURE; }
+
+    Block inode_buf;
+    // Walk through the inode table, adjusting bitmap as we go.  Holes in a
+    // sparse image were never written, so they cannot hold valid inodes.
+    for(size_t i = disk_find_data(disk, 1); i <= sb.super.inode_blocks; i = disk_find_data(disk, i)) {
+        size_t end = min(disk_find_hole(disk, i), (size_t)sb.super.inode_blocks + 1);
+        for(; i < end; i++) { // For every inode block that holds data
+            const Block *inode_blk = (const Block *)disk_view(disk, i, inode_buf.data);
+            if(!inode_blk) { goto FAILURE; }
+            if(!fs_scan_inodes(fs, disk, sb.super.flags, inode_blk, (i-1)*INODES_PER_BLOCK, indirect_bufs)) { goto FAILURE; }
         }
     }
+    free(indirect_bufs);
+    indirect_bufs = NULL;
+
+    // Replace the stale bitmaps on disk with the ones we just rebuilt
+    if(!fs_store_bitmaps(fs, disk, &sb)) { goto FAILURE; }
+
+CACHE:
+    // Size the block cache to the disk (never larger than the disk itself)
+    fs->cache = cache_create(disk, min(disk->blocks, CACHE_BLOCKS));
+    if(!fs->cache) { goto FAILURE; }
+    if(!fs_initialize_locks(fs)) {
+        cache_delete(fs->cache);
+        fs->cache = NULL;
+        goto FAILURE;
+    }
+
+    // Any crash from here on leaves the stored bitmap untrusted
+    fs->meta_data = sb.super;
+    memset(fs->readahead, 0, sizeof(fs->readahead));
+    fs->handles = NULL;
+    if(sb.super.bitmap_blocks && !fs_write_super_block(fs, disk, false)) {
+        fs_destroy_locks(fs);
+        cache_delete(fs->cache);
+        fs->cache = NULL;
+        goto FAILURE;
+    }
+
+    fs->disk = disk;
     return true;
+
+FAILURE:
+    free(indirect_bufs);
+    bitmap_delete(fs->free_blocks);
+    bitmap_delete(fs->free_inodes);
+    fs->free_blocks = NULL;
+    fs->free_inodes = NULL;
+    return false;
 }
 
 /**
  * Unmount FileSystem from internal Disk by doing the following:
  *
- *  1. Set FileSystem disk attribute.
+ *  1. Close any open file handles.
+ *
+ *  2. Write back and release block cache.
+ *
+ *  3. Mark SuperBlock clean once everything (including the free block
+ *  bitmap) has reached the Disk.
+ *
+ *  4. Set FileSystem disk attribute.
  *
- *  2. Release free blocks bitmap.
+ *  5. Release free blocks and free inodes bitmaps and destroy locks.
  *
  * @param       fs      Pointer to FileSystem structure.
  **/
 void fs_unmount(FileSystem *fs) {
+    while(fs->handles) {
+        fs_close(fs->handles);
+    }
+    if(fs->disk && fs->meta_data.bitmap_blocks && cache_sync(fs->cache)) {
+        fs_write_super_block(fs, fs->disk, true);
+    }
+    if(fs->cache) {
+        fs_destroy_locks(fs);
+    }
+    cache_delete(fs->cache);
+    fs->cache = NULL;
     fs->disk = NULL;
-    free(fs->free_blocks);
+    bitmap_delete(fs->free_blocks);
+    bitmap_delete(fs->free_inodes);
     fs->free_blocks = NULL;
+    fs->free_inodes = NULL;
+}
+
+/**
+ * Write back the metadata of every open file handle and then all dirty blocks
+ * held in the block cache to the Disk by doing the following:
+ *
+ *  1. Collect the Inode numbers of the open handles.
+ *
+ *  2. Save each handle that is still open under its Inode lock.
+ *
+ *  3. Write back the block cache.
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @return      Whether or not all disk operations were successful.
+ **/
+bool fs_sync(FileSystem *fs) {
+    if(!fs->cache) { return false; }
+
+    // Inode locks come before the handles lock, so gather the Inodes first
+    size_t  count = 0, *inodes = NULL;
+    pthread_mutex_lock(&fs->handles_lock);
+    for(FileHandle *handle = fs->handles; handle; handle = handle->next) {
+        count++;
+    }
+    if(count) {
+        inodes = malloc(count*sizeof(size_t));
+        count  = 0;
+        for(FileHandle *handle = fs->handles; inodes && handle; handle = handle->next) {
+            inodes[count++] = handle->inode_number;
+        }
+    }
+    pthread_mutex_unlock(&fs->handles_lock);
+
+    bool success = count == 0 || inodes;
+    for(size_t i = 0; i < count; i++) {
+        fs_lock_inode(fs, inodes[i], true);
+        FileHandle *handle = fs_find_handle(fs, inodes[i]);
+        if(handle) {
+            success = fs_handle_save(handle) && success;
+        }
+        fs_unlock_inode(fs, inodes[i]);
+    }
+    free(inodes);
+    return cache_sync(fs->cache) && success;
 }
 
 /**
  * Allocate an Inode in the FileSystem Inode table by doing the following:
  *
- *  1. Search Inode table for free inode.
+ *  1. Find the lowest free inode in the free inodes bitmap.
  *
- *  2. Reserve free inode in Inode table.
+ *  2. Reserve free inode in Inode table and bitmap.
  *
  * Note: Be sure to record updates to Inode table to Disk.
  *
@@ -215,21 +425,25 @@ void fs_unmount(FileSystem *fs) {
  * @return      Inode number of allocated Inode.
  **/
 ssize_t fs_create(FileSystem *fs) {
-    Block block = {{0}};
+    if(!fs->free_inodes) { return -1; }
 
-    for(int i=1;i<=fs->meta_data.inode_blocks;i++) {
-        if(disk_read(fs->disk,i,block.data)==BLOCK_SIZE) {
-            for(int j=0;j<INODES_PER_BLOCK;j++) {
-                if(!block.inodes[j].valid) {
-                    block.inodes[j].valid=1;
-                    if(disk_write(fs->disk,i,block.data)==BLOCK_SIZE) {
-                        return j+((i-1)*INODES_PER_BLOCK); // i is the inode block, so you must multiply by 128
-                    }
-                }
-            }
-        }
+    pthread_mutex_lock(&fs->alloc_lock);
+    size_t inode_number = bitmap_find(fs->free_inodes, 0);
+    if(inode_number == BITMAP_NOT_FOUND) {
+        pthread_mutex_unlock(&fs->alloc_lock);
+        return -1;
     }
-    return -1;
+    bitmap_clear(fs->free_inodes, inode_number);
+    bool saved = fs_save_free_inode(fs, inode_number);
+    pthread_mutex_unlock(&fs->alloc_lock);
+    if(!saved) { return -1; }
+
+    Inode inode = {0};
+    inode.valid = 1;
+    fs_lock_inode(fs, inode_number, true);
+    saved = fs_save_inode(fs, inode_number, &inode);
+    fs_unlock_inode(fs, inode_number);
+    return saved ? (ssize_t)inode_number : -1;
 }
 
 /**
@@ -241,41 +455,140 @@ ssize_t fs_create(FileSystem *fs) {
  *
  *  3. Release any indirect blocks.
  *
- *  4. Mark Inode as free in Inode table.
+ *  4. Mark Inode as free in Inode table and free inodes bitmap.
+ *
+ * Note: Released blocks are zeroed unless the FS_NOSCRUB option is set (every
+ * allocation path overwrites or zeroes blocks before they can be read).
  *
  * @param       fs              Pointer to FileSystem structure.
  * @param       inode_number    Inode to remove.
  * @return      Whether or not removing the specified Inode was successful.
  **/
 bool    fs_remove(FileSystem *fs, size_t inode_number) {
+    if(inode_number >= fs->meta_data.inodes) { return false; }
+
+    fs_lock_inode(fs, inode_number, true);
+    bool removed = fs_remove_inode(fs, inode_number);
+    fs_unlock_inode(fs, inode_number);
+    return removed;
+}
+
+/**
+ * Remove Inode and associated data from FileSystem (the caller must hold the
+ * Inode lock for writing).
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to remove.
+ * @return      Whether or not removing the specified Inode was successful.
+ **/
+static bool fs_remove_inode(FileSystem *fs, size_t inode_number) {
     Inode iblank = {0},  inode;
-    Block blank = {{0}}, block;
+    Block block;
+    bool  scrub = !(fs->options & FS_NOSCRUB);
 
+    // Open files must be closed before they can be removed
+    if(fs_find_handle(fs, inode_number)) { return false; }
     if(!fs_load_inode(fs, inode_number, &inode)) { return false; }
-    // Free direct blocks
-    for(int j=0;j<POINTERS_PER_INODE;j++) {
-        if(inode.direct[j]) {
-            if(disk_write(fs->disk, inode.direct[j], blank.data) == DISK_FAILURE) { return false; }
-            fs->free_blocks[inode.direct[j]] = true;
+
+    if(fs->meta_data.flags & FS_EXTENTS) {
+        FileHandle handle;
+        if(!fs_handle_load(fs, inode_number, &handle)) { return false; }
+        // Scrub and free each run of blocks as a whole
+        for(size_t e = 0; e < inode.nextents; e++) {
+            Extent *extent = fs_extent(&handle, e);
+            for(size_t b = 0; b < extent->length; b++) {
+                cache_discard(fs->cache, extent->start + b);
+            }
+            if(scrub && !disk_zero(fs->disk, extent->start, extent->length)) { return false; }
+            if(!fs_release_range(fs, extent->start, extent->length)) { return false; }
+        }
+        if(inode.indirect) { // Extent block
+            if(!fs_scrub_block(fs, inode.indirect)) { return false; }
+            if(!fs_release_block(fs, inode.indirect)) { return false; }
         }
     }
+    else {
+        // Collect direct blocks, indirectly referenced blocks, and the indirect block
+        size_t blocks[POINTERS_PER_INODE + POINTERS_PER_BLOCK + 1];
+        size_t nblocks = 0;
+        for(size_t j=0;j<POINTERS_PER_INODE;j++) {
+            if(inode.direct[j]) {
+                blocks[nblocks++] = inode.direct[j];
+            }
+        }
+        if(inode.indirect) {
+            if(cache_read(fs->cache, inode.indirect,block.data) == DISK_FAILURE) { return false; }
 
-    if(inode.indirect) {
-        fs->free_blocks[inode.indirect] = true; // Indirect block
-        if(disk_read(fs->disk,inode.indirect,block.data) == DISK_FAILURE) { return false; }
-
-        for(int l=0; l<POINTERS_PER_BLOCK; l++) { // For every point in the referenced indirect block, set true
-            if(block.pointers[l]) {
-                if(disk_write(fs->disk, block.pointers[l], blank.data) == DISK_FAILURE) { return false; }
-                fs->free_blocks[block.pointers[l]] = true;
-                block.pointers[l]=0;
+            for(size_t l=0; l<POINTERS_PER_BLOCK; l++) {
+                if(block.pointers[l]) {
+                    blocks[nblocks++] = block.pointers[l];
+                }
             }
+            blocks[nblocks++] = inode.indirect;
+        }
+
+        // Scrub them all at once, then mark them free
+        if(!fs_scrub_blocks(fs, blocks, nblocks)) { return false; }
+        for(size_t b = 0; b < nblocks; b++) {
+            if(!fs_release_block(fs, blocks[b])) { return false; }
         }
-        if(disk_write(fs->disk, inode.indirect, blank.data) == DISK_FAILURE) { return false; }
     }
-    // write blank over the inode
-    fs_save_inode(fs, inode_number, &iblank);
-    return true;
+    // write blank over the inode and make it available again
+    if(!fs_save_inode(fs, inode_number, &iblank)) { return false; }
+    pthread_mutex_lock(&fs->alloc_lock);
+    bitmap_set(fs->free_inodes, inode_number);
+    bool saved = fs_save_free_inode(fs, inode_number);
+    pthread_mutex_unlock(&fs->alloc_lock);
+    return saved;
+}
+
+/**
+ * Zero a block that is being released (through the cache), or just drop it
+ * from the cache if the FS_NOSCRUB option is set.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       block           Block to scrub.
+ * @return      Whether or not the block was scrubbed successfully.
+ **/
+static bool fs_scrub_block(FileSystem *fs, size_t block) {
+    Block blank = {{0}};
+
+    if(fs->options & FS_NOSCRUB) {
+        cache_discard(fs->cache, block);
+        return true;
+    }
+    return cache_write(fs->cache, block, blank.data) != DISK_FAILURE;
+}
+
+/**
+ * Zero blocks that are being released by writing them straight to disk as
+ * one batch (so many writes are in flight at once), or just drop them from
+ * the cache if the FS_NOSCRUB option is set.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       blocks          Array of nblocks blocks to scrub.
+ * @param       nblocks         Number of blocks to scrub.
+ * @return      Whether or not the blocks were scrubbed successfully.
+ **/
+static bool fs_scrub_blocks(FileSystem *fs, const size_t *blocks, size_t nblocks) {
+    static char blank[BLOCK_SIZE] = {0};
+
+    for(size_t b = 0; b < nblocks; b++) {
+        cache_discard(fs->cache, blocks[b]);
+    }
+    if((fs->options & FS_NOSCRUB) || !nblocks) {
+        return true;
+    }
+
+    // Every buffer is the same blank block
+    char **data = malloc(nblocks * sizeof(char *));
+    if(!data) { return false; }
+    for(size_t b = 0; b < nblocks; b++) {
+        data[b] = blank;
+    }
+    bool scrubbed = disk_write_blocks(fs->disk, blocks, data, nblocks) != DISK_FAILURE;
+    free(data);
+    return scrubbed;
 }
 
 /**
@@ -286,235 +599,1060 @@ bool    fs_remove(FileSystem *fs, size_t inode_number) {
  * @return      Size of specified Inode (-1 if does not exist).
  **/
 ssize_t fs_stat(FileSystem *fs, size_t inode_number) {
-    Inode inode;
+    Inode   inode;
+    ssize_t size = -1;
 
-    if(!fs_load_inode(fs,inode_number, &inode)) { return -1; }
+    if(inode_number >= fs->meta_data.inodes) { return -1; }
 
-    return inode.size;
+    fs_lock_inode(fs, inode_number, false);
+    // An open handle may hold a newer copy of the Inode
+    FileHandle *handle = fs_find_handle(fs, inode_number);
+    if(handle) {
+        size = handle->inode.size;
+    }
+    else if(fs_load_inode(fs,inode_number, &inode)) {
+        size = inode.size;
+    }
+    fs_unlock_inode(fs, inode_number);
+    return size;
 }
 /**
  * Read from the specified Inode into the data buffer exactly length bytes
- * beginning from the specified offset by doing the following:
+ * beginning from the specified offset (through its open handle if there is
+ * one, otherwise through a temporary handle).
  *
- *  1. Load Inode information.
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to read data from.
+ * @param       data            Buffer to copy data to.
+ * @param       length          Number of bytes to read.
+ * @param       offset          Byte offset from which to begin reading.
+ * @return      Number of bytes read (-1 on error).
+ **/
+ssize_t fs_read(FileSystem *fs, size_t inode_number, char *data, size_t length, size_t offset) {
+    FileHandle temporary;
+    ssize_t    result = -1;
+
+    if(inode_number >= fs->meta_data.inodes) { return -1; }
+
+    fs_lock_inode(fs, inode_number, false);
+    FileHandle *handle = fs_find_handle(fs, inode_number);
+    if(handle) {
+        result = fs_handle_pread(handle, data, length, offset);
+    }
+    else if(fs_handle_load(fs, inode_number, &temporary)) {
+        result = fs_handle_pread(&temporary, data, length, offset);
+    }
+    fs_unlock_inode(fs, inode_number);
+    return result;
+}
+
+/**
+ * Write to the specified Inode from the data buffer exactly length bytes
+ * beginning from the specified offset (through its open handle if there is
+ * one, otherwise through a temporary handle that is saved immediately).
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to write data to.
+ * @param       data            Buffer with data to copy
+ * @param       length          Number of bytes to write.
+ * @param       offset          Byte offset from which to begin writing.
+ * @return      Number of bytes read (-1 on error).
+ **/
+ssize_t fs_write(FileSystem *fs, size_t inode_number, char *data, size_t length, size_t offset) {
+    FileHandle temporary;
+    ssize_t    result = -1;
+
+    if(inode_number >= fs->meta_data.inodes) { return -1; }
+
+    fs_lock_inode(fs, inode_number, true);
+    FileHandle *handle = fs_find_handle(fs, inode_number);
+    if(handle) {
+        result = fs_handle_pwrite(handle, data, length, offset);
+    }
+    else if(fs_handle_load(fs, inode_number, &temporary)) {
+        result = fs_handle_pwrite(&temporary, data, length, offset);
+        if(!fs_handle_save(&temporary)) { result = -1; }
+    }
+    fs_unlock_inode(fs, inode_number);
+    return result;
+}
+
+/**
+ * Preallocate blocks so the specified Inode can hold at least bytes bytes
+ * (through its open handle if there is one, otherwise through a temporary
+ * handle that is saved immediately).
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to reserve space for.
+ * @param       bytes           Number of bytes to reserve.
+ * @return      Whether or not all of the space was reserved.
+ **/
+bool fs_reserve(FileSystem *fs, size_t inode_number, size_t bytes) {
+    FileHandle temporary;
+    bool       reserved = false;
+
+    if(inode_number >= fs->meta_data.inodes) { return false; }
+
+    fs_lock_inode(fs, inode_number, true);
+    FileHandle *handle = fs_find_handle(fs, inode_number);
+    if(handle) {
+        reserved = fs_handle_allocate(handle, bytes);
+    }
+    else if(fs_handle_load(fs, inode_number, &temporary)) {
+        reserved = fs_handle_allocate(&temporary, bytes);
+        reserved = fs_handle_save(&temporary) && reserved;
+    }
+    fs_unlock_inode(fs, inode_number);
+    return reserved;
+}
+
+// Find the next free block, return 0 if there isn't one.  The block is not
+// cleared, so callers must overwrite (or zero) all of it before it is read.
+static ssize_t fs_find_free(FileSystem* fs) {
+    pthread_mutex_lock(&fs->alloc_lock);
+    size_t i = bitmap_find_next(fs->free_blocks);
+    if(i != BITMAP_NOT_FOUND) {
+        // Reserve block i
+        bitmap_clear(fs->free_blocks, i);
+        if(!fs_save_free_block(fs, i)) {
+            bitmap_set(fs->free_blocks, i);
+            i = BITMAP_NOT_FOUND;
+        }
+    }
+    pthread_mutex_unlock(&fs->alloc_lock);
+    return i == BITMAP_NOT_FOUND ? 0 : (ssize_t)i;
+}
+
+/* File Handle Functions */
+
+/**
+ * Open the specified Inode by doing the following:
  *
- *  2. Continuously read blocks and copy data to buffer.
+ *  1. Load Inode and its indirect pointer block into a new FileHandle.
  *
- *  Note: Data is read from direct blocks first, and then from indirect blocks.
+ *  2. Add FileHandle to FileSystem list of open handles.
+ *
+ * The Inode and indirect block stay pinned in the handle, so reads and writes
+ * through it never reload them; they are written back on fs_close or fs_sync.
+ *
+ * Note: Each Inode may only be open once at a time.
  *
  * @param       fs              Pointer to FileSystem structure.
- * @param       inode_number    Inode to read data from.
+ * @param       inode_number    Inode to open.
+ * @return      Pointer to newly allocated FileHandle (NULL on failure).
+ **/
+FileHandle *fs_open(FileSystem *fs, size_t inode_number) {
+    if(inode_number >= fs->meta_data.inodes) { return NULL; }
+
+    FileHandle *handle = malloc(sizeof(FileHandle));
+    if(!handle) { return NULL; }
+
+    fs_lock_inode(fs, inode_number, true);
+    if(fs_find_handle(fs, inode_number) || !fs_handle_load(fs, inode_number, handle)) {
+        fs_unlock_inode(fs, inode_number);
+        free(handle);
+        return NULL;
+    }
+    pthread_mutex_lock(&fs->handles_lock);
+    handle->next = fs->handles;
+    fs->handles  = handle;
+    pthread_mutex_unlock(&fs->handles_lock);
+    fs_unlock_inode(fs, inode_number);
+    return handle;
+}
+
+/**
+ * Close FileHandle by doing the following:
+ *
+ *  1. Write back Inode and indirect block if they changed.
+ *
+ *  2. Remove FileHandle from FileSystem list of open handles.
+ *
+ *  3. Release FileHandle.
+ *
+ * @param       handle          Pointer to FileHandle structure.
+ * @return      Whether or not the metadata was written back successfully.
+ **/
+bool fs_close(FileHandle *handle) {
+    if(!handle) { return false; }
+
+    FileSystem *fs           = handle->fs;
+    size_t      inode_number = handle->inode_number;
+
+    fs_lock_inode(fs, inode_number, true);
+    bool success = fs_handle_save(handle);
+    pthread_mutex_lock(&fs->handles_lock);
+    FileHandle **link = &fs->handles;
+    while(*link && *link != handle) {
+        link = &(*link)->next;
+    }
+    if(*link) {
+        *link = handle->next;
+    }
+    pthread_mutex_unlock(&fs->handles_lock);
+    fs_unlock_inode(fs, inode_number);
+    free(handle);
+    return success;
+}
+
+/**
+ * Read from FileHandle at its current offset and advance the offset.
+ *
+ * @param       handle          Pointer to FileHandle structure.
+ * @param       data            Buffer to copy data to.
+ * @param       length          Number of bytes to read.
+ * @return      Number of bytes read (-1 on error).
+ **/
+ssize_t fs_handle_read(FileHandle *handle, char *data, size_t length) {
+    fs_lock_inode(handle->fs, handle->inode_number, false);
+    ssize_t result = fs_handle_pread(handle, data, length, handle->offset);
+    fs_unlock_inode(handle->fs, handle->inode_number);
+    if(result > 0) { handle->offset += result; }
+    return result;
+}
+
+/**
+ * Write to FileHandle at its current offset and advance the offset.
+ *
+ * @param       handle          Pointer to FileHandle structure.
+ * @param       data            Buffer with data to copy.
+ * @param       length          Number of bytes to write.
+ * @return      Number of bytes written (-1 on error).
+ **/
+ssize_t fs_handle_write(FileHandle *handle, char *data, size_t length) {
+    fs_lock_inode(handle->fs, handle->inode_number, true);
+    ssize_t result = fs_handle_pwrite(handle, data, length, handle->offset);
+    fs_unlock_inode(handle->fs, handle->inode_number);
+    if(result > 0) { handle->offset += result; }
+    return result;
+}
+
+/**
+ * Preallocate blocks so the Inode of FileHandle can hold at least bytes bytes
+ * without changing its size (see fs_handle_allocate).
+ *
+ * @param       handle          Pointer to FileHandle structure.
+ * @param       bytes           Number of bytes to reserve.
+ * @return      Whether or not all of the space was reserved.
+ **/
+bool fs_handle_reserve(FileHandle *handle, size_t bytes) {
+    fs_lock_inode(handle->fs, handle->inode_number, true);
+    bool reserved = fs_handle_allocate(handle, bytes);
+    fs_unlock_inode(handle->fs, handle->inode_number);
+    return reserved;
+}
+
+/**
+ * Set current offset of FileHandle.
+ *
+ * @param       handle          Pointer to FileHandle structure.
+ * @param       offset          New byte offset (may be past the end of file).
+ * @return      New offset (-1 if it is past the maximum file size).
+ **/
+ssize_t fs_seek(FileHandle *handle, size_t offset) {
+    if(offset > fs_max_blocks(handle->fs)*BLOCK_SIZE) { return -1; }
+
+    handle->offset = offset;
+    return offset;
+}
+
+/**
+ * Read from FileHandle into the data buffer exactly length bytes beginning
+ * from the specified offset by doing the following:
+ *
+ *  1. Clamp read to the size of the file.
+ *
+ *  2. Prefetch the blocks ahead of the read if it continues the previous read
+ *  of this Inode (or starts at the beginning of the file).
+ *
+ *  3. Continuously copy data from blocks to buffer.
+ *
+ *  Note: Data is read from direct blocks first, and then from indirect blocks.
+ *
+ * @param       handle          Pointer to FileHandle structure.
  * @param       data            Buffer to copy data to.
  * @param       length          Number of bytes to read.
  * @param       offset          Byte offset from which to begin reading.
  * @return      Number of bytes read (-1 on error).
  **/
-ssize_t fs_read(FileSystem *fs, size_t inode_number, char *data, size_t length, size_t offset) {
-    Inode inode;
-    if(!fs_load_inode(fs,inode_number,&inode)) { return -1; }
+ssize_t fs_handle_pread(FileHandle *handle, char *data, size_t length, size_t offset) {
+    FileSystem *fs    = handle->fs;
+    Inode      *inode = &handle->inode;
+
+    // Never read past the end of the file
+    if(offset >= inode->size) { return 0; }
+    length = min(length, inode->size - offset);
 
-    size_t bytes_read = 0;
     size_t curr_iblk = offset/BLOCK_SIZE;
-    size_t block_pos = offset % BLOCK_SIZE;
-    // Edge case checks
-    if(inode_number>=fs->meta_data.inode_blocks * INODES_PER_BLOCK) { return -1; }
+    size_t last_iblk = (offset + length - 1)/BLOCK_SIZE;
+    size_t file_blks = (inode->size + BLOCK_SIZE - 1)/BLOCK_SIZE;
 
-    if(!fs->free_blocks) { return -1; }
+    // Keep the cache READAHEAD_BLOCKS ahead of sequential readers, topping it
+    // up once they are halfway through the previous window
+    ReadAhead *ra = &fs->readahead[handle->inode_number % READAHEAD_SLOTS];
+    size_t from = 0, to = 0;
+    pthread_mutex_lock(&fs->readahead_lock);
+    bool sequential = ra->inode_number == handle->inode_number && ra->next_offset == offset;
+    if(!sequential) {
+        ra->inode_number = handle->inode_number;
+        ra->prefetched = 0;
+    }
+    if(sequential || offset == 0) {
+        if(ra->prefetched < last_iblk + 1 + READAHEAD_BLOCKS/2) {
+            from = max(ra->prefetched, curr_iblk);
+            to   = min(last_iblk + 1 + READAHEAD_BLOCKS, file_blks);
+            // Claim the window so concurrent readers do not prefetch it again
+            if(from < to) { ra->prefetched = to; }
+        }
+    }
+    pthread_mutex_unlock(&fs->readahead_lock);
+    // Prefetch the window in chunks (fs_prefetch takes at most
+    // READAHEAD_BLOCKS*2 blocks at a time), so large reads claim no blocks
+    // that are never fetched
+    for(size_t start = from; start < to; start += READAHEAD_BLOCKS*2) {
+        fs_prefetch(handle, start, to);
+    }
 
-    if(curr_iblk < POINTERS_PER_INODE) {
-        // Read in the block ontop of which we will read new data
-        Block read_block;
-        if(disk_read(fs->disk, inode.direct[curr_iblk], read_block.data)==DISK_FAILURE) { return -1; }
-        ssize_t to_read = BLOCK_SIZE;
+    size_t bytes_read = 0;
+    size_t block_pos  = offset % BLOCK_SIZE;
+    while(bytes_read < length) {
+        ssize_t block = fs_map_block(handle, curr_iblk, false);
+        if(block < 0) { return -1; }
         // Figure out how many bytes we should read in this block
-        if(to_read > inode.size - offset) {
-            to_read = inode.size - offset;
+        size_t to_read = min(BLOCK_SIZE - block_pos, length - bytes_read);
+        // Unmapped blocks inside the file are holes and read back as zeros
+        if(!block) {
+            memset(data + bytes_read, 0, to_read);
+        }
+        else if(cache_read_range(fs->cache, block, block_pos, data + bytes_read, to_read) == DISK_FAILURE) {
+            return bytes_read ? (ssize_t)bytes_read : -1;
         }
-        // Read block data into *data
-        memcpy(data+bytes_read, read_block.data+block_pos, to_read);
-        // Update bytes read and see if we have finished
+        // Update bytes read and move on to the start of the next block
         bytes_read += to_read;
-
-        if(bytes_read == length){return bytes_read;}
-        // Indicates we have dealt with starting the read in the middle of a block, i.e. we finished the first read
         block_pos = 0;
+        curr_iblk++;
     }
-    else {
-        if(inode.indirect) {
-            // Load the indirect pointers block
-            Block ind_blk;
-            if(disk_read(fs->disk, inode.indirect, ind_blk.data)==DISK_FAILURE) { return -1; }
-            // Loop oveer the entries in the indirect block
-            if(ind_blk.pointers[curr_iblk-POINTERS_PER_INODE]) {
-                Block read_block;
-                if(disk_read(fs->disk, ind_blk.pointers[curr_iblk-POINTERS_PER_INODE], read_block.data)==DISK_FAILURE) { return -1; }
-                ssize_t to_read = BLOCK_SIZE;
-                // Figure out how many bytes we should read in this block
-                if(to_read > inode.size - offset) {
-                    to_read = inode.size - offset;
-                }
-                // Read data from block into buffer
-                memcpy(data+bytes_read, read_block.data+block_pos, to_read);
-                // Update bytes read and see if we have finished
-                bytes_read += to_read;
-                if(bytes_read == length) { return bytes_read; }
-                // Indicates we have dealt with starting the read in the middle of a block, i.e. we finished the first read
-                block_pos = 0;
-            }
-        }
-        else {
-            return -1;
-        }
+    pthread_mutex_lock(&fs->readahead_lock);
+    if(ra->inode_number == handle->inode_number) {
+        ra->next_offset = offset + bytes_read;
     }
+    pthread_mutex_unlock(&fs->readahead_lock);
     return bytes_read;
 }
 
-// Find the next free block, return 0 if there isn't one
-ssize_t fs_find_free(FileSystem* fs) {
-    Block blank = {{0}};
-    for(int i = 0; i < fs->meta_data.blocks; i++) {
-        // If block i is free
-        if(fs->free_blocks[i]) {
-            fs->free_blocks[i] = false;
-            if(disk_write(fs->disk,i,blank.data) == DISK_FAILURE) { return false; }
-            return i;
-        }
-    }
-    return 0;
-}
-
 /**
- * Write to the specified Inode from the data buffer exactly length bytes
- * beginning from the specified offset by doing the following:
+ * Write to FileHandle from the data buffer exactly length bytes beginning
+ * from the specified offset by continuously copying data from buffer to
+ * blocks:
  *
- *  1. Load Inode information.
+ *  - Whole blocks are written straight from the buffer to the disk (runs of
+ *  adjacent blocks as one vectored write), skipping the cache.
  *
- *  2. Continuously copy data from buffer to blocks.
+ *  - Partial blocks that were just allocated are zero filled in the cache
+ *  instead of being read from disk.
  *
- *  Note: Data is read from direct blocks first, and then from indirect blocks.
+ *  - Other partial blocks are merged with their old contents by the cache.
  *
- * @param       fs              Pointer to FileSystem structure.
- * @param       inode_number    Inode to write data to.
+ *  Note: Data is written to direct blocks first, and then to indirect blocks.
+ *  The updated Inode and indirect block are only written back when the handle
+ *  is saved.
+ *
+ * @param       handle          Pointer to FileHandle structure.
  * @param       data            Buffer with data to copy
  * @param       length          Number of bytes to write.
  * @param       offset          Byte offset from which to begin writing.
- * @return      Number of bytes read (-1 on error).
+ * @return      Number of bytes written (-1 on error).
  **/
-ssize_t fs_write(FileSystem *fs, size_t inode_number, char *data, size_t length, size_t offset) {
+ssize_t fs_handle_pwrite(FileHandle *handle, char *data, size_t length, size_t offset) {
+    FileSystem *fs = handle->fs;
     size_t bytes_written = 0;
     size_t curr_iblk = offset/BLOCK_SIZE;
     size_t block_pos = offset % BLOCK_SIZE;
 
-    Inode inode;
-    if(!fs_load_inode(fs,inode_number,&inode)) { return -1; }
-    // If we need to start writing to the direct blocks
-    if(curr_iblk < POINTERS_PER_INODE) {
-        // Start writing to direct blocks
-        for(int i = curr_iblk; i < POINTERS_PER_INODE; i++) {
-            // Check if the direct block has been allocated already
-            if(!inode.direct[i]) {
-                // Try to find the next free_block and update the direct pointer entry
-                ssize_t next_free = fs_find_free(fs);
-                if(!next_free) { goto END; }
-                inode.direct[i] = next_free;
-            }
-            // Read in the block ontop of which we will write new data
-            Block old_data;
-            disk_read(fs->disk, inode.direct[i], old_data.data);
-            ssize_t to_write;
-            // Figure out how many bytes we should write in this block
-            if(BLOCK_SIZE-block_pos <= length-bytes_written) { to_write = BLOCK_SIZE-block_pos; }
-            else { to_write = length-bytes_written; }
-            // Write necessary data to staging block
-            memcpy(old_data.data, data+bytes_written, to_write);
-            // Write the updated staging block to memory
-            disk_write(fs->disk, inode.direct[i], old_data.data);
-            // Update bytes written and see if we have finished
-            bytes_written += to_write;
-            if(bytes_written == length) { goto END; }
-            // Indicates we have dealt with starting the write in the middle of a block, i.e. we finished the first write
-            block_pos = 0;
-        }
-        curr_iblk = POINTERS_PER_INODE;
-    }
-
-    /* If we make it here then we either: will start with the indirect blocks, or didn't finish in the direct blocks */
-
-    // Allocate an indirect block if there isn't already one allocated
-    if(!inode.indirect) {
-        ssize_t next_free = fs_find_free(fs);
-        if(!next_free) { goto END; }
-        inode.indirect = next_free;
-    }
-    // Load the indirect pointers block
-    Block ind_blk;
-    disk_read(fs->disk, inode.indirect, ind_blk.data);
-    // Loop oveer the entries in the indirect block
-    for(int i = curr_iblk-POINTERS_PER_INODE; i < POINTERS_PER_BLOCK; i++) {
-        // Allocate an indirect block if there isn't one already allocated
-        if(!ind_blk.pointers[i]) {
-            ssize_t next_free = fs_find_free(fs);
-            if(!next_free) { goto END; }
-            ind_blk.pointers[i] = next_free;
-            disk_write(fs->disk, inode.indirect, ind_blk.data);
-        }
-        // Read in the block ontop of which we will write new data
-        Block old_data;
-        disk_read(fs->disk, ind_blk.pointers[i], old_data.data);
-        ssize_t to_write;
+    char  *run[DISK_IOV_MAX];   // Whole blocks waiting to be written directly
+    size_t run_start = 0, run_length = 0;
+
+    // Write block by block until done or we run out of pointers or free blocks
+    size_t max_blocks = fs_max_blocks(fs);
+    while(bytes_written < length && curr_iblk < max_blocks) {
+        // Find the block backing this part of the file (allocating it if needed)
+        bool    fresh = fs_map_block(handle, curr_iblk, false) == 0;
+        ssize_t block = fs_map_block(handle, curr_iblk, true);
+        if(block <= 0) { break; }
         // Figure out how many bytes we should write in this block
-        if(BLOCK_SIZE-block_pos <= length-bytes_written) { to_write = BLOCK_SIZE-block_pos; }
-        else { to_write = length-bytes_written; }
-        // Write necessary data to staging block
-        memcpy(old_data.data, data+bytes_written, to_write);
-        // Write the updated staging block to memory
-        disk_write(fs->disk, ind_blk.pointers[i], old_data.data);
-        // Update bytes written and see if we have finished
+        size_t to_write = min(BLOCK_SIZE - block_pos, length - bytes_written);
+
+        // Flush the pending run unless this block extends it
+        if(run_length && (to_write != BLOCK_SIZE || (size_t)block != run_start + run_length || run_length == DISK_IOV_MAX)) {
+            if(!fs_write_run(fs, run_start, run, run_length)) {
+                bytes_written -= run_length*BLOCK_SIZE;
+                run_length = 0;
+                break;
+            }
+            run_length = 0;
+        }
+
+        if(to_write == BLOCK_SIZE) {
+            if(!run_length) { run_start = block; }
+            run[run_length++] = data + bytes_written;
+        }
+        else if(fresh) {
+            Block buffer = {{0}};
+            memcpy(buffer.data + block_pos, data + bytes_written, to_write);
+            if(cache_write(fs->cache, block, buffer.data) == DISK_FAILURE) { break; }
+        }
+        else if(cache_write_range(fs->cache, block, block_pos, data + bytes_written, to_write) == DISK_FAILURE) {
+            break;
+        }
+        // Update bytes written and move on to the start of the next block
         bytes_written += to_write;
-        if(bytes_written == length) { goto END; }
-        // Indicates we have dealt with starting the write in the middle of a block, i.e. we finished the first write
         block_pos = 0;
+        curr_iblk++;
+    }
+    if(run_length && !fs_write_run(fs, run_start, run, run_length)) {
+        bytes_written -= run_length*BLOCK_SIZE;
+    }
+    // Only grow the file if we wrote past its end
+    if(offset + bytes_written > handle->inode.size) {
+        handle->inode.size  = offset + bytes_written;
+        handle->inode_dirty = true;
     }
-END:
-    inode.size += bytes_written;
-    fs_save_inode(fs,inode_number,&inode);
     return bytes_written;
 }
 
-bool fs_load_inode(FileSystem *fs, size_t inode_number, Inode *node) {
+/**
+ * Initialize FileHandle for the specified Inode by loading the Inode and its
+ * indirect pointer block.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to load.
+ * @param       handle          Pointer to FileHandle structure to initialize.
+ * @return      Whether or not the Inode is valid and was loaded successfully.
+ **/
+static bool fs_handle_load(FileSystem *fs, size_t inode_number, FileHandle *handle) {
+    // Edge case checks
+    if(!fs->free_blocks) { return false; }
+    if(inode_number >= fs->meta_data.inodes) { return false; }
+
+    handle->fs             = fs;
+    handle->inode_number   = inode_number;
+    handle->inode_dirty    = false;
+    handle->indirect_dirty = false;
+    handle->offset         = 0;
+    handle->next           = NULL;
+    handle->blocks         = 0;
+    if(!fs_load_inode(fs, inode_number, &handle->inode)) { return false; }
+
+    if(handle->inode.indirect) {
+        if(cache_read(fs->cache, handle->inode.indirect, handle->indirect.data) == DISK_FAILURE) { return false; }
+    }
+    else {
+        memset(handle->indirect.data, 0, BLOCK_SIZE);
+    }
+
+    if(fs->meta_data.flags & FS_EXTENTS) {
+        if(handle->inode.nextents > EXTENTS_PER_INODE + (handle->inode.indirect ? EXTENTS_PER_BLOCK : 0)) { return false; }
+        for(size_t e = 0; e < handle->inode.nextents; e++) {
+            handle->extent_starts[e] = handle->blocks;
+            handle->blocks += fs_extent(handle, e)->length;
+        }
+    }
+    return true;
+}
+
+/**
+ * Write back the Inode and indirect pointer block of FileHandle (through the
+ * block cache) if they changed.
+ *
+ * @param       handle          Pointer to FileHandle structure.
+ * @return      Whether or not the metadata was written back successfully.
+ **/
+static bool fs_handle_save(FileHandle *handle) {
+    FileSystem *fs = handle->fs;
+
+    if(handle->indirect_dirty) {
+        if(cache_write(fs->cache, handle->inode.indirect, handle->indirect.data) == DISK_FAILURE) { return false; }
+        handle->indirect_dirty = false;
+    }
+    if(handle->inode_dirty) {
+        if(!fs_save_inode(fs, handle->inode_number, &handle->inode)) { return false; }
+        handle->inode_dirty = false;
+    }
+    return true;
+}
+
+/**
+ * Return open FileHandle for the specified Inode (the handle stays valid only
+ * while the caller holds the Inode lock).
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to look for.
+ * @return      Pointer to FileHandle (NULL if Inode is not open).
+ **/
+static FileHandle *fs_find_handle(FileSystem *fs, size_t inode_number) {
+    FileHandle *handle;
+
+    pthread_mutex_lock(&fs->handles_lock);
+    for(handle = fs->handles; handle; handle = handle->next) {
+        if(handle->inode_number == inode_number) { break; }
+    }
+    pthread_mutex_unlock(&fs->handles_lock);
+    return handle;
+}
+
+/**
+ * Write a run of whole, adjacent blocks directly to the disk (bypassing the
+ * block cache), dropping any cached copies of the blocks first.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       block           First disk block of run.
+ * @param       data            Array of nblocks data buffers (BLOCK_SIZE each).
+ * @param       nblocks         Number of blocks in run.
+ * @return      Whether or not the run was written successfully.
+ **/
+static bool fs_write_run(FileSystem *fs, size_t block, char **data, size_t nblocks) {
+    for(size_t i = 0; i < nblocks; i++) {
+        cache_discard(fs->cache, block + i);
+    }
+    return disk_writev(fs->disk, block, data, nblocks) == (ssize_t)(nblocks*BLOCK_SIZE);
+}
+
+/**
+ * Map the specified logical block of an open Inode to a disk block by doing
+ * the following:
+ *
+ *  1. Use the direct pointers for the first POINTERS_PER_INODE blocks.
+ *
+ *  2. Use the pinned indirect pointer block for the remaining blocks
+ *  (allocating the indirect block first if needed).
+ *
+ *  3. Allocate a free block for an unmapped entry if requested.
+ *
+ * Note: Changes are recorded in the handle and written back when it is saved.
+ *
+ * @param       handle          Pointer to FileHandle structure.
+ * @param       index           Logical block index within the file.
+ * @param       allocate        Whether or not to allocate unmapped blocks.
+ * @return      Disk block number (0 if unmapped or out of space, -1 on error).
+ **/
+static ssize_t fs_map_block(FileHandle *handle, size_t index, bool allocate) {
+    Inode *inode = &handle->inode;
+
+    if(handle->fs->meta_data.flags & FS_EXTENTS) {
+        return fs_map_extent(handle, index, allocate);
+    }
+
+    if(index < POINTERS_PER_INODE) {
+        if(!inode->direct[index] && allocate) {
+            inode->direct[index] = fs_find_free(handle->fs);
+            handle->inode_dirty  = true;
+        }
+        return inode->direct[index];
+    }
+
+    index -= POINTERS_PER_INODE;
+    if(index >= POINTERS_PER_BLOCK) { return -1; }
+
+    if(!inode->indirect) {
+        if(!allocate) { return 0; }
+        // The pinned copy was cleared on load, so all pointers start out empty
+        inode->indirect = fs_find_free(handle->fs);
+        if(!inode->indirect) { return 0; }
+        handle->inode_dirty    = true;
+        handle->indirect_dirty = true;
+    }
+
+    uint32_t *pointer = &handle->indirect.pointers[index];
+    if(!*pointer && allocate) {
+        *pointer = fs_find_free(handle->fs);
+        if(!*pointer) { return 0; }
+        handle->indirect_dirty = true;
+    }
+    return *pointer;
+}
+
+/**
+ * Map the specified logical block of an open extent based Inode to a disk
+ * block by doing the following:
+ *
+ *  1. Append blocks up to the logical block if requested (growing the last
+ *  extent in place when the next disk block is free).  Blocks skipped over
+ *  are zeroed, since extents cannot describe holes.
+ *
+ *  2. Binary search the logical start of each extent for the one that
+ *  contains the logical block (without modifying the handle, so readers can
+ *  share it).
+ *
+ * @param       handle          Pointer to FileHandle structure.
+ * @param       index           Logical block index within the file.
+ * @param       allocate        Whether or not to allocate unmapped blocks.
+ * @return      Disk block number (0 if unmapped or out of space, -1 on error).
+ **/
+static ssize_t fs_map_extent(FileHandle *handle, size_t index, bool allocate) {
+    FileSystem *fs = handle->fs;
+
+    if(index >= fs_max_blocks(fs)) { return -1; }
+    while(index >= handle->blocks) {
+        if(!allocate) { return 0; }
+
+        ssize_t block = 0;
+        if(handle->inode.nextents) {
+            Extent *last = fs_extent(handle, handle->inode.nextents - 1);
+            size_t  next = (size_t)last->start + last->length;
+            if(fs_allocate_block(fs, next)) {
+                last->length++;
+                block = next;
+                if(handle->inode.nextents <= EXTENTS_PER_INODE) { handle->inode_dirty = true; }
+                else { handle->indirect_dirty = true; }
+            }
+        }
+        if(!block) {
+            block = fs_find_free(fs);
+            if(!block) { return 0; }
+            if(!fs_add_extent(handle, block, 1)) {
+                fs_release_block(fs, block);
+                return 0;
+            }
+        }
+        handle->blocks++;
+
+        // Only the requested block is filled in by the caller
+        if(index >= handle->blocks) {
+            cache_discard(fs->cache, block);
+            if(!disk_zero(fs->disk, block, 1)) { return -1; }
+        }
+    }
+
+    // Find the last extent that starts at or before the logical block
+    size_t low = 0, high = handle->inode.nextents - 1;
+    while(low < high) {
+        size_t middle = (low + high + 1)/2;
+        if(handle->extent_starts[middle] <= index) { low = middle; }
+        else { high = middle - 1; }
+    }
+    return fs_extent(handle, low)->start + (index - handle->extent_starts[low]);
+}
+
+/**
+ * Return the specified extent of an open extent based Inode (the first
+ * EXTENTS_PER_INODE are stored in the Inode, the rest in the extent block).
+ *
+ * @param       handle          Pointer to FileHandle structure.
+ * @param       index           Extent index.
+ * @return      Pointer to extent.
+ **/
+static Extent *fs_extent(FileHandle *handle, size_t index) {
+    if(index < EXTENTS_PER_INODE) {
+        return &handle->inode.extents[index];
+    }
+    return &handle->indirect.extents[index - EXTENTS_PER_INODE];
+}
+
+/**
+ * Append an extent to an open extent based Inode, allocating the extent
+ * block once the inline extents are used up.
+ *
+ * @param       handle          Pointer to FileHandle structure.
+ * @param       start           First disk block of run.
+ * @param       length          Number of blocks in run.
+ * @return      Whether or not the extent was added (false if Inode is full).
+ **/
+static bool fs_add_extent(FileHandle *handle, size_t start, size_t length) {
+    Inode *inode = &handle->inode;
+
+    if(inode->nextents >= EXTENTS_PER_INODE + EXTENTS_PER_BLOCK) { return false; }
+    if(inode->nextents >= EXTENTS_PER_INODE && !inode->indirect) {
+        // The pinned copy was cleared on load, so it starts out empty
+        inode->indirect = fs_find_free(handle->fs);
+        if(!inode->indirect) { return false; }
+        handle->indirect_dirty = true;
+    }
+
+    // New extents always begin where the mapped blocks end
+    handle->extent_starts[inode->nextents] = handle->blocks;
+    Extent *extent = fs_extent(handle, inode->nextents++);
+    extent->start  = start;
+    extent->length = length;
+    handle->inode_dirty = true;
+    if(inode->nextents > EXTENTS_PER_INODE) { handle->indirect_dirty = true; }
+    return true;
+}
+
+/**
+ * Return the maximum number of blocks a file can hold.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @return      Maximum number of blocks per file.
+ **/
+size_t fs_max_blocks(FileSystem *fs) {
+    // Inode sizes are 32-bit, so extents are limited by the size field
+    if(fs->meta_data.flags & FS_EXTENTS) {
+        return UINT32_MAX / BLOCK_SIZE;
+    }
+    return POINTERS_PER_INODE + POINTERS_PER_BLOCK;
+}
+
+/**
+ * Preallocate blocks so an open Inode can hold at least bytes bytes without
+ * changing its size (the caller must hold the Inode lock for writing) by doing
+ * the following:
+ *
+ *  1. For extent based Inodes, grow the last extent in place and then claim
+ *  the first run of free blocks long enough for the rest (or the longest one
+ *  available), repeating until enough blocks are mapped.
+ *
+ *  2. For pointer based Inodes, allocate each unmapped block in turn.
+ *
+ *  Note: Reserved blocks are zeroed, so they read back as zeros once the file
+ *  grows over them.
+ *
+ * @param       handle          Pointer to FileHandle structure.
+ * @param       bytes           Number of bytes to reserve.
+ * @return      Whether or not all of the space was reserved.
+ **/
+static bool fs_handle_allocate(FileHandle *handle, size_t bytes) {
+    FileSystem *fs     = handle->fs;
+    size_t      needed = (bytes + BLOCK_SIZE - 1)/BLOCK_SIZE;
+    if(needed > fs_max_blocks(fs)) { return false; }
+
+    if(!(fs->meta_data.flags & FS_EXTENTS)) {
+        Block blank = {{0}};
+        for(size_t i = 0; i < needed; i++) {
+            bool    fresh = fs_map_block(handle, i, false) == 0;
+            ssize_t block = fs_map_block(handle, i, true);
+            if(block <= 0) { return false; }
+            if(fresh && cache_write(fs->cache, block, blank.data) == DISK_FAILURE) { return false; }
+        }
+        return true;
+    }
+
+    while(handle->blocks < needed) {
+        size_t  wanted = needed - handle->blocks;
+        size_t  start  = BITMAP_NOT_FOUND, length = 0;
+        Extent *last   = handle->inode.nextents ? fs_extent(handle, handle->inode.nextents - 1) : NULL;
+        pthread_mutex_lock(&fs->alloc_lock);
+        // Prefer growing the last extent so the file stays contiguous
+        if(last) {
+            start  = (size_t)last->start + last->length;
+            length = bitmap_run_length(fs->free_blocks, start, min(wanted, UINT32_MAX - last->length));
+        }
+        if(!length) {
+            last  = NULL;
+            start = bitmap_find_run(fs->free_blocks, 0, min(wanted, UINT32_MAX), &length);
+        }
+
+        // Claim the whole run at once
+        bool claimed = start != BITMAP_NOT_FOUND;
+        if(claimed) {
+            bitmap_clear_range(fs->free_blocks, start, length);
+            claimed = fs_save_free_range(fs, start, length);
+        }
+        pthread_mutex_unlock(&fs->alloc_lock);
+        if(!claimed) { return false; }
+
+        // Clear it outside the allocator lock
+        for(size_t b = 0; b < length; b++) {
+            cache_discard(fs->cache, start + b);
+        }
+        if(!disk_zero(fs->disk, start, length)) { return false; }
+
+        if(last) {
+            last->length += length;
+            if(handle->inode.nextents <= EXTENTS_PER_INODE) { handle->inode_dirty = true; }
+            else { handle->indirect_dirty = true; }
+        }
+        else if(!fs_add_extent(handle, start, length)) {
+            fs_release_range(fs, start, length);
+            return false;
+        }
+        handle->blocks += length;
+    }
+    return true;
+}
+
+/**
+ * Prefetch the logical blocks [start, end) of an open Inode into the block
+ * cache (runs of adjacent disk blocks are read with a single vectored read).
+ *
+ * @param       handle          Pointer to FileHandle structure.
+ * @param       start           First logical block to prefetch.
+ * @param       end             Logical block to stop prefetching at.
+ * @return      Whether or not the prefetch was successful.
+ **/
+static bool fs_prefetch(FileHandle *handle, size_t start, size_t end) {
+    size_t blocks[READAHEAD_BLOCKS*2];
+    size_t nblocks = 0;
+
+    end = min(end, start + READAHEAD_BLOCKS*2);
+    for(size_t i = start; i < end; i++) {
+        ssize_t block = fs_map_block(handle, i, false);
+        if(block < 0) { break; }
+        if(block) { blocks[nblocks++] = block; }
+    }
+    return cache_prefetch(handle->fs->cache, blocks, nblocks);
+}
+
+static bool fs_load_inode(FileSystem *fs, size_t inode_number, Inode *node) {
     // Plus 1 to shift for superblock
     size_t block_num = inode_number/INODES_PER_BLOCK + 1;
     size_t block_index = inode_number - (block_num-1)*INODES_PER_BLOCK;
 
-    Block ib;
-    if(disk_read(fs->disk, block_num, ib.data) == DISK_FAILURE) { return false; }
-    // set use Inode pointer to pass the found node back
-    *node = ib.inodes[block_index];
+    // Only copy the requested inode out of the cached inode block
+    if(cache_read_range(fs->cache, block_num, block_index*sizeof(Inode), node, sizeof(Inode)) == DISK_FAILURE) { return false; }
     if (!node->valid) return false; 
     return true;
 }
 
-bool fs_save_inode(FileSystem *fs, size_t inode_number, Inode *node) {
+static bool fs_save_inode(FileSystem *fs, size_t inode_number, Inode *node) {
     // Plus 1 to shift for superblock
     size_t block_num = inode_number/INODES_PER_BLOCK + 1;
     size_t block_index = inode_number - (block_num-1)*INODES_PER_BLOCK;
 
-    Block ib;
-    if(disk_read(fs->disk, block_num, ib.data) == DISK_FAILURE) { return false; }
-    // Update the inode block with the new inode
-    ib.inodes[block_index] = *node;
-    // Write back the updated block
-    if(disk_write(fs->disk, block_num, ib.data) == DISK_FAILURE) { return false; }
+    // Update the inode in the cached inode block (written back on eviction or sync)
+    if(cache_write_range(fs->cache, block_num, block_index*sizeof(Inode), node, sizeof(Inode)) == DISK_FAILURE) { return false; }
 
     return true;
 }
 
-void fs_initialize_free_block_bitmap(FileSystem *fs, Block *sb){
-    fs->free_blocks = calloc(1, sb->super.blocks);
-    for(int i=0;i<sb->super.blocks;i++) {
-        fs->free_blocks[i] = true; 
-        if(i<=sb->super.inode_blocks) {
-            fs->free_blocks[i] = false;
+/**
+ * Mark the inodes of an inode block and every block they use as allocated
+ * (while mounting) by doing the following:
+ *
+ *  1. Mark each valid inode and its direct blocks (or inline extents) as
+ *  used, collecting its indirect block.
+ *
+ *  2. Read all the collected indirect blocks at once (so they are in flight
+ *  together rather than one after another).
+ *
+ *  3. Mark the blocks each indirect block points to (or the extents it
+ *  holds) as used.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       disk            Pointer to Disk structure.
+ * @param       flags           File system format flags (FS_EXTENTS).
+ * @param       inode_blk       Inode block.
+ * @param       inode_number    Number of first inode in inode block.
+ * @param       indirect        Buffers for INODES_PER_BLOCK indirect blocks.
+ * @return      Whether or not the inode block was scanned successfully.
+ **/
+static bool fs_scan_inodes(FileSystem *fs, Disk *disk, uint32_t flags, const Block *inode_blk, size_t inode_number, Block *indirect) {
+    const Inode *owners[INODES_PER_BLOCK];
+    size_t       blocks[INODES_PER_BLOCK];
+    char        *data[INODES_PER_BLOCK];
+    size_t       nblocks = 0;
+
+    for(size_t j = 0; j < INODES_PER_BLOCK; j++) { // For every inode in inode block
+        const Inode *inode = &inode_blk->inodes[j];
+        if(!inode->valid) { continue; }
+        bitmap_clear(fs->free_inodes, inode_number + j);
+
+        if(flags & FS_EXTENTS) { // Mark every run of every inline extent as used
+            for(size_t k = 0; k < min(inode->nextents, EXTENTS_PER_INODE); k++) {
+                bitmap_clear_range(fs->free_blocks, inode->extents[k].start, inode->extents[k].length);
+            }
+        }
+        else {
+            for(size_t k = 0; k < POINTERS_PER_INODE; k++) { // mark all direct blocks as used
+                if(inode->direct[k]) {
+                    bitmap_clear(fs->free_blocks, inode->direct[k]);
+                }
+            }
+        }
+        if(inode->indirect) {
+            bitmap_clear(fs->free_blocks, inode->indirect);
+            owners[nblocks] = inode;
+            blocks[nblocks] = inode->indirect;
+            data[nblocks]   = indirect[nblocks].data;
+            nblocks++;
+        }
+    }
+    if(nblocks && disk_read_blocks(disk, blocks, data, nblocks) == DISK_FAILURE) { return false; }
+
+    for(size_t k = 0; k < nblocks; k++) { // Mark everything the indirect blocks reference as used
+        const Inode *inode = owners[k];
+        if(flags & FS_EXTENTS) {
+            for(size_t l = 0; l + EXTENTS_PER_INODE < inode->nextents && l < EXTENTS_PER_BLOCK; l++) {
+                bitmap_clear_range(fs->free_blocks, indirect[k].extents[l].start, indirect[k].extents[l].length);
+            }
+            continue;
+        }
+        for(size_t l = 0; l < POINTERS_PER_BLOCK; l++) {
+            if(indirect[k].pointers[l]) {
+                bitmap_clear(fs->free_blocks, indirect[k].pointers[l]);
+            }
         }
     }
-}
\ No newline at end of file
+    return true;
+}
+
+static void fs_initialize_free_block_bitmap(FileSystem *fs, Block *sb){
+    // Every block starts out free except the SuperBlock, Inode table, and bitmaps
+    fs->free_blocks = bitmap_create(sb->super.blocks, true);
+    if(fs->free_blocks) {
+        bitmap_clear_range(fs->free_blocks, 0, 1 + (size_t)sb->super.inode_blocks + sb->super.bitmap_blocks + sb->super.inode_bitmap_blocks);
+    }
+}
+
+static bool fs_load_bitmaps(FileSystem *fs, Disk *disk, Block *sb) {
+    size_t start = 1 + sb->super.inode_blocks;
+
+    fs->free_blocks = fs_load_bitmap(disk, start, sb->super.bitmap_blocks, sb->super.blocks);
+    fs->free_inodes = fs_load_bitmap(disk, start + sb->super.bitmap_blocks, sb->super.inode_bitmap_blocks, sb->super.inodes);
+    if(!fs->free_blocks || !fs->free_inodes) {
+        bitmap_delete(fs->free_blocks);
+        bitmap_delete(fs->free_inodes);
+        fs->free_blocks = NULL;
+        fs->free_inodes = NULL;
+        return false;
+    }
+    // Never hand out meta data blocks, even if the stored bitmap says otherwise
+    bitmap_clear_range(fs->free_blocks, 0, start + sb->super.bitmap_blocks + sb->super.inode_bitmap_blocks);
+    return true;
+}
+
+static bool fs_store_bitmaps(FileSystem *fs, Disk *disk, Block *sb) {
+    size_t start = 1 + sb->super.inode_blocks;
+
+    if(!fs_store_bitmap(disk, fs->free_blocks, start, sb->super.bitmap_blocks)) { return false; }
+    return fs_store_bitmap(disk, fs->free_inodes, start + sb->super.bitmap_blocks, sb->super.inode_bitmap_blocks);
+}
+
+static Bitmap *fs_load_bitmap(Disk *disk, size_t start, size_t nblocks, size_t bits) {
+    Block buffer;
+
+    Bitmap *bitmap = bitmap_create(bits, false);
+    if(!bitmap) { return NULL; }
+    // Copy each stored bitmap block straight into the packed words
+    for(size_t i = 0; i < nblocks; i++) {
+        const Block *block = (const Block *)disk_view(disk, start + i, buffer.data);
+        if(!block) {
+            bitmap_delete(bitmap);
+            return NULL;
+        }
+        bitmap_load(bitmap, i*WORDS_PER_BLOCK, (const uint64_t *)block->data, WORDS_PER_BLOCK);
+    }
+    return bitmap;
+}
+
+static bool fs_store_bitmap(Disk *disk, Bitmap *bitmap, size_t start, size_t nblocks) {
+    for(size_t i = 0; i < nblocks; i++) {
+        Block block = {{0}};
+        size_t words = min(WORDS_PER_BLOCK, bitmap->nwords - i*WORDS_PER_BLOCK);
+        memcpy(block.data, bitmap->words + i*WORDS_PER_BLOCK, words*sizeof(uint64_t));
+        if(disk_write(disk, start + i, block.data) != BLOCK_SIZE) { return false; }
+    }
+    return true;
+}
+
+static bool fs_save_bitmap_word(FileSystem *fs, Bitmap *bitmap, size_t start, size_t bit) {
+    // Update the word holding this bit in the cached bitmap block
+    size_t word = bitmap_word(bit);
+    size_t block_num = start + word/WORDS_PER_BLOCK;
+    size_t word_offset = (word % WORDS_PER_BLOCK)*sizeof(uint64_t);
+    return cache_write_range(fs->cache, block_num, word_offset, &bitmap->words[word], sizeof(uint64_t)) != DISK_FAILURE;
+}
+
+static bool fs_save_free_inode(FileSystem *fs, size_t inode_number) {
+    if(!fs->meta_data.inode_bitmap_blocks) { return true; }
+
+    size_t start = 1 + fs->meta_data.inode_blocks + fs->meta_data.bitmap_blocks;
+    return fs_save_bitmap_word(fs, fs->free_inodes, start, inode_number);
+}
+
+static bool fs_save_free_block(FileSystem *fs, size_t block) {
+    if(!fs->meta_data.bitmap_blocks) { return true; }
+
+    return fs_save_bitmap_word(fs, fs->free_blocks, 1 + fs->meta_data.inode_blocks, block);
+}
+
+static bool fs_save_free_range(FileSystem *fs, size_t block, size_t length) {
+    // The caller holds the allocator lock.  Save each bitmap word touched by the range once
+    for(size_t b = block; b < block + length; b = (bitmap_word(b) + 1)*BITMAP_WORD_BITS) {
+        if(!fs_save_free_block(fs, b)) { return false; }
+    }
+    return true;
+}
+
+static bool fs_allocate_block(FileSystem *fs, size_t block) {
+    bool allocated = false;
+
+    pthread_mutex_lock(&fs->alloc_lock);
+    if(bitmap_test(fs->free_blocks, block)) {
+        bitmap_clear(fs->free_blocks, block);
+        allocated = fs_save_free_block(fs, block);
+    }
+    pthread_mutex_unlock(&fs->alloc_lock);
+    return allocated;
+}
+
+static bool fs_release_block(FileSystem *fs, size_t block) {
+    pthread_mutex_lock(&fs->alloc_lock);
+    bitmap_set(fs->free_blocks, block);
+    bool saved = fs_save_free_block(fs, block);
+    pthread_mutex_unlock(&fs->alloc_lock);
+    return saved;
+}
+
+static bool fs_release_range(FileSystem *fs, size_t block, size_t length) {
+    pthread_mutex_lock(&fs->alloc_lock);
+    for(size_t b = block; b < block + length; b++) {
+        bitmap_set(fs->free_blocks, b);
+    }
+    bool saved = fs_save_free_range(fs, block, length);
+    pthread_mutex_unlock(&fs->alloc_lock);
+    return saved;
+}
+
+bool fs_write_super_block(FileSystem *fs, Disk *disk, bool clean) {
+    Block block = {{0}};
+
+    fs->meta_data.clean = clean;
+    block.super = fs->meta_data;
+    return disk_write(disk, 0, block.data) == BLOCK_SIZE;
+}
+static void fs_lock_inode(FileSystem *fs, size_t inode_number, bool write) {
+    pthread_rwlock_t *lock = &fs->inode_locks[inode_number % INODE_LOCKS];
+
+    if(write) {
+        pthread_rwlock_wrlock(lock);
+    }
+    else {
+        pthread_rwlock_rdlock(lock);
+    }
+}
+
+static void fs_unlock_inode(FileSystem *fs, size_t inode_number) {
+    pthread_rwlock_unlock(&fs->inode_locks[inode_number % INODE_LOCKS]);
+}
+
+static bool fs_initialize_locks(FileSystem *fs) {
+    size_t locks = 0;
+
+    if(pthread_mutex_init(&fs->alloc_lock, NULL)) { return false; }
+    if(pthread_mutex_init(&fs->handles_lock, NULL)) { goto ALLOC; }
+    if(pthread_mutex_init(&fs->readahead_lock, NULL)) { goto HANDLES; }
+    for(; locks < INODE_LOCKS; locks++) {
+        if(pthread_rwlock_init(&fs->inode_locks[locks], NULL)) { goto INODES; }
+    }
+    return true;
+
+INODES:
+    while(locks) {
+        pthread_rwlock_destroy(&fs->inode_locks[--locks]);
+    }
+    pthread_mutex_destroy(&fs->readahead_lock);
+HANDLES:
+    pthread_mutex_destroy(&fs->handles_lock);
+ALLOC:
+    pthread_mutex_destroy(&fs->alloc_lock);
+    return false;
+}
+
+static void fs_destroy_locks(FileSystem *fs) {
+    for(size_t i = 0; i < INODE_LOCKS; i++) {
+        pthread_rwlock_destroy(&fs->inode_locks[i]);
+    }
+    pthread_mutex_destroy(&fs->readahead_lock);
+    pthread_mutex_destroy(&fs->handles_lock);
+    pthread_mutex_destroy(&fs->alloc_lock);
+}
@@ -0,0 +1,132 @@
+/* sfsbench.c: SimpleFS scaling benchmark
+ *
+ * Build from the simple-file-system directory with:
+ *
+ *      gcc -std=gnu99 -O2 -pthread -I. -o sfsbench src/bench.c src/bitmap.c \
+ *          src/cache.c src/disk.c src/disk_file.c src/disk_mmap.c \
+ *          src/disk_uring.c src/fs.c src/sfsbench.c
+ **/
+
+#include "sfs/bench.h"
+#include "sfs/disk.h"
+#include "sfs/fs.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/* Macros */
+
+#define streq(a, b)	(strcmp((a), (b)) == 0)
+
+/* Constants */
+
+#define DEFAULT_BLOCKS  (1<<20)     /* 1M blocks (4 GiB image) */
+#define MEGABYTE        (1<<20)
+
+/* Utility Prototypes */
+
+void    usage(const char *program);
+
+/* Main Execution */
+
+int main(int argc, char *argv[]) {
+    int    flags   = 0;
+    int    format  = 0;
+    size_t blocks  = DEFAULT_BLOCKS;
+    size_t percent = 100;
+    int    argind  = 1;
+
+    while (argind < argc && strlen(argv[argind]) > 1 && argv[argind][0] == '-') {
+        char *arg = argv[argind++];
+        if (streq(arg, "-m")) {
+            flags |= DISK_MMAP;
+        }
+        else if (streq(arg, "-s")) {
+            flags |= DISK_SYNC;
+        }
+        else if (streq(arg, "-e")) {
+            format |= FS_EXTENTS;
+        }
+        else if (streq(arg, "-b") && argind < argc) {
+            blocks = strtoul(argv[argind++], NULL, 10);
+        }
+        else if (streq(arg, "-p") && argind < argc) {
+            percent = strtoul(argv[argind++], NULL, 10);
+        }
+        else {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (argc - argind != 1) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    Disk *disk = disk_open(argv[argind], blocks, flags);
+    if (!disk) {
+        fprintf(stderr, "Unable to open %s with %lu blocks\n", argv[argind], blocks);
+        return EXIT_FAILURE;
+    }
+
+    FileSystem fs     = {0};
+    int        status = EXIT_FAILURE;
+    double start, elapsed;
+
+    /* Format */
+    start = bench_timestamp();
+    if (!fs_format(&fs, disk, format)) {
+        fprintf(stderr, "format failed!\n");
+        goto FAILURE;
+    }
+    printf("format:  %10.3lf s (%lu blocks)\n", bench_timestamp() - start, blocks);
+
+    /* Mount empty image */
+    start = bench_timestamp();
+    if (!fs_mount(&fs, disk)) {
+        fprintf(stderr, "mount failed!\n");
+        goto FAILURE;
+    }
+    printf("mount:   %10.3lf s (empty)\n", bench_timestamp() - start);
+
+    /* Fill image with files until the requested share of data blocks is used */
+    size_t data_bytes = (blocks - 1 - fs.meta_data.inode_blocks - fs.meta_data.bitmap_blocks - fs.meta_data.inode_bitmap_blocks) * (size_t)BLOCK_SIZE;
+    size_t target     = data_bytes / 100 * percent;
+    start   = bench_timestamp();
+    size_t written = bench_fill(&fs, target);
+    fs_unmount(&fs);
+    elapsed = bench_timestamp() - start;
+    printf("fill:    %10.3lf s (%lu MB, %.2lf MB/s)\n", elapsed,
+        written / MEGABYTE, written / MEGABYTE / (elapsed > 0 ? elapsed : 1));
+
+    /* Mount populated image */
+    start = bench_timestamp();
+    if (!fs_mount(&fs, disk)) {
+        fprintf(stderr, "mount failed!\n");
+        goto FAILURE;
+    }
+    printf("remount: %10.3lf s (full)\n", bench_timestamp() - start);
+
+    fs_unmount(&fs);
+    status = EXIT_SUCCESS;
+
+FAILURE:
+    disk_close(disk);
+    return status;
+}
+
+/* Utility Functions */
+
+/**
+ * Display usage message.
+ * @param       program     String containing name of program.
+ **/
+void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [options] <diskfile>\n\n", program);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    -m                 Use memory mapped disk backend\n");
+    fprintf(stderr, "    -s                 Perform disk requests synchronously (no io_uring)\n");
+    fprintf(stderr, "    -e                 Format with extent based inodes\n");
+    fprintf(stderr, "    -b BLOCKS          Number of blocks in disk image (default %d)\n", DEFAULT_BLOCKS);
+    fprintf(stderr, "    -p PERCENT         Percentage of data blocks to fill (default 100)\n");
+}
@@ -1,5 +1,6 @@
 /* sfssh.c: SimpleFS shell */
 
+#include "sfs/bench.h"
 #include "sfs/disk.h"
 #include "sfs/fs.h"
 
@@ -7,6 +8,7 @@
 #include <errno.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 
 /* Macros */
 
@@ -23,21 +25,52 @@ void do_stat(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
 void do_copyout(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
 void do_cat(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
 void do_copyin(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
+void do_reserve(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
+void do_sync(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
+void do_bench(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
 void do_help(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
 
 /* Utility Prototypes */
 
 bool copyout(FileSystem *fs, size_t inode_number, const char *path);
 bool copyin(FileSystem *fs, const char *path, size_t inode_number);
+void usage(const char *program);
 
 /* Main Execution */
 
 int main(int argc, char *argv[]) {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <diskfile> <nblocks>\n", argv[0]);
+    int   flags  = 0;
+    int   argind = 1;
+    FILE *input  = stdin;
+    bool  batch  = false;
+
+    while (argind < argc && strlen(argv[argind]) > 1 && argv[argind][0] == '-') {
+        char *arg = argv[argind++];
+        if (streq(arg, "-m")) {
+            flags |= DISK_MMAP;
+        }
+        else if (streq(arg, "-s")) {
+            flags |= DISK_SYNC;
+        }
+        else if (streq(arg, "-f") && argind < argc && !batch) {
+            input = fopen(argv[argind], "r");
+            if (!input) {
+                fprintf(stderr, "Unable to open %s: %s\n", argv[argind], strerror(errno));
+                return EXIT_FAILURE;
+            }
+            batch = true;
+            argind++;
+        }
+        else {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (argc - argind != 2) {
+        usage(argv[0]);
         return EXIT_FAILURE;
     }
-    Disk *disk = disk_open(argv[1], atoi(argv[2]));
+    Disk *disk = disk_open(argv[argind], atoi(argv[argind + 1]), flags);
     if (!disk) {
     	return EXIT_FAILURE;
     }
@@ -45,16 +78,24 @@ int main(int argc, char *argv[]) {
     FileSystem fs = {0};
     while (true) {
         char line[BUFSIZ], cmd[BUFSIZ], arg1[BUFSIZ], arg2[BUFSIZ];
-        fprintf(stderr, "sfs> ");
-        fflush(stderr);
+        if (!batch) {
+            fprintf(stderr, "sfs> ");
+            fflush(stderr);
+        }
 
-        if (fgets(line, BUFSIZ, stdin) == NULL) {
+        if (fgets(line, BUFSIZ, input) == NULL) {
             break;
         }
+        // Blank lines and comments (in scripts) are skipped
         int args = sscanf(line, "%s %s %s", cmd, arg1, arg2);
-        if (args == 0) {
+        if (args <= 0 || cmd[0] == '#') {
             continue;
         }
+        // Echo scripted commands so their output can be told apart
+        if (batch) {
+            printf("sfs> %s", line);
+            fflush(stdout);
+        }
 
         if (streq(cmd, "debug")) {
             do_debug(disk, &fs, args, arg1, arg2);
@@ -83,6 +124,15 @@ int main(int argc, char *argv[]) {
         else if (streq(cmd, "copyin")) {
             do_copyin(disk, &fs, args, arg1, arg2);
         } 
+        else if (streq(cmd, "reserve")) {
+            do_reserve(disk, &fs, args, arg1, arg2);
+        } 
+        else if (streq(cmd, "sync")) {
+            do_sync(disk, &fs, args, arg1, arg2);
+        } 
+        else if (streq(cmd, "bench")) {
+            do_bench(disk, &fs, args, arg1, arg2);
+        } 
         else if (streq(cmd, "help")) {
             do_help(disk, &fs, args, arg1, arg2);
         } 
@@ -95,6 +145,9 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    if (batch) {
+        fclose(input);
+    }
     fs_unmount(&fs);
     assert(fs.disk == NULL);
     assert(fs.free_blocks == NULL);
@@ -113,12 +166,12 @@ void do_debug(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
 }
 
 void do_format(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
-    if (args != 1) {
-        printf("Usage: format\n");
+    if (args > 2 || (args == 2 && !streq(arg1, "extents"))) {
+        printf("Usage: format [extents]\n");
         return;
     }
 
-    if (fs_format(fs, disk)) {
+    if (fs_format(fs, disk, args == 2 ? FS_EXTENTS : 0)) {
         printf("disk formatted.\n");
     } 
     else {
@@ -127,12 +180,19 @@ void do_format(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
 }
 
 void do_mount(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
-    if (args != 1) {
-        printf("Usage: mount\n");
+    if (args > 2 || (args == 2 && !streq(arg1, "noscrub"))) {
+        printf("Usage: mount [noscrub]\n");
+        return;
+    }
+
+    if (fs->disk) {
+        printf("disk already mounted!\n");
         return;
     }
 
+    // Only take on the new options once the mount succeeded
     if (fs_mount(fs, disk)) {
+        fs->options = (args == 2) ? FS_NOSCRUB : 0;
         printf("disk mounted.\n");
     } 
     else {
@@ -219,10 +279,128 @@ void do_copyin(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
     }
 }
 
+void do_reserve(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
+    if (args != 3) {
+        printf("Usage: reserve <inode> <bytes>\n");
+        return;
+    }
+
+    size_t inode_number = atoi(arg1);
+    size_t bytes        = strtoul(arg2, NULL, 10);
+    if (fs_reserve(fs, inode_number, bytes)) {
+        printf("reserved %lu bytes for inode %ld.\n", bytes, inode_number);
+    } 
+    else {
+        printf("reserve failed!\n");
+    }
+}
+
+void do_sync(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
+    if (args != 1) {
+        printf("Usage: sync\n");
+        return;
+    }
+
+    if (fs_sync(fs)) {
+        printf("disk synced.\n");
+    } 
+    else {
+        printf("sync failed!\n");
+    }
+}
+
+void do_bench(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
+    const char *workload = (args >= 2) ? arg1 : "all";
+    bool all = streq(workload, "all");
+    if (args > 3 || !(all || streq(workload, "seq") || streq(workload, "random") || streq(workload, "churn") || streq(workload, "mount"))) {
+        printf("Usage: bench [all|seq|random|churn|mount] [MB]\n");
+        return;
+    }
+    if (!streq(workload, "mount") && !fs->disk) {
+        printf("bench failed: disk is not mounted!\n");
+        return;
+    }
+
+    BenchResult result = {0};
+    if (all || streq(workload, "seq") || streq(workload, "random")) {
+        // Files are limited by the inode format (and never outgrow the disk)
+        size_t bytes = (args == 3) ? strtoul(arg2, NULL, 10) << 20 : BENCH_FILE_BYTES;
+        bytes = bytes < fs_max_blocks(fs)*BLOCK_SIZE ? bytes : fs_max_blocks(fs)*BLOCK_SIZE;
+        bytes = bytes < bitmap_count(fs->free_blocks)/2*BLOCK_SIZE ? bytes : bitmap_count(fs->free_blocks)/2*BLOCK_SIZE;
+
+        ssize_t inode_number = bench_write(fs, bytes, &result);
+        if (inode_number < 0) {
+            bench_release(&result);
+            printf("bench failed!\n");
+            return;
+        }
+        bench_report(&result, stdout);
+        bench_release(&result);
+
+        if (all || streq(workload, "seq")) {
+            if (bench_read(fs, inode_number, &result)) {
+                bench_report(&result, stdout);
+            }
+            else {
+                printf("seq-read failed!\n");
+            }
+            bench_release(&result);
+        }
+        if (all || streq(workload, "random")) {
+            if (bench_random_read(fs, inode_number, BENCH_RANDOM_READS, &result)) {
+                bench_report(&result, stdout);
+            }
+            else {
+                printf("rand-read failed!\n");
+            }
+            bench_release(&result);
+        }
+        fs_remove(fs, inode_number);
+    }
+
+    if (all || streq(workload, "churn")) {
+        if (bench_churn(fs, BENCH_CHURN_FILES, &result)) {
+            bench_report(&result, stdout);
+        }
+        else {
+            printf("churn failed!\n");
+        }
+        bench_release(&result);
+    }
+
+    if (all || streq(workload, "mount")) {
+        // Scratch images use the same backend and format as this disk
+        size_t   sizes[]  = {1<<12, 1<<15, 1<<18};
+        int      flags    = ((disk->ops == &DiskMmapOps) ? DISK_MMAP : 0) | (disk->flags & DISK_SYNC);
+        uint32_t format   = fs->disk ? fs->meta_data.flags : 0;
+        for (size_t i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++) {
+            BenchResult clean = {0}, dirty = {0};
+            char path[] = "/tmp/sfsbench.XXXXXX";
+            int  fd     = mkstemp(path);
+            if (fd < 0) {
+                printf("mount failed: %s\n", strerror(errno));
+                break;
+            }
+            close(fd);
+
+            printf("image of %lu blocks (half full):\n", sizes[i]);
+            if (bench_mount(path, sizes[i], flags, format, &clean, &dirty)) {
+                bench_report(&clean, stdout);
+                bench_report(&dirty, stdout);
+            }
+            else {
+                printf("mount failed!\n");
+            }
+            bench_release(&clean);
+            bench_release(&dirty);
+        }
+    }
+}
+
 void do_help(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
     printf("Commands are:\n");
-    printf("    format\n");
-    printf("    mount\n");
+    printf("    format  [extents]\n");
+    printf("    mount   [noscrub]\n");
     printf("    debug\n");
     printf("    create\n");
     printf("    remove  <inode>\n");
@@ -230,6 +408,9 @@ void do_help(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
     printf("    stat    <inode>\n");
     printf("    copyin  <file> <inode>\n");
     printf("    copyout <inode> <file>\n");
+    printf("    reserve <inode> <bytes>\n");
+    printf("    sync\n");
+    printf("    bench   [all|seq|random|churn|mount] [MB]\n");
     printf("    help\n");
     printf("    quit\n");
     printf("    exit\n");
@@ -237,10 +418,25 @@ void do_help(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
 
 /* Utility Functions */
 
+void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [options] <diskfile> <nblocks>\n\n", program);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    -m                 Use memory mapped disk backend\n");
+    fprintf(stderr, "    -s                 Perform disk requests synchronously (no io_uring)\n");
+    fprintf(stderr, "    -f SCRIPT          Run commands from SCRIPT instead of standard input\n");
+}
+
 bool copyin(FileSystem *fs, const char *path, size_t inode_number) {
+    FileHandle *handle = fs_open(fs, inode_number);
+    if (!handle) {
+        fprintf(stderr, "Unable to open inode %lu\n", inode_number);
+        return false;
+    }
+
     FILE *stream = fopen(path, "r");
     if (!stream) {
         fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
+        fs_close(handle);
         return false;
     }
 
@@ -251,7 +447,7 @@ bool copyin(FileSystem *fs, const char *path, size_t inode_number) {
         if (result <= 0) {
             break;
         }
-        ssize_t actual = fs_write(fs, inode_number, buffer, result, offset);
+        ssize_t actual = fs_handle_write(handle, buffer, result);
         if (actual < 0) {
             fprintf(stderr, "fs_write returned invalid result %ld\n", actual);
             break;
@@ -264,20 +460,27 @@ bool copyin(FileSystem *fs, const char *path, size_t inode_number) {
     }
     printf("%lu bytes copied\n", offset);
     fclose(stream);
-    return true;
+    return fs_close(handle);
 }
 
 bool copyout(FileSystem *fs, size_t inode_number, const char *path) {
+    FileHandle *handle = fs_open(fs, inode_number);
+    if (!handle) {
+        fprintf(stderr, "Unable to open inode %lu\n", inode_number);
+        return false;
+    }
+
     FILE *stream = fopen(path, "w");
     if (!stream) {
         fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
+        fs_close(handle);
         return false;
     }
 
     char buffer[4*BUFSIZ] = {0};
     size_t offset = 0;
     while (true) {
-        ssize_t result = fs_read(fs, inode_number, buffer, sizeof(buffer), offset);
+        ssize_t result = fs_handle_read(handle, buffer, sizeof(buffer));
         if (result <= 0) {
             break;
         }
@@ -286,5 +489,5 @@ bool copyout(FileSystem *fs, size_t inode_number, const char *path) {
     }
     printf("%lu bytes copied\n", offset);
     fclose(stream);
-    return true;
+    return fs_close(handle);
 }
\ No newline at end of file